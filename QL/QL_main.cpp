@@ -12,6 +12,7 @@
 #include "QL_Compiler.h"
 #include "QL_Interpreter.h"
 #include "QL_Exception.h"
+#include <process.h>
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -28,6 +29,16 @@ bool    g_objecttrace = false;
 bool    g_inttrace    = false;
 bool    g_objectfile  = false;
 bool    g_dumpmem     = false;
+bool    g_gcstats     = false;
+bool    g_threaded    = false;
+bool    g_registers   = false;
+bool    g_jit         = false;
+bool    g_measure     = false;
+bool    g_streamed    = false;
+bool    g_compress    = false;
+bool    g_nocache     = false;
+bool    g_concurrent  = false;
+int     g_contexts    = 0;
 CString g_entrypoint(_T("main"));
 
 // Provide standard drivers for output
@@ -67,7 +78,16 @@ Usage()
          _T("-p word   Use 'word' as database password\n")
          _T("-h        Show this help page\n")
          _T("-o        show contents of object file\n")
-         _T("-x        Dump object chain on exit\n"));
+         _T("-x        Dump object chain on exit\n")
+         _T("-g        Show garbage collector pause times on exit\n")
+         _T("-f        Run with the pre-decoded (threaded) code engine\n")
+         _T("-r        Run with the register code engine\n")
+         _T("-j        Run with the register code engine and compile hot functions\n")
+         _T("-m        Measure the load and execution time of the entry point\n")
+         _T("-s        Write a streamed (version 2) object file instead of an image\n")
+         _T("-z        Compress literals and bytecode of a streamed object file\n")
+         _T("-n        Do not use the compile cache (QL_CACHE or %%LOCALAPPDATA%%\\QL\\Cache)\n")
+         _T("-w num    Run the entry point in 'num' threads at once (0 = one per core)\n"));
 }
 
 bool
@@ -106,6 +126,39 @@ ParseCommandLine(int& index)
       {
         g_dumpmem = true;
       }
+      else if(_totlower(lpszParam[1]) == 'g')
+      {
+        g_gcstats = true;
+      }
+      else if(_totlower(lpszParam[1]) == 'f')
+      {
+        g_threaded = true;
+      }
+      else if(_totlower(lpszParam[1]) == 'r')
+      {
+        g_registers = true;
+      }
+      else if(_totlower(lpszParam[1]) == 'j')
+      {
+        g_registers = true;
+        g_jit       = true;
+      }
+      else if(_totlower(lpszParam[1]) == 'm')
+      {
+        g_measure = true;
+      }
+      else if(_totlower(lpszParam[1]) == 's')
+      {
+        g_streamed = true;
+      }
+      else if(_totlower(lpszParam[1]) == 'z')
+      {
+        g_compress = true;
+      }
+      else if(_totlower(lpszParam[1]) == 'n')
+      {
+        g_nocache = true;
+      }
       else if(_totlower(lpszParam[1]) == 'o')
       {
         g_objecttrace = true;
@@ -118,6 +171,11 @@ ParseCommandLine(int& index)
           g_entrypoint = _T("main");
         }
       }
+      else if (_totlower(lpszParam[1]) == 'w')
+      {
+        g_concurrent = true;
+        g_contexts   = _ttoi(__targv[++index]);
+      }
       else if (_totlower(lpszParam[1]) == 'd')
       {
         db_database = __targv[++index];
@@ -163,6 +221,130 @@ int InitMFC()
   return 0;
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+// CONCURRENT EXECUTION CONTEXTS
+//
+//////////////////////////////////////////////////////////////////////////
+
+// One thread running the entry point
+typedef struct _context
+{
+  QLImage*  m_image;    // Shared code image
+  CString   m_output;   // Captured stdout
+  CString   m_error;    // Error message, if any
+  int       m_result;
+}
+Context;
+
+// Each thread has a VM of its own: heap, globals and interpreter.
+// Only the code image is shared between the threads
+unsigned __stdcall
+RunContext(void* p_context)
+{
+  Context* context = reinterpret_cast<Context*>(p_context);
+  QLVirtualMachine vm;
+  vm.SetOutputCapture(&context->m_output);
+
+  try
+  {
+    if(vm.LoadContext(context->m_image))
+    {
+      QLInterpreter inter(&vm,false);
+      inter.SetThreaded(g_threaded);
+      inter.SetRegisters(g_registers);
+      inter.SetJit(g_jit);
+
+      context->m_result = inter.Execute(g_entrypoint);
+    }
+    vm.FlushOutput();
+  }
+  catch(int& error)
+  {
+    vm.FlushOutput();
+    context->m_result = error;
+  }
+  catch(QLException& exp)
+  {
+    vm.FlushOutput();
+    context->m_result = -1;
+    context->m_error  = exp.GetErrorMessage();
+  }
+  return 0;
+}
+
+// Run the entry point on all threads at the same time. Every run must
+// deliver the same output, which is then written only once.
+// If they differ, nothing is written to stdout at all
+int
+RunConcurrent(QLVirtualMachine& p_vm,int p_contexts)
+{
+  if(p_contexts <= 0)
+  {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    p_contexts = (int) info.dwNumberOfProcessors;
+  }
+  QLImage* image = p_vm.GetCodeImage();
+  if(image == nullptr)
+  {
+    _ftprintf(stderr,_T("No code image to run in concurrent contexts\n"));
+    return -1;
+  }
+
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER start;
+  LARGE_INTEGER stop;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&start);
+
+  std::vector<Context> contexts(p_contexts);
+  std::vector<HANDLE>  threads;
+  for(auto& context : contexts)
+  {
+    context.m_image  = image;
+    context.m_result = -1;
+    HANDLE thread = (HANDLE)_beginthreadex(NULL,0,RunContext,&context,0,NULL);
+    if(thread == NULL)
+    {
+      context.m_error = _T("Cannot start a thread for an execution context");
+      continue;
+    }
+    threads.push_back(thread);
+  }
+  for(auto& thread : threads)
+  {
+    WaitForSingleObject(thread,INFINITE);
+    CloseHandle(thread);
+  }
+  image->Release();
+
+  if(g_measure)
+  {
+    QueryPerformanceCounter(&stop);
+    double ms = (double)(stop.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    _ftprintf(stderr,_T("Execution time (%d contexts): %.3f ms\n"),p_contexts,ms);
+  }
+
+  Context& first  = contexts[0];
+  int      result = first.m_result;
+  for(int ind = 1;ind < p_contexts; ++ind)
+  {
+    Context& context = contexts[ind];
+    if(context.m_output != first.m_output || context.m_error != first.m_error || context.m_result != first.m_result)
+    {
+      _ftprintf(stderr,_T("Context %d of %d did not run the same as the first one\n"),ind + 1,p_contexts);
+      return -1;
+    }
+  }
+  osputs_stdout(first.m_output);
+  if(!first.m_error.IsEmpty())
+  {
+    _ftprintf(stderr,_T("%s\n"),first.m_error.GetString());
+  }
+  return result;
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 // MAIN PROGRAM DRIVER
@@ -197,7 +379,20 @@ int _tmain(int argc,TCHAR* argv[],TCHAR* envp[])
       {
         if(vm.IsObjectFile(argv[ind]) && !g_objectfile)
         {
+          LARGE_INTEGER frequency;
+          LARGE_INTEGER start;
+          LARGE_INTEGER stop;
+          QueryPerformanceFrequency(&frequency);
+          QueryPerformanceCounter(&start);
+
           compiled = vm.LoadFile(argv[ind],g_objecttrace);
+
+          if(g_measure)
+          {
+            QueryPerformanceCounter(&stop);
+            double ms = (double)(stop.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+            _ftprintf(stderr,_T("Load time (%s): %.3f ms\n"),argv[ind],ms);
+          }
           if(compiled && g_verbose)
           {
             _tprintf(_T("Read object file: %s\n"),argv[ind]);
@@ -205,7 +400,15 @@ int _tmain(int argc,TCHAR* argv[],TCHAR* envp[])
         }
         else if(vm.IsSourceFile(argv[ind]))
         {
-          compiled = vm.CompileFile(argv[ind],g_comptrace);
+          if(g_objectfile || g_comptrace || g_nocache)
+          {
+            compiled = vm.CompileFile(argv[ind],g_comptrace);
+          }
+          else
+          {
+            // Unchanged sources are loaded from the compile cache
+            compiled = vm.CompileCached(argv[ind],g_comptrace);
+          }
           if(compiled && g_verbose)
           {
             _tprintf(_T("Compiled source file: %s\n"),argv[ind]);
@@ -223,11 +426,17 @@ int _tmain(int argc,TCHAR* argv[],TCHAR* envp[])
       if(g_objectfile)
       {
         // Last argument is the object file
-        if(vm.WriteFile(argv[argc - 1],g_objecttrace) && g_verbose)
+        vm.SetCompression(g_compress);
+        if(vm.WriteFile(argv[argc - 1],g_objecttrace,!g_streamed) && g_verbose)
         {
           _tprintf(_T("Written object file: %s\n"),argv[argc - 1]);
         }
       }
+      else if(compiled && g_concurrent)
+      {
+        // Execute the entrypoint in many contexts at once
+        returnCode = RunConcurrent(vm,g_contexts);
+      }
       else if(compiled)
       {
         // Now execute main or the entrypoint
@@ -236,14 +445,47 @@ int _tmain(int argc,TCHAR* argv[],TCHAR* envp[])
           vm.SetDumping(g_dumpmem);
 
           QLInterpreter inter(&vm, g_inttrace);
+          inter.SetThreaded(g_threaded);
+          inter.SetRegisters(g_registers);
+          inter.SetJit(g_jit);
+          if(g_inttrace)
+          {
+            // Keep the printed output between the trace lines
+            vm.SetOutputFlush(QL_FLUSH_ALWAYS);
+          }
+
+          LARGE_INTEGER frequency;
+          LARGE_INTEGER start;
+          LARGE_INTEGER stop;
+          QueryPerformanceFrequency(&frequency);
+          QueryPerformanceCounter(&start);
+
           returnCode = inter.Execute(g_entrypoint);
+          vm.FlushOutput();
+
+          if(g_measure)
+          {
+            QueryPerformanceCounter(&stop);
+            double ms = (double)(stop.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+            LPCTSTR engine = g_jit ? _T("compiled") : g_registers ? _T("register") : g_threaded ? _T("threaded") : _T("bytecode");
+            _ftprintf(stderr,_T("Execution time (%s engine): %.3f ms\n"),engine,ms);
+          }
+
+          if(g_gcstats)
+          {
+            const GCStats& stats = vm.GetGCStats();
+            _ftprintf(stderr,_T("GC minor: %d major: %d slices: %d\n"),stats.m_minor,stats.m_major,stats.m_slices);
+            _ftprintf(stderr,_T("GC pause (us) last: %.1f max: %.1f total: %.1f\n"),stats.m_lastPause,stats.m_maxPause,stats.m_totalPause);
+          }
         }
         catch(int &error)
         {
+          vm.FlushOutput();
           returnCode = error;
         }
         catch(QLException& exp)
         {
+          vm.FlushOutput();
           returnCode = -1;
           _ftprintf(stderr,_T("%s\n"),exp.GetErrorMessage().GetString());
         }
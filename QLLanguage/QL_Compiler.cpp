@@ -12,6 +12,7 @@
 #include "QL_Debugger.h"
 #include "QL_Objects.h"
 #include "QL_Opcodes.h"
+#include "QL_Peephole.h"
 #include <stdio.h>
 
 #ifdef _DEBUG
@@ -27,7 +28,13 @@ QLCompiler::QLCompiler(QLVirtualMachine* p_vm)
            ,m_literals(nullptr)
            ,m_methodclass(nullptr)
            ,cbuff(nullptr)
+           ,m_cmax(CMAX)
            ,cptr(0)
+           ,m_sendsites(0)
+           ,m_statement(false)
+           ,m_appendTemp(-1)
+           ,m_appendLoad(-1)
+           ,m_appendAdd(-1)
            ,m_decode(0)
 {
   cbuff = (BYTE*) GetMemory(CMAX);
@@ -301,6 +308,8 @@ QLCompiler::do_regular_function(CString p_name)
   // Cannot be done in do_code, as it can be called recursively
   m_arguments.clear();
   m_temporaries.clear();
+  m_argtypes.clear();
+  m_temptypes.clear();
 }
 
 // Parse a member function definition
@@ -340,6 +349,8 @@ QLCompiler::do_member_function(Class* p_class)
   // Cannot be done in do_code, as it can be called recursively
   m_arguments.clear();
   m_temporaries.clear();
+  m_argtypes.clear();
+  m_temptypes.clear();
 }
 
 // Compile the code part of a function or method 
@@ -353,8 +364,11 @@ QLCompiler::do_code(Function* p_function)
   // initialize
   m_arguments.clear();
   m_temporaries.clear();
-  // reset code pointer
+  m_argtypes.clear();
+  m_temptypes.clear();
+  // reset code pointer and the send caches
   cptr = 0;
+  m_sendsites = 0;
 
   // add the implicit 'this' argument for member functions
   if(p_function->GetClass() != nullptr)
@@ -370,8 +384,10 @@ QLCompiler::do_code(Function* p_function)
   RequireToken(tkn,')');
     
   // reserve space for the temporaries
+  // Wide, as we do not know the number yet. The peephole makes it small
+  putcbyte(OP_WIDE);
   putcbyte(OP_TSPACE);
-  tcode = putcbyte(tcnt);
+  tcode = putcword(tcnt);
 
   // compile the code
   FetchRequireToken('{');
@@ -399,6 +415,10 @@ QLCompiler::do_code(Function* p_function)
   // We can only do this AFTER the function is compiled
   fixup_ref(tcode,tcnt + 1);
 
+  // Fuse common instruction sequences into superinstructions
+  QLPeephole peephole(cbuff,cptr,m_literals);
+  cptr = peephole.Optimize();
+
   // Copy the literals to the function
   if(m_literals)
   {
@@ -451,24 +471,99 @@ QLCompiler::do_statement()
     case _T('{'):     do_block();   break;
     case _T(';'):     ;             break;
     default:          m_scanner->SaveToken(tkn);
+                      m_statement = true;
                       do_expr();
                       FetchRequireToken(';');
                       break;
   }
 }
 
+// Compile a statement that can never be reached, and drop its code
+void
+QLCompiler::do_dead_statement()
+{
+  DEADCODE dead;
+
+  dead_begin(dead);
+  do_statement();
+  dead_end(dead);
+}
+
+// Start of unreachable code: branch around it and remember the state
+void
+QLCompiler::dead_begin(DEADCODE& p_dead)
+{
+  p_dead.mark         = cptr;
+  p_dead.breaks       = (bsp >= bstack) ? *bsp : 0;
+  p_dead.nCases       = (ssp > ssbase)  ? ssp->nCases : 0;
+  p_dead.defaultLabel = (ssp > ssbase)  ? ssp->defaultLabel : 0;
+  p_dead.sendsites    = m_sendsites;
+
+  putcbyte(OP_BR);
+  p_dead.skip = putclong(0);
+}
+
+// End of unreachable code: remove it from the code buffer
+// A 'case' or 'default' label in it makes it reachable, so it stays
+void
+QLCompiler::dead_end(DEADCODE& p_dead)
+{
+  if (ssp > ssbase && (ssp->nCases != p_dead.nCases || ssp->defaultLabel != p_dead.defaultLabel))
+  {
+    Fixup(p_dead.skip,cptr);
+    return;
+  }
+  // Breaks in the removed code are no longer in the break chain
+  if (bsp >= bstack)
+  {
+    *bsp = p_dead.breaks;
+  }
+  m_sendsites = p_dead.sendsites;
+  cptr        = p_dead.mark;
+}
+
 // do_if - compile the IF/ELSE expression 
 void 
 QLCompiler::do_if()
 {
-  int tkn,nxt,end;
+  int tkn,nxt,end,test;
+  int start = cptr;
 
   // compile the test expression
   do_test();
 
+  // a constant test only keeps the clause that can be taken
+  if ((test = constant_test(start)) >= 0)
+  {
+    if (test)
+    {
+      do_statement();
+    }
+    else
+    {
+      do_dead_statement();
+    }
+    if ((tkn = m_scanner->GetToken()) == T_ELSE) 
+    {
+      if (test)
+      {
+        do_dead_statement();
+      }
+      else
+      {
+        do_statement();
+      }
+    }
+    else
+    {
+      m_scanner->SaveToken(tkn);
+    }
+    return;
+  }
+
   // skip around the 'then' clause if the expression is false
   putcbyte(OP_BRF);
-  nxt = putcword(0);
+  nxt = putclong(0);
 
   // compile the 'then' clause
   do_statement();
@@ -477,7 +572,7 @@ QLCompiler::do_if()
   if ((tkn = m_scanner->GetToken()) == T_ELSE) 
   {
     putcbyte(OP_BR);
-    end = putcword(0);
+    end = putclong(0);
     Fixup(nxt,cptr);
     do_statement();
     nxt = end;
@@ -540,26 +635,40 @@ QLCompiler::remcontinue(int* old)
 void 
 QLCompiler::do_while()
 {
-  int nxt,end,*ob,*oc;
+  int nxt,end = 0,test,*ob,*oc;
 
   // compile the test expression
   nxt = cptr;
   do_test();
 
   // skip around the loop body if the expression is false
-  putcbyte(OP_BRF);
-  end = putcword(0);
+  // a constant test needs no branch: the loop runs forever or never
+  if ((test = constant_test(nxt)) < 0)
+  {
+    putcbyte(OP_BRF);
+    end = putclong(0);
+  }
 
   // compile the loop body
   ob = addbreak(end);
   oc = addcontinue(nxt);
-  do_statement();
+  if (test)
+  {
+    do_statement();
+  }
+  else
+  {
+    do_dead_statement();
+  }
   end = rembreak(ob,end);
   remcontinue(oc);
 
   // branch back to the start of the loop
-  putcbyte(OP_BR);
-  putcword(nxt);
+  if (test)
+  {
+    putcbyte(OP_BR);
+    putclong(nxt);
+  }
 
   // handle the end of the statement 
   Fixup(end,cptr);
@@ -569,7 +678,7 @@ QLCompiler::do_while()
 void 
 QLCompiler::do_dowhile()
 {
-  int nxt,end=0,*ob,*oc;
+  int nxt,end=0,test,start,*ob,*oc;
 
   // remember the start of the loop
   nxt = cptr;
@@ -583,12 +692,17 @@ QLCompiler::do_dowhile()
 
   // compile the test expression
   FetchRequireToken(T_WHILE);
+  start = cptr;
   do_test();
   FetchRequireToken(';');
 
   // branch to the top if the expression is true
-  putcbyte(OP_BRT);
-  putcword(nxt);
+  // a constant test branches always or falls through
+  if ((test = constant_test(start)) != 0)
+  {
+    putcbyte(test < 0 ? OP_BRT : OP_BR);
+    putclong(nxt);
+  }
 
   // handle the end of the statement
   Fixup(end,cptr);
@@ -598,7 +712,8 @@ QLCompiler::do_dowhile()
 void 
 QLCompiler::do_for()
 {
-  int tkn,nxt,end,body,update,*ob,*oc;
+  int tkn,nxt,end,body,update,test = -1,*ob,*oc;
+  DEADCODE dead;
 
   // compile the initialization expression 
   FetchRequireToken('(');
@@ -616,15 +731,33 @@ QLCompiler::do_for()
     m_scanner->SaveToken(tkn);
     do_expr();
     FetchRequireToken(';');
+    test = constant_test(nxt);
   }
 
-  // branch to the loop body if the expression is true
-  putcbyte(OP_BRT);
-  body = putcword(0);
+  if (test < 0)
+  {
+    // branch to the loop body if the expression is true
+    putcbyte(OP_BRT);
+    body = putclong(0);
 
-  // branch to the end if the expression is false
-  putcbyte(OP_BR);
-  end = putcword(0);
+    // branch to the end if the expression is false
+    putcbyte(OP_BR);
+    end = putclong(0);
+  }
+  else if (test)
+  {
+    // constant true: always branch to the loop body
+    putcbyte(OP_BR);
+    body = putclong(0);
+    end  = 0;
+  }
+  else
+  {
+    // constant false: update and body are never run
+    dead_begin(dead);
+    body = 0;
+    end  = 0;
+  }
 
   // compile the update expression
   update = cptr;
@@ -637,7 +770,7 @@ QLCompiler::do_for()
 
   // branch back to the test code
   putcbyte(OP_BR);
-  putcword(nxt);
+  putclong(nxt);
 
   // compile the loop body
   Fixup(body,cptr);
@@ -649,10 +782,14 @@ QLCompiler::do_for()
 
   // branch back to the update code
   putcbyte(OP_BR);
-  putcword(update);
+  putclong(update);
 
   // handle the end of the statement
   Fixup(end,cptr);
+  if (test == 0)
+  {
+    dead_end(dead);
+  }
 }
 
 // Compile the BREAK statement 
@@ -662,7 +799,7 @@ QLCompiler::do_break()
   if (bsp >= bstack) 
   {
     putcbyte(OP_BR);
-    *bsp = putcword(*bsp);
+    *bsp = putclong(*bsp);
   }
   else
   {
@@ -677,7 +814,7 @@ QLCompiler::do_continue()
   if (csp >= cstack) 
   {
     putcbyte(OP_BR);
-    putcword(*csp);
+    putclong(*csp);
   }
   else
   {
@@ -721,6 +858,7 @@ void
 QLCompiler::do_switch()
 {
   int dispatch,end,cnt;
+  int type = 0,low = 0,high = 0;
   int*     ob;
   SWENTRY* os;
   CENTRY*  e;
@@ -730,7 +868,7 @@ QLCompiler::do_switch()
 
   // branch to the dispatch code
   putcbyte(OP_BR);
-  dispatch = putcword(0);
+  dispatch = putclong(0);
 
   // compile the body of the switch statement
   os = AddSwitch();
@@ -740,29 +878,41 @@ QLCompiler::do_switch()
 
   // branch to the end of the statement
   putcbyte(OP_BR);
-  end = putcword(end);
+  end = putclong(end);
 
   // compile the dispatch code
   Fixup(dispatch,cptr);
-  putcbyte(OP_SWITCH);
-  putcword(ssp->nCases);
-
-  // output the case table
-  cnt = ssp->nCases;
-  e   = ssp->cases;
-  while (--cnt >= 0) 
+  type = SwitchType(low,high);
+  if(type == DTYPE_INTEGER && (long long) high - low < 2 * ssp->nCases)
+  {
+    putcdense(low,high - low + 1);
+  }
+  else if(type)
   {
-    putcword(e->value);
-    putcword(e->label);
-    e = e->next;
+    putchashed(type);
+  }
+  else
+  {
+    putcbyte(OP_SWITCH);
+    putcword(ssp->nCases);
+
+    // output the case table
+    cnt = ssp->nCases;
+    e   = ssp->cases;
+    while (--cnt >= 0) 
+    {
+      putcword(e->value);
+      putclong(e->label);
+      e = e->next;
+    }
   }
   if (ssp->defaultLabel)
   {
-    putcword(ssp->defaultLabel);
+    putclong(ssp->defaultLabel);
   }
   else
   {
-    end = putcword(end);
+    end = putclong(end);
   }
   //resolve break targets
   Fixup(end,cptr);
@@ -771,6 +921,98 @@ QLCompiler::do_switch()
   RemoveSwitch(os);
 }
 
+// Type of the cases if all are integers or all are strings
+// Gives zero for small or mixed switches: these keep the linear table
+int
+QLCompiler::SwitchType(int& p_low,int& p_high)
+{
+  int type = 0;
+
+  if(ssp->nCases < SWITCH_MINIMUM || ssp->nCases > SWITCH_MAXIMUM)
+  {
+    return 0;
+  }
+  for(CENTRY* e = ssp->cases; e != nullptr; e = e->next)
+  {
+    MemObject* lit = m_literals->GetEntry(e->value);
+    if(lit->m_type != DTYPE_INTEGER && lit->m_type != DTYPE_STRING)
+    {
+      return 0;
+    }
+    if(type == 0)
+    {
+      type   = lit->m_type;
+      p_low  = INT_MAX;
+      p_high = INT_MIN;
+    }
+    else if(type != lit->m_type)
+    {
+      return 0;
+    }
+    if(type == DTYPE_INTEGER)
+    {
+      p_low  = min(p_low, lit->m_value.v_integer);
+      p_high = max(p_high,lit->m_value.v_integer);
+    }
+  }
+  return type;
+}
+
+// Dense jump table for a compact range of integer cases
+// OP_DSWITCH <slots> <low>, indexed by (selector - low), holes have label zero
+void
+QLCompiler::putcdense(int p_low,int p_slots)
+{
+  std::vector<CENTRY*> table(p_slots,nullptr);
+
+  for(CENTRY* e = ssp->cases; e != nullptr; e = e->next)
+  {
+    table[m_literals->GetEntry(e->value)->m_value.v_integer - p_low] = e;
+  }
+  putcbyte(OP_DSWITCH);
+  putcword(p_slots);
+  putclong(p_low);
+  for(auto& e : table)
+  {
+    putcword(e ? e->value : 0);
+    putclong(e ? e->label : 0);
+  }
+}
+
+// Hash table for sparse integer cases or string cases
+// OP_HSWITCH <slots> <type>, at most half full, so probing always ends
+void
+QLCompiler::putchashed(int p_type)
+{
+  int slots = 8;
+  while(slots < 2 * ssp->nCases)
+  {
+    slots <<= 1;
+  }
+  std::vector<CENTRY*> table(slots,nullptr);
+
+  for(CENTRY* e = ssp->cases; e != nullptr; e = e->next)
+  {
+    MemObject* lit  = m_literals->GetEntry(e->value);
+    unsigned   hash = (p_type == DTYPE_INTEGER) ? SwitchHash(lit->m_value.v_integer)
+                                                : SwitchHash(*lit->m_value.v_string);
+    int slot = hash & (slots - 1);
+    while(table[slot])
+    {
+      slot = (slot + 1) & (slots - 1);
+    }
+    table[slot] = e;
+  }
+  putcbyte(OP_HSWITCH);
+  putcword(slots);
+  putcbyte(p_type);
+  for(auto& e : table)
+  {
+    putcword(e ? e->value : 0);
+    putclong(e ? e->label : 0);
+  }
+}
+
 // Compile the CASE statement
 void
 QLCompiler::do_case()
@@ -863,9 +1105,10 @@ QLCompiler::CountOfTemporaries()
 void 
 QLCompiler::do_block()
 {
-  int tkn = m_scanner->GetToken();
+  int tkn  = m_scanner->GetToken();
+  int type = FindDataType(m_scanner->GetTokenAsString());
 
-  if(FindDataType(m_scanner->GetTokenAsString()) != DTYPE_NIL)
+  if(type != DTYPE_NIL)
   {
     int tcnt = CountOfTemporaries();
     // parse each local declaration 
@@ -876,7 +1119,7 @@ QLCompiler::do_block()
       {
         // Get local variable name
         FetchRequireToken(T_IDENTIFIER);
-        AddTemporary(m_scanner->GetTokenAsString());
+        AddTemporary(m_scanner->GetTokenAsString(),type);
         ++tcnt;
 
         if ((tkn = m_scanner->GetToken()) == '=') 
@@ -896,7 +1139,7 @@ QLCompiler::do_block()
       // Next also a declaration?
       tkn = m_scanner->GetToken();
     } 
-    while(FindDataType(m_scanner->GetTokenAsString()) != DTYPE_NIL);
+    while((type = FindDataType(m_scanner->GetTokenAsString())) != DTYPE_NIL);
   }
 
   // Now do the rest of the block
@@ -993,6 +1236,9 @@ QLCompiler::do_expr2(PVAL* pv)
 {
   int tkn; // ,nxt,end;
   PVAL rhs;
+  // Only the outermost assignment of a statement discards its value
+  bool statement = m_statement;
+  m_statement = false;
   do_expr3(pv);
   while (( tkn = m_scanner->GetToken()) == _T('=')
         || tkn == T_ADDEQ || tkn == T_SUBEQ
@@ -1004,11 +1250,34 @@ QLCompiler::do_expr2(PVAL* pv)
     switch (tkn) 
     {
       case _T('='): 	    emit_code(pv->m_pval_type,PUSH,0);
+                      m_appendTemp = -1;
+                      m_appendAdd  = -1;
+                      if(statement && pv->m_pval_type == PV_TEMPORARY)
+                      {
+                        m_appendTemp = pv->m_value;
+                      }
                       do_expr1(&rhs); 
                       rvalue(&rhs);
+                      m_appendTemp = -1;
+                      if(m_appendAdd >= 0 && m_appendAdd == cptr - 1)
+                      {
+                        // 's = s + expr': append to the string in place
+                        cbuff[m_appendLoad + (cbuff[m_appendLoad] == OP_WIDE ? 1 : 0)] = OP_TLOADA;
+                        cptr = m_appendAdd;
+                        putcoperand(OP_TAPPEND,pv->m_value);
+                        m_appendAdd = -1;
+                        break;
+                      }
+                      m_appendAdd = -1;
                       emit_code(pv->m_pval_type,STORE,pv->m_value);
                       break;
-      case T_ADDEQ:	  do_assignment(pv,OP_ADD);	    break;
+      case T_ADDEQ:	  if(statement && pv->m_pval_type == PV_TEMPORARY)
+                      {
+                        do_append(pv);
+                        break;
+                      }
+                      do_assignment(pv,OP_ADD);
+                      break;
       case T_SUBEQ:	  do_assignment(pv,OP_SUB);	    break;
       case T_MULEQ:	  do_assignment(pv,OP_MUL);	    break;
       case T_DIVEQ:	  do_assignment(pv,OP_DIV);	    break;
@@ -1020,6 +1289,7 @@ QLCompiler::do_expr2(PVAL* pv)
       case T_SHREQ:	  do_assignment(pv,OP_SHR);	    break;
     }
     pv->m_pval_type = PV_NOVALUE;
+    pv->m_datatype  = DTYPE_NIL;
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1039,6 +1309,20 @@ QLCompiler::do_assignment(PVAL* pv,int op)
   emit_code(pv->m_pval_type,STORE,pv->m_value);
 }
 
+// do_append - handle 's += expr' on a local variable as a statement
+// The string of the local is extended in place if it is the only owner
+void 
+QLCompiler::do_append(PVAL* pv)
+{
+  PVAL rhs;
+
+  putcoperand(OP_TLOADA,pv->m_value);
+  putcbyte(OP_PUSH);
+  do_expr1(&rhs); 
+  rvalue(&rhs);
+  putcoperand(OP_TAPPEND,pv->m_value);
+}
+
 // do_expr3 - handle the '?:' operator
 void 
 QLCompiler::do_expr3(PVAL* pv)
@@ -1049,16 +1333,17 @@ QLCompiler::do_expr3(PVAL* pv)
   {
     rvalue(pv);
     putcbyte(OP_BRF);
-    nxt = putcword(0);
+    nxt = putclong(0);
     do_expr1(pv); 
     rvalue(pv);
     FetchRequireToken(':');
     putcbyte(OP_BR);
-    end = putcword(0);
+    end = putclong(0);
     Fixup(nxt,cptr);
     do_expr1(pv); 
     rvalue(pv);
     Fixup(end,cptr);
+    pv->m_datatype = DTYPE_NIL;
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1073,9 +1358,10 @@ QLCompiler::do_expr4(PVAL* pv)
   {
     rvalue(pv);
     putcbyte(OP_BRT);
-    end = putcword(end);
+    end = putclong(end);
     do_expr5(pv); 
     rvalue(pv);
+    pv->m_datatype = DTYPE_NIL;
   }
   Fixup(end,cptr);
   m_scanner->SaveToken(tkn);
@@ -1091,9 +1377,10 @@ QLCompiler::do_expr5(PVAL* pv)
   {
     rvalue(pv);
     putcbyte(OP_BRF);
-    end = putcword(end);
+    end = putclong(end);
     do_expr6(pv); 
     rvalue(pv);
+    pv->m_datatype = DTYPE_NIL;
   }
   Fixup(end,cptr);
   m_scanner->SaveToken(tkn);
@@ -1103,15 +1390,17 @@ QLCompiler::do_expr5(PVAL* pv)
 void 
 QLCompiler::do_expr6(PVAL* pv)
 {
-  int tkn;
+  int tkn,push,type;
+  int start = cptr;
   do_expr7(pv);
   while ((tkn = m_scanner->GetToken()) == '|') 
   {
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr7(pv); 
     rvalue(pv);
-    putcbyte(OP_BOR);
+    pv->m_datatype = putcbinary(OP_BOR,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1120,15 +1409,17 @@ QLCompiler::do_expr6(PVAL* pv)
 void 
 QLCompiler::do_expr7(PVAL * pv)
 {
-  int tkn;
+  int tkn,push,type;
+  int start = cptr;
   do_expr8(pv);
   while ((tkn = m_scanner->GetToken()) == '^') 
   {
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr8(pv); 
     rvalue(pv);
-    putcbyte(OP_XOR);
+    pv->m_datatype = putcbinary(OP_XOR,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1137,15 +1428,17 @@ QLCompiler::do_expr7(PVAL * pv)
 void 
 QLCompiler::do_expr8(PVAL* pv)
 {
-  int tkn;
+  int tkn,push,type;
+  int start = cptr;
   do_expr9(pv);
   while ((tkn = m_scanner->GetToken()) == '&') 
   {
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr9(pv); 
     rvalue(pv);
-    putcbyte(OP_BAND);
+    pv->m_datatype = putcbinary(OP_BAND,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1154,7 +1447,8 @@ QLCompiler::do_expr8(PVAL* pv)
 void 
 QLCompiler::do_expr9(PVAL* pv)
 {
-  int tkn,op;
+  int tkn,op,push,type;
+  int start = cptr;
   do_expr10(pv);
   while ((tkn = m_scanner->GetToken()) == T_EQ || tkn == T_NE) 
   {
@@ -1164,10 +1458,11 @@ QLCompiler::do_expr9(PVAL* pv)
       case T_NE: op = OP_NE; break;
     }
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr10(pv); 
     rvalue(pv);
-    putcbyte(op);
+    pv->m_datatype = putcbinary(op,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1176,7 +1471,8 @@ QLCompiler::do_expr9(PVAL* pv)
 void 
 QLCompiler::do_expr10(PVAL* pv)
 {
-  int tkn,op;
+  int tkn,op,push,type;
+  int start = cptr;
   do_expr11(pv);
   while ((tkn = m_scanner->GetToken()) == _T('<') || tkn == T_LE || tkn == T_GE || tkn == '>') 
   {
@@ -1188,10 +1484,11 @@ QLCompiler::do_expr10(PVAL* pv)
       case _T('>'):  op = OP_GT; break;
     }
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr11(pv); 
     rvalue(pv);
-    putcbyte(op);
+    pv->m_datatype = putcbinary(op,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1200,7 +1497,8 @@ QLCompiler::do_expr10(PVAL* pv)
 void 
 QLCompiler::do_expr11(PVAL* pv)
 {
-  int tkn,op;
+  int tkn,op,push,type;
+  int start = cptr;
   do_expr12(pv);
   while ((tkn = m_scanner->GetToken()) == T_SHL || tkn == T_SHR) 
   {
@@ -1210,10 +1508,11 @@ QLCompiler::do_expr11(PVAL* pv)
       case T_SHR: op = OP_SHR; break;
     }
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr12(pv); 
     rvalue(pv);
-    putcbyte(op);
+    pv->m_datatype = putcbinary(op,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1222,8 +1521,16 @@ QLCompiler::do_expr11(PVAL* pv)
 void 
 QLCompiler::do_expr12(PVAL* pv)
 {
-  int tkn,op;
+  int tkn,op,push,type;
+  int start = cptr;
+  // Right hand side of 's = s + expr' starts with the local 's'
+  int append = m_appendTemp;
+  m_appendTemp = -1;
   do_expr13(pv);
+  if(pv->m_pval_type != PV_TEMPORARY || pv->m_value != append)
+  {
+    append = -1;
+  }
   while ((tkn = m_scanner->GetToken()) == _T('+') || tkn == '-') 
   {
     switch (tkn) 
@@ -1231,11 +1538,21 @@ QLCompiler::do_expr12(PVAL* pv)
       case _T('+'): op = OP_ADD; break;
       case _T('-'): op = OP_SUB; break;
     }
+    if(append >= 0 && op == OP_ADD)
+    {
+      m_appendLoad = cptr;
+    }
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr13(pv); 
     rvalue(pv);
-    putcbyte(op);
+    if(append >= 0 && op == OP_ADD)
+    {
+      m_appendAdd = cptr;
+    }
+    append = -1;
+    pv->m_datatype = putcbinary(op,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1244,7 +1561,8 @@ QLCompiler::do_expr12(PVAL* pv)
 void 
 QLCompiler::do_expr13(PVAL* pv)
 {
-  int tkn,op;
+  int tkn,op,push,type;
+  int start = cptr;
   do_expr14(pv);
   while ((tkn = m_scanner->GetToken()) == _T('*') || tkn == _T('/') || tkn == '%') 
   {
@@ -1255,10 +1573,11 @@ QLCompiler::do_expr13(PVAL* pv)
       case _T('%'): op = OP_REM; break;
     }
     rvalue(pv);
-    putcbyte(OP_PUSH);
+    type = pv->m_datatype;
+    push = putcbyte(OP_PUSH);
     do_expr14(pv);
     rvalue(pv);
-    putcbyte(op);
+    pv->m_datatype = putcbinary(op,start,push,type,pv->m_datatype);
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1268,27 +1587,33 @@ void
 QLCompiler::do_expr14(PVAL* pv)
 {
   int tkn;
+  int start = cptr;
   switch (tkn = m_scanner->GetToken()) 
   {
     case _T('-'): 	  do_expr15(pv); 
                   rvalue(pv);
-                  putcbyte(OP_NEG);
+                  putcunary(OP_NEG,start);
+                  pv->m_datatype = DTYPE_INTEGER;
                   break;
     case _T('!'):	    do_expr15(pv); 
                   rvalue(pv);
-                  putcbyte(OP_NOT);
+                  putcunary(OP_NOT,start);
+                  pv->m_datatype = DTYPE_INTEGER;
                   break;
     case _T('~'):	    do_expr15(pv); 
                   rvalue(pv);
-                  putcbyte(OP_BNOT);
+                  putcunary(OP_BNOT,start);
+                  pv->m_datatype = DTYPE_INTEGER;
                   break;
     case T_INC:   do_preincrement(pv,OP_INC);
                   break;
     case T_DEC:   do_preincrement(pv,OP_DEC);
                   break;
     case T_NEW:   do_new(pv);
+                  pv->m_datatype = DTYPE_NIL;
                   break;
     case T_DELETE:do_delete(pv);
+                  pv->m_datatype = DTYPE_NIL;
                   break;
     default:	    m_scanner->SaveToken(tkn);
                   do_expr15(pv);
@@ -1344,7 +1669,8 @@ QLCompiler::do_new(PVAL* pv)
   putcbyte(OP_NEW);
   pv->m_pval_type = PV_NOVALUE;
     
-  do_send(selector,pv);
+  // The constructor of a known class
+  do_send(selector,pv,v_class);
 }
 
 void
@@ -1382,13 +1708,22 @@ QLCompiler::do_expr15(PVAL* pv)
                       break;
       case T_MEMREF:  FetchRequireToken(T_IDENTIFIER);
                       selector = m_scanner->GetTokenAsString();
-                      do_send(selector,pv);
+                      // Sending to 'this' in a member function
+                      if(m_methodclass && pv->m_pval_type == PV_ARGUMENT && pv->m_value == FindArgument(_T("this")))
+                      {
+                        do_send(selector,pv,m_methodclass);
+                      }
+                      else
+                      {
+                        do_send(selector,pv);
+                      }
                       break;
       case T_INC:     do_postincrement(pv,OP_INC);
                       break;
       case T_DEC:     do_postincrement(pv,OP_DEC);
                       break;
     }
+    pv->m_datatype = DTYPE_NIL;
   }
   m_scanner->SaveToken(tkn);
 }
@@ -1401,6 +1736,7 @@ QLCompiler::do_primary(PVAL* pv)
   Class*  v_class = nullptr;
   int     tkn = 0;
 
+  pv->m_datatype = DTYPE_NIL;
   switch (m_scanner->GetToken()) 
   {
     case _T('('):         	do_expr1(pv);
@@ -1408,20 +1744,25 @@ QLCompiler::do_primary(PVAL* pv)
                         break;
     case T_NUMBER:    	do_lit_integer((long)m_scanner->GetTokenAsInteger());
                         pv->m_pval_type = PV_NOVALUE;
+                        pv->m_datatype  = DTYPE_INTEGER;
                         break;
     case T_FLOAT:       do_lit_float(m_scanner->GetTokenAsFloat());
                         pv->m_pval_type = PV_NOVALUE;
+                        pv->m_datatype  = DTYPE_BCD;
                         break;
     case T_STRING:    	do_lit_string(m_scanner->GetTokenAsString());
                         pv->m_pval_type = PV_NOVALUE;
+                        pv->m_datatype  = DTYPE_STRING;
                         break;
     case T_NIL:       	putcbyte(OP_NIL);
                         break;
     case T_TRUE:        do_lit_integer(1);
                         pv->m_pval_type = PV_NOVALUE;
+                        pv->m_datatype  = DTYPE_INTEGER;
                         break;
     case T_FALSE:       do_lit_integer(0);
                         pv->m_pval_type = PV_NOVALUE;
+                        pv->m_datatype  = DTYPE_INTEGER;
                         break;
     case T_IDENTIFIER:	id = m_scanner->GetTokenAsString();
                         if ((tkn = m_scanner->GetToken()) == T_CC) 
@@ -1475,8 +1816,9 @@ QLCompiler::do_call(PVAL* pv)
 }
 
 // compile a message sending expression
+// With a known class of the receiver, the send goes through its vtable
 void 
-QLCompiler::do_send(CString selector,PVAL* pv)
+QLCompiler::do_send(CString selector,PVAL* pv,Class* p_class)
 {
   MemObject *lit = nullptr;
   int tkn = 0;
@@ -1511,8 +1853,10 @@ QLCompiler::do_send(CString selector,PVAL* pv)
   RequireToken(tkn,')');
 
   // send the method message to the object
-  putcbyte(OP_SEND);
+  // Each send gets its own inline cache in the function
+  putcbyte(p_class ? OP_VSEND : OP_SEND);
   putcbyte(n);
+  putcword(m_sendsites++);
 
   // we've got an rvalue now
   pv->m_pval_type = PV_NOVALUE;
@@ -1552,7 +1896,7 @@ QLCompiler::GetArgumentList(Function* p_function)
       if(p_function)
       {
         p_function->AddArgument(type);
-        AddArgument(argument);
+        AddArgument(argument,type);
       }
       ++cnt;
     } 
@@ -1587,6 +1931,10 @@ QLCompiler::FindDataType(CString p_name)
     }
     ++index;
   }
+  if(p_name.Compare(_T("map")) == 0)
+  {
+    return DTYPE_MAP;
+  }
   if(m_vm->FindClass(p_name))
   {
     return DTYPE_OBJECT;
@@ -1595,16 +1943,19 @@ QLCompiler::FindDataType(CString p_name)
 }
 
 // add a formal argument
+// The declared datatype is used to infer the datatypes of expressions
 void 
-QLCompiler::AddArgument(CString p_name)
+QLCompiler::AddArgument(CString p_name,int p_type /*= DTYPE_NIL*/)
 {
   m_arguments.push_back(p_name);
+  m_argtypes.push_back(p_type);
 }
 
 void
-QLCompiler::AddTemporary(CString p_name)
+QLCompiler::AddTemporary(CString p_name,int p_type /*= DTYPE_NIL*/)
 {
   m_temporaries.push_back(p_name);
+  m_temptypes.push_back(p_type);
 }
 
 // free a list of arguments or temporaries
@@ -1706,6 +2057,7 @@ QLCompiler::FreeLiterals()
     delete m_literals;
     m_literals = nullptr;
   }
+  m_constants.clear();
 }
 
 // Fetch a token and check it
@@ -1735,23 +2087,29 @@ void
 QLCompiler::do_lit_integer(long n)
 {
   MemObject* lit = nullptr;
-  code_literal(AddLiteral(DTYPE_INTEGER,&lit,_T(""),n));
+  int index = AddLiteral(DTYPE_INTEGER,&lit,_T(""),n);
   lit->m_value.v_integer = n;
+  m_constants.insert(index);
+  code_literal(index);
 }
 
 void
 QLCompiler::do_lit_float(bcd fl)
 {
   MemObject* lit = nullptr;
-  code_literal(AddLiteral(DTYPE_BCD,&lit));
+  int index = AddLiteral(DTYPE_BCD,&lit);
   *(lit->m_value.v_floating) = fl;
+  m_constants.insert(index);
+  code_literal(index);
 }
 
 // compile a literal string
 void 
 QLCompiler::do_lit_string(CString str)
 {
-  code_literal(make_lit_string(str));
+  int index = make_lit_string(str);
+  m_constants.insert(index);
+  code_literal(index);
 }
 
 // make a literal string
@@ -1771,8 +2129,8 @@ QLCompiler::make_lit_string(CString p_string)
 int
 QLCompiler::make_lit_integer(long p_value)
 {
-  MemObject* lit;
-  int n = AddLiteral(DTYPE_INTEGER,&lit);
+  MemObject* lit = nullptr;
+  int n = AddLiteral(DTYPE_INTEGER,&lit,_T(""),p_value);
   lit->m_value.v_integer = p_value;
   return n;
 }
@@ -1797,6 +2155,168 @@ QLCompiler::make_lit_variable(MemObject* p_sym)
   return n;
 }
 
+// The constant literal, if the code from p_start to p_end is one OP_LIT of it
+// Symbols and classes are literals too, but their value is not known yet
+MemObject*
+QLCompiler::constant_at(int p_start,int p_end)
+{
+  int index = -1;
+
+  if (p_end - p_start == 2 && cbuff[p_start] == OP_LIT)
+  {
+    index = cbuff[p_start + 1];
+  }
+  else if (p_end - p_start == 4 && cbuff[p_start] == OP_WIDE && cbuff[p_start + 1] == OP_LIT)
+  {
+    index = cbuff[p_start + 2] | (cbuff[p_start + 3] << 8);
+  }
+  if (index >= 0 && m_constants.find(index) != m_constants.end())
+  {
+    return m_literals->GetEntry(index);
+  }
+  return nullptr;
+}
+
+// Outcome of a constant test expression from p_start: 1 (true) or 0 (false)
+// The test is removed from the code. Gives -1 if the test is not a constant
+int
+QLCompiler::constant_test(int p_start)
+{
+  MemObject* lit = constant_at(p_start,cptr);
+  if (lit == nullptr)
+  {
+    return -1;
+  }
+  cptr = p_start;
+  // Same as the interpreter: only the integer zero is false
+  return (lit->m_type == DTYPE_INTEGER && lit->m_value.v_integer == 0) ? 0 : 1;
+}
+
+// Fold a binary operator with two constant operands into one literal
+// p_left is the start of the left operand, p_push the OP_PUSH before the right one
+// Operations that give a runtime message (division by zero) are not folded
+bool
+QLCompiler::fold_binary(int p_op,int p_left,int p_push)
+{
+  MemObject* left  = constant_at(p_left,p_push);
+  MemObject* right = constant_at(p_push + 1,cptr);
+
+  if (left == nullptr || right == nullptr || left->m_type != right->m_type)
+  {
+    return false;
+  }
+  switch (left->m_type)
+  {
+    case DTYPE_INTEGER: { int l = left ->m_value.v_integer;
+                          int r = right->m_value.v_integer;
+                          int number = 0;
+                          switch (p_op)
+                          {
+                            case OP_ADD:  number = (int)((unsigned)l + (unsigned)r); break;
+                            case OP_SUB:  number = (int)((unsigned)l - (unsigned)r); break;
+                            case OP_MUL:  number = (int)((unsigned)l * (unsigned)r); break;
+                            case OP_DIV:  if (r == 0 || (r == -1 && l == INT_MIN)) return false;
+                                          number = l / r;   break;
+                            case OP_REM:  if (r == 0 || (r == -1 && l == INT_MIN)) return false;
+                                          number = l % r;   break;
+                            case OP_BAND: number = l & r;   break;
+                            case OP_BOR:  number = l | r;   break;
+                            case OP_XOR:  number = l ^ r;   break;
+                            case OP_SHL:  if (r < 0 || r > 31) return false;
+                                          number = l << r;  break;
+                            case OP_SHR:  if (r < 0 || r > 31) return false;
+                                          number = l >> r;  break;
+                            case OP_LT:   number = l <  r;  break;
+                            case OP_LE:   number = l <= r;  break;
+                            case OP_EQ:   number = l == r;  break;
+                            case OP_NE:   number = l != r;  break;
+                            case OP_GE:   number = l >= r;  break;
+                            case OP_GT:   number = l >  r;  break;
+                            default:      return false;
+                          }
+                          cptr = p_left;
+                          do_lit_integer(number);
+                        }
+                        break;
+    case DTYPE_STRING:  { CString l = *left ->m_value.v_string;
+                          CString r = *right->m_value.v_string;
+                          int number = 0;
+                          switch (p_op)
+                          {
+                            case OP_ADD:  cptr = p_left;
+                                          do_lit_string(l + r);
+                                          return true;
+                            case OP_LT:   number = l <  r;  break;
+                            case OP_LE:   number = l <= r;  break;
+                            case OP_EQ:   number = l.Compare(r) == 0; break;
+                            case OP_NE:   number = l.Compare(r) != 0; break;
+                            case OP_GE:   number = l >= r;  break;
+                            case OP_GT:   number = l >  r;  break;
+                            default:      return false;
+                          }
+                          cptr = p_left;
+                          do_lit_integer(number);
+                        }
+                        break;
+    case DTYPE_BCD:     { bcd l = *left ->m_value.v_floating;
+                          bcd r = *right->m_value.v_floating;
+                          bcd number;
+                          switch (p_op)
+                          {
+                            case OP_ADD:  number = l + r;   break;
+                            case OP_SUB:  number = l - r;   break;
+                            case OP_MUL:  number = l * r;   break;
+                            case OP_DIV:  if (r.IsNULL()) return false;
+                                          number = l / r;   break;
+                            case OP_REM:  if (r.IsNULL()) return false;
+                                          number = l % r;   break;
+                            case OP_LT:   cptr = p_left; do_lit_integer(l <  r); return true;
+                            case OP_LE:   cptr = p_left; do_lit_integer(l <= r); return true;
+                            case OP_EQ:   cptr = p_left; do_lit_integer(l == r); return true;
+                            case OP_NE:   cptr = p_left; do_lit_integer(l != r); return true;
+                            case OP_GE:   cptr = p_left; do_lit_integer(l >= r); return true;
+                            case OP_GT:   cptr = p_left; do_lit_integer(l >  r); return true;
+                            default:      return false;
+                          }
+                          cptr = p_left;
+                          do_lit_float(number);
+                        }
+                        break;
+    default:            return false;
+  }
+  return true;
+}
+
+// Fold a unary operator on a constant operand into one literal
+// Does the same as the interpreter for these operators
+bool
+QLCompiler::fold_unary(int p_op,int p_start)
+{
+  MemObject* lit = constant_at(p_start,cptr);
+  if (lit == nullptr)
+  {
+    return false;
+  }
+  bool isint = lit->m_type == DTYPE_INTEGER;
+  int  value = isint ? lit->m_value.v_integer : 0;
+
+  switch (p_op)
+  {
+    case OP_NEG:  if (!isint) return false;
+                  value = (int)(0U - (unsigned)value);
+                  break;
+    case OP_NOT:  value = (isint && value == 0) ? 1 : 0;
+                  break;
+    case OP_BNOT: if (!isint) return false;
+                  value = value > 0 ? 0 : 1;
+                  break;
+    default:      return false;
+  }
+  cptr = p_start;
+  do_lit_integer(value);
+  return true;
+}
+
 // Find a variable
 void 
 QLCompiler::FindVariable(CString p_name,PVAL* pv)
@@ -1807,11 +2327,13 @@ QLCompiler::FindVariable(CString p_name,PVAL* pv)
   {
     pv->m_pval_type = PV_ARGUMENT;
     pv->m_value = n;
+    pv->m_datatype = m_argtypes[n];
   }
   else if ((n = FindTemporary(p_name)) >= 0) 
   {
     pv->m_pval_type = PV_TEMPORARY;
     pv->m_value = n;
+    pv->m_datatype = m_temptypes[n];
   }
   else if (m_methodclass == nullptr || 
           !FindClassVariable(m_methodclass,p_name,pv)) 
@@ -1849,7 +2371,7 @@ QLCompiler::FindClassVariable(Class* p_class,CString p_name,PVAL* pv)
                         pv->m_value = m_vm->AddGlobal(entry,p_name);
                         break;
     case ST_FUNCTION: 	FindVariable(_T("this"),pv);
-                        do_send(p_name,pv);
+                        do_send(p_name,pv,p_class);
                         break;
     case ST_SFUNCTION:	code_literal(make_lit_variable(entry));
                         pv->m_pval_type = PV_NOVALUE;
@@ -1879,8 +2401,8 @@ QLCompiler::code_argument(int fcn,int n)
 {
   switch (fcn) 
   {
-    case LOAD:	putcbyte(OP_ALOAD);  putcbyte(n); break;
-    case STORE:	putcbyte(OP_ASTORE); putcbyte(n); break;
+    case LOAD:	putcoperand(OP_ALOAD, n); break;
+    case STORE:	putcoperand(OP_ASTORE,n); break;
   }
 }
 
@@ -1890,8 +2412,8 @@ QLCompiler::code_temporary(int fcn,int n)
 {
   switch (fcn) 
   {
-    case LOAD:	putcbyte(OP_TLOAD);  putcbyte(n); break;
-    case STORE:	putcbyte(OP_TSTORE); putcbyte(n); break;
+    case LOAD:	putcoperand(OP_TLOAD, n); break;
+    case STORE:	putcoperand(OP_TSTORE,n); break;
   }
 }
 
@@ -1901,8 +2423,8 @@ QLCompiler::code_member(int fcn,int n)
 {
   switch (fcn) 
   {
-    case LOAD:	putcbyte(OP_MLOAD);  putcbyte(n); break;
-    case STORE:	putcbyte(OP_MSTORE); putcbyte(n); break;
+    case LOAD:	putcoperand(OP_MLOAD, n); break;
+    case STORE:	putcoperand(OP_MSTORE,n); break;
   }
 }
 
@@ -1912,8 +2434,8 @@ QLCompiler::code_variable(int fcn,int n)
 {
   switch (fcn) 
   {
-    case LOAD:	putcbyte(OP_LOAD);  putcbyte(n); break;
-    case STORE:	putcbyte(OP_STORE); putcbyte(n); break;
+    case LOAD:	putcoperand(OP_LOAD, n); break;
+    case STORE:	putcoperand(OP_STORE,n); break;
   }
 }
 
@@ -1935,17 +2457,23 @@ QLCompiler::code_index(int fcn)
 void 
 QLCompiler::code_literal(int n)
 {
-  putcbyte(OP_LIT);
-  putcbyte(n);
+  putcoperand(OP_LIT,n);
 }
 
 // put a code byte into data space
 int 
 QLCompiler::putcbyte(int b)
 {
-  if (cptr >= CMAX)
+  if (cptr >= m_cmax)
   {
-    m_scanner->ParseError(_T("Insufficient code space"));
+    // Large scripts: grow the code buffer
+    BYTE* buffer = (BYTE*) realloc(cbuff,2 * m_cmax);
+    if(buffer == nullptr)
+    {
+      m_scanner->ParseError(_T("Insufficient code space"));
+    }
+    cbuff   = buffer;
+    m_cmax *= 2;
   }
   cbuff[cptr] = b;
   return (cptr++);
@@ -1960,23 +2488,132 @@ QLCompiler::putcword(int w)
   return (cptr-2);
 }
 
-// Fixup a single bytecode reference
+// put a code long (branch offset) into data space
+int
+QLCompiler::putclong(int l)
+{
+  putcword(l);
+  putcword(l >> 16);
+  return (cptr-4);
+}
+
+// put an opcode with a byte operand, or with a word after OP_WIDE
+void
+QLCompiler::putcoperand(int op,int n)
+{
+  if (n > 0xFFFF)
+  {
+    m_scanner->ParseError(_T("Too many literals, variables or members"));
+  }
+  if (n > 0xFF)
+  {
+    putcbyte(OP_WIDE);
+    putcbyte(op);
+    putcword(n);
+  }
+  else
+  {
+    putcbyte(op);
+    putcbyte(n);
+  }
+}
+
+// put a binary operator, or fold it if both operands are constants
+// With the same inferred datatype for both operands, the operator is
+// specialized on that datatype (the interpreter still checks the types)
+// Returns the inferred datatype of the result
+int
+QLCompiler::putcbinary(int op,int p_left,int p_push,int p_ltype,int p_rtype)
+{
+  int type = DTYPE_NIL;
+
+  if (fold_binary(op,p_left,p_push))
+  {
+    return constant_at(p_left,cptr)->m_type;
+  }
+  if (p_ltype == p_rtype)
+  {
+    switch (p_ltype)
+    {
+      case DTYPE_INTEGER: switch (op)
+                          {
+                            case OP_ADD: op = OP_ADDII; break;
+                            case OP_SUB: op = OP_SUBII; break;
+                            case OP_MUL: op = OP_MULII; break;
+                            case OP_LT:  op = OP_LTII;  break;
+                            case OP_LE:  op = OP_LEII;  break;
+                            case OP_EQ:  op = OP_EQII;  break;
+                            case OP_NE:  op = OP_NEII;  break;
+                            case OP_GE:  op = OP_GEII;  break;
+                            case OP_GT:  op = OP_GTII;  break;
+                          }
+                          type = DTYPE_INTEGER;
+                          break;
+      case DTYPE_BCD:     switch (op)
+                          {
+                            case OP_ADD: op = OP_ADDBB; break;
+                            case OP_SUB: op = OP_SUBBB; break;
+                            case OP_MUL: op = OP_MULBB; break;
+                          }
+                          if (op == OP_ADDBB || op == OP_SUBBB || op == OP_MULBB || op == OP_DIV || op == OP_REM)
+                          {
+                            type = DTYPE_BCD;
+                          }
+                          break;
+      case DTYPE_STRING:  if (op == OP_ADD)
+                          {
+                            op   = OP_CONCAT;
+                            type = DTYPE_STRING;
+                          }
+                          break;
+    }
+  }
+  // Only defined for integers, or comparisons that give an integer
+  switch (op)
+  {
+    case OP_BAND: // Fall through
+    case OP_BOR:  // Fall through
+    case OP_XOR:  // Fall through
+    case OP_SHR:  // Fall through
+    case OP_LT:   // Fall through
+    case OP_LE:   // Fall through
+    case OP_EQ:   // Fall through
+    case OP_NE:   // Fall through
+    case OP_GE:   // Fall through
+    case OP_GT:   type = DTYPE_INTEGER;
+                  break;
+  }
+  putcbyte(op);
+  return type;
+}
+
+// put a unary operator, or fold it if the operand is a constant
+void
+QLCompiler::putcunary(int op,int p_start)
+{
+  if (!fold_unary(op,p_start))
+  {
+    putcbyte(op);
+  }
+}
+
+// Fixup a single bytecode word reference
 void
 QLCompiler::fixup_ref(int chn,int val)
 {
-  cbuff[chn] = val & 0xFF;
+  cbuff[chn]   = val & 0xFF;
+  cbuff[chn+1] = (val >> 8) & 0xFF;
 }
 
-// Fixup a reference chain
+// Fixup a reference chain of branch offsets
 void 
 QLCompiler::Fixup(int chn,int val)
 {
-  int hval,nxt;
-  for (hval = val >> 8; chn != 0; chn = nxt) 
+  int nxt;
+  for (; chn != 0; chn = nxt) 
   {
-    nxt = (cbuff[chn] & 0xFF) | (cbuff[chn+1] << 8);
-    cbuff[chn] = val;
-    cbuff[chn+1] = hval;
+    nxt = ReadLong(&cbuff[chn]);
+    WriteLong(&cbuff[chn],val);
   }
 }
 
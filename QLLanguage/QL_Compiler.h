@@ -9,6 +9,7 @@
 #include "QL_Language.h"
 #include "QL_Scanner.h"
 #include "QL_vm.h"
+#include <set>
 
 /* variable access function codes */
 #define LOAD	1
@@ -19,6 +20,11 @@
 // Break/continue stack size
 #define SSIZE	10
 
+// Switch statements with fewer cases keep the linear case table
+#define SWITCH_MINIMUM  5
+// Most cases in a dense or hashed switch table
+#define SWITCH_MAXIMUM  0x4000
+
 // RVALUE type for PVAL
 #define PV_NOVALUE   0
 #define PV_CODE      1
@@ -29,7 +35,7 @@
 #define PV_MEMBER    6
 #define PV_GLOBAL    7
 
-// Max amount of bytecode per function
+// Initial amount of bytecode per function (the buffer grows)
 #define CMAX     32000
 
 // partial value structure for the compiler
@@ -38,7 +44,7 @@ typedef struct _pval
   // int (*fcn)(int,int);
   int m_pval_type;
   int m_value;
-  // int m_datatype;
+  int m_datatype;   // Inferred DTYPE_* of the value, DTYPE_NIL if not known
 } 
 PVAL;
 
@@ -61,7 +67,20 @@ struct swentry
   int       label;
 };
 
+/* unreachable code entry structure */
+typedef struct deadcode DEADCODE;
+struct deadcode
+{
+  int       mark;
+  int       skip;
+  int       breaks;
+  int       nCases;
+  int       defaultLabel;
+  int       sendsites;
+};
+
 typedef std::vector<CString> ARGUMENT;
+typedef std::set<int>        CONSTANTS;
 
 // forward declarations
 class QLDebugger;
@@ -84,6 +103,7 @@ private:
   void    do_code(Function* p_function);
   void    do_class();
   void    do_statement();
+  void    do_dead_statement();
   void    do_if();
   void    do_while();
   void    do_dowhile();
@@ -114,17 +134,25 @@ private:
   void    do_expr14(PVAL* pv);
   void    do_expr15(PVAL* pv);
   void    do_assignment(PVAL* pv,int op);
+  void    do_append(PVAL* pv);
   void    do_preincrement(PVAL* pv,int op);
   void    do_postincrement(PVAL* pv,int op);
   void    do_new(PVAL* pv);
   void    do_delete(PVAL* pv);
-  void    do_send(CString selector,PVAL* pv);
+  void    do_send(CString selector,PVAL* pv,Class* p_class = nullptr);
   void    do_primary(PVAL* pv);
   void    do_call(PVAL* pv);
   void    do_index(PVAL* pv);
   void    do_lit_integer(long n);
   void    do_lit_string(CString str);
   void    do_lit_float(bcd fl);
+  // Constant folding and unreachable code
+  MemObject* constant_at(int p_start,int p_end);
+  int       constant_test(int p_start);
+  bool      fold_binary(int p_op,int p_left,int p_push);
+  bool      fold_unary(int p_op,int p_start);
+  void      dead_begin(DEADCODE& p_dead);
+  void      dead_end(DEADCODE& p_dead);
 
   int       FindDataType(CString p_name);
   void      FindVariable(CString p_name,PVAL* pv);
@@ -138,8 +166,8 @@ private:
   void      rvalue(PVAL* pv);
   void      Check_LValue(PVAL* pv);
   int       GetArgumentList(Function* p_function);
-  void      AddArgument (CString p_name);
-  void      AddTemporary(CString p_name);
+  void      AddArgument (CString p_name,int p_type = DTYPE_NIL);
+  void      AddTemporary(CString p_name,int p_type = DTYPE_NIL);
   void      freelist(ARGUMENT* p_list);
   int       FindArgument(CString p_name);
   int       FindTemporary(CString p_name);
@@ -152,6 +180,9 @@ private:
   int       make_lit_variable(MemObject* p_sym);
   SWENTRY*  AddSwitch();
   void      RemoveSwitch(SWENTRY *old);
+  int       SwitchType(int& p_low,int& p_high);
+  void      putcdense(int p_low,int p_slots);
+  void      putchashed(int p_type);
   int       CountOfTemporaries();
   void      emit_code(int p_type,int p_code,int p_value);
   void      code_argument(int fcn,int n);
@@ -162,6 +193,10 @@ private:
   void      code_literal(int n);
   int       putcbyte(int b);
   int       putcword(int w);
+  int       putclong(int l);
+  void      putcoperand(int op,int n);
+  int       putcbinary(int op,int p_left,int p_push,int p_ltype,int p_rtype);
+  void      putcunary(int op,int p_start);
   void      Fixup(int chn,int val);
   void      fixup_ref(int chn,int val);
   TCHAR*     GetMemory(int size);
@@ -172,10 +207,19 @@ private:
   QLDebugger*       m_debugger;     // QL Debugger object
   ARGUMENT          m_arguments;	  // argument list */
   ARGUMENT          m_temporaries;	// temporary variable list */
+  ArgTypes          m_argtypes;     // declared datatypes of the arguments
+  ArgTypes          m_temptypes;    // declared datatypes of the temporaries
   Array*            m_literals;	    // literal list 
+  CONSTANTS         m_constants;    // literals that are compile time constants
   Class*            m_methodclass;	// bob_class of the current method */
   BYTE*             cbuff;	        // code buffer
+  int               m_cmax;         // size of the code buffer
   int               cptr;		        // code pointer
+  int               m_sendsites;    // number of OP_SEND in the function
+  bool              m_statement;    // Next assignment is a complete statement
+  int               m_appendTemp;   // Temporary of 's = s + expr' being parsed
+  int               m_appendLoad;   // Code position of the 's' in 's = s + expr'
+  int               m_appendAdd;    // Code position of the '+' in 's = s + expr'
   /* break/continue stacks */
   int               bstack[SSIZE];
   int*              bsp;
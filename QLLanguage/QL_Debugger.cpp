@@ -23,9 +23,9 @@ static char THIS_FILE[] = __FILE__;
 
 OTDEF opcode_table[] = 
 {
-  { OP_BRT,     _T("BRT"),    FMT_WORD, -1 },  // Branch on true
-  { OP_BRF,     _T("BRF"),    FMT_WORD, -1 },  // Branch on false
-  { OP_BR,      _T("BR"),     FMT_WORD, -1 },  // Branch
+  { OP_BRT,     _T("BRT"),    FMT_LONG, -1 },  // Branch on true
+  { OP_BRF,     _T("BRF"),    FMT_LONG, -1 },  // Branch on false
+  { OP_BR,      _T("BR"),     FMT_LONG, -1 },  // Branch
   { OP_NIL,     _T("NIL"),    FMT_NONE, -1 },  // Load TOS with NILL
   { OP_PUSH,    _T("PUSH"),   FMT_NONE, -1 },  // Push NILL onto stack
   { OP_NOT,     _T("NOT"),    FMT_NONE,  0 },  // logical negate TOS
@@ -63,12 +63,40 @@ OTDEF opcode_table[] =
   { OP_TLOAD,   _T("TLOAD"),  FMT_BYTE,  0 },  // Load temporary value
   { OP_TSTORE,  _T("TSTORE"), FMT_BYTE,  0 },  // Set temporary value
   { OP_TSPACE,  _T("TSPACE"), FMT_BYTE, -1 },  // Allocate temp space
-  { OP_SEND,    _T("SEND"),   FMT_BYTE,  0 },  // Send message to an object
+  { OP_SEND,    _T("SEND"),   FMT_SEND,  0 },  // Send message to an object
   { OP_DUP2,    _T("DUP2"),   FMT_NONE, -1 },  // Duplicate top two stack entries
   { OP_NEW,     _T("NEW"),    FMT_NONE,  0 },  // Create a new class object
   { OP_DELETE,  _T("DELETE"), FMT_NONE,  0 },  // Delete an object variable by calling Destroy
   { OP_DESTROY, _T("DESTROY"),FMT_NONE,  0 },  // Really destroy the object
   { OP_SWITCH,  _T("SWITCH"), FMT_TABLE,-1 },  // Switch table entry
+  { OP_TLOADP,  _T("TLOADP"), FMT_BYTE,  0 },  // Load temporary value and push
+  { OP_PTLOAD,  _T("PTLOAD"), FMT_BYTE,  0 },  // Push and load temporary value
+  { OP_PLIT,    _T("PLIT"),   FMT_LIT,   0 },  // Push and load literal value
+  { OP_INT,     _T("INT"),    FMT_BYTE,  0 },  // Load small integer
+  { OP_PINT,    _T("PINT"),   FMT_BYTE,  0 },  // Push and load small integer
+  { OP_TINC,    _T("TINC"),   FMT_BYTE,  0 },  // Increment temporary value
+  { OP_TDEC,    _T("TDEC"),   FMT_BYTE,  0 },  // Decrement temporary value
+  { OP_CBRT,    _T("CBRT"),   FMT_CBR,  -1 },  // Compare and branch on true
+  { OP_CBRF,    _T("CBRF"),   FMT_CBR,  -1 },  // Compare and branch on false
+  { OP_VSEND,   _T("VSEND"),  FMT_SEND,  0 },  // Send through the vtable
+  { OP_WIDE,    _T("WIDE"),   FMT_WIDE,  0 },  // Word operand for next opcode
+  { OP_DSWITCH, _T("DSWITCH"),FMT_TABLE,-1 },  // Switch by dense jump table
+  { OP_HSWITCH, _T("HSWITCH"),FMT_TABLE,-1 },  // Switch by hash table
+  { OP_TLOADA,  _T("TLOADA"), FMT_BYTE,  0 },  // Load temporary value to append to
+  { OP_TAPPEND, _T("TAPPEND"),FMT_BYTE,  0 },  // Append to temporary value
+  { OP_ADDII,   _T("ADDII"),  FMT_NONE,  0 },  // Add two integers
+  { OP_SUBII,   _T("SUBII"),  FMT_NONE,  0 },  // Subtract two integers
+  { OP_MULII,   _T("MULII"),  FMT_NONE,  0 },  // Multiply two integers
+  { OP_LTII,    _T("LTII"),   FMT_NONE, -1 },  // <  of two integers
+  { OP_LEII,    _T("LEII"),   FMT_NONE, -1 },  // <= of two integers
+  { OP_EQII,    _T("EQII"),   FMT_NONE, -1 },  // == of two integers
+  { OP_NEII,    _T("NEII"),   FMT_NONE, -1 },  // != of two integers
+  { OP_GEII,    _T("GEII"),   FMT_NONE, -1 },  // >= of two integers
+  { OP_GTII,    _T("GTII"),   FMT_NONE, -1 },  // >  of two integers
+  { OP_ADDBB,   _T("ADDBB"),  FMT_NONE,  0 },  // Add two bcd's
+  { OP_SUBBB,   _T("SUBBB"),  FMT_NONE,  0 },  // Subtract two bcd's
+  { OP_MULBB,   _T("MULBB"),  FMT_NONE,  0 },  // Multiply two bcd's
+  { OP_CONCAT,  _T("CONCAT"), FMT_NONE,  0 },  // Concatenate two strings
   { 0,          NULL,     0,        -1 }   // End of opcode table
 };
 
@@ -193,20 +221,55 @@ QLDebugger::DecodeInstruction(Function* p_function,BYTE* code,int lc,bool p_gene
       case FMT_TABLE:   buffer.Format(_T("%02x %02x %s %02x%02x\n"),cp[1],cp[2],opcode->ot_name,cp[2],cp[1]);
                         osputs_stderr(buffer);
                         cnt = cp[2] << 8 | cp[1];
-                        n  += 2 + cnt * 4 + 2;
-                        i   = 3;
+                        i   = SwitchTableOffset(cp);
+                        n  += i - 1 + cnt * 6 + 4;
+                        if(*cp == OP_DSWITCH)
+                        {
+                          buffer.Format(_T("     %08X       ; LOWEST\n"),ReadLong(&cp[3]));
+                          osputs_stderr(buffer);
+                        }
 
                         // Print the jump table of the switch statement  
                         while (--cnt >= 0) 
                         {
-                          buffer.Format(_T("     %02X%02X  %02X%02X   ; "),cp[i+1],cp[i],cp[i+3],cp[i+2]);
+                          if(ReadLong(&cp[i+2]) == 0)
+                          {
+                            // Empty slot of a dense or hashed table
+                            i += 6;
+                            continue;
+                          }
+                          buffer.Format(_T("     %02X%02X  %08X ; "),cp[i+1],cp[i],ReadLong(&cp[i+2]));
                           osputs_stderr(buffer);
                           m_vm->Print((WinFile*)QL_STDERR,TRUE,p_function->GetLiteral((cp[i+1] << 8) | cp[i]));
                           osputs_stderr(_T("\n"));
-                          i += 4;
+                          i += 6;
                         }
-                        buffer.Format(_T("     %02X%02X         ; DEFAULT"),cp[i+1],cp[i]);
+                        buffer.Format(_T("     %08X       ; DEFAULT"),ReadLong(&cp[i]));
+                        osputs_stderr(buffer);
+                        break;
+      case FMT_CBR:     buffer.Format(_T("%02X%02X%02X %-6s %s %08X")
+                                     ,cp[1],cp[2],cp[3],opcode->ot_name
+                                     ,opcode_table[cp[1] - 1].ot_name,ReadLong(&cp[2]));
+                        osputs_stderr(buffer);
+                        n += 5; // skip operator and long
+                        break;
+      case FMT_LONG:    buffer.Format(_T("%02X%02X%02X %-6s %08X"),cp[1],cp[2],cp[3],opcode->ot_name,ReadLong(&cp[1]));
+                        osputs_stderr(buffer);
+                        n += 4; // skip 1 long
+                        break;
+      case FMT_WIDE:    if(cp[1] >= 1 && cp[1] <= OP_LAST)
+                        {
+                          // Print as the instruction itself
+                          opcode = &opcode_table[cp[1] - 1];
+                        }
+                        buffer.Format(_T("%02X%02X%02X %-6s %02X%02X"),cp[1],cp[2],cp[3],opcode->ot_name,cp[3],cp[2]);
+                        osputs_stderr(buffer);
+                        n += 3; // skip opcode and word
+                        break;
+      case FMT_SEND:    buffer.Format(_T("%02X%02X%02X %-6s %02X %02X%02X")
+                                     ,cp[1],cp[2],cp[3],opcode->ot_name,cp[1],cp[3],cp[2]);
                         osputs_stderr(buffer);
+                        n += 3; // skip arguments and send cache word
                         break;
     }
     // Recall the print offset
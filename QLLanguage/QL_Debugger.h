@@ -15,6 +15,10 @@
 #define FMT_WORD	2
 #define FMT_LIT		3
 #define FMT_TABLE 4 // Switch table
+#define FMT_CBR   5 // Compare operator and branch word
+#define FMT_SEND  6 // Argument count and send cache word
+#define FMT_LONG  7 // Long branch offset
+#define FMT_WIDE  8 // Opcode with a word operand
 
 // Opcode type definition table
 typedef struct 
@@ -12,6 +12,7 @@
 #include "QL_vm.h"
 #include "QL_Interpreter.h"
 #include "QL_Objects.h"
+#include "QL_Tasks.h"
 #include "SQLDatabase.h"
 #include "SQLQuery.h"
 #include "SQLVariant.h"
@@ -93,14 +94,30 @@ static int xtypeof(QLInterpreter* p_inter,int argc)
   return 0;
 }
 
-// Allocate a new array vector
+// Allocate a new array vector: newarray(size[,"int"|"bcd"|"string"])
+// With an element type the array is packed: the elements have no MemObject
 static int xnewarray(QLInterpreter* p_inter,int argc)
 {
-  argcount(p_inter, argc, 1);
-  int size = p_inter->GetIntegerArgument(0);
+  int type = DTYPE_NIL;
+  if(argc == 2)
+  {
+    CString name = p_inter->GetStringArgument(0);
+    if     (name.Compare(_T("int"))    == 0) type = DTYPE_INTEGER;
+    else if(name.Compare(_T("bcd"))    == 0) type = DTYPE_BCD;
+    else if(name.Compare(_T("string")) == 0) type = DTYPE_STRING;
+    else
+    {
+      p_inter->GetVirtualMachine()->Error(_T("Cannot pack an array of: %s"),name.GetString());
+    }
+  }
+  else
+  {
+    argcount(p_inter, argc, 1);
+  }
+  int size = p_inter->GetIntegerArgument(argc - 1);
   QLVirtualMachine* vm = p_inter->GetVirtualMachine();
 
-  Array* array = new Array(vm,size);
+  Array* array = type == DTYPE_NIL ? new Array(vm,size) : new Array(vm,size,type);
   MemObject* object = vm->AllocMemObject(DTYPE_NIL);
   object->m_type = DTYPE_ARRAY;
   object->m_value.v_array = array;
@@ -110,6 +127,282 @@ static int xnewarray(QLInterpreter* p_inter,int argc)
   return 0;
 }
 
+// append(array,value): add to the end. Returns the new size
+static int xappend(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,2);
+  MemObject** sp = p_inter->GetStackPointer();
+  p_inter->CheckType(1,DTYPE_ARRAY);
+
+  Array* array = sp[1]->m_value.v_array;
+  array->Append(p_inter->GetVirtualMachine(),sp[0]);
+  p_inter->SetInteger(array->GetSize());
+  return 0;
+}
+
+// resize(array,size): grow or shrink. Returns the new size
+static int xresize(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,2);
+  MemObject** sp = p_inter->GetStackPointer();
+  p_inter->CheckType(1,DTYPE_ARRAY);
+  p_inter->CheckType(0,DTYPE_INTEGER);
+
+  Array* array = sp[1]->m_value.v_array;
+  array->Resize(p_inter->GetVirtualMachine(),sp[0]->m_value.v_integer);
+  p_inter->SetInteger(array->GetSize());
+  return 0;
+}
+
+// Allocate a new hash map
+static int xnewmap(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,0);
+  QLVirtualMachine* vm = p_inter->GetVirtualMachine();
+  p_inter->GetStackPointer()[0] = vm->AllocMemObject(DTYPE_MAP);
+  return 0;
+}
+
+// has(map,key): 1 if the key is in the map
+static int xhas(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,2);
+  MemObject** sp = p_inter->GetStackPointer();
+  p_inter->CheckType(1,DTYPE_MAP);
+
+  bool found = sp[1]->m_value.v_map->Find(sp[0]) != nullptr;
+  p_inter->SetInteger(found ? 1 : 0);
+  return 0;
+}
+
+// remove(map,key): 1 if the key was in the map
+static int xremove(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,2);
+  MemObject** sp = p_inter->GetStackPointer();
+  p_inter->CheckType(1,DTYPE_MAP);
+
+  QLVirtualMachine* vm = p_inter->GetVirtualMachine();
+  bool removed = sp[1]->m_value.v_map->Remove(vm,sp[0]);
+  p_inter->SetInteger(removed ? 1 : 0);
+  return 0;
+}
+
+// keys(map): array of all keys in order of insertion.
+// The keys are shared with the map: they must not be changed
+static int xkeys(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,1);
+  MemObject** sp = p_inter->GetStackPointer();
+  p_inter->CheckType(0,DTYPE_MAP);
+
+  QLVirtualMachine* vm = p_inter->GetVirtualMachine();
+  MemObject* object = vm->AllocMemObject(DTYPE_ARRAY);
+  Map*       map    = sp[0]->m_value.v_map;
+  for(int ind = 0;ind < map->GetSize(); ++ind)
+  {
+    object->m_value.v_array->AddEntry(map->GetKey(ind));
+  }
+  sp[0] = object;
+  return 0;
+}
+
+// size(x): number of entries of a map or array, or the length of a string
+static int xsize(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,1);
+  MemObject* object = *p_inter->GetStackPointer();
+  switch(object->m_type)
+  {
+    case DTYPE_MAP:     p_inter->SetInteger(object->m_value.v_map->GetSize());
+                        break;
+    case DTYPE_ARRAY:   p_inter->SetInteger(object->m_value.v_array->GetSize());
+                        break;
+    case DTYPE_STRING:  p_inter->SetInteger(object->m_value.v_string->GetLength());
+                        break;
+    default:            p_inter->BadType(0,DTYPE_MAP);
+                        break;
+  }
+  return 0;
+}
+
+// The script function of a task: by name or the function itself
+// Methods of a class cannot run as a task
+static CString
+TaskFunction(QLInterpreter* p_inter,int p_offset)
+{
+  MemObject* object = p_inter->GetStackPointer()[p_offset];
+  if(object->m_type == DTYPE_STRING)
+  {
+    return *object->m_value.v_string;
+  }
+  if(object->m_type == DTYPE_SCRIPT && object->m_value.v_script->GetClass() == nullptr)
+  {
+    return object->m_value.v_script->GetName();
+  }
+  p_inter->BadType(p_offset,DTYPE_SCRIPT);
+  return CString();
+}
+
+// Write the output of a finished task and return its error, if any
+static CString
+TaskFinish(QLVirtualMachine* p_vm,QLTask* p_task)
+{
+  CString& output = p_task->GetOutput();
+  if(!output.IsEmpty())
+  {
+    p_vm->Output(output.GetString(),output.GetLength());
+  }
+  return p_task->GetError();
+}
+
+// parallel_for(lo,hi,function): calls function(i) for lo <= i < hi on all cores.
+// A task calls the function for a range of i in a context of its own.
+// Returns the array of the return values in the order of i
+static int xparallel_for(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,3);
+  p_inter->CheckType(2,DTYPE_INTEGER);
+  p_inter->CheckType(1,DTYPE_INTEGER);
+  MemObject**       sp       = p_inter->GetStackPointer();
+  QLVirtualMachine* vm       = p_inter->GetVirtualMachine();
+  int               low      = sp[2]->m_value.v_integer;
+  int               count    = sp[1]->m_value.v_integer > low ? sp[1]->m_value.v_integer - low : 0;
+  CString           function = TaskFunction(p_inter,0);
+
+  std::vector<QLTask*> tasks;
+  if(count)
+  {
+    QLImage* image = vm->GetCodeImage();
+    if(image == nullptr)
+    {
+      vm->Error(_T("parallel_for: no code image for the tasks"));
+    }
+    // More tasks than workers: a worker that is done early steals the rest
+    QLTaskPool* pool   = QLTaskPool::GetPool();
+    int         chunks = pool->GetWorkers() * TASK_CHUNKS;
+    if(chunks > count)
+    {
+      chunks = count;
+    }
+    for(int chunk = 0;chunk < chunks; ++chunk)
+    {
+      int first = low + (int)((INT64) count * chunk       / chunks);
+      int last  = low + (int)((INT64) count * (chunk + 1) / chunks);
+
+      QLTask* task = new QLTask(image,function);
+      task->SetEngine(p_inter);
+      for(int ind = first;ind < last; ++ind)
+      {
+        std::vector<TaskValue>& arguments = task->AddCall();
+        arguments.resize(1);
+        arguments[0].m_type    = DTYPE_INTEGER;
+        arguments[0].m_integer = ind;
+      }
+      tasks.push_back(task);
+      pool->Submit(task);
+    }
+    image->Release();
+  }
+
+  // All tasks end before an error stops the script
+  TaskValue results;
+  CString   error;
+  results.m_type = DTYPE_ARRAY;
+  for(auto& task : tasks)
+  {
+    task->Wait();
+    CString failed = TaskFinish(vm,task);
+    if(error.IsEmpty())
+    {
+      error = failed;
+    }
+    for(int call = 0;call < task->GetCalls(); ++call)
+    {
+      results.m_elements.push_back(std::move(task->GetResult(call)));
+    }
+    delete task;
+  }
+  if(!error.IsEmpty())
+  {
+    vm->Error(_T("parallel_for: %s"),error.GetString());
+  }
+  sp[0] = QLTask::MakeValue(vm,results);
+  QLTask::FillValue(vm,results,sp[0]);
+  return 0;
+}
+
+// spawn(function,arguments...): starts function(arguments...) as a task.
+// The arguments are copied. Returns the handle to join the task
+static int xspawn(QLInterpreter* p_inter,int argc)
+{
+  QLVirtualMachine* vm = p_inter->GetVirtualMachine();
+  if(argc < 1)
+  {
+    vm->Error(_T("spawn: no function to start"));
+  }
+  MemObject** sp       = p_inter->GetStackPointer();
+  CString     function = TaskFunction(p_inter,argc - 1);
+  QLImage*    image    = vm->GetCodeImage();
+  if(image == nullptr)
+  {
+    vm->Error(_T("spawn: no code image for the task"));
+  }
+  QLTask* task = new QLTask(image,function);
+  image->Release();
+  task->SetEngine(p_inter);
+
+  std::vector<TaskValue>& arguments = task->AddCall();
+  arguments.resize(argc - 1);
+  try
+  {
+    for(int ind = 0;ind < argc - 1; ++ind)
+    {
+      QLTask::CopyValue(sp[argc - 2 - ind],arguments[ind]);
+    }
+  }
+  catch(QLException&)
+  {
+    delete task;
+    throw;
+  }
+  QLTaskPool::GetPool()->Submit(task);
+  p_inter->SetInteger(vm->AddTask(task));
+  return 0;
+}
+
+// join(handle): waits for a task of spawn. The output of the task is
+// written now. Returns a copy of what the function returned
+static int xjoin(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,1);
+  p_inter->CheckType(0,DTYPE_INTEGER);
+  MemObject**       sp     = p_inter->GetStackPointer();
+  QLVirtualMachine* vm     = p_inter->GetVirtualMachine();
+  int               handle = sp[0]->m_value.v_integer;
+
+  QLTask* task = vm->TakeTask(handle);
+  if(task == nullptr)
+  {
+    vm->Error(_T("join: no task with handle: %d"),handle);
+  }
+  task->Wait();
+  CString   error = TaskFinish(vm,task);
+  TaskValue result;
+  if(error.IsEmpty())
+  {
+    result = std::move(task->GetResult(0));
+  }
+  delete task;
+  if(!error.IsEmpty())
+  {
+    vm->Error(_T("join: %s"),error.GetString());
+  }
+  sp[0] = QLTask::MakeValue(vm,result);
+  QLTask::FillValue(vm,result,sp[0]);
+  return 0;
+}
+
 // Allocate a new string
 static int xnewstring(QLInterpreter* p_inter,int argc)
 {
@@ -127,6 +420,8 @@ static int xsizeof(QLInterpreter* p_inter,int argc)
   {
     case DTYPE_ARRAY:   p_inter->SetInteger(object->m_value.v_array->GetSize());
                         break;
+    case DTYPE_MAP:     p_inter->SetInteger(object->m_value.v_map->GetSize());
+                        break;
     case DTYPE_STRING:  p_inter->SetInteger(object->m_value.v_string->GetLength());
                         break;
     case DTYPE_BCD:     p_inter->SetInteger(sizeof(bcd));
@@ -194,14 +489,62 @@ static int xfclose(QLInterpreter* p_inter,int argc)
   switch((INT_PTR)fp)
   {
     case QL_STDIN:  res = fclose(stdin);  break;
-    case QL_STDOUT: res = fclose(stdout); break;
-    case QL_STDERR: res = fclose(stderr); break;
+    case QL_STDOUT: p_inter->GetVirtualMachine()->FlushOutput();
+                    res = fclose(stdout); break;
+    case QL_STDERR: p_inter->GetVirtualMachine()->FlushOutput();
+                    res = fclose(stderr); break;
     default:        res = fp->Close();    break;
   }
   p_inter->SetInteger(res);
   return 0;
 }
 
+// Flush the buffered output of a file
+static int xfflush(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,1);
+  p_inter->CheckType(0,DTYPE_FILE);
+  WinFile* fp = p_inter->GetStackPointer()[0]->m_value.v_file;
+  int res = 0;
+  switch((INT_PTR)fp)
+  {
+    case QL_STDIN:  p_inter->BadType(0,DTYPE_FILE);
+                    break;
+    case QL_STDOUT: p_inter->GetVirtualMachine()->FlushOutput();
+                    res = fflush(stdout);
+                    break;
+    case QL_STDERR: res = fflush(stderr);
+                    break;
+    default:        res = fp->Flush() ? 0 : EOF;
+                    break;
+  }
+  p_inter->SetInteger(res);
+  return 0;
+}
+
+// Flush policy of stdout: 0 = every print, 1 = every line, 2 = full buffer
+// Returns the previous policy
+static int xsetflush(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,1);
+  p_inter->CheckType(0,DTYPE_INTEGER);
+  int policy = p_inter->GetIntegerArgument(0);
+  p_inter->SetInteger(p_inter->GetVirtualMachine()->SetOutputFlush(policy));
+  return 0;
+}
+
+// Size of the output buffer of stdout in characters
+static int xsetbuffer(QLInterpreter* p_inter,int argc)
+{
+  argcount(p_inter,argc,1);
+  p_inter->CheckType(0,DTYPE_INTEGER);
+  QLVirtualMachine* vm = p_inter->GetVirtualMachine();
+  vm->SetOutputSize(p_inter->GetIntegerArgument(0));
+  // The size the buffer really has: it is at least one character
+  p_inter->SetInteger(vm->GetOutputSize());
+  return 0;
+}
+
 // Get a character from a file
 static int xgetc(QLInterpreter* p_inter,int argc)
 {
@@ -211,7 +554,8 @@ static int xgetc(QLInterpreter* p_inter,int argc)
   int ch = EOF;
   switch((INT_PTR)fp)
   {
-    case QL_STDIN:  ch = _gettc(stdin);
+    case QL_STDIN:  p_inter->GetVirtualMachine()->FlushOutput();
+                    ch = _gettc(stdin);
                     break;
     case QL_STDOUT: [[fallthrough]];
     case QL_STDERR: p_inter->BadType(0,DTYPE_FILE);
@@ -236,8 +580,13 @@ static int xputc(QLInterpreter* p_inter,int argc)
   {
     case QL_STDIN:  p_inter->BadType(0,DTYPE_FILE);
                     break;
-    case QL_STDOUT: res = _puttc(cc,stdout); break;
-    case QL_STDERR: res = _puttc(cc,stderr); break;
+    case QL_STDOUT: { TCHAR ch = (TCHAR) cc;
+                      p_inter->GetVirtualMachine()->Output(&ch,1);
+                      res = cc;
+                    }
+                    break;
+    case QL_STDERR: p_inter->GetVirtualMachine()->FlushOutput();
+                    res = _puttc(cc,stderr); break;
     default:        res = fp->Putch(cc);
                     break;
   }
@@ -256,7 +605,8 @@ static int xgets(QLInterpreter* p_inter,int argc)
   CString s;
   switch((INT_PTR)fp)
   {
-    case QL_STDIN:  while((cc = _gettc(stdin)) != _TEOF && cc != '\n')
+    case QL_STDIN:  p_inter->GetVirtualMachine()->FlushOutput();
+                    while((cc = _gettc(stdin)) != _TEOF && cc != '\n')
                     {
                       s.Append((const TCHAR*)&cc);
                     }
@@ -283,9 +633,11 @@ static int xputs(QLInterpreter* p_inter,int argc)
   {
     case QL_STDIN:  p_inter->BadType(0,DTYPE_FILE);
                     break;
-    case QL_STDOUT: res = _fputts(*str,stdout);
+    case QL_STDOUT: p_inter->GetVirtualMachine()->Output(*str,str->GetLength());
+                    res = 0;
                     break;
-    case QL_STDERR: res = _fputts(*str,stderr);
+    case QL_STDERR: p_inter->GetVirtualMachine()->FlushOutput();
+                    res = _fputts(*str,stderr);
                     break;
     default:        res = fp->Write(*str);
                     break;
@@ -363,6 +715,7 @@ static int xexit(QLInterpreter* p_inter,int argc)
 {
   argcount(p_inter,argc,1);
   int ex = p_inter->GetIntegerArgument(0);
+  p_inter->GetVirtualMachine()->FlushOutput();
   // DIRECT EXIT THIS QL INTERPRETER AND SURROUNDING PROGRAM
   exit(ex);
 }
@@ -1382,6 +1735,16 @@ void init_functions(QLVirtualMachine* p_vm)
   // Adding default functions
   add_function(_T("typeof"),    xtypeof,      p_vm);
   add_function(_T("newarray"),  xnewarray,    p_vm);
+  add_function(_T("append"),    xappend,      p_vm);
+  add_function(_T("resize"),    xresize,      p_vm);
+  add_function(_T("newmap"),    xnewmap,      p_vm);
+  add_function(_T("has"),       xhas,         p_vm);
+  add_function(_T("remove"),    xremove,      p_vm);
+  add_function(_T("keys"),      xkeys,        p_vm);
+  add_function(_T("size"),      xsize,        p_vm);
+  add_function(_T("parallel_for"),xparallel_for,p_vm);
+  add_function(_T("spawn"),     xspawn,       p_vm);
+  add_function(_T("join"),      xjoin,        p_vm);
   add_function(_T("newstring"), xnewstring,   p_vm);
   add_function(_T("newdbase"),  xnewdbase,    p_vm);
   add_function(_T("newquery"),  xnewquery,    p_vm);
@@ -1389,6 +1752,9 @@ void init_functions(QLVirtualMachine* p_vm)
   add_function(_T("trace"),     xtrace,       p_vm);
   add_function(_T("fopen"),     xfopen,       p_vm);
   add_function(_T("fclose"),    xfclose,      p_vm);
+  add_function(_T("fflush"),    xfflush,      p_vm);
+  add_function(_T("setflush"),  xsetflush,    p_vm);
+  add_function(_T("setbuffer"), xsetbuffer,   p_vm);
   add_function(_T("getc"),      xgetc,        p_vm);
   add_function(_T("putc"),      xputc,        p_vm);
   add_function(_T("gets"),      xgets,        p_vm);
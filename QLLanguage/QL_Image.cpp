@@ -0,0 +1,634 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language object file image (*.qob version 3)
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QL_Language.h"
+#include "QL_MemObject.h"
+#include "QL_Objects.h"
+#include "QL_vm.h"
+#include "QL_Exception.h"
+#include "QL_Image.h"
+#include "bcd.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static char THIS_FILE[] = __FILE__;
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//
+// MAPPING OF AN IMAGE
+//
+//////////////////////////////////////////////////////////////////////////
+
+// All images of the process that were mapped from a file, by full path name.
+// A server that runs one object file in many VMs maps it only once
+class ImageCache
+{
+public:
+  ImageCache()
+  {
+    InitializeCriticalSection(&m_lock);
+  }
+ ~ImageCache()
+  {
+    DeleteCriticalSection(&m_lock);
+  }
+  CRITICAL_SECTION            m_lock;
+  std::map<CString,QLImage*>  m_images;
+};
+
+static ImageCache g_imageCache;
+
+QLImage::QLImage()
+        :m_file(INVALID_HANDLE_VALUE)
+        ,m_mapping(NULL)
+        ,m_base(nullptr)
+        ,m_size(0)
+        ,m_memory(false)
+        ,m_references(1)
+{
+}
+
+QLImage::~QLImage()
+{
+  if(m_base)
+  {
+    if(m_memory)
+    {
+      VirtualFree(m_base,0,MEM_RELEASE);
+    }
+    else
+    {
+      UnmapViewOfFile(m_base);
+    }
+    m_base = nullptr;
+  }
+  if(m_mapping)
+  {
+    CloseHandle(m_mapping);
+    m_mapping = NULL;
+  }
+  if(m_file != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+  }
+}
+
+// Map an image file, or take one more reference on the mapping
+// another VM of this process already made of it
+/*static*/ QLImage*
+QLImage::Acquire(LPCTSTR p_filename)
+{
+  TCHAR fullpath[MAX_PATH + 1];
+  if(GetFullPathName(p_filename,MAX_PATH,fullpath,NULL) == 0)
+  {
+    return nullptr;
+  }
+  CString key(fullpath);
+  key.MakeLower();
+
+  QLImage* image = nullptr;
+  EnterCriticalSection(&g_imageCache.m_lock);
+  auto it = g_imageCache.m_images.find(key);
+  if(it != g_imageCache.m_images.end())
+  {
+    image = it->second;
+    ++image->m_references;
+  }
+  else
+  {
+    image = new QLImage();
+    if(image->Open(fullpath))
+    {
+      image->m_key = key;
+      g_imageCache.m_images[key] = image;
+    }
+    else
+    {
+      delete image;
+      image = nullptr;
+    }
+  }
+  LeaveCriticalSection(&g_imageCache.m_lock);
+  return image;
+}
+
+// Copy the sections to pages of their own and make them read-only,
+// just like the mapping of a file
+/*static*/ QLImage*
+QLImage::Create(const std::vector<BYTE>& p_image)
+{
+  QLImage* image = new QLImage();
+  image->m_memory = true;
+  image->m_size   = (DWORD) p_image.size();
+  image->m_base   = (BYTE*) VirtualAlloc(NULL,p_image.size(),MEM_COMMIT | MEM_RESERVE,PAGE_READWRITE);
+
+  DWORD protection = 0;
+  if(image->m_base == nullptr || image->m_size < sizeof(QobHeader))
+  {
+    delete image;
+    return nullptr;
+  }
+  memcpy(image->m_base,p_image.data(),p_image.size());
+  if(!VirtualProtect(image->m_base,p_image.size(),PAGE_READONLY,&protection) || !image->Check())
+  {
+    delete image;
+    return nullptr;
+  }
+  return image;
+}
+
+void
+QLImage::AddRef()
+{
+  EnterCriticalSection(&g_imageCache.m_lock);
+  ++m_references;
+  LeaveCriticalSection(&g_imageCache.m_lock);
+}
+
+// The last reference unmaps the image
+void
+QLImage::Release()
+{
+  EnterCriticalSection(&g_imageCache.m_lock);
+  bool last = --m_references == 0;
+  if(last && !m_key.IsEmpty())
+  {
+    g_imageCache.m_images.erase(m_key);
+  }
+  LeaveCriticalSection(&g_imageCache.m_lock);
+
+  if(last)
+  {
+    delete this;
+  }
+}
+
+// Map the file read-only: the pages are shared with the file cache
+// and with all threads. Nothing in the image is ever written.
+bool
+QLImage::Open(LPCTSTR p_filename)
+{
+  m_file = CreateFile(p_filename,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+  if(m_file == INVALID_HANDLE_VALUE)
+  {
+    return false;
+  }
+  m_size = GetFileSize(m_file,NULL);
+  if(m_size == INVALID_FILE_SIZE || m_size < sizeof(QobHeader))
+  {
+    return false;
+  }
+  m_mapping = CreateFileMapping(m_file,NULL,PAGE_READONLY,0,0,NULL);
+  if(m_mapping == NULL)
+  {
+    return false;
+  }
+  m_base = (BYTE*) MapViewOfFile(m_mapping,FILE_MAP_READ,0,0,0);
+  if(m_base == nullptr)
+  {
+    return false;
+  }
+  return Check();
+}
+
+// Check the marker and that all sections are in the image
+bool
+QLImage::Check()
+{
+  QobHeader* header = GetHeader();
+  if(header->m_magic != QOB_MAGIC || header->m_format != QOB_FORMAT || header->m_size > m_size)
+  {
+    return false;
+  }
+  for(int ind = 0;ind < QOB_SECTIONS; ++ind)
+  {
+    QobSection& section = header->m_sections[ind];
+    if(section.m_offset > m_size || section.m_size > m_size - section.m_offset)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Test the first bytes of an opened object file
+bool
+QLImage::IsImage(FILE* p_fp)
+{
+  DWORD magic = 0;
+  bool  image = fread(&magic,sizeof(DWORD),1,p_fp) == 1 && magic == QOB_MAGIC;
+  rewind(p_fp);
+  return image;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// WRITING AN IMAGE
+//
+//////////////////////////////////////////////////////////////////////////
+
+QLImageWriter::QLImageWriter(QLvm* p_vm)
+              :m_vm(p_vm)
+              ,m_codeBlocks(0)
+{
+  memset(&m_header,0,sizeof(QobHeader));
+  m_header.m_magic    = QOB_MAGIC;
+  m_header.m_format   = QOB_FORMAT;
+  m_header.m_version  = QL_VERSION;
+  m_header.m_charsize = sizeof(TCHAR);
+}
+
+DWORD
+QLImageWriter::AddString(const CString& p_string)
+{
+  auto it = m_stringIndex.find(p_string);
+  if(it != m_stringIndex.end())
+  {
+    return it->second;
+  }
+  DWORD index = (DWORD) m_strings.size();
+  m_strings.push_back(p_string);
+  m_stringIndex.insert(std::make_pair(p_string,index));
+  return index;
+}
+
+// Store a MemObject once. The index is known before the contents are
+// stored, so arrays that (indirectly) contain themselves are no problem
+DWORD
+QLImageWriter::AddValue(MemObject* p_object)
+{
+  auto it = m_valueIndex.find(p_object);
+  if(it != m_valueIndex.end())
+  {
+    return it->second;
+  }
+  DWORD index = (DWORD) m_values.size();
+  m_valueIndex.insert(std::make_pair(p_object,index));
+
+  QobValue value;
+  memset(&value,0,sizeof(QobValue));
+  m_values.push_back(value);
+
+  value.m_type    = (BYTE) p_object->m_type;
+  value.m_storage = (WORD) p_object->m_storage;
+  if(p_object->m_flags & FLAG_REFERENCE)
+  {
+    value.m_flags |= QOB_REFERENCE;
+  }
+  if(p_object->m_flags & FLAG_IMMEDIATE)
+  {
+    value.m_flags |= QOB_IMMEDIATE;
+  }
+
+  if(p_object->m_type & DTYPE_REFERENCE)
+  {
+    // Not yet resolved after an earlier load: keep the name
+    value.m_value = AddString(*p_object->m_value.v_string);
+  }
+  else switch(p_object->m_type)
+  {
+    case DTYPE_NIL:       break;
+    case DTYPE_INTEGER:   value.m_value = (DWORD) p_object->m_value.v_integer;
+                          break;
+    case DTYPE_STRING:    value.m_value = AddString(*p_object->m_value.v_string);
+                          break;
+    case DTYPE_BCD:       value.m_first = AddNumeric(p_object->m_value.v_floating);
+                          value.m_count = QOB_BCD_ELEMENTS;
+                          break;
+    case DTYPE_FILE:      // Fall through: files and internals are found by name
+    case DTYPE_INTERNAL:  value.m_value = AddString(m_vm->FindSymbolName(p_object));
+                          break;
+    case DTYPE_EXTERNAL:  value.m_value = AddString(*p_object->m_value.v_sysname);
+                          break;
+    case DTYPE_ARRAY:     value.m_count = p_object->m_value.v_array->GetSize();
+                          value.m_first = AddElements(p_object->m_value.v_array);
+                          break;
+    case DTYPE_MAP:       value.m_count = 2 * p_object->m_value.v_map->GetSize();
+                          value.m_first = AddElements(p_object->m_value.v_map);
+                          break;
+    case DTYPE_OBJECT:    value.m_value = AddClass(p_object->m_value.v_object->GetClass());
+                          if((p_object->m_flags & FLAG_REFERENCE) == 0)
+                          {
+                            Array& attributes = p_object->m_value.v_object->GetAttributes();
+                            value.m_count = attributes.GetSize();
+                            value.m_first = AddElements(&attributes);
+                          }
+                          break;
+    case DTYPE_CLASS:     value.m_value = AddClass(p_object->m_value.v_class);
+                          break;
+    case DTYPE_SCRIPT:    value.m_value = AddFunction(p_object->m_value.v_script);
+                          break;
+    default:              // Databases, queries and variants only exist while running
+                          value.m_type = DTYPE_NIL;
+                          break;
+  }
+  m_values[index] = value;
+  return index;
+}
+
+DWORD
+QLImageWriter::AddClass(Class* p_class)
+{
+  auto it = m_classIndex.find(p_class);
+  if(it != m_classIndex.end())
+  {
+    return it->second;
+  }
+  DWORD index = (DWORD) m_classes.size();
+  m_classIndex.insert(std::make_pair(p_class,index));
+
+  QobClass theClass;
+  memset(&theClass,0,sizeof(QobClass));
+  m_classes.push_back(theClass);
+
+  theClass.m_name = AddString(p_class->GetName());
+  theClass.m_base = p_class->GetBaseClass() ? AddClass(p_class->GetBaseClass()) : QOB_NONE;
+  theClass.m_membersCount    = p_class->GetMembers().GetSize();
+  theClass.m_members         = AddElements(&p_class->GetMembers());
+  theClass.m_attributesCount = p_class->GetAttributes().GetSize();
+  theClass.m_attributes      = AddElements(&p_class->GetAttributes());
+
+  m_classes[index] = theClass;
+  return index;
+}
+
+DWORD
+QLImageWriter::AddFunction(Function* p_function)
+{
+  auto it = m_functionIndex.find(p_function);
+  if(it != m_functionIndex.end())
+  {
+    return it->second;
+  }
+  DWORD index = (DWORD) m_functions.size();
+  m_functionIndex.insert(std::make_pair(p_function,index));
+
+  QobFunction function;
+  memset(&function,0,sizeof(QobFunction));
+  m_functions.push_back(function);
+
+  function.m_name  = AddString(p_function->GetName());
+  function.m_class = p_function->GetClass() ? AddClass(p_function->GetClass()) : QOB_NONE;
+  function.m_size  = p_function->GetBytecodeSize();
+  function.m_code  = AddBytecode(p_function->GetBytecode(),p_function->GetBytecodeSize());
+
+  // Literals of the function
+  Array* literals = p_function->GetLiterals();
+  if(literals)
+  {
+    function.m_literalsCount = literals->GetSize();
+    function.m_literals      = AddElements(literals);
+  }
+  else
+  {
+    function.m_literals = QOB_NONE;
+  }
+
+  // The data types of the arguments
+  ArgTypes& types = p_function->GetArgumentTypes();
+  function.m_arguments      = (DWORD) m_elements.size();
+  function.m_argumentsCount = (DWORD) types.size();
+  for(auto& type : types)
+  {
+    m_elements.push_back((DWORD) type);
+  }
+
+  m_functions[index] = function;
+  return index;
+}
+
+// Store the entries of an array as consecutive elements
+DWORD
+QLImageWriter::AddElements(Array* p_array)
+{
+  DWORD first = (DWORD) m_elements.size();
+  int   size  = p_array->GetSize();
+  bool  packed = p_array->GetElementType() != DTYPE_NIL;
+
+  m_elements.resize(first + size,0);
+  for(int ind = 0;ind < size; ++ind)
+  {
+    DWORD value = packed ? AddPacked(p_array,ind) : AddValue(p_array->GetEntry(ind));
+    m_elements[first + ind] = value;
+  }
+  return first;
+}
+
+// An element of a packed array becomes a value of its own.
+// After loading the array is no longer packed
+DWORD
+QLImageWriter::AddPacked(Array* p_array,int p_index)
+{
+  QobValue value;
+  memset(&value,0,sizeof(QobValue));
+
+  value.m_type = (BYTE) p_array->GetElementType();
+  switch(value.m_type)
+  {
+    case DTYPE_INTEGER: value.m_value = (DWORD) p_array->GetInteger(p_index);
+                        break;
+    case DTYPE_BCD:     value.m_first = AddNumeric(&p_array->GetBcd(p_index));
+                        value.m_count = QOB_BCD_ELEMENTS;
+                        break;
+    case DTYPE_STRING:  value.m_value = AddString(p_array->GetString(p_index));
+                        break;
+  }
+  m_values.push_back(value);
+  return (DWORD) m_values.size() - 1;
+}
+
+// A bcd is stored as its SQL numeric structure
+DWORD
+QLImageWriter::AddNumeric(bcd* p_bcd)
+{
+  SQL_NUMERIC_STRUCT numeric;
+  memset(&numeric,0,sizeof(SQL_NUMERIC_STRUCT));
+  p_bcd->AsNumeric(&numeric);
+
+  DWORD first = (DWORD) m_elements.size();
+  m_elements.resize(m_elements.size() + QOB_BCD_ELEMENTS,0);
+  memcpy(&m_elements[first],&numeric,sizeof(SQL_NUMERIC_STRUCT));
+  return first;
+}
+
+// Keys and values of a map alternate
+DWORD
+QLImageWriter::AddElements(Map* p_map)
+{
+  DWORD first = (DWORD) m_elements.size();
+  int   size  = p_map->GetSize();
+
+  m_elements.resize(first + 2 * size,0);
+  for(int ind = 0;ind < size; ++ind)
+  {
+    DWORD key   = AddValue(p_map->GetKey(ind));
+    DWORD value = AddValue(p_map->GetValue(ind));
+    m_elements[first + 2 * ind]     = key;
+    m_elements[first + 2 * ind + 1] = value;
+  }
+  return first;
+}
+
+// Internal C++ functions are not stored: they are always in the VM
+void
+QLImageWriter::AddSymbols(NameMap& p_symbols,NameMap& p_scripts)
+{
+  for(auto& symbol : p_symbols)
+  {
+    if(symbol.second->m_type != DTYPE_INTERNAL)
+    {
+      QobSymbol entry = { AddString(symbol.first),AddValue(symbol.second) };
+      m_symbols.push_back(entry);
+    }
+  }
+  m_header.m_symbols = (DWORD) m_symbols.size();
+
+  for(auto& script : p_scripts)
+  {
+    if(script.second->m_type != DTYPE_INTERNAL)
+    {
+      QobSymbol entry = { AddString(script.first),AddValue(script.second) };
+      m_symbols.push_back(entry);
+    }
+  }
+}
+
+void
+QLImageWriter::SetGlobals(Array* p_globals,Array* p_literals)
+{
+  if(p_globals)
+  {
+    m_header.m_globalsCount = p_globals->GetSize();
+    m_header.m_globals      = AddElements(p_globals);
+  }
+  if(p_literals)
+  {
+    m_header.m_literalsCount = p_literals->GetSize();
+    m_header.m_literals      = AddElements(p_literals);
+  }
+}
+
+// The init code is stored with its closing OP_RETURN
+void
+QLImageWriter::SetInitCode(BYTE* p_code,int p_size)
+{
+  m_header.m_initcodeSize = p_code ? p_size : 0;
+  m_header.m_initcode     = AddBytecode(p_code,p_code ? p_size + 1 : 0);
+}
+
+// Bytecode starts on a 4 byte boundary and ends with a zero byte,
+// just as the bytecode of a function that is not mapped
+DWORD
+QLImageWriter::AddBytecode(BYTE* p_code,int p_size)
+{
+  DWORD offset = (DWORD)((m_bytecode.size() + 3) & ~3);
+  m_bytecode.resize(offset,0);
+  if(p_code && p_size > 0)
+  {
+    m_bytecode.insert(m_bytecode.end(),p_code,p_code + p_size);
+  }
+  m_bytecode.push_back(0);
+  ++m_codeBlocks;
+  return offset;
+}
+
+void
+QLImageWriter::Write(FILE* p_fp,bool p_trace)
+{
+  std::vector<BYTE> image;
+  Write(image,p_trace);
+
+  if(fwrite(image.data(),image.size(),1,p_fp) != 1)
+  {
+    throw QLException(_T("Image not written!"));
+  }
+}
+
+// Lay out the header and the sections in one block of memory
+void
+QLImageWriter::Write(std::vector<BYTE>& p_image,bool p_trace)
+{
+  // The string table: an offset for every string, then the strings
+  std::vector<BYTE> strings(m_strings.size() * sizeof(DWORD),0);
+  for(size_t ind = 0;ind < m_strings.size(); ++ind)
+  {
+    DWORD offset = (DWORD) strings.size();
+    DWORD length = (DWORD) m_strings[ind].GetLength();
+    DWORD bytes  = (DWORD)(sizeof(DWORD) + (length + 1) * sizeof(TCHAR) + 3) & ~3;
+
+    strings.resize(offset + bytes,0);
+    memcpy(&strings[ind * sizeof(DWORD)],&offset,sizeof(DWORD));
+    memcpy(&strings[offset],&length,sizeof(DWORD));
+    memcpy(&strings[offset + sizeof(DWORD)],m_strings[ind].GetString(),length * sizeof(TCHAR));
+  }
+  m_bytecode.resize((m_bytecode.size() + 3) & ~3,0);
+
+  const void* data[QOB_SECTIONS] =
+  {
+     strings.data()
+    ,m_bytecode.data()
+    ,m_values.data()
+    ,m_elements.data()
+    ,m_classes.data()
+    ,m_functions.data()
+    ,m_symbols.data()
+  };
+  DWORD count[QOB_SECTIONS] =
+  {
+     (DWORD) m_strings.size()
+    ,m_codeBlocks
+    ,(DWORD) m_values.size()
+    ,(DWORD) m_elements.size()
+    ,(DWORD) m_classes.size()
+    ,(DWORD) m_functions.size()
+    ,(DWORD) m_symbols.size()
+  };
+  DWORD size[QOB_SECTIONS] =
+  {
+     (DWORD) strings.size()
+    ,(DWORD) m_bytecode.size()
+    ,(DWORD)(m_values.size()    * sizeof(QobValue))
+    ,(DWORD)(m_elements.size()  * sizeof(DWORD))
+    ,(DWORD)(m_classes.size()   * sizeof(QobClass))
+    ,(DWORD)(m_functions.size() * sizeof(QobFunction))
+    ,(DWORD)(m_symbols.size()   * sizeof(QobSymbol))
+  };
+  const TCHAR* names[QOB_SECTIONS] =
+  {
+    _T("STRINGS"),_T("BYTECODE"),_T("VALUES"),_T("ELEMENTS"),_T("CLASSES"),_T("FUNCTIONS"),_T("SYMBOLS")
+  };
+
+  // Sections follow the header in this order
+  DWORD offset = sizeof(QobHeader);
+  for(int ind = 0;ind < QOB_SECTIONS; ++ind)
+  {
+    m_header.m_sections[ind].m_offset = offset;
+    m_header.m_sections[ind].m_count  = count[ind];
+    m_header.m_sections[ind].m_size   = size[ind];
+    offset += size[ind];
+  }
+  m_header.m_size = offset;
+
+  p_image.resize(offset);
+  memcpy(p_image.data(),&m_header,sizeof(QobHeader));
+  for(int ind = 0;ind < QOB_SECTIONS; ++ind)
+  {
+    if(size[ind])
+    {
+      memcpy(&p_image[m_header.m_sections[ind].m_offset],data[ind],size[ind]);
+    }
+    if(p_trace)
+    {
+      _ftprintf(stderr,_T("%-10s offset: %08X size: %8u count: %u\n")
+               ,names[ind],m_header.m_sections[ind].m_offset,size[ind],count[ind]);
+    }
+  }
+}
@@ -0,0 +1,226 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language object file image (*.qob version 3)
+// ir. W.E. Huisman (c) 2018
+//
+// The image is a header with a table of sections. All references
+// between the sections are indices, so the file is mapped into memory
+// and used in place: the bytecode of the functions runs from the mapping
+// and every string is made only once from the string table.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "QL_Language.h"
+#include <vector>
+#include <map>
+
+// Marker "QLIM" and layout version of the image
+#define QOB_MAGIC       0x4D494C51
+#define QOB_FORMAT      3
+// No index (no base class, no literals)
+#define QOB_NONE        0xFFFFFFFF
+
+// Flags of a value in the image
+#define QOB_REFERENCE   0x01    // Object carries FLAG_REFERENCE
+#define QOB_IMMEDIATE   0x02    // Shared NIL or small integer of the VM
+
+// The sections of an image
+#define QOB_STRINGS     0       // Offset table, then: length, characters, zero
+#define QOB_BYTECODE    1       // Bytecode of all functions and the init code
+#define QOB_VALUES      2       // QobValue  for every MemObject
+#define QOB_ELEMENTS    3       // DWORD value indices of arrays, maps and objects
+#define QOB_CLASSES     4       // QobClass  for every class
+#define QOB_FUNCTIONS   5       // QobFunction for every script function
+#define QOB_SYMBOLS     6       // QobSymbol for the symbols, then the scripts
+#define QOB_SECTIONS    7
+
+typedef struct _qobSection
+{
+  DWORD   m_offset;             // From the start of the file
+  DWORD   m_count;              // Number of entries
+  DWORD   m_size;               // Size in bytes
+}
+QobSection;
+
+typedef struct _qobHeader
+{
+  DWORD   m_magic;              // QOB_MAGIC
+  DWORD   m_format;             // QOB_FORMAT
+  DWORD   m_version;            // QL_VERSION of the bytecode
+  DWORD   m_charsize;           // sizeof(TCHAR) of the string table
+  DWORD   m_size;               // Size of the file
+  DWORD   m_globals;            // First element of the globals
+  DWORD   m_globalsCount;
+  DWORD   m_literals;           // First element of the global literals
+  DWORD   m_literalsCount;
+  DWORD   m_initcode;           // Offset of the init code in QOB_BYTECODE
+  DWORD   m_initcodeSize;
+  DWORD   m_symbols;            // Number of symbols, the rest are scripts
+  QobSection m_sections[QOB_SECTIONS];
+}
+QobHeader;
+
+typedef struct _qobValue
+{
+  BYTE    m_type;               // DTYPE_*
+  BYTE    m_flags;              // QOB_REFERENCE, QOB_IMMEDIATE
+  WORD    m_storage;            // MemObject::m_storage
+  DWORD   m_value;              // Integer, string, class or function index
+  DWORD   m_first;              // First element of an array, map or object (or bcd)
+  DWORD   m_count;              // Number of elements
+}
+QobValue;
+
+typedef struct _qobClass
+{
+  DWORD   m_name;               // String index
+  DWORD   m_base;               // Class index or QOB_NONE
+  DWORD   m_members;            // First element of the member functions
+  DWORD   m_membersCount;
+  DWORD   m_attributes;         // First element of the attributes
+  DWORD   m_attributesCount;
+}
+QobClass;
+
+typedef struct _qobFunction
+{
+  DWORD   m_name;               // String index
+  DWORD   m_class;              // Class index or QOB_NONE
+  DWORD   m_code;               // Offset in QOB_BYTECODE
+  DWORD   m_size;               // Bytecode size (a zero byte follows)
+  DWORD   m_literals;           // First element or QOB_NONE
+  DWORD   m_literalsCount;
+  DWORD   m_arguments;          // First element: the argument data types
+  DWORD   m_argumentsCount;
+}
+QobFunction;
+
+typedef struct _qobSymbol
+{
+  DWORD   m_name;               // String index
+  DWORD   m_value;              // Value index
+}
+QobSymbol;
+
+// Numbers of a bcd are stored as elements
+#define QOB_BCD_ELEMENTS  ((sizeof(SQL_NUMERIC_STRUCT) + sizeof(DWORD) - 1) / sizeof(DWORD))
+
+// The tables of an image while it is being read
+typedef struct _qobTables
+{
+  std::vector<CString>    m_strings;    // Every string made once
+  std::vector<Class*>     m_classes;
+  std::vector<Function*>  m_functions;
+  std::vector<MemObject*> m_objects;    // One for every QobValue
+  DWORD*                  m_elements;
+  DWORD                   m_elementsCount;
+}
+QobTables;
+
+// A read-only mapping of an image file, or an image made in memory.
+// An image is never written after it is made, so one image is shared
+// by all VMs that run it, on any thread. It is reference counted:
+// Acquire() or Create() hands out the first reference.
+class QLImage
+{
+public:
+  // Map a file once for the whole process. Nullptr if it is not an image
+  static QLImage* Acquire(LPCTSTR p_filename);
+  // An image of the sections written by QLImageWriter
+  static QLImage* Create(const std::vector<BYTE>& p_image);
+  // Test the first bytes of an opened object file
+  static bool IsImage(FILE* p_fp);
+
+  void        AddRef();
+  void        Release();
+
+  // Getters
+  BYTE*       GetBase();
+  DWORD       GetSize();
+  QobHeader*  GetHeader();
+  BYTE*       GetSection(int p_section);
+
+private:
+  QLImage();
+ ~QLImage();
+
+  bool        Open(LPCTSTR p_filename);
+  bool        Check();
+
+  HANDLE      m_file;
+  HANDLE      m_mapping;
+  BYTE*       m_base;
+  DWORD       m_size;
+  bool        m_memory;     // Made by Create(), not mapped
+  long        m_references;
+  CString     m_key;        // Full path name in the image cache
+};
+
+inline BYTE*
+QLImage::GetBase()
+{
+  return m_base;
+}
+
+inline DWORD
+QLImage::GetSize()
+{
+  return m_size;
+}
+
+inline QobHeader*
+QLImage::GetHeader()
+{
+  return reinterpret_cast<QobHeader*>(m_base);
+}
+
+inline BYTE*
+QLImage::GetSection(int p_section)
+{
+  return m_base + GetHeader()->m_sections[p_section].m_offset;
+}
+
+// Collects the sections of an image and writes them to a file
+// Every object is stored once: the same pointer gets the same index
+class QLImageWriter
+{
+public:
+  QLImageWriter(QLvm* p_vm);
+
+  // Adding to the image. All return the index
+  DWORD       AddString  (const CString& p_string);
+  DWORD       AddValue   (MemObject* p_object);
+  DWORD       AddClass   (Class* p_class);
+  DWORD       AddFunction(Function* p_function);
+  DWORD       AddElements(Array* p_array);
+  DWORD       AddElements(Map*   p_map);
+  void        AddSymbols (NameMap& p_symbols,NameMap& p_scripts);
+  void        SetGlobals (Array* p_globals,Array* p_literals);
+  void        SetInitCode(BYTE* p_code,int p_size);
+
+  // Write the image. Throws a QLException on error
+  void        Write(FILE* p_fp,bool p_trace);
+  void        Write(std::vector<BYTE>& p_image,bool p_trace);
+
+private:
+  DWORD       AddBytecode(BYTE* p_code,int p_size);
+  DWORD       AddPacked  (Array* p_array,int p_index);
+  DWORD       AddNumeric (bcd* p_bcd);
+
+  QLvm*       m_vm;
+  QobHeader   m_header;
+  DWORD       m_codeBlocks;   // Functions and the init code in the bytecode
+  std::vector<CString>      m_strings;
+  std::vector<BYTE>         m_bytecode;
+  std::vector<QobValue>     m_values;
+  std::vector<DWORD>        m_elements;
+  std::vector<QobClass>     m_classes;
+  std::vector<QobFunction>  m_functions;
+  std::vector<QobSymbol>    m_symbols;
+  // Already stored objects
+  std::map<CString,DWORD>           m_stringIndex;
+  std::map<const void*,DWORD>       m_valueIndex;
+  std::map<const void*,DWORD>       m_classIndex;
+  std::map<const void*,DWORD>       m_functionIndex;
+};
@@ -13,6 +13,8 @@
 #include "QL_Objects.h"
 #include "QL_vm.h"
 #include "QL_Opcodes.h"
+#include "QL_Register.h"
+#include "QL_Jit.h"
 #include <memory.h>
 #include <string.h>
 
@@ -67,6 +69,19 @@ QLInterpreter::Mark()
       }
     } 
     while (m_stack_pointer != stack--);
+
+    // Functions and objects to return to
+    for(CallFrame* call = m_call_base + 1;call <= m_call; ++call)
+    {
+      if(call->m_function)
+      {
+        call->m_function->Mark(m_vm);
+      }
+      if(call->m_object)
+      {
+        call->m_object->Mark(m_vm);
+      }
+    }
   }
 }
 
@@ -106,6 +121,12 @@ QLInterpreter::AllocateStack()
   m_stack_base    = (MemObject**) calloc(m_stacksize,sizeof(MemObject*));
   m_stack_top     = m_stack_base + m_stacksize - 1;
   m_stack_pointer = m_stack_top;
+
+  // Every call takes at least its callee from the stack, so the call
+  // stack never gets deeper than the stack. Entry 0 is never used
+  m_call_base = (CallFrame*) calloc(m_stacksize + 1,sizeof(CallFrame));
+  m_call_top  = m_call_base + m_stacksize;
+  m_call      = m_call_base;
 }
 
 // Remove the stack again
@@ -115,10 +136,14 @@ QLInterpreter::DestroyStack()
   if(m_stack_base)
   {
     free(m_stack_base);
+    free(m_call_base);
     m_stack_base    = nullptr;
     m_stack_top     = nullptr;
     m_stack_pointer = nullptr;
     m_frame_pointer = nullptr;
+    m_call_base     = nullptr;
+    m_call_top      = nullptr;
+    m_call          = nullptr;
   }
 }
 
@@ -126,16 +151,8 @@ QLInterpreter::DestroyStack()
 int 
 QLInterpreter::Execute(CString p_name)
 {
-  // Check initialization of the VM
-  m_vm->CheckInit();
-  // Check the allocation of the stack
-  AllocateStack();
-
-  // EXECUTE the global init code, if any
-  if(m_vm->HasInitCode())
-  {
-    Interpret(nullptr,nullptr);
-  }
+  // Stack and globals
+  Initialize();
 
   // Various parameters
   shortint   type   = 0;
@@ -177,10 +194,61 @@ QLInterpreter::Execute(CString p_name)
   return -1;
 }
 
+// Check initialization of the VM and the allocation of the stack
+// Then EXECUTE the global init code, if any
+void
+QLInterpreter::Initialize()
+{
+  m_vm->CheckInit();
+  AllocateStack();
+
+  if(m_vm->HasInitCode())
+  {
+    Interpret(nullptr,nullptr);
+  }
+}
+
+// A new argument on the stack for Call(). Set it to the value:
+// from now on the garbage collector finds it
+MemObject**
+QLInterpreter::PushArgument()
+{
+  CheckStack(1);
+  *(--m_stack_pointer) = m_vm->GetNil();
+  return m_stack_pointer;
+}
+
+// Call a script function with the arguments of PushArgument(), the first
+// argument pushed first. Returns the return value of the function, which
+// is no longer on the stack: copy it before the next allocation
+MemObject*
+QLInterpreter::Call(Function* p_function,int p_arguments)
+{
+  MemObject** bottom = m_stack_pointer + p_arguments;
+  TestFunctionArguments(p_function,p_arguments);
+
+  m_entryArguments = p_arguments;
+  Interpret(nullptr,p_function);
+
+  MemObject* result = m_stack_pointer[0];
+  m_stack_pointer = bottom;
+  return result;
+}
+
 // interpret - interpret bytecode instructions
 int
 QLInterpreter::Interpret(Object* p_object,Function* p_function)
 {
+  if(m_registers && !m_trace && p_function)
+  {
+    return InterpretRegisters(p_object,p_function);
+  }
+  if(m_threaded)
+  {
+    return m_trace ? InterpretThreaded<true> (p_object,p_function)
+                   : InterpretThreaded<false>(p_object,p_function);
+  }
+
   int           pcoff        = 0;
   int           numArguments = 0;;
   Object*       runObject    = p_object;
@@ -199,18 +267,17 @@ QLInterpreter::Interpret(Object* p_object,Function* p_function)
   // initialize
   m_code = m_pc = runFunction ? runFunction->GetBytecode() : m_vm->GetBytecode();
 
-  /* make a dummy call frame */
-  CheckStack(STACKFRAME_SIZE);
-  PushInteger(0);
-  PushInteger(0);
-  PushInteger(0);
-  PushInteger(0);
-  m_stack_pointer = PushInteger(0);
+  /* make a dummy call frame, with the stack for the whole code */
+  CheckStack(StackNeeded(runFunction));
+  PushEntryFrame();
   m_frame_pointer = topframe = m_stack_pointer;
 
   // execute each instruction
   while(true)
   {
+    // Slice of incremental garbage collection
+    m_vm->GCStep();
+
     if(m_trace) 
     {
       // Decode exactly one bytecode instruction
@@ -230,6 +297,7 @@ QLInterpreter::Interpret(Object* p_object,Function* p_function)
       case OP_RETURN:   // RETURN FROM A SCRIPT FUNCTION or THE COMPLETE INTERPRETER
                         if(m_frame_pointer == topframe)
                         {
+                          --m_call;
                           if(m_trace)
                           {
                             osputs_stderr(_T("\n"));
@@ -268,7 +336,7 @@ QLInterpreter::Interpret(Object* p_object,Function* p_function)
                         break;
       case OP_MSTORE:   // STORE TOS IN AN OBJECT MEMBER
                         numArguments = *m_pc++;
-                        if(runObject->SetAttribute(numArguments,m_vm->AllocMemObject(m_stack_pointer[0])) == false)
+                        if(runObject->SetAttribute(m_vm,numArguments,m_vm->AllocMemObject(m_stack_pointer[0])) == false)
                         {
                           BadMemberArgument(runObject,numArguments);
                         }
@@ -283,7 +351,7 @@ QLInterpreter::Interpret(Object* p_object,Function* p_function)
                         break;
       case OP_TLOAD:    // REFERENCE A LOCAL VARIABLE
                         numArguments = *m_pc++;
-                        m_stack_pointer[0] = m_frame_pointer[-numArguments - 1];
+                        m_stack_pointer[0] = LoadTemporary(numArguments);
                         break;
       case OP_TSTORE:   // SET a value in a Temporary (local variable)
                         numArguments = *m_pc++;
@@ -293,19 +361,18 @@ QLInterpreter::Interpret(Object* p_object,Function* p_function)
                         ReserveSpace(*m_pc++);
                         break;
       case OP_BRT:      // BRANCH if TRUE
-                        m_pc = (istrue(m_stack_pointer[0])) ? m_pc = m_code + GetWordOperand() : m_pc + 2;
+                        m_pc = (istrue(m_stack_pointer[0])) ? m_pc = m_code + GetLongOperand() : m_pc + 4;
                         break;
       case OP_BRF:      // BRANCH IF FALSE
-                        m_pc = (istrue(m_stack_pointer[0])) ? m_pc + 2 : m_pc = m_code + GetWordOperand();
+                        m_pc = (istrue(m_stack_pointer[0])) ? m_pc + 4 : m_pc = m_code + GetLongOperand();
                         break;
       case OP_BR:       // UNCONDITIONAL BRANCH
-                        m_pc = m_code + GetWordOperand();
+                        m_pc = m_code + GetLongOperand();
                         break;
       case OP_NIL:      // SET TOS TO NIL (ZERO)
                         SetNil(0);
                         break;
       case OP_PUSH:     // PUSH INTEGER TO TOS
-                        CheckStack(1);
                         PushInteger(0);
                         break;
       case OP_NOT:      // NOT OPERATOR ON TOS
@@ -313,7 +380,7 @@ QLInterpreter::Interpret(Object* p_object,Function* p_function)
                         break;
       case OP_NEG:      // NEGATE TOS
                         CheckType(0,DTYPE_INTEGER);
-                        m_stack_pointer[0]->m_value.v_integer = -(m_stack_pointer[0]->m_value.v_integer);
+                        SetInteger(-(m_stack_pointer[0]->m_value.v_integer));
                         break;
       case OP_ADD:      // PERFORM OPERATOR ADD on INTEGER, STRING, BCD or VARIANT
                         inter_operator(OP_ADD);
@@ -380,60 +447,843 @@ QLInterpreter::Interpret(Object* p_object,Function* p_function)
                         inter_operator(OP_NE);
                         pop = 1;
                         break;
-      case OP_GE:       // OPERATOR GREATER THAN OR EQUAL TO (>=)
-                        inter_operator(OP_GE);
+      case OP_GE:       // OPERATOR GREATER THAN OR EQUAL TO (>=)
+                        inter_operator(OP_GE);
+                        pop = 1;
+                        break;
+      case OP_GT:       // OPERATOR GREATER THAN (<)
+                        inter_operator(OP_GT);
+                        pop = 1;
+                        break;
+      case OP_LIT:      // LOAD A LITERAL FOR THE CURRENT FUNCTION
+                        Inter_literal(val,runFunction,*m_pc++);
+                        break;
+      case OP_SEND:     // SEND REQUEST -> CALL A MEMBER OF AN OBJECT, INTERNAL METHOD
+                        Inter_send(numArguments,newline,calObject,vClass,selector,val,pop,calFunction,runObject,runFunction,false);
+                        break;
+      case OP_VSEND:    // SEND REQUEST TO AN OBJECT OF A KNOWN CLASS, THROUGH THE VTABLE
+                        Inter_send(numArguments,newline,calObject,vClass,selector,val,pop,calFunction,runObject,runFunction,true);
+                        break;
+      case OP_DUP2:     // Duplicate top two stack entries
+                        Inter_duplicate2();
+                        break;
+      case OP_NEW:      // Create a new object from a class reference
+                        if(m_stack_pointer[0]->m_type != DTYPE_CLASS)
+                        {
+                          BadType(0,DTYPE_CLASS);
+                        }
+                        m_stack_pointer[0] = m_vm->NewObject(m_stack_pointer[0]->m_value.v_class);
+                        break;
+      case OP_DESTROY:  // Delete the object on the top of the stack
+                        Inter_Destroy(val,calFunction,calObject,runFunction,runObject);
+                        break;
+      case OP_DELETE:   // At the end of the "Destroy" DTOR method
+                        // The compiler emits an OP_DELETE after the OP_DESTROY
+                        // so we always end up here after a "destroy <object>"
+                        number = m_vm->DestroyObject(m_stack_pointer[0]);
+                        SetInteger(number);
+                        break;
+      case OP_SWITCH:   // PERFORM A SWITCH STATEMENT
+                        Inter_switch(numArguments,val,runFunction,pcoff);
+                        break;
+      case OP_DSWITCH:  // SWITCH BY A DENSE JUMP TABLE
+                        Inter_denseSwitch();
+                        break;
+      case OP_HSWITCH:  // SWITCH BY A HASH TABLE
+                        Inter_hashSwitch(runFunction);
+                        break;
+      case OP_TLOADP:   // LOAD A LOCAL VARIABLE, THEN PUSH
+                        numArguments = *m_pc++;
+                        m_stack_pointer[0] = LoadTemporary(numArguments);
+                        PushInteger(0);
+                        break;
+      case OP_PTLOAD:   // PUSH, THEN LOAD A LOCAL VARIABLE
+                        PushInteger(0);
+                        numArguments = *m_pc++;
+                        m_stack_pointer[0] = LoadTemporary(numArguments);
+                        break;
+      case OP_PLIT:     // PUSH, THEN LOAD A LITERAL
+                        PushInteger(0);
+                        Inter_literal(val,runFunction,*m_pc++);
+                        break;
+      case OP_INT:      // LOAD A SMALL INTEGER
+                        SetInteger((signed char) *m_pc++);
+                        break;
+      case OP_PINT:     // PUSH A SMALL INTEGER
+                        PushInteger((signed char) *m_pc++);
+                        break;
+      case OP_TINC:     // INCREMENT A LOCAL VARIABLE
+                        numArguments = *m_pc++;
+                        m_stack_pointer[0] = m_frame_pointer[-numArguments - 1];
+                        Inter_increment();
+                        m_frame_pointer[-numArguments - 1] = m_stack_pointer[0];
+                        break;
+      case OP_TDEC:     // DECREMENT A LOCAL VARIABLE
+                        numArguments = *m_pc++;
+                        m_stack_pointer[0] = m_frame_pointer[-numArguments - 1];
+                        Inter_decrement();
+                        m_frame_pointer[-numArguments - 1] = m_stack_pointer[0];
+                        break;
+      case OP_CBRT:     // COMPARE AND BRANCH IF TRUE
+                        inter_typed_operator(*m_pc++);
+                        PopStack(1);
+                        m_pc = (istrue(m_stack_pointer[0])) ? m_code + GetLongOperand() : m_pc + 4;
+                        break;
+      case OP_CBRF:     // COMPARE AND BRANCH IF FALSE
+                        inter_typed_operator(*m_pc++);
+                        PopStack(1);
+                        m_pc = (istrue(m_stack_pointer[0])) ? m_pc + 4 : m_code + GetLongOperand();
+                        break;
+      case OP_TLOADA:   // LOAD A LOCAL STRING TO APPEND TO, WITHOUT SHARING IT
+                        numArguments = *m_pc++;
+                        m_stack_pointer[0] = m_frame_pointer[-numArguments - 1];
+                        break;
+      case OP_TAPPEND:  // APPEND TOS TO A LOCAL STRING (IN PLACE IF WE CAN)
+                        Inter_append(*m_pc++);
+                        pop = 1;
+                        break;
+      case OP_ADDII:    // Fall through
+      case OP_SUBII:    // Fall through
+      case OP_MULII:    // Fall through
+      case OP_LTII:     // Fall through
+      case OP_LEII:     // Fall through
+      case OP_EQII:     // Fall through
+      case OP_NEII:     // Fall through
+      case OP_GEII:     // Fall through
+      case OP_GTII:     // Fall through
+      case OP_ADDBB:    // Fall through
+      case OP_SUBBB:    // Fall through
+      case OP_MULBB:    // Fall through
+      case OP_CONCAT:   // OPERATOR ON THE DATATYPES INFERRED BY THE COMPILER
+                        inter_typed_operator(m_pc[-1]);
+                        pop = 1;
+                        break;
+      case OP_WIDE:     // NEXT INSTRUCTION HAS A WORD OPERAND
+                        Inter_wide(val,runFunction,runObject);
+                        break;
+      default:          // UNKNOWN BYTECODE
+                        m_vm->Error(_T("INTERNAL Bad opcode: %02X"),m_pc[-1]);
+                        break;
+    }
+    if(m_trace)
+    {
+      // Complete the trace by printing the object (optionally)
+      m_debugger->PrintObject(m_stack_pointer[0],newline);
+    }
+    // Popping the stack is not generated as bytecode
+    // but is inserted by the interpreter as virtual code
+    if(pop)
+    {
+      PopStack(pop);
+      pop = 0;
+    }
+  }
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// THREADED CODE ENGINE
+//
+// Runs the pre-decoded instructions of QL_Threaded.h, so operands are
+// not decoded again on every execution. There is no computed goto in
+// our compiler, so the dispatch is a switch on the decoded opcode.
+// The tracing version is a separate instantiation: without TRACE
+// there are no tests for the debugger and operands are popped at once.
+// Opcodes with a stack frame or a switch table run the same helpers
+// as the bytecode engine, with m_pc set right after the opcode.
+//
+//////////////////////////////////////////////////////////////////////////
+
+template<bool TRACE>
+int
+QLInterpreter::InterpretThreaded(Object* p_object,Function* p_function)
+{
+  int           pcoff        = 0;
+  int           numArguments = 0;
+  Object*       runObject    = p_object;
+  Object*       calObject    = nullptr;
+  Function*     runFunction  = p_function;
+  Function*     calFunction  = nullptr;
+  MemObject**   topframe     = nullptr;
+  MemObject*    val          = nullptr;
+  Class*        vClass       = nullptr;
+  int           number       = 0;
+  int           pop          = 0;
+  bool          newline      = true;
+  CString       selector;
+
+  // initialize
+  m_code = m_pc = runFunction ? runFunction->GetBytecode() : m_vm->GetBytecode();
+  const Instruction* base = GetThreadedCode(runFunction);
+  const Instruction* ip   = base;
+
+  /* make a dummy call frame, with the stack for the whole code */
+  CheckStack(StackNeeded(runFunction));
+  PushEntryFrame();
+  m_frame_pointer = topframe = m_stack_pointer;
+
+  // execute each instruction
+  while(true)
+  {
+    // Slice of incremental garbage collection
+    m_vm->GCStep();
+
+    if(TRACE)
+    {
+      // Decode exactly one bytecode instruction
+      m_debugger->DecodeInstruction(runFunction,m_code,(int) (ip - base));
+      newline = true;
+    }
+
+    switch(ip->m_opcode)
+    {
+      case OP_CALL:     // CALL A FUNCTION (SCRIPT, INTERNAL, EXTERNAL)
+                        m_pc = m_code + (ip - base) + 1;
+                        if(Inter_call(numArguments,newline,pop,calFunction,runFunction,runObject) < 0)
+                        {
+                          return -1;
+                        }
+                        base = GetThreadedCode(runFunction);
+                        ip   = base + (m_pc - m_code);
+                        PopOperands<TRACE>(pop);
+                        break;
+      case OP_RETURN:   // RETURN FROM A SCRIPT FUNCTION or THE COMPLETE INTERPRETER
+                        if(m_frame_pointer == topframe)
+                        {
+                          --m_call;
+                          if(TRACE)
+                          {
+                            osputs_stderr(_T("\n"));
+                          }
+                          if(m_stack_pointer[0]->m_type == DTYPE_INTEGER)
+                          {
+                            return m_stack_pointer[0]->m_value.v_integer;
+                          }
+                          return 0;
+                        }
+                        Inter_return(numArguments,val,runObject,pcoff,runFunction);
+                        base = GetThreadedCode(runFunction);
+                        ip   = base + pcoff;
+                        pop  = numArguments;
+                        PopOperands<TRACE>(pop);
+                        break;
+      case OP_LOAD:     m_stack_pointer[0] = m_vm->GetGlobal(ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_STORE:    m_vm->SetGlobal(ip->m_operand,m_stack_pointer[0]);
+                        ip += ip->m_length;
+                        break;
+      case OP_VLOAD:    Inter_vload();
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      case OP_VSTORE:   Inter_vstore();
+                        pop = 2;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      case OP_MLOAD:    m_stack_pointer[0] = runObject->GetAttribute(ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_MSTORE:   if(runObject->SetAttribute(m_vm,ip->m_operand,m_vm->AllocMemObject(m_stack_pointer[0])) == false)
+                        {
+                          BadMemberArgument(runObject,ip->m_operand);
+                        }
+                        ip += ip->m_length;
+                        break;
+      case OP_ALOAD:    number = ArgumentReference(ip->m_operand);
+                        m_stack_pointer[0] = m_frame_pointer[number];
+                        ip += ip->m_length;
+                        break;
+      case OP_ASTORE:   number = ArgumentReference(ip->m_operand);
+                        m_frame_pointer[number] = m_stack_pointer[0];
+                        ip += ip->m_length;
+                        break;
+      case OP_TLOAD:    m_stack_pointer[0] = LoadTemporary(ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_TSTORE:   m_frame_pointer[-ip->m_operand - 1] = m_stack_pointer[0];
+                        ip += ip->m_length;
+                        break;
+      case OP_TSPACE:   ReserveSpace(ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_BRT:      ip = istrue(m_stack_pointer[0]) ? base + ip->m_operand : ip + ip->m_length;
+                        break;
+      case OP_BRF:      ip = istrue(m_stack_pointer[0]) ? ip + ip->m_length : base + ip->m_operand;
+                        break;
+      case OP_BR:       ip = base + ip->m_operand;
+                        break;
+      case OP_NIL:      SetNil(0);
+                        ip += ip->m_length;
+                        break;
+      case OP_PUSH:     PushInteger(0);
+                        ip += ip->m_length;
+                        break;
+      case OP_NOT:      SetInteger(istrue(m_stack_pointer[0]) ? FALSE : TRUE);
+                        ip += ip->m_length;
+                        break;
+      case OP_NEG:      CheckType(0,DTYPE_INTEGER);
+                        SetInteger(-(m_stack_pointer[0]->m_value.v_integer));
+                        ip += ip->m_length;
+                        break;
+      case OP_ADD:      // Fall through
+      case OP_SUB:      // Fall through
+      case OP_MUL:      // Fall through
+      case OP_DIV:      // Fall through
+      case OP_REM:      // Fall through
+      case OP_LT:       // Fall through
+      case OP_LE:       // Fall through
+      case OP_EQ:       // Fall through
+      case OP_NE:       // Fall through
+      case OP_GE:       // Fall through
+      case OP_GT:       inter_operator(ip->m_opcode);
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      case OP_INC:      Inter_increment();
+                        ip += ip->m_length;
+                        break;
+      case OP_DEC:      Inter_decrement();
+                        ip += ip->m_length;
+                        break;
+      case OP_BAND:     // Fall through
+      case OP_BOR:      // Fall through
+      case OP_XOR:      Inter_binary(ip->m_opcode);
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      case OP_BNOT:     Inter_binary(OP_BNOT);
+                        ip += ip->m_length;
+                        break;
+      case OP_SHL:      Inter_shiftLeft();
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      case OP_SHR:      Inter_shiftRight();
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      case OP_LIT:      Inter_literal(val,runFunction,ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_SEND:     // Fall through
+      case OP_VSEND:    m_pc = m_code + (ip - base) + 1;
+                        Inter_send(numArguments,newline,calObject,vClass,selector,val,pop,calFunction,runObject,runFunction,ip->m_opcode == OP_VSEND);
+                        base = GetThreadedCode(runFunction);
+                        ip   = base + (m_pc - m_code);
+                        PopOperands<TRACE>(pop);
+                        break;
+      case OP_DUP2:     Inter_duplicate2();
+                        ip += ip->m_length;
+                        break;
+      case OP_NEW:      if(m_stack_pointer[0]->m_type != DTYPE_CLASS)
+                        {
+                          BadType(0,DTYPE_CLASS);
+                        }
+                        m_stack_pointer[0] = m_vm->NewObject(m_stack_pointer[0]->m_value.v_class);
+                        ip += ip->m_length;
+                        break;
+      case OP_DESTROY:  m_pc = m_code + (ip - base) + 1;
+                        Inter_Destroy(val,calFunction,calObject,runFunction,runObject);
+                        base = GetThreadedCode(runFunction);
+                        ip   = base + (m_pc - m_code);
+                        break;
+      case OP_DELETE:   number = m_vm->DestroyObject(m_stack_pointer[0]);
+                        SetInteger(number);
+                        ip += ip->m_length;
+                        break;
+      case OP_SWITCH:   m_pc = m_code + (ip - base) + 1;
+                        Inter_switch(numArguments,val,runFunction,pcoff);
+                        ip = base + (m_pc - m_code);
+                        break;
+      case OP_DSWITCH:  m_pc = m_code + (ip - base) + 1;
+                        Inter_denseSwitch();
+                        ip = base + (m_pc - m_code);
+                        break;
+      case OP_HSWITCH:  m_pc = m_code + (ip - base) + 1;
+                        Inter_hashSwitch(runFunction);
+                        ip = base + (m_pc - m_code);
+                        break;
+      case OP_TLOADP:   m_stack_pointer[0] = LoadTemporary(ip->m_operand);
+                        PushInteger(0);
+                        ip += ip->m_length;
+                        break;
+      case OP_PTLOAD:   PushInteger(0);
+                        m_stack_pointer[0] = LoadTemporary(ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_PLIT:     PushInteger(0);
+                        Inter_literal(val,runFunction,ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_INT:      SetInteger(ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_PINT:     PushInteger(ip->m_operand);
+                        ip += ip->m_length;
+                        break;
+      case OP_TINC:     m_stack_pointer[0] = m_frame_pointer[-ip->m_operand - 1];
+                        Inter_increment();
+                        m_frame_pointer[-ip->m_operand - 1] = m_stack_pointer[0];
+                        ip += ip->m_length;
+                        break;
+      case OP_TDEC:     m_stack_pointer[0] = m_frame_pointer[-ip->m_operand - 1];
+                        Inter_decrement();
+                        m_frame_pointer[-ip->m_operand - 1] = m_stack_pointer[0];
+                        ip += ip->m_length;
+                        break;
+      case OP_CBRT:     inter_typed_operator(ip->m_extra);
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip = istrue(m_stack_pointer[0]) ? base + ip->m_operand : ip + ip->m_length;
+                        break;
+      case OP_CBRF:     inter_typed_operator(ip->m_extra);
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip = istrue(m_stack_pointer[0]) ? ip + ip->m_length : base + ip->m_operand;
+                        break;
+      case OP_TLOADA:   m_stack_pointer[0] = m_frame_pointer[-ip->m_operand - 1];
+                        ip += ip->m_length;
+                        break;
+      case OP_TAPPEND:  Inter_append(ip->m_operand);
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      case OP_ADDII:    // Fall through
+      case OP_SUBII:    // Fall through
+      case OP_MULII:    // Fall through
+      case OP_LTII:     // Fall through
+      case OP_LEII:     // Fall through
+      case OP_EQII:     // Fall through
+      case OP_NEII:     // Fall through
+      case OP_GEII:     // Fall through
+      case OP_GTII:     // Fall through
+      case OP_ADDBB:    // Fall through
+      case OP_SUBBB:    // Fall through
+      case OP_MULBB:    // Fall through
+      case OP_CONCAT:   inter_typed_operator(ip->m_opcode);
+                        pop = 1;
+                        PopOperands<TRACE>(pop);
+                        ip += ip->m_length;
+                        break;
+      default:          // UNKNOWN BYTECODE
+                        m_vm->Error(_T("INTERNAL Bad opcode: %02X"),m_code[ip - base]);
+                        break;
+    }
+    if(TRACE)
+    {
+      // Complete the trace by printing the object (optionally)
+      m_debugger->PrintObject(m_stack_pointer[0],newline);
+      if(pop)
+      {
+        PopStack(pop);
+        pop = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+// Popping the stack as virtual code of the threaded engine.
+// When tracing, this is done after printing the result
+template<bool TRACE>
+void
+QLInterpreter::PopOperands(int& p_pop)
+{
+  if(!TRACE && p_pop)
+  {
+    MemObject* val = m_stack_pointer[0];
+    m_stack_pointer += p_pop;
+    m_stack_pointer[0] = val;
+    p_pop = 0;
+  }
+}
+
+// Threaded code of a function, or of the init code
+Instruction*
+QLInterpreter::GetThreadedCode(Function* p_function)
+{
+  return p_function ? p_function->GetThreadedCode() : m_vm->GetThreadedCode();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// REGISTER CODE ENGINE
+//
+// Runs the register code of QL_Register.h. Register opcodes read their
+// operands from the registers of the stack frame and the constants of
+// the function, and write their result to a register. Any other opcode
+// runs on the stack, the same as in the threaded engine. The init code
+// and tracing run in the bytecode engine.
+// Hot functions are compiled to machine code (QL_Jit.h). The machine
+// code runs until an instruction it has no template for, which the
+// engine then runs before it enters the machine code again.
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Source of a register instruction: a register of the stack frame or a constant
+inline MemObject*
+QLInterpreter::GetRegister(const RegisterCode* p_code,int p_register)
+{
+  return p_register > 0 ? m_frame_pointer[-p_register] : p_code->m_constants[-p_register];
+}
+
+int
+QLInterpreter::InterpretRegisters(Object* p_object,Function* p_function)
+{
+  int           pcoff        = 0;
+  int           numArguments = 0;
+  Object*       runObject    = p_object;
+  Object*       calObject    = nullptr;
+  Function*     runFunction  = p_function;
+  Function*     calFunction  = nullptr;
+  MemObject**   topframe     = nullptr;
+  MemObject*    val          = nullptr;
+  Class*        vClass       = nullptr;
+  int           number       = 0;
+  int           pop          = 0;
+  bool          newline      = true;
+  CString       selector;
+
+  // initialize
+  m_code = m_pc = runFunction->GetBytecode();
+
+  /* make a dummy call frame, with the stack for the whole code */
+  CheckStack(StackNeeded(runFunction));
+  PushEntryFrame();
+  m_frame_pointer = topframe = m_stack_pointer;
+
+  RegisterCode*         regs   = runFunction->GetRegisterCode(m_vm);
+  const RegInstruction* ip     = &regs->m_code[0];
+  JitCode*              native = GetNativeCode(regs);
+  JitContext            context;
+  context.m_immediates = m_vm->GetNil();
+  context.m_pages      = m_vm->GetImmediatePages();
+
+  // execute each instruction
+  while(true)
+  {
+    if(native)
+    {
+      context.m_frame     = m_frame_pointer;
+      context.m_stack     = m_stack_pointer;
+      context.m_constants = regs->m_constants.data();
+      context.m_arguments = m_call->m_arguments;
+      ip = &regs->m_code[native->m_entry(&context,(int)(ip - &regs->m_code[0]))];
+      m_stack_pointer = context.m_stack;
+    }
+    // Slice of incremental garbage collection
+    m_vm->GCStep();
+
+    switch(ip->m_opcode)
+    {
+      case RG_MOVE:     // Loading a local variable shares its value
+                        val = GetRegister(regs,ip->m_left);
+                        if(val->m_flags & FLAG_OWNED)
+                        {
+                          val->m_flags &= ~FLAG_OWNED;
+                        }
+                        m_frame_pointer[-ip->m_target] = val;
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        ++ip;
+                        break;
+      case RG_LITERAL:  // Get a duplicate (by-value) from a string literal
+                        val = m_vm->AllocMemObject(runFunction->GetLiteral(ip->m_operand));
+                        m_frame_pointer[-ip->m_target] = val;
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        ++ip;
+                        break;
+      case RG_LOAD:     m_frame_pointer[-ip->m_target] = m_vm->GetGlobal(ip->m_operand);
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        ++ip;
+                        break;
+      case RG_STORE:    val = GetRegister(regs,ip->m_left);
+                        if(val->m_flags & FLAG_OWNED)
+                        {
+                          val->m_flags &= ~FLAG_OWNED;
+                        }
+                        m_vm->SetGlobal(ip->m_operand,val);
+                        ++ip;
+                        break;
+      case RG_ALOAD:    number = ArgumentReference(ip->m_operand);
+                        m_frame_pointer[-ip->m_target] = m_frame_pointer[number];
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        ++ip;
+                        break;
+      case RG_OPER:     val = RegisterOperator(regs,ip);
+                        m_frame_pointer[-ip->m_target] = val;
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        ++ip;
+                        break;
+      case RG_CBRT:     val = RegisterOperator(regs,ip);
+                        m_frame_pointer[-ip->m_target] = val;
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        if(ip->m_operand < ip - &regs->m_code[0])
+                        {
+                          native = GetNativeCode(regs);
+                        }
+                        ip = istrue(val) ? &regs->m_code[ip->m_operand] : ip + 1;
+                        break;
+      case RG_CBRF:     val = RegisterOperator(regs,ip);
+                        m_frame_pointer[-ip->m_target] = val;
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        if(ip->m_operand < ip - &regs->m_code[0])
+                        {
+                          native = GetNativeCode(regs);
+                        }
+                        ip = istrue(val) ? ip + 1 : &regs->m_code[ip->m_operand];
+                        break;
+      case RG_INC:      // Fall through
+      case RG_DEC:      val = RegisterIncrement(ip);
+                        m_frame_pointer[-ip->m_target] = val;
+                        m_stack_pointer = m_frame_pointer - ip->m_depth;
+                        ++ip;
+                        break;
+      case OP_CALL:     // CALL A FUNCTION (SCRIPT, INTERNAL, EXTERNAL)
+                        m_pc = m_code + ip->m_offset + 1;
+                        if(Inter_call(numArguments,newline,pop,calFunction,runFunction,runObject) < 0)
+                        {
+                          return -1;
+                        }
+                        regs   = runFunction->GetRegisterCode(m_vm);
+                        native = GetNativeCode(regs);
+                        ip   = &regs->m_code[regs->m_entry[m_pc - m_code]];
+                        PopOperands<false>(pop);
+                        break;
+      case OP_RETURN:   // RETURN FROM A SCRIPT FUNCTION or THE COMPLETE INTERPRETER
+                        if(m_frame_pointer == topframe)
+                        {
+                          --m_call;
+                          if(m_stack_pointer[0]->m_type == DTYPE_INTEGER)
+                          {
+                            return m_stack_pointer[0]->m_value.v_integer;
+                          }
+                          return 0;
+                        }
+                        Inter_return(numArguments,val,runObject,pcoff,runFunction);
+                        regs   = runFunction->GetRegisterCode(m_vm);
+                        native = GetNativeCode(regs);
+                        ip   = &regs->m_code[regs->m_entry[pcoff]];
+                        pop  = numArguments;
+                        PopOperands<false>(pop);
+                        break;
+      case OP_VLOAD:    Inter_vload();
+                        pop = 1;
+                        PopOperands<false>(pop);
+                        ++ip;
+                        break;
+      case OP_VSTORE:   Inter_vstore();
+                        pop = 2;
+                        PopOperands<false>(pop);
+                        ++ip;
+                        break;
+      case OP_MLOAD:    m_stack_pointer[0] = runObject->GetAttribute(ip->m_operand);
+                        ++ip;
+                        break;
+      case OP_MSTORE:   if(runObject->SetAttribute(m_vm,ip->m_operand,m_vm->AllocMemObject(m_stack_pointer[0])) == false)
+                        {
+                          BadMemberArgument(runObject,ip->m_operand);
+                        }
+                        ++ip;
+                        break;
+      case OP_ASTORE:   number = ArgumentReference(ip->m_operand);
+                        m_frame_pointer[number] = m_stack_pointer[0];
+                        ++ip;
+                        break;
+      case OP_TSPACE:   ReserveSpace(ip->m_operand);
+                        ++ip;
+                        break;
+      case OP_BRT:      ip = istrue(m_stack_pointer[0]) ? &regs->m_code[ip->m_operand] : ip + 1;
+                        break;
+      case OP_BRF:      ip = istrue(m_stack_pointer[0]) ? ip + 1 : &regs->m_code[ip->m_operand];
+                        break;
+      case OP_BR:       // A loop counts for the compiler
+                        if(ip->m_operand < ip - &regs->m_code[0])
+                        {
+                          native = GetNativeCode(regs);
+                        }
+                        ip = &regs->m_code[ip->m_operand];
+                        break;
+      case OP_NIL:      SetNil(0);
+                        ++ip;
+                        break;
+      case OP_NOT:      SetInteger(istrue(m_stack_pointer[0]) ? FALSE : TRUE);
+                        ++ip;
+                        break;
+      case OP_NEG:      CheckType(0,DTYPE_INTEGER);
+                        SetInteger(-(m_stack_pointer[0]->m_value.v_integer));
+                        ++ip;
+                        break;
+      case OP_INC:      Inter_increment();
+                        ++ip;
+                        break;
+      case OP_DEC:      Inter_decrement();
+                        ++ip;
+                        break;
+      case OP_BAND:     // Fall through
+      case OP_BOR:      // Fall through
+      case OP_XOR:      Inter_binary(ip->m_opcode);
                         pop = 1;
+                        PopOperands<false>(pop);
+                        ++ip;
                         break;
-      case OP_GT:       // OPERATOR GREATER THAN (<)
-                        inter_operator(OP_GT);
+      case OP_BNOT:     Inter_binary(OP_BNOT);
+                        ++ip;
+                        break;
+      case OP_SHL:      Inter_shiftLeft();
                         pop = 1;
+                        PopOperands<false>(pop);
+                        ++ip;
                         break;
-      case OP_LIT:      // LOAD A LITERAL FOR THE CURRENT FUNCTION
-                        Inter_literal(val,runFunction);
+      case OP_SHR:      Inter_shiftRight();
+                        pop = 1;
+                        PopOperands<false>(pop);
+                        ++ip;
                         break;
-      case OP_SEND:     // SEND REQUEST -> CALL A MEMBER OF AN OBJECT, INTERNAL METHOD
-                        Inter_send(numArguments,newline,calObject,vClass,selector,val,pop,calFunction,runObject,runFunction);
+      case OP_SEND:     // Fall through
+      case OP_VSEND:    m_pc = m_code + ip->m_offset + 1;
+                        Inter_send(numArguments,newline,calObject,vClass,selector,val,pop,calFunction,runObject,runFunction,ip->m_opcode == OP_VSEND);
+                        regs   = runFunction->GetRegisterCode(m_vm);
+                        native = GetNativeCode(regs);
+                        ip   = &regs->m_code[regs->m_entry[m_pc - m_code]];
+                        PopOperands<false>(pop);
                         break;
-      case OP_DUP2:     // Duplicate top two stack entries
-                        Inter_duplicate2();
+      case OP_DUP2:     Inter_duplicate2();
+                        ++ip;
                         break;
-      case OP_NEW:      // Create a new object from a class reference
-                        if(m_stack_pointer[0]->m_type != DTYPE_CLASS)
+      case OP_NEW:      if(m_stack_pointer[0]->m_type != DTYPE_CLASS)
                         {
                           BadType(0,DTYPE_CLASS);
                         }
                         m_stack_pointer[0] = m_vm->NewObject(m_stack_pointer[0]->m_value.v_class);
+                        ++ip;
                         break;
-      case OP_DESTROY:  // Delete the object on the top of the stack
+      case OP_DESTROY:  m_pc = m_code + ip->m_offset + 1;
                         Inter_Destroy(val,calFunction,calObject,runFunction,runObject);
+                        regs   = runFunction->GetRegisterCode(m_vm);
+                        native = GetNativeCode(regs);
+                        ip   = &regs->m_code[regs->m_entry[m_pc - m_code]];
                         break;
-      case OP_DELETE:   // At the end of the "Destroy" DTOR method
-                        // The compiler emits an OP_DELETE after the OP_DESTROY
-                        // so we always end up here after a "destroy <object>"
-                        number = m_vm->DestroyObject(m_stack_pointer[0]);
+      case OP_DELETE:   number = m_vm->DestroyObject(m_stack_pointer[0]);
                         SetInteger(number);
+                        ++ip;
                         break;
-      case OP_SWITCH:   // PERFORM A SWITCH STATEMENT
+      case OP_SWITCH:   m_pc = m_code + ip->m_offset + 1;
                         Inter_switch(numArguments,val,runFunction,pcoff);
+                        ip = &regs->m_code[regs->m_entry[m_pc - m_code]];
+                        break;
+      case OP_DSWITCH:  m_pc = m_code + ip->m_offset + 1;
+                        Inter_denseSwitch();
+                        ip = &regs->m_code[regs->m_entry[m_pc - m_code]];
+                        break;
+      case OP_HSWITCH:  m_pc = m_code + ip->m_offset + 1;
+                        Inter_hashSwitch(runFunction);
+                        ip = &regs->m_code[regs->m_entry[m_pc - m_code]];
+                        break;
+      case OP_TLOADA:   m_stack_pointer[0] = m_frame_pointer[-ip->m_operand - 1];
+                        ++ip;
+                        break;
+      case OP_TAPPEND:  Inter_append(ip->m_operand);
+                        pop = 1;
+                        PopOperands<false>(pop);
+                        ++ip;
                         break;
       default:          // UNKNOWN BYTECODE
-                        m_vm->Error(_T("INTERNAL Bad opcode: %02X"),m_pc[-1]);
+                        m_vm->Error(_T("INTERNAL Bad opcode: %02X"),m_code[ip->m_offset]);
                         break;
     }
-    if(m_trace)
+  }
+  return 0;
+}
+
+// Machine code of the register code of a function. Each entry of the
+// function and each loop it makes counts. When the function gets hot,
+// it is compiled once
+JitCode*
+QLInterpreter::GetNativeCode(RegisterCode* p_code)
+{
+  if(m_jit && p_code->m_native == nullptr && p_code->m_hotness < JIT_THRESHOLD)
+  {
+    if(++p_code->m_hotness == JIT_THRESHOLD)
     {
-      // Complete the trace by printing the object (optionally)
-      m_debugger->PrintObject(m_stack_pointer[0],newline);
+      QLJit jit;
+      p_code->m_native = jit.Compile(p_code);
     }
-    // Popping the stack is not generated as bytecode
-    // but is inserted by the interpreter as virtual code
-    if(pop)
+  }
+  return p_code->m_native;
+}
+
+// Binary operator of a register instruction
+// Two integers are done right here. Other datatypes are put on the stack
+// in the place of the operands of the stack instruction, so the operators
+// and their errors are the same as in the bytecode engine
+MemObject*
+QLInterpreter::RegisterOperator(const RegisterCode* p_code,const RegInstruction* p_ins)
+{
+  MemObject* left  = GetRegister(p_code,p_ins->m_left);
+  MemObject* right = GetRegister(p_code,p_ins->m_right);
+
+  if(left->m_type == DTYPE_INTEGER && right->m_type == DTYPE_INTEGER)
+  {
+    int l = left ->m_value.v_integer;
+    int r = right->m_value.v_integer;
+    switch(p_ins->m_extra)
     {
-      PopStack(pop);
-      pop = 0;
+      case OP_ADD:  // Fall through
+      case OP_ADDII:return m_vm->GetInteger(l +  r);
+      case OP_SUB:  // Fall through
+      case OP_SUBII:return m_vm->GetInteger(l -  r);
+      case OP_MUL:  // Fall through
+      case OP_MULII:return m_vm->GetInteger(l *  r);
+      case OP_LT:   // Fall through
+      case OP_LTII: return m_vm->GetInteger(l <  r);
+      case OP_LE:   // Fall through
+      case OP_LEII: return m_vm->GetInteger(l <= r);
+      case OP_EQ:   // Fall through
+      case OP_EQII: return m_vm->GetInteger(l == r);
+      case OP_NE:   // Fall through
+      case OP_NEII: return m_vm->GetInteger(l != r);
+      case OP_GE:   // Fall through
+      case OP_GEII: return m_vm->GetInteger(l >= r);
+      case OP_GT:   // Fall through
+      case OP_GTII: return m_vm->GetInteger(l >  r);
     }
   }
-  return 0;
+  m_stack_pointer    = m_frame_pointer - p_ins->m_stage;
+  m_stack_pointer[1] = left;
+  m_stack_pointer[0] = right;
+  inter_typed_operator(p_ins->m_extra);
+  return m_stack_pointer[0];
+}
+
+// Increment or decrement of a local variable in a register
+MemObject*
+QLInterpreter::RegisterIncrement(const RegInstruction* p_ins)
+{
+  MemObject* value = m_frame_pointer[-p_ins->m_target];
+  if(value->m_type == DTYPE_INTEGER)
+  {
+    return m_vm->GetInteger(value->m_value.v_integer + (p_ins->m_opcode == RG_INC ? 1 : -1));
+  }
+  m_stack_pointer    = m_frame_pointer - p_ins->m_stage;
+  m_stack_pointer[0] = value;
+  if(p_ins->m_opcode == RG_INC)
+  {
+    Inter_increment();
+  }
+  else
+  {
+    Inter_decrement();
+  }
+  return m_stack_pointer[0];
 }
 
 int
@@ -444,6 +1294,7 @@ QLInterpreter::Inter_call(int&       numArguments
                          ,Function*& runFunction
                          ,Object*&   runObject)
 {
+  int site     = (int)(m_pc - m_code) - 1;
   numArguments = *m_pc++;  // Where we find our callee
   if(m_trace)
   {
@@ -470,14 +1321,13 @@ QLInterpreter::Inter_call(int&       numArguments
   if(calFunction)
   {
     // Test number of arguments and data types
-    TestFunctionArguments(calFunction,numArguments);
-
-    CheckStack(STACKFRAME_SIZE);
-    PushInteger(0);                                     // No object
-    PushFunction(runFunction);                          // Running function
-    PushInteger(numArguments);                          // NUMBER OF ARGUMENTS
-    PushInteger((int)(m_stack_top - m_frame_pointer));  // OFFSET SP FROM TOP (BEGINNING)
-    PushInteger((int)(m_pc - m_code));                  // OFFSET IN BYTECODE
+    // unless the verifier proved them for this call site
+    if(runFunction == nullptr || !runFunction->GetProvenCall(site))
+    {
+      TestFunctionArguments(calFunction,numArguments);
+    }
+    CheckStack(StackNeeded(calFunction));
+    PushFrame(runFunction,runObject,numArguments);
     m_code = m_pc   = calFunction->GetBytecode();       // New bytecode program counter
     runFunction     = calFunction;                      // Now running this function
     m_frame_pointer = m_stack_pointer;
@@ -497,9 +1347,11 @@ QLInterpreter::Inter_send(int&        numArguments
                          ,int&        pop
                          ,Function*&  calFunction
                          ,Object*&    runObject
-                         ,Function*&  runFunction)
+                         ,Function*&  runFunction
+                         ,bool        p_virtual)
 {
-  numArguments = *m_pc++; // Get the stack offset
+  numArguments = *m_pc++;          // Get the stack offset
+  int site     = GetWordOperand(); // Inline cache of this send
 
   // Check that the member selector is a string!
   CheckType(numArguments - 1, DTYPE_STRING);
@@ -511,38 +1363,36 @@ QLInterpreter::Inter_send(int&        numArguments
     newline = false;
   }
 
+  // The init code has no function to keep the caches
+  SendCache* cache = runFunction ? runFunction->GetSendCache(site) : nullptr;
+
   // See if it is an immediate scripted object
   if(m_stack_pointer[numArguments]->m_type == DTYPE_OBJECT)
   {
     // SEND REQUEST TO AN OBJECT
     calObject = m_stack_pointer[numArguments]->m_value.v_object;
     vClass    = calObject->GetClass();
-    selector  = *m_stack_pointer[numArguments - 1]->m_value.v_string;
+    CString* name = m_stack_pointer[numArguments - 1]->m_value.v_string;
     // Creating the "this" pointer on the stack on the place of the selector!
     m_stack_pointer[numArguments - 1] = m_stack_pointer[numArguments];
 
-    if(selector.IsEmpty())
+    // Receiver of a known class: try the vtable first
+    val = p_virtual ? FindVirtualMember(cache,vClass,name) : nullptr;
+    if(val == nullptr)
     {
-      NoMethod(selector);
-      return;
+      val = FindCachedMember(cache,vClass,name,selector);
+      if(val == nullptr)
+      {
+        NoMethod(selector);
+        return;
+      }
     }
-    val = vClass->RecursiveFindFuncMember(selector);
 
     switch(val->m_type)
     {
       case DTYPE_INTERNAL:	(*val->m_value.v_internal)(this,numArguments);
                             pop = numArguments;
                             break;
-      case DTYPE_STRING:    val = calObject->GetClass()->FindFuncMember(selector);
-                            if(val)
-                            {
-                              calFunction = val->m_value.v_script;
-                            }
-                            else
-                            {
-                              NoMethod(selector);
-                            }
-                            break;
       case DTYPE_SCRIPT:    calFunction = val->m_value.v_script;
                             break;
       default:              m_vm->Error(_T("Bad method, Selector '%s', Type %d"),selector,val->m_type);
@@ -553,12 +1403,8 @@ QLInterpreter::Inter_send(int&        numArguments
       // Test arguments. Allow for 'this' pointer as extra argument
       TestFunctionArguments(calFunction,numArguments - 1);
 
-      CheckStack(STACKFRAME_SIZE);
-      PushObject(runObject);
-      PushFunction(runFunction);
-      PushInteger(numArguments);
-      PushInteger((int)(m_stack_top - m_frame_pointer));
-      PushInteger((int)(m_pc - m_code));
+      CheckStack(StackNeeded(calFunction));
+      PushFrame(runFunction,runObject,numArguments);
       m_code = m_pc   = calFunction->GetBytecode();
       runFunction     = calFunction;
       runObject       = calObject;
@@ -570,7 +1416,7 @@ QLInterpreter::Inter_send(int&        numArguments
   else
   {
     // SEND REQUEST TO INTERNAL OBJECT
-    DoSendInternal(numArguments);
+    DoSendInternal(numArguments,cache);
     // POP two of the stack
     pop = numArguments;
   }
@@ -585,18 +1431,20 @@ QLInterpreter::Inter_return(int&         numArguments
 {
   val             = m_stack_pointer[0];
   runObject       = nullptr;
-  m_stack_pointer = m_frame_pointer;
-  pcoff           = m_frame_pointer[SF_OFF_PRGCOUNTER]->m_value.v_integer;
-  numArguments    = m_frame_pointer[SF_OFF_ARGUMENTS] ->m_value.v_integer;
-  runFunction     = m_frame_pointer[SF_OFF_FUNCTION]  ->m_value.v_script;
-  if(m_frame_pointer[SF_OFF_OBJECT]->m_type == DTYPE_OBJECT)
+  // The return value of 's += x' as the last statement escapes its local
+  if(val->m_flags & FLAG_OWNED)
   {
-    runObject = m_frame_pointer[SF_OFF_OBJECT]->m_value.v_object;
+    val->m_flags &= ~FLAG_OWNED;
   }
-  m_frame_pointer = m_stack_top - m_frame_pointer[SF_OFF_FRAMEPNTR]->m_value.v_integer;
+  m_stack_pointer = m_frame_pointer;
+  pcoff           = m_call->m_pc;
+  numArguments    = m_call->m_arguments;
+  runFunction     = m_call->m_function;
+  runObject       = m_call->m_object;
+  m_frame_pointer = m_call->m_frame;
+  --m_call;
   m_code = runFunction->GetBytecode();
   m_pc   = m_code + pcoff;
-  m_stack_pointer += STACKFRAME_SIZE; 
   // Restore return value from function
   m_stack_pointer[0] = val;
   if(m_trace)
@@ -608,11 +1456,16 @@ QLInterpreter::Inter_return(int&         numArguments
 void
 QLInterpreter::Inter_vload()
 {
-  CheckType(0,DTYPE_INTEGER);
   switch(m_stack_pointer[1]->m_type)
   {
-    case DTYPE_ARRAY:  VectorRef(); break;
-    case DTYPE_STRING: StringRef(); break;
+    case DTYPE_ARRAY:  CheckType(0,DTYPE_INTEGER);
+                       VectorRef();
+                       break;
+    case DTYPE_STRING: CheckType(0,DTYPE_INTEGER);
+                       StringRef();
+                       break;
+    case DTYPE_MAP:    MapRef();
+                       break;
     default:	         BadType(1,DTYPE_ARRAY); break;
   }
 }
@@ -620,11 +1473,16 @@ QLInterpreter::Inter_vload()
 void
 QLInterpreter::Inter_vstore()
 {
-  CheckType(1,DTYPE_INTEGER);
   switch(m_stack_pointer[2]->m_type)
   {
-    case DTYPE_ARRAY:  VectorSet(); break;
-    case DTYPE_STRING: StringSet(); break;
+    case DTYPE_ARRAY:  CheckType(1,DTYPE_INTEGER);
+                       VectorSet();
+                       break;
+    case DTYPE_STRING: CheckType(1,DTYPE_INTEGER);
+                       StringSet();
+                       break;
+    case DTYPE_MAP:    MapSet();
+                       break;
     default:	         BadType(1,DTYPE_ARRAY); break;
   }
 }
@@ -635,7 +1493,7 @@ QLInterpreter::Inter_shiftLeft()
   switch(m_stack_pointer[1]->m_type) 
   {
     case DTYPE_INTEGER: CheckType(0,DTYPE_INTEGER);
-                        m_stack_pointer[1]->m_value.v_integer <<= m_stack_pointer[0]->m_value.v_integer;
+                        SetInteger(m_stack_pointer[1]->m_value.v_integer << m_stack_pointer[0]->m_value.v_integer);
                         break;
     case DTYPE_FILE:    m_vm->Print(m_stack_pointer[1]->m_value.v_file,false,m_stack_pointer[0]);
                         break;
@@ -648,16 +1506,20 @@ QLInterpreter::Inter_shiftRight()
 {
   CheckType(0,DTYPE_INTEGER);
   CheckType(1,DTYPE_INTEGER);
-  m_stack_pointer[1]->m_value.v_integer >>= m_stack_pointer[0]->m_value.v_integer;
+  SetInteger(m_stack_pointer[1]->m_value.v_integer >> m_stack_pointer[0]->m_value.v_integer);
 }
 
 void
-QLInterpreter::Inter_literal(MemObject*& val,Function*& runFunction)
+QLInterpreter::Inter_literal(MemObject*& val,Function*& runFunction,int p_index)
 {
-  val = runFunction ? runFunction->GetLiteral(*m_pc++) 
-                    : m_vm->GetLiteral(*m_pc++);
-  if(val->m_type == DTYPE_INTEGER ||
-      val->m_type == DTYPE_STRING)
+  val = runFunction ? runFunction->GetLiteral(p_index) 
+                    : m_vm->GetLiteral(p_index);
+  if(val->m_type == DTYPE_INTEGER)
+  {
+    // Integers are by-value immediates (no allocation if small)
+    m_stack_pointer[0] = m_vm->GetInteger(val->m_value.v_integer);
+  }
+  else if(val->m_type == DTYPE_STRING)
   {
     // Get a duplicate (by-value) from a literal
     // See the QL_Compiler::add_literal function!
@@ -673,7 +1535,6 @@ QLInterpreter::Inter_literal(MemObject*& val,Function*& runFunction)
 void
 QLInterpreter::Inter_duplicate2()
 {
-  CheckStack(2);
   m_stack_pointer   -= 2; // Grow the stack by 2
   m_stack_pointer[0] = m_stack_pointer[2];
   m_stack_pointer[1] = m_stack_pointer[3];
@@ -699,12 +1560,8 @@ QLInterpreter::Inter_Destroy(MemObject*& val,Function*& calFunction,Object*& cal
       calFunction = val->m_value.v_script;
       TestFunctionArguments(calFunction,0);
       // Same as a OP_SEND method
-      CheckStack(STACKFRAME_SIZE);
-      PushObject(runObject);
-      PushFunction(runFunction);
-      PushInteger(1); // No arguments
-      PushInteger((int)(m_stack_top - m_frame_pointer));
-      PushInteger((int)(m_pc - m_code));
+      CheckStack(StackNeeded(calFunction));
+      PushFrame(runFunction,runObject,1); // No arguments
       m_code = m_pc   = calFunction->GetBytecode();
       runFunction     = calFunction;
       runObject       = calObject;
@@ -712,6 +1569,12 @@ QLInterpreter::Inter_Destroy(MemObject*& val,Function*& calFunction,Object*& cal
       calFunction     = nullptr;
       calObject       = nullptr;
   }
+  else
+  {
+    // No 'destroy' method: take the object off the stack again
+    // so the stack is as deep as after a call of the method
+    ++m_stack_pointer;
+  }
 }
 
 void
@@ -729,9 +1592,147 @@ QLInterpreter::Inter_switch(int& numArguments,MemObject*& val,Function*& runFunc
     {
       break;
     }
-    m_pc += 2;
+    m_pc += 4;
+  }
+  m_pc = m_code + GetLongOperand();
+}
+
+// Switch over a compact range of integer cases
+// The jump table is indexed by the selector minus the lowest case
+void
+QLInterpreter::Inter_denseSwitch()
+{
+  int slots = GetWordOperand();
+  int low   = GetLongOperand();
+  int label = 0;
+  int value = 0;
+
+  if(SwitchInteger(m_stack_pointer[0],value))
+  {
+    unsigned index = (unsigned) value - (unsigned) low;
+    if(index < (unsigned) slots)
+    {
+      label = ReadLong(&m_pc[index * 6 + 2]);
+    }
+  }
+  // Holes in the table have label zero
+  if(label == 0)
+  {
+    label = ReadLong(&m_pc[slots * 6]);
+  }
+  m_pc = m_code + label;
+}
+
+// Switch by a hash table of integer or string cases
+// Collisions are resolved by linear probing, an empty slot has label zero
+void
+QLInterpreter::Inter_hashSwitch(Function* runFunction)
+{
+  int        slots = GetWordOperand();
+  int        type  = *m_pc++;
+  int        mask  = slots - 1;
+  int        label = 0;
+  int        slot  = 0;
+  MemObject* val   = m_stack_pointer[0];
+  MemObject* lit   = nullptr;
+
+  if(type == DTYPE_INTEGER)
+  {
+    int value = 0;
+    if(SwitchInteger(val,value))
+    {
+      for(slot = SwitchHash(value) & mask; (label = ReadLong(&m_pc[slot * 6 + 2])) != 0; slot = (slot + 1) & mask)
+      {
+        lit = runFunction->GetLiteral(m_pc[slot * 6] | (m_pc[slot * 6 + 1] << 8));
+        if(lit->m_value.v_integer == value)
+        {
+          break;
+        }
+      }
+    }
+  }
+  else if(val->m_type == DTYPE_STRING || val->m_type == DTYPE_VARIANT)
+  {
+    CString variant;
+    const CString* value = val->m_value.v_string;
+    if(val->m_type == DTYPE_VARIANT)
+    {
+      variant = val->m_value.v_variant->GetAsChar();
+      value   = &variant;
+    }
+    for(slot = SwitchHash(*value) & mask; (label = ReadLong(&m_pc[slot * 6 + 2])) != 0; slot = (slot + 1) & mask)
+    {
+      lit = runFunction->GetLiteral(m_pc[slot * 6] | (m_pc[slot * 6 + 1] << 8));
+      if(*lit->m_value.v_string == *value)
+      {
+        break;
+      }
+    }
+  }
+  else
+  {
+    // Numbers against string cases: compare every case, as OP_SWITCH does
+    for(slot = 0; slot < slots; ++slot)
+    {
+      label = ReadLong(&m_pc[slot * 6 + 2]);
+      if(label && Equal(val,runFunction->GetLiteral(m_pc[slot * 6] | (m_pc[slot * 6 + 1] << 8))))
+      {
+        break;
+      }
+      label = 0;
+    }
+  }
+  if(label == 0)
+  {
+    label = ReadLong(&m_pc[slots * 6]);
+  }
+  m_pc = m_code + label;
+}
+
+// Instruction with a word operand, after the OP_WIDE prefix
+// For more than 255 literals, globals, members, arguments or temporaries
+void
+QLInterpreter::Inter_wide(MemObject*& val,Function*& runFunction,Object*& runObject)
+{
+  BYTE opcode  = *m_pc++;
+  int  operand = GetWordOperand();
+  int  number  = 0;
+
+  switch(opcode)
+  {
+    case OP_LIT:    Inter_literal(val,runFunction,operand);
+                    break;
+    case OP_LOAD:   m_stack_pointer[0] = m_vm->GetGlobal(operand);
+                    break;
+    case OP_STORE:  m_vm->SetGlobal(operand,m_stack_pointer[0]);
+                    break;
+    case OP_MLOAD:  m_stack_pointer[0] = runObject->GetAttribute(operand);
+                    break;
+    case OP_MSTORE: if(runObject->SetAttribute(m_vm,operand,m_vm->AllocMemObject(m_stack_pointer[0])) == false)
+                    {
+                      BadMemberArgument(runObject,operand);
+                    }
+                    break;
+    case OP_ALOAD:  number = ArgumentReference(operand);
+                    m_stack_pointer[0] = m_frame_pointer[number];
+                    break;
+    case OP_ASTORE: number = ArgumentReference(operand);
+                    m_frame_pointer[number] = m_stack_pointer[0];
+                    break;
+    case OP_TLOAD:  m_stack_pointer[0] = LoadTemporary(operand);
+                    break;
+    case OP_TSTORE: m_frame_pointer[-operand - 1] = m_stack_pointer[0];
+                    break;
+    case OP_TLOADA: m_stack_pointer[0] = m_frame_pointer[-operand - 1];
+                    break;
+    case OP_TAPPEND:Inter_append(operand);
+                    PopStack(1);
+                    break;
+    case OP_TSPACE: ReserveSpace(operand);
+                    break;
+    default:        m_vm->Error(_T("INTERNAL Bad wide opcode: %02X"),opcode);
+                    break;
   }
-  m_pc = m_code + GetWordOperand();
 }
 
 // Test correct data types and number of arguments
@@ -764,7 +1765,7 @@ QLInterpreter::Inter_increment()
   int type = m_stack_pointer[0]->m_type;
   switch(type)
   {
-    case DTYPE_INTEGER: ++(m_stack_pointer[0]->m_value.v_integer);
+    case DTYPE_INTEGER: SetInteger(m_stack_pointer[0]->m_value.v_integer + 1);
                         break;
     case DTYPE_BCD:     ++(*m_stack_pointer[0]->m_value.v_floating);
                         break;
@@ -778,13 +1779,48 @@ QLInterpreter::Inter_increment()
   }
 }
 
+// Append TOS to the value of a local variable: "s = s + TOS"
+// TOS[1] is the value of the local, loaded by OP_TLOADA.
+// A string that only the local refers to is extended in place. Its CString
+// buffer grows geometrically, so building a large string takes linear time.
+void
+QLInterpreter::Inter_append(int p_temp)
+{
+  MemObject*  target = m_stack_pointer[1];
+  MemObject*  value  = m_stack_pointer[0];
+  MemObject*& local  = m_frame_pointer[-p_temp - 1];
+
+  if(target == local && (target->m_flags & FLAG_OWNED))
+  {
+    switch(value->m_type)
+    {
+      case DTYPE_STRING:  target->m_value.v_string->Append(*value->m_value.v_string);
+                          m_stack_pointer[0] = target;
+                          return;
+      case DTYPE_INTEGER: target->m_value.v_string->AppendFormat(_T("%d"),value->m_value.v_integer);
+                          m_stack_pointer[0] = target;
+                          return;
+    }
+  }
+  // Shared string or other datatypes: the ordinary ADD operator
+  inter_operator(OP_ADD);
+
+  // A new string is only referenced by the local from now on
+  MemObject* result = m_stack_pointer[0];
+  if(result->m_type == DTYPE_STRING && result != target && result != value)
+  {
+    result->m_flags |= FLAG_OWNED;
+  }
+  local = result;
+}
+
 void
 QLInterpreter::Inter_decrement()
 {
   int type = m_stack_pointer[0]->m_type;
   switch(type)
   {
-    case DTYPE_INTEGER: --(m_stack_pointer[0]->m_value.v_integer);
+    case DTYPE_INTEGER: SetInteger(m_stack_pointer[0]->m_value.v_integer - 1);
                         break;
     case DTYPE_BCD:     --(*m_stack_pointer[0]->m_value.v_floating);
                         break;
@@ -842,6 +1878,76 @@ QLInterpreter::inter_operator(BYTE p_operator)
   }
 }
 
+// Generic operator of a typed operator (OP_ADDII -> OP_ADD)
+static BYTE
+GenericOperator(BYTE p_operator)
+{
+  switch(p_operator)
+  {
+    case OP_ADDII:  // Fall through
+    case OP_ADDBB:  // Fall through
+    case OP_CONCAT: return OP_ADD;
+    case OP_SUBII:  // Fall through
+    case OP_SUBBB:  return OP_SUB;
+    case OP_MULII:  // Fall through
+    case OP_MULBB:  return OP_MUL;
+    case OP_LTII:   return OP_LT;
+    case OP_LEII:   return OP_LE;
+    case OP_EQII:   return OP_EQ;
+    case OP_NEII:   return OP_NE;
+    case OP_GEII:   return OP_GE;
+    case OP_GTII:   return OP_GT;
+  }
+  return p_operator;
+}
+
+// OPERATOR on the datatypes the compiler inferred for both operands
+// The declared type of a variable is not enforced, so the types are
+// checked first. Any other type goes to the generic operator, and
+// gets the same result or the same 'BadOperator' error as ever.
+// Also does the generic comparison operators of OP_CBRT/OP_CBRF
+void
+QLInterpreter::inter_typed_operator(BYTE p_operator)
+{
+  MemObject* left  = m_stack_pointer[1];
+  MemObject* right = m_stack_pointer[0];
+
+  if(left->m_type == DTYPE_INTEGER && right->m_type == DTYPE_INTEGER)
+  {
+    int l = left ->m_value.v_integer;
+    int r = right->m_value.v_integer;
+    switch(p_operator)
+    {
+      case OP_ADDII:  SetInteger(l +  r); return;
+      case OP_SUBII:  SetInteger(l -  r); return;
+      case OP_MULII:  SetInteger(l *  r); return;
+      case OP_LTII:   SetInteger(l <  r); return;
+      case OP_LEII:   SetInteger(l <= r); return;
+      case OP_EQII:   SetInteger(l == r); return;
+      case OP_NEII:   SetInteger(l != r); return;
+      case OP_GEII:   SetInteger(l >= r); return;
+      case OP_GTII:   SetInteger(l >  r); return;
+    }
+  }
+  else if(left->m_type == DTYPE_BCD && right->m_type == DTYPE_BCD)
+  {
+    bcd* l = left ->m_value.v_floating;
+    bcd* r = right->m_value.v_floating;
+    switch(p_operator)
+    {
+      case OP_ADDBB:  SetBcd(*l + *r); return;
+      case OP_SUBBB:  SetBcd(*l - *r); return;
+      case OP_MULBB:  SetBcd(*l * *r); return;
+    }
+  }
+  else if(left->m_type == DTYPE_STRING && right->m_type == DTYPE_STRING && p_operator == OP_CONCAT)
+  {
+    SetString(*left->m_value.v_string + *right->m_value.v_string);
+    return;
+  }
+  inter_operator(GenericOperator(p_operator));
+}
+
 // OPERATOR: INTEGER (result) = INTEGER oper INTEGER;
 void
 QLInterpreter::inter_intint_operator(BYTE p_operator)
@@ -1732,7 +2838,27 @@ QLInterpreter::Equal(MemObject* p_left,MemObject* p_right)
   return false;
 }
 
+// Integer value of a SWITCH selector, as Equal compares it to an integer
+bool
+QLInterpreter::SwitchInteger(MemObject* p_value,int& p_integer)
+{
+  switch(p_value->m_type)
+  {
+    case DTYPE_INTEGER: p_integer = p_value->m_value.v_integer;
+                        return true;
+    case DTYPE_STRING:  p_integer = _ttoi(*p_value->m_value.v_string);
+                        return true;
+    case DTYPE_BCD:     p_integer = p_value->m_value.v_floating->AsLong();
+                        return true;
+    case DTYPE_VARIANT: p_integer = p_value->m_value.v_variant->GetAsSLong();
+                        return true;
+  }
+  m_vm->Error(_T("Cannot be used as selector for a switch statement. Type: %d\n"),p_value->m_type);
+  return false;
+}
+
 // Binary operators '|' '&' and '~'
+// Integers are immutable values, so the result is always a new TOS
 void
 QLInterpreter::Inter_binary(BYTE p_operator)
 {
@@ -1743,21 +2869,18 @@ QLInterpreter::Inter_binary(BYTE p_operator)
   {
     case OP_BAND: // OPERATOR BINARY-AND on an INTEGER
                   CheckType(1,DTYPE_INTEGER);
-                  m_stack_pointer[0]->m_value.v_integer =
-                  m_stack_pointer[1]->m_value.v_integer & m_stack_pointer[0]->m_value.v_integer;
+                  SetInteger(m_stack_pointer[1]->m_value.v_integer & m_stack_pointer[0]->m_value.v_integer);
                   break;
     case OP_BOR:  // OPERATOR BINARY-OR on an INTEGER	
                   CheckType(1,DTYPE_INTEGER);
-                  m_stack_pointer[0]->m_value.v_integer =
-                  m_stack_pointer[1]->m_value.v_integer | m_stack_pointer[0]->m_value.v_integer;
+                  SetInteger(m_stack_pointer[1]->m_value.v_integer | m_stack_pointer[0]->m_value.v_integer);
                   break;
     case OP_XOR: 	// OPERATOR BINARY-EXCLUSIVE OR on an INTEGER
                   CheckType(1,DTYPE_INTEGER);
-                  m_stack_pointer[0]->m_value.v_integer = 
-                  m_stack_pointer[1]->m_value.v_integer ^ m_stack_pointer[0]->m_value.v_integer;
+                  SetInteger(m_stack_pointer[1]->m_value.v_integer ^ m_stack_pointer[0]->m_value.v_integer);
                   break;
     case OP_BNOT: // OPERATOR BINARY-NOT on an INTEGER
-                  m_stack_pointer[0]->m_value.v_integer = m_stack_pointer[0]->m_value.v_integer > 0 ? 0 : 1;
+                  SetInteger(m_stack_pointer[0]->m_value.v_integer > 0 ? 0 : 1);
                   break;
   }
 }
@@ -1770,13 +2893,13 @@ QLInterpreter::ArgumentReference(int n)
   if(n >= 0)
   {
     // Getting the number of arguments when calling this function/member
-    number = m_frame_pointer[SF_OFF_ARGUMENTS]->m_value.v_integer;
+    number = m_call->m_arguments;
     if(n && n >= number)
     {
       m_vm->Error(_T("Too few arguments in calling function/member"));
     }
     // Calculate stack offset for argument
-    number = STACKFRAME_SIZE + number - n - 1;
+    number = number - n - 1;
   }
   else
   {
@@ -1792,7 +2915,6 @@ QLInterpreter::ReserveSpace(int p_arguments)
   if(p_arguments > 0)
   {
     // member/function using local variables
-    CheckStack(p_arguments);
     while(--p_arguments >= 0)
     {
       --m_stack_pointer;
@@ -1815,7 +2937,7 @@ QLInterpreter::VectorRef()
   {
     m_vm->Error(_T("Array subscript out of bounds: %d"),index);
   }
-  m_stack_pointer[0] = array->GetEntry(index);
+  m_stack_pointer[0] = array->GetEntry(m_vm,index);
 }
 
 // Load a string element as in "string[index]"
@@ -1860,7 +2982,7 @@ QLInterpreter::VectorSet()
   {
     m_vm->Error(_T("Array subscript out of bounds: %d"),index);
   }
-  array->SetEntry(index,m_stack_pointer[0]);
+  array->SetEntry(m_vm,index,m_stack_pointer[0]);
 }
 
 // Set a string element as in "string[index] = value"
@@ -1883,6 +3005,53 @@ QLInterpreter::StringSet()
   SetInteger(cc);
 }
 
+// Load a map value as in "map[key]"
+// TOS    = key
+// TOS[1] = map
+// A key that is not in the map gives NIL
+// After this function a "POP 1" must be done
+void
+QLInterpreter::MapRef()
+{
+  Map*       map = m_stack_pointer[1]->m_value.v_map;
+  MemObject* key = m_stack_pointer[0];
+
+  if(!Map::IsKeyType(key->m_type))
+  {
+    m_vm->Error(_T("Bad datatype for a map key: %s"),GetTypename(key->m_type).GetString());
+  }
+  MemObject* value = map->Find(key);
+  m_stack_pointer[0] = value ? value : m_vm->GetNil();
+}
+
+// MapSet as in "map[key] = value"
+// TOS    = value
+// TOS[1] = key
+// TOS[2] = map
+// After this function a "POP 2" must be done
+void
+QLInterpreter::MapSet()
+{
+  if(m_trace && m_debugger)
+  {
+    m_debugger->PrintIndexedObject(m_stack_pointer[2],m_stack_pointer[1],m_stack_pointer[0]);
+  }
+
+  Map*       map = m_stack_pointer[2]->m_value.v_map;
+  MemObject* key = m_stack_pointer[1];
+
+  if(!Map::IsKeyType(key->m_type))
+  {
+    m_vm->Error(_T("Bad datatype for a map key: %s"),GetTypename(key->m_type).GetString());
+  }
+  // A new key is copied, so that changing the string does not change the map
+  if(map->Find(key) == nullptr)
+  {
+    key = m_vm->AllocMemObject(key);
+  }
+  map->Set(m_vm,key,m_stack_pointer[0]);
+}
+
 // Get data word from program counter
 int 
 QLInterpreter::GetWordOperand()
@@ -1892,15 +3061,42 @@ QLInterpreter::GetWordOperand()
   return ((*m_pc++ << 8) | b);
 }
 
+int
+QLInterpreter::GetLongOperand()
+{
+  int offset = ReadLong(m_pc);
+  m_pc += 4;
+  return offset;
+}
+
 // Send request to a method of an internal data type
 // e.g. DTYPE_DATABASE object gets an "Open" request
 void
-QLInterpreter::DoSendInternal(int p_offset)
+QLInterpreter::DoSendInternal(int p_offset,SendCache* p_cache)
 {
-  int     type =  m_stack_pointer[p_offset  ]->m_type;
-  CString name = *m_stack_pointer[p_offset-1]->m_value.v_string;
+  int         type = m_stack_pointer[p_offset]->m_type;
+  const void* key  = (const void*)(INT_PTR)type;
+  CString     name;
+  Method*     method = nullptr;
 
-  Method* method = m_vm->FindMethod(name,type);
+  SendEntry* entry = FindSendEntry(p_cache,key);
+  if(entry)
+  {
+    method = entry->m_method;
+  }
+  else
+  {
+    name   = *m_stack_pointer[p_offset-1]->m_value.v_string;
+    method = m_vm->FindSendMethod(type,SendSelector(p_cache,name),name);
+    if(method)
+    {
+      entry = NewSendEntry(p_cache,key);
+      if(entry)
+      {
+        entry->m_method = method;
+      }
+    }
+  }
   if(method)
   {
     // Call the internal method
@@ -1914,6 +3110,120 @@ QLInterpreter::DoSendInternal(int p_offset)
   }
 }
 
+// Find the entry of the inline cache for a class or datatype
+SendEntry*
+QLInterpreter::FindSendEntry(SendCache* p_cache,const void* p_key)
+{
+  if(p_cache == nullptr)
+  {
+    return nullptr;
+  }
+  if(p_cache->m_epoch != m_vm->GetSendEpoch())
+  {
+    // Classes or methods have changed since this send was cached
+    p_cache->m_epoch = m_vm->GetSendEpoch();
+    p_cache->m_used  = 0;
+    return nullptr;
+  }
+  for(int ind = 0; ind < p_cache->m_used; ++ind)
+  {
+    if(p_cache->m_entries[ind].m_key == p_key)
+    {
+      return &p_cache->m_entries[ind];
+    }
+  }
+  return nullptr;
+}
+
+// Find the member function through the inline cache of the send
+MemObject*
+QLInterpreter::FindCachedMember(SendCache* p_cache,Class* p_class,CString* p_name,CString& p_selector)
+{
+  SendEntry* entry = FindSendEntry(p_cache,p_class);
+  if(entry)
+  {
+    return entry->m_member;
+  }
+  p_selector = *p_name;
+  if(p_selector.IsEmpty())
+  {
+    return nullptr;
+  }
+  MemObject* member = m_vm->FindSendMember(p_class,SendSelector(p_cache,p_selector),p_selector);
+  if(member && (member->m_type == DTYPE_SCRIPT || member->m_type == DTYPE_INTERNAL))
+  {
+    entry = NewSendEntry(p_cache,p_class);
+    if(entry)
+    {
+      entry->m_member = member;
+    }
+  }
+  return member;
+}
+
+// Find the member function in the vtable of the class.
+// The slot of the selector is found once for each send site
+MemObject*
+QLInterpreter::FindVirtualMember(SendCache* p_cache,Class* p_class,CString* p_name)
+{
+  if(p_cache == nullptr)
+  {
+    return nullptr;
+  }
+  if(p_cache->m_epoch != m_vm->GetSendEpoch())
+  {
+    // Classes have changed, and so have the vtables
+    p_cache->m_epoch = m_vm->GetSendEpoch();
+    p_cache->m_used  = 0;
+    p_cache->m_slot  = 0;
+  }
+  if(p_cache->m_slot == 0)
+  {
+    CString selector(*p_name);
+    int slot = p_class->FindSlot(SendSelector(p_cache,selector));
+    p_cache->m_slot = (slot >= 0) ? slot + 1 : -1;
+  }
+  if(p_cache->m_slot < 0)
+  {
+    // Not in the vtable. Use the inline cache
+    return nullptr;
+  }
+  return p_class->GetVirtual(p_cache->m_slot - 1,p_cache->m_selector);
+}
+
+// Take a new entry in the inline cache.
+// A megamorphic send keeps replacing the last entry
+SendEntry*
+QLInterpreter::NewSendEntry(SendCache* p_cache,const void* p_key)
+{
+  if(p_cache == nullptr)
+  {
+    return nullptr;
+  }
+  int ind = (p_cache->m_used < SENDCACHE_WAYS) ? p_cache->m_used++ : SENDCACHE_WAYS - 1;
+
+  SendEntry* entry = &p_cache->m_entries[ind];
+  entry->m_key    = p_key;
+  entry->m_member = nullptr;
+  entry->m_method = nullptr;
+  return entry;
+}
+
+// Interned selector of a send. Interned only once for each send site
+int
+QLInterpreter::SendSelector(SendCache* p_cache,CString& p_selector)
+{
+  if(p_cache == nullptr)
+  {
+    return m_vm->InternSelector(p_selector);
+  }
+  if(p_cache->m_selector == 0)
+  {
+    p_cache->m_selector = m_vm->InternSelector(p_selector);
+  }
+  return p_cache->m_selector;
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 // RUNTIME ERROR PRINTING
@@ -1939,6 +3249,8 @@ static TCHAR *type_names[] =
   ,_T("SCRIPT")
   ,_T("INTERNAL")
   ,_T("EXTERNAL")
+  ,_T("STREAM")
+  ,_T("MAP")
 };
 
 // typename - get the name of a type 
@@ -2051,51 +3363,66 @@ QLInterpreter::CheckStack(int p_size)
   }
 }
 
+// Stack for a call of a function (or the init code): the deepest stack
+// the verifier found. Pushes within the function are not checked again.
+// The verifier runs now if the bytecode is new
+int
+QLInterpreter::StackNeeded(Function* p_function)
+{
+  int maxstack = p_function ? p_function->GetMaxStack() : -1;
+  if(maxstack < 0)
+  {
+    maxstack = m_vm->Verify(p_function);
+  }
+  return maxstack;
+}
+
 MemObject**
 QLInterpreter::PushInteger(int p_num)
 {
-  MemObject* object = m_vm->AllocMemObject(DTYPE_INTEGER);
-  object->m_value.v_integer = p_num;
-  *(--m_stack_pointer) = object;
+  *(--m_stack_pointer) = m_vm->GetInteger(p_num);
   return m_stack_pointer;
 }
 
-MemObject**
-QLInterpreter::PushFunction(Function* p_func)
+// A call records where to return to on the call stack
+// The frame pointer of the called function is the current stack pointer
+void
+QLInterpreter::PushFrame(Function* p_function,Object* p_object,int p_arguments)
 {
-  MemObject* object = m_vm->AllocMemObject(DTYPE_NIL);
-  object->m_value.v_script = p_func;
-  object->m_type   = DTYPE_SCRIPT;
-  object->m_flags |= FLAG_REFERENCE;
-  *(--m_stack_pointer) = object;
-  return m_stack_pointer;
+  if(m_call == m_call_top)
+  {
+    StackOverflow();
+  }
+  ++m_call;
+  m_call->m_function  = p_function;
+  m_call->m_object    = p_object;
+  m_call->m_frame     = m_frame_pointer;
+  m_call->m_pc        = (int)(m_pc - m_code);
+  m_call->m_arguments = p_arguments;
 }
 
-MemObject**
-QLInterpreter::PushObject(Object* p_object)
+// The dummy frame of the entry function of Interpret
+// holds the arguments of Call(), or none at all
+void
+QLInterpreter::PushEntryFrame()
 {
-  MemObject* object = m_vm->AllocMemObject(DTYPE_NIL);
-  object->m_value.v_object = p_object;
-  object->m_type = DTYPE_OBJECT;
-  object->m_flags |= FLAG_REFERENCE;
-  *(--m_stack_pointer) = object;
-  return m_stack_pointer;
+  PushFrame(nullptr,nullptr,m_entryArguments);
+  m_entryArguments = 0;
 }
 
 // Set stack[offset] to NIL
 void
 QLInterpreter::SetNil(int p_offset)
 {
-  m_stack_pointer[p_offset] = m_vm->AllocMemObject(DTYPE_NIL);
+  m_stack_pointer[p_offset] = m_vm->GetNil();
 }
 
 // Set TOS to an INTEGER
+// Small integers are shared immediates: no allocation
 void
 QLInterpreter::SetInteger(int p_value)
 {
-  MemObject* object = m_vm->AllocMemObject(DTYPE_INTEGER);
-  object->m_value.v_integer = p_value;
-  m_stack_pointer[0] = object;
+  m_stack_pointer[0] = m_vm->GetInteger(p_value);
 }
 
 // Set TOS to a STRING
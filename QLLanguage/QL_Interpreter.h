@@ -11,22 +11,26 @@
 class QLVirtualMachine;
 class QLDebugger;
 class Function;
+class Class;
+typedef struct _instruction Instruction;
+typedef struct _reginstruction RegInstruction;
+typedef struct _registercode RegisterCode;
+typedef struct _jitcode JitCode;
 
 using SQLComponents::SQLVariant;
 
-// EACH STACKFRAME CONTAINS
-// 1) Script function to be run
-// 2) Number of arguments on the stack
-// 3) Stack Frame pointer (stack offset)
-// 4) Program counter (bytecode offset)
-#define STACKFRAME_SIZE 5
-
-// STACKFRAME CONTENTS
-#define SF_OFF_OBJECT     4
-#define SF_OFF_FUNCTION   3
-#define SF_OFF_ARGUMENTS  2
-#define SF_OFF_FRAMEPNTR  1
-#define SF_OFF_PRGCOUNTER 0
+// EACH CALL HAS A FRAME ON THE CALL STACK, APART FROM THE STACK OF VALUES
+// The frame pointer of the called function is the stack pointer at the call:
+// the arguments are above it and the local variables below it
+typedef struct _callframe
+{
+  Function*     m_function;   // Script function to return to
+  Object*       m_object;     // Object to return to
+  MemObject**   m_frame;      // Frame pointer to return to
+  int           m_pc;         // Program counter to return to (bytecode offset)
+  int           m_arguments;  // Number of arguments of the call
+}
+CallFrame;
 
 class QLInterpreter 
 {
@@ -37,9 +41,24 @@ public:
   // Setting tracing off code execution on-off
   void              SetTracing(bool p_trace);
   void              SetStacksize(int p_size);
+  // Select the pre-decoded (threaded) code engine
+  void              SetThreaded(bool p_threaded);
+  // Select the register code engine
+  void              SetRegisters(bool p_registers);
+  // Compile hot functions of the register code engine to machine code
+  void              SetJit(bool p_jit);
+  // Engine settings, for the tasks this interpreter starts
+  bool              GetThreaded();
+  bool              GetRegisters();
+  bool              GetJit();
 
   // Execute a bytecode function
   int               Execute(CString p_name);
+  // Prepare the stack and run the global init code
+  void              Initialize();
+  // Calling a script function with arguments from outside the interpreter
+  MemObject**       PushArgument();
+  MemObject*        Call(Function* p_function,int p_arguments);
   // interpret - interpret bytecode instructions
   int               Interpret(Object* p_object,Function* p_function);
 
@@ -83,10 +102,33 @@ private:
   void        StringRef();
   // Setting char x in string "string[i] = x"
   void        StringSet();
+  // x = map[key], getting x for the key
+  void        MapRef();
+  // map[key] = x, setting the key to x
+  void        MapSet();
   // Get data word operand
   int         GetWordOperand();
+  int         GetLongOperand();
+  // Threaded code engine, with and without tracing
+  template<bool TRACE>
+  int         InterpretThreaded(Object* p_object,Function* p_function);
+  template<bool TRACE>
+  void        PopOperands(int& p_pop);
+  Instruction* GetThreadedCode(Function* p_function);
+  // Register code engine
+  int         InterpretRegisters(Object* p_object,Function* p_function);
+  MemObject*  RegisterOperator (const RegisterCode* p_code,const RegInstruction* p_ins);
+  MemObject*  RegisterIncrement(const RegInstruction* p_ins);
+  MemObject*  GetRegister(const RegisterCode* p_code,int p_register);
+  JitCode*    GetNativeCode(RegisterCode* p_code);
   // Send request to internal object
-  void        DoSendInternal(int p_offset);
+  void        DoSendInternal(int p_offset,SendCache* p_cache = nullptr);
+  // Inline caches of the OP_SEND instructions
+  SendEntry*  FindSendEntry(SendCache* p_cache,const void* p_key);
+  MemObject*  FindCachedMember (SendCache* p_cache,Class* p_class,CString* p_name,CString& p_selector);
+  MemObject*  FindVirtualMember(SendCache* p_cache,Class* p_class,CString* p_name);
+  SendEntry*  NewSendEntry (SendCache* p_cache,const void* p_key);
+  int         SendSelector (SendCache* p_cache,CString& p_selector);
   // Stack offset of an argument reference (this-pointer, member arguments)
   int         ArgumentReference(int n);
   // Reserve stack space for local variables
@@ -96,23 +138,29 @@ private:
   void        AllocateStack();
   void        DestroyStack();
   void        CheckStack(int p_size);
+  int         StackNeeded(Function* p_function);
   void        PopStack(int p_num);
   void        StackOverflow();
   MemObject** PushInteger(int p_num);
-  MemObject** PushFunction(Function* p_func);
-  MemObject** PushObject (Object* p_object);
+  void        PushFrame(Function* p_function,Object* p_object,int p_arguments);
+  void        PushEntryFrame();
 
   int         Inter_call  (int& numArguments,bool& newline,int& pop,Function*& calFunction,Function*& runFunction,Object*& runObject);
   void        Inter_return(int& numArguments,MemObject*& val,Object*& runObject,int& pcoff,Function*& runFunction);
-  void        Inter_send  (int& numArguments,bool& newline,Object*& calObject,Class*& vClass,CString& selector,MemObject*& val,int& pop,Function*& calFunction,Object*& runObject,Function*& runFunction);
+  void        Inter_send  (int& numArguments,bool& newline,Object*& calObject,Class*& vClass,CString& selector,MemObject*& val,int& pop,Function*& calFunction,Object*& runObject,Function*& runFunction,bool p_virtual);
   void        Inter_vload();
   void        Inter_vstore();
   void        Inter_shiftLeft();
   void        Inter_shiftRight();
-  void        Inter_literal(MemObject*& val,Function*& runFunction);
+  void        Inter_literal(MemObject*& val,Function*& runFunction,int p_index);
+  void        Inter_wide(MemObject*& val,Function*& runFunction,Object*& runObject);
   void        Inter_duplicate2();
   void        Inter_Destroy(MemObject*& val,Function*& calFunction,Object*& calObject,Function*& runFunction,Object*& runObject);
   void        Inter_switch(int& numArguments,MemObject*& val,Function*& runFunction,int& pcoff);
+  void        Inter_denseSwitch();
+  void        Inter_hashSwitch(Function* runFunction);
+  void        Inter_append(int p_temp);
+  MemObject*  LoadTemporary(int p_temp);
 
   // Unary operators
   void        Inter_increment();
@@ -120,6 +168,7 @@ private:
 
   // Do "operand operator operand"
   void        inter_operator       (BYTE p_operator);
+  void        inter_typed_operator (BYTE p_operator);
   void        inter_intint_operator(BYTE p_operator);
   void        inter_intbcd_operator(BYTE p_operator);
   void        inter_intstr_operator(BYTE p_operator);
@@ -138,6 +187,8 @@ private:
   void        inter_varvar_operator(BYTE p_operator);
   // Equal comparison for the SWITCH statement
   bool        Equal(MemObject* p_left,MemObject* p_right);
+  // Integer value of a SWITCH selector, as Equal compares it to an integer
+  bool        SwitchInteger(MemObject* p_value,int& p_integer);
   // Binary operators '|' '&' and '~'
   void        Inter_binary(BYTE p_operator);
 
@@ -157,6 +208,9 @@ private:
   QLVirtualMachine* m_vm;             // Connected Virtual Machine
   QLDebugger*       m_debugger;       // Connected debugger
   bool              m_trace;          // variable to control tracing
+  bool              m_threaded { false }; // Use the threaded code engine
+  bool              m_registers { false };// Use the register code engine
+  bool              m_jit { false };      // Compile hot register code
   BYTE*             m_code;           // currently executing code vector
   BYTE*             m_pc;             // the program counter
 
@@ -166,6 +220,10 @@ private:
   MemObject**       m_stack_top;      // _stack_base + _stacksize * sizeof(MemObject)
   MemObject**       m_stack_pointer;  // current stack pointer
   MemObject**       m_frame_pointer;  // the frame pointer
+  CallFrame*        m_call_base { nullptr }; // The call stack
+  CallFrame*        m_call_top  { nullptr }; // Last entry of the call stack
+  CallFrame*        m_call      { nullptr }; // Frame of the running function
+  int               m_entryArguments { 0 };  // Arguments of Call() on the stack
 
   // External testing system
   int               m_testIterations { 0 };   // Number of iterations of latest test
@@ -173,6 +231,19 @@ private:
   int               m_testRunning    { 0 };   // Do one more iteration? (0 = NO, 1 = YES)
 };
 
+// Loading a local variable shares its value with the rest of the program
+// so a string owned by the local (see OP_TAPPEND) cannot be appended in place anymore
+inline MemObject*
+QLInterpreter::LoadTemporary(int p_temp)
+{
+  MemObject* object = m_frame_pointer[-p_temp - 1];
+  if(object->m_flags & FLAG_OWNED)
+  {
+    object->m_flags &= ~FLAG_OWNED;
+  }
+  return object;
+}
+
 inline MemObject**
 QLInterpreter::GetStackPointer()
 {
@@ -189,4 +260,40 @@ inline void
 QLInterpreter::SetStacksize(int p_size)
 {
   m_stacksize = p_size;
-}
\ No newline at end of file
+}
+
+inline void
+QLInterpreter::SetThreaded(bool p_threaded)
+{
+  m_threaded = p_threaded;
+}
+
+inline void
+QLInterpreter::SetRegisters(bool p_registers)
+{
+  m_registers = p_registers;
+}
+
+inline void
+QLInterpreter::SetJit(bool p_jit)
+{
+  m_jit = p_jit;
+}
+
+inline bool
+QLInterpreter::GetThreaded()
+{
+  return m_threaded;
+}
+
+inline bool
+QLInterpreter::GetRegisters()
+{
+  return m_registers;
+}
+
+inline bool
+QLInterpreter::GetJit()
+{
+  return m_jit;
+}
@@ -0,0 +1,561 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language baseline compiler of register code to x64 machine code
+// ir. W.E. Huisman (c) 2018
+//
+// Every register instruction with a template becomes a fixed sequence
+// of machine code: moves of locals, arguments and constants, integer
+// arithmetic, compares and branches. The templates only handle the
+// integer case and never call back into C++. Whenever an operand is
+// not an integer, a result is no immediate integer (or its page of the
+// wide immediates is not made yet) or the instruction has no template
+// at all, the machine code returns the index of the
+// instruction to the register engine. The engine runs that one
+// instruction (with all datatypes, allocation and errors) and enters
+// the machine code again at the next one.
+//
+// The machine code only uses the registers rax, rcx, rdx and r8-r11,
+// which need no saving in any x64 calling convention:
+//   r8  the frame pointer
+//   r9  the constants of the register code
+//   r10 the immediate integers of the VM
+//   r11 the context, which holds the stack pointer
+// Nothing is allocated in the machine code, so the garbage collector
+// cannot run while the stack pointer is only in the context.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QL_Language.h"
+#include "QL_MemObject.h"
+#include "QL_Opcodes.h"
+#include "QL_Jit.h"
+#include <stddef.h>
+#include <string.h>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static char THIS_FILE[] = __FILE__;
+#endif
+
+// x64 registers
+#define JIT_RAX   0
+#define JIT_RCX   1
+#define JIT_RDX   2
+#define JIT_R8    8
+#define JIT_R9    9
+#define JIT_R10   10
+#define JIT_R11   11
+
+// Condition codes of the jumps and setcc
+#define JIT_ALWAYS  -1
+#define JIT_E       0x4
+#define JIT_NE      0x5
+#define JIT_BE      0x6
+#define JIT_A       0x7
+#define JIT_L       0xC
+#define JIT_GE      0xD
+#define JIT_LE      0xE
+#define JIT_G       0xF
+
+// Fields of the context
+#define JIT_STACK   ((int) offsetof(JitContext,m_stack))
+#define JIT_ARGS    ((int) offsetof(JitContext,m_arguments))
+#define JIT_PAGES   ((int) offsetof(JitContext,m_pages))
+
+// Page of a wide immediate is (value - IMMEDIATE_WIDE_MIN) >> JIT_PAGE_SHIFT
+#define JIT_PAGE_SHIFT  10
+static_assert((1 << JIT_PAGE_SHIFT) == IMMEDIATE_PAGE,"Shift does not match the immediate pages");
+
+// Fields of a MemObject
+#define JIT_TYPE    ((int) offsetof(MemObject,m_type))
+#define JIT_FLAGS   ((int) offsetof(MemObject,m_flags))
+#define JIT_VALUE   ((int) offsetof(MemObject,m_value))
+
+// Condition code of an integer compare, or -1 for other operators
+static int
+CompareCondition(int p_operator)
+{
+  switch(p_operator)
+  {
+    case OP_LT: case OP_LTII: return JIT_L;
+    case OP_LE: case OP_LEII: return JIT_LE;
+    case OP_EQ: case OP_EQII: return JIT_E;
+    case OP_NE: case OP_NEII: return JIT_NE;
+    case OP_GE: case OP_GEII: return JIT_GE;
+    case OP_GT: case OP_GTII: return JIT_G;
+  }
+  return -1;
+}
+
+// Integer arithmetic with a template
+static bool
+ArithmeticOperator(int p_operator)
+{
+  switch(p_operator)
+  {
+    case OP_ADD: case OP_ADDII:
+    case OP_SUB: case OP_SUBII:
+    case OP_MUL: case OP_MULII: return true;
+  }
+  return false;
+}
+
+QLJit::QLJit()
+{
+}
+
+JitCode*
+QLJit::Compile(const RegisterCode* p_code)
+{
+#if defined(_M_X64)
+  int count = (int) p_code->m_code.size();
+  m_offsets.assign(count,0);
+
+  // Entry: load the context and jump to instruction p_index
+  Memory(0x8B,JIT_R8, JIT_RCX,offsetof(JitContext,m_frame),     true);
+  Memory(0x8B,JIT_R9, JIT_RCX,offsetof(JitContext,m_constants), true);
+  Memory(0x8B,JIT_R10,JIT_RCX,offsetof(JitContext,m_immediates),true);
+  Byte(0x49); Byte(0x89); Byte(0xCB); // mov r11,rcx
+  Byte(0x89); Byte(0xD0);           // mov eax,edx
+  Byte(0x48); Byte(0xBA);           // mov rdx,labels
+  int table = (int) m_buffer.size();
+  Int64(0);
+  Byte(0xFF); Byte(0x24); Byte(0xC2); // jmp [rdx + rax * 8]
+
+  for(int index = 0;index < count; ++index)
+  {
+    m_offsets[index] = (int) m_buffer.size();
+    if(!CompileInstruction(p_code->m_code[index],index))
+    {
+      Exit(index);
+    }
+  }
+
+  // Jumps back to the register engine share one exit per instruction
+  std::vector<int> exits(count,-1);
+  for(auto& fixup : m_exits)
+  {
+    if(exits[fixup.m_index] < 0)
+    {
+      exits[fixup.m_index] = (int) m_buffer.size();
+      Exit(fixup.m_index);
+    }
+    WriteLong(&m_buffer[fixup.m_position],exits[fixup.m_index] - (fixup.m_position + 4));
+  }
+  for(auto& fixup : m_jumps)
+  {
+    WriteLong(&m_buffer[fixup.m_position],m_offsets[fixup.m_index] - (fixup.m_position + 4));
+  }
+
+  BYTE* memory = (BYTE*) VirtualAlloc(NULL,m_buffer.size(),MEM_COMMIT | MEM_RESERVE,PAGE_READWRITE);
+  if(memory == nullptr)
+  {
+    return nullptr;
+  }
+  JitCode* result  = new JitCode();
+  result->m_memory = memory;
+  result->m_size   = m_buffer.size();
+  result->m_entry  = (JitEntry) memory;
+  result->m_labels.resize(count);
+  for(int index = 0;index < count; ++index)
+  {
+    result->m_labels[index] = memory + m_offsets[index];
+  }
+  BYTE** labels = result->m_labels.data();
+  memcpy(&m_buffer[table],&labels,sizeof(BYTE**));
+  memcpy(memory,m_buffer.data(),m_buffer.size());
+
+  // Write XOR execute
+  DWORD protection = 0;
+  VirtualProtect(memory,result->m_size,PAGE_EXECUTE_READ,&protection);
+  FlushInstructionCache(GetCurrentProcess(),memory,result->m_size);
+  return result;
+#else
+  // No templates for this processor: the register engine runs everything
+  UNREFERENCED_PARAMETER(p_code);
+  return nullptr;
+#endif
+}
+
+void
+QLJit::Release(JitCode* p_code)
+{
+  if(p_code)
+  {
+    VirtualFree(p_code->m_memory,0,MEM_RELEASE);
+    delete p_code;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// TEMPLATES
+//
+//////////////////////////////////////////////////////////////////////////
+
+bool
+QLJit::CompileInstruction(const RegInstruction& p_ins,int p_index)
+{
+  switch(p_ins.m_opcode)
+  {
+    case RG_MOVE:   // Loading a local variable shares its value
+                    LoadSource(JIT_RAX,p_ins.m_left);
+                    {
+                      ShortImmediate(0,JIT_RAX,JIT_FLAGS,FLAG_OWNED);
+                      int shared = JumpShort(JIT_E);
+                      ShortImmediate(4,JIT_RAX,JIT_FLAGS,~FLAG_OWNED);
+                      PatchShort(shared);
+                    }
+                    StoreTarget(p_ins.m_target);
+                    SetStack(p_ins.m_depth);
+                    return true;
+    case RG_ALOAD:  if(p_ins.m_operand < 0)
+                    {
+                      return false;
+                    }
+                    CompileArgument(p_ins,p_index,false);
+                    return true;
+    case RG_OPER:   if(CompareCondition(p_ins.m_extra) < 0 && !ArithmeticOperator(p_ins.m_extra))
+                    {
+                      return false;
+                    }
+                    CompileOperator(p_ins,p_index,false);
+                    return true;
+    case RG_CBRT:   // Fall through
+    case RG_CBRF:   if(CompareCondition(p_ins.m_extra) < 0)
+                    {
+                      return false;
+                    }
+                    CompileOperator(p_ins,p_index,true);
+                    return true;
+    case RG_INC:    // Fall through
+    case RG_DEC:    CompileIncrement(p_ins,p_index);
+                    return true;
+    case OP_ASTORE: if(p_ins.m_operand < 0)
+                    {
+                      return false;
+                    }
+                    CompileArgument(p_ins,p_index,true);
+                    return true;
+    case OP_BR:     Jump(JIT_ALWAYS,p_ins.m_operand);
+                    return true;
+    case OP_BRT:    CompileTruth(p_ins,true);
+                    return true;
+    case OP_BRF:    CompileTruth(p_ins,false);
+                    return true;
+    case OP_NIL:    Memory(0x8B,JIT_RDX,JIT_R11,JIT_STACK,true);  // mov rdx,stack pointer
+                    Memory(0x89,JIT_R10,JIT_RDX,0,true);  // TOS = immediates[0]
+                    return true;
+    case OP_TLOADA: LoadSource(JIT_RAX,p_ins.m_operand + 1);
+                    Memory(0x8B,JIT_RDX,JIT_R11,JIT_STACK,true);
+                    Memory(0x89,JIT_RAX,JIT_RDX,0,true);
+                    return true;
+  }
+  return false;
+}
+
+// Integer operator of two registers or constants
+// The result of a compare is always an immediate integer
+void
+QLJit::CompileOperator(const RegInstruction& p_ins,int p_index,bool p_branch)
+{
+  int condition = CompareCondition(p_ins.m_extra);
+
+  LoadSource(JIT_RAX,p_ins.m_left);
+  LoadSource(JIT_RCX,p_ins.m_right);
+  CheckInteger(JIT_RAX,p_index);
+  CheckInteger(JIT_RCX,p_index);
+  Memory(0x8B,JIT_RAX,JIT_RAX,JIT_VALUE,false);   // mov eax,[rax].v_integer
+  Memory(0x8B,JIT_RCX,JIT_RCX,JIT_VALUE,false);   // mov ecx,[rcx].v_integer
+  if(condition >= 0)
+  {
+    Byte(0x39); Byte(0xC8);                       // cmp eax,ecx
+    Byte(0x0F); Byte(0x90 + condition); Byte(0xC0); // setcc al
+    Byte(0x0F); Byte(0xB6); Byte(0xC0);           // movzx eax,al
+    Byte(0x89); Byte(0xC1);                       // mov ecx,eax
+    MakeBoolean();
+  }
+  else
+  {
+    switch(p_ins.m_extra)
+    {
+      case OP_ADD: case OP_ADDII: Byte(0x01); Byte(0xC8);             break; // add  eax,ecx
+      case OP_SUB: case OP_SUBII: Byte(0x29); Byte(0xC8);             break; // sub  eax,ecx
+      case OP_MUL: case OP_MULII: Byte(0x0F); Byte(0xAF); Byte(0xC1); break; // imul eax,ecx
+    }
+    MakeInteger(p_index);
+  }
+  StoreTarget(p_ins.m_target);
+  SetStack(p_ins.m_depth);
+  if(p_branch)
+  {
+    Byte(0x85); Byte(0xC9);                       // test ecx,ecx
+    Jump(p_ins.m_opcode == RG_CBRT ? JIT_NE : JIT_E,p_ins.m_operand);
+  }
+}
+
+void
+QLJit::CompileIncrement(const RegInstruction& p_ins,int p_index)
+{
+  LoadSource(JIT_RAX,p_ins.m_target);
+  CheckInteger(JIT_RAX,p_index);
+  Memory(0x8B,JIT_RAX,JIT_RAX,JIT_VALUE,false);
+  Byte(0x83); Byte(0xC0); Byte(p_ins.m_opcode == RG_INC ? 1 : -1);  // add eax,+/-1
+  MakeInteger(p_index);
+  StoreTarget(p_ins.m_target);
+  SetStack(p_ins.m_depth);
+}
+
+// Argument n is frame_pointer[arguments - n - 1]
+// Too few arguments is an error of the register engine
+void
+QLJit::CompileArgument(const RegInstruction& p_ins,int p_index,bool p_store)
+{
+  int number = p_ins.m_operand;
+  int disp   = (-number - 1) * (int) sizeof(MemObject*);
+
+  Memory(0x8B,JIT_RAX,JIT_R11,JIT_ARGS,false);    // eax = number of arguments
+  if(number > 0)
+  {
+    Byte(0x3D); Int32(number);                    // cmp eax,number
+    JumpExit(JIT_LE,p_index);
+  }
+  if(p_store)
+  {
+    Memory(0x8B,JIT_RDX,JIT_R11,JIT_STACK,true);  // rdx = TOS
+    Memory(0x8B,JIT_RDX,JIT_RDX,0,true);
+    Byte(0x49); Byte(0x89); Byte(0x94); Byte(0xC0); Int32(disp);  // mov [r8 + rax * 8 + disp],rdx
+  }
+  else
+  {
+    Byte(0x49); Byte(0x8B); Byte(0x84); Byte(0xC0); Int32(disp);  // mov rax,[r8 + rax * 8 + disp]
+    StoreTarget(p_ins.m_target);
+    SetStack(p_ins.m_depth);
+  }
+}
+
+// Branch on the TOS: NIL and integer zero are false
+void
+QLJit::CompileTruth(const RegInstruction& p_ins,bool p_jumpOnTrue)
+{
+  Memory(0x8B,JIT_RAX,JIT_R11,JIT_STACK,true);
+  Memory(0x8B,JIT_RAX,JIT_RAX,0,true);
+  ShortImmediate(7,JIT_RAX,JIT_TYPE,DTYPE_NIL);
+  if(p_jumpOnTrue)
+  {
+    int nil = JumpShort(JIT_E);
+    ShortImmediate(7,JIT_RAX,JIT_TYPE,DTYPE_INTEGER);
+    Jump(JIT_NE,p_ins.m_operand);
+    Memory(0x83,7,JIT_RAX,JIT_VALUE,false); Byte(0); // cmp dword [rax].v_integer,0
+    Jump(JIT_NE,p_ins.m_operand);
+    PatchShort(nil);
+  }
+  else
+  {
+    Jump(JIT_E,p_ins.m_operand);
+    ShortImmediate(7,JIT_RAX,JIT_TYPE,DTYPE_INTEGER);
+    int other = JumpShort(JIT_NE);
+    Memory(0x83,7,JIT_RAX,JIT_VALUE,false); Byte(0);
+    Jump(JIT_E,p_ins.m_operand);
+    PatchShort(other);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// PARTS OF THE TEMPLATES
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Register (frame_pointer[-r]) or constant (constants[-r]) into p_reg
+void
+QLJit::LoadSource(int p_reg,int p_source)
+{
+  if(p_source > 0)
+  {
+    Memory(0x8B,p_reg,JIT_R8,-p_source * (int) sizeof(MemObject*),true);
+  }
+  else
+  {
+    Memory(0x8B,p_reg,JIT_R9,-p_source * (int) sizeof(MemObject*),true);
+  }
+}
+
+// Register p_target = rax
+void
+QLJit::StoreTarget(int p_target)
+{
+  Memory(0x89,JIT_RAX,JIT_R8,-p_target * (int) sizeof(MemObject*),true);
+}
+
+// Stack pointer = frame_pointer - p_depth
+void
+QLJit::SetStack(int p_depth)
+{
+  Memory(0x8D,JIT_RDX,JIT_R8,-p_depth * (int) sizeof(MemObject*),true);
+  Memory(0x89,JIT_RDX,JIT_R11,JIT_STACK,true);
+}
+
+void
+QLJit::CheckInteger(int p_reg,int p_index)
+{
+  ShortImmediate(7,p_reg,JIT_TYPE,DTYPE_INTEGER);
+  JumpExit(JIT_NE,p_index);
+}
+
+// The integer in eax becomes its immediate object in rax: from the
+// table of the VM, or from a page of the wide immediates that is made.
+// Others are made by the register engine (a new page or the heap)
+void
+QLJit::MakeInteger(int p_index)
+{
+  Memory(0x8D,JIT_RDX,JIT_RAX,-IMMEDIATE_MIN,false);  // lea edx,[rax - IMMEDIATE_MIN]
+  Byte(0x81); Byte(0xFA); Int32(IMMEDIATE_MAX - IMMEDIATE_MIN); // cmp edx,count - 1
+  int wide = JumpShort(JIT_A);
+  Immediate();
+  int done = JumpShort(JIT_ALWAYS);
+
+  PatchShort(wide);
+  Memory(0x8D,JIT_RDX,JIT_RAX,-IMMEDIATE_WIDE_MIN,false);  // lea edx,[rax - IMMEDIATE_WIDE_MIN]
+  Byte(0x81); Byte(0xFA); Int32(IMMEDIATE_WIDE_MAX - IMMEDIATE_WIDE_MIN); // cmp edx,count - 1
+  JumpExit(JIT_A,p_index);
+  Byte(0x89); Byte(0xD0);                             // mov eax,edx
+  Byte(0x25); Int32(IMMEDIATE_PAGE - 1);              // and eax,page - 1
+  Byte(0xC1); Byte(0xEA); Byte(JIT_PAGE_SHIFT);       // shr edx,shift
+  Byte(0xC1); Byte(0xE2); Byte(3);                    // shl edx,3
+  Memory(0x03,JIT_RDX,JIT_R11,JIT_PAGES,true);        // add rdx,[r11].m_pages
+  Byte(0x48); Byte(0x8B); Byte(0x12);                 // mov rdx,[rdx]
+  Byte(0x48); Byte(0x85); Byte(0xD2);                 // test rdx,rdx
+  JumpExit(JIT_E,p_index);
+  Byte(0x48); Byte(0x69); Byte(0xC0); Int32((int) sizeof(MemObject)); // imul rax,rax,size
+  Byte(0x48); Byte(0x01); Byte(0xD0);                 // add rax,rdx
+  PatchShort(done);
+}
+
+// Zero or one in eax
+void
+QLJit::MakeBoolean()
+{
+  Memory(0x8D,JIT_RDX,JIT_RAX,-IMMEDIATE_MIN,false);
+  Immediate();
+}
+
+// rax = immediates[edx + 1], behind NIL
+void
+QLJit::Immediate()
+{
+  Byte(0x48); Byte(0x69); Byte(0xD2); Int32((int) sizeof(MemObject));   // imul rdx,rdx,size
+  Byte(0x49); Byte(0x8D); Byte(0x84); Byte(0x12); Int32((int) sizeof(MemObject)); // lea rax,[r10 + rdx + size]
+}
+
+// Return to the register engine at instruction p_index
+void
+QLJit::Exit(int p_index)
+{
+  Byte(0xB8); Int32(p_index);   // mov eax,index
+  Byte(0xC3);                   // ret
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// INSTRUCTION ENCODING
+//
+//////////////////////////////////////////////////////////////////////////
+
+void
+QLJit::Byte(int p_byte)
+{
+  m_buffer.push_back((BYTE) p_byte);
+}
+
+void
+QLJit::Int32(int p_value)
+{
+  BYTE bytes[4];
+  WriteLong(bytes,p_value);
+  m_buffer.insert(m_buffer.end(),bytes,bytes + 4);
+}
+
+void
+QLJit::Int64(INT64 p_value)
+{
+  Int32((int) p_value);
+  Int32((int)(p_value >> 32));
+}
+
+// Opcode with a [base + disp32] operand. p_reg is a register or the
+// extension of a group opcode. p_wide makes it a 64 bits operation
+void
+QLJit::Memory(int p_opcode,int p_reg,int p_base,int p_disp,bool p_wide)
+{
+  int rex = (p_wide ? 8 : 0) | (p_reg >= 8 ? 4 : 0) | (p_base >= 8 ? 1 : 0);
+  if(rex)
+  {
+    Byte(0x40 | rex);
+  }
+  Byte(p_opcode);
+  Byte(0x80 | ((p_reg & 7) << 3) | (p_base & 7));
+  Int32(p_disp);
+}
+
+// Test (0), and (4) or compare (7) of a shortint field with a value
+// A shortint is a byte or a word, depending on the character set
+void
+QLJit::ShortImmediate(int p_group,int p_base,int p_disp,int p_value)
+{
+  bool test = (p_group == 0);
+  if(sizeof(shortint) == 1)
+  {
+    Memory(test ? 0xF6 : 0x80,p_group,p_base,p_disp,false);
+    Byte(p_value);
+  }
+  else
+  {
+    Byte(0x66);
+    Memory(test ? 0xF7 : 0x81,p_group,p_base,p_disp,false);
+    Byte(p_value);
+    Byte(p_value >> 8);
+  }
+}
+
+void
+QLJit::Jump(int p_condition,int p_index)
+{
+  if(p_condition == JIT_ALWAYS)
+  {
+    Byte(0xE9);
+  }
+  else
+  {
+    Byte(0x0F);
+    Byte(0x80 + p_condition);
+  }
+  m_jumps.push_back({ (int) m_buffer.size(),p_index });
+  Int32(0);
+}
+
+void
+QLJit::JumpExit(int p_condition,int p_index)
+{
+  Byte(0x0F);
+  Byte(0x80 + p_condition);
+  m_exits.push_back({ (int) m_buffer.size(),p_index });
+  Int32(0);
+}
+
+// Short forward jump within a template
+int
+QLJit::JumpShort(int p_condition)
+{
+  Byte(p_condition == JIT_ALWAYS ? 0xEB : 0x70 + p_condition);
+  Byte(0);
+  return (int) m_buffer.size() - 1;
+}
+
+void
+QLJit::PatchShort(int p_position)
+{
+  m_buffer[p_position] = (BYTE)(m_buffer.size() - (p_position + 1));
+}
@@ -0,0 +1,93 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language baseline compiler of register code to x64 machine code
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "QL_Language.h"
+#include "QL_Register.h"
+#include <vector>
+
+// A function is compiled once the register engine has entered it, or
+// looped back in it, this many times
+#define JIT_THRESHOLD   50
+
+// What the machine code needs of the running function
+typedef struct _jitcontext
+{
+  MemObject**       m_frame;      // Frame pointer: register r is m_frame[-r]
+  MemObject**       m_stack;      // Stack pointer, in and out
+  MemObject* const* m_constants;  // Constants of the register code
+  MemObject*        m_immediates; // NIL and the immediate integers of the VM
+  MemObject* const* m_pages;      // Pages of the wide immediates, nullptr until made
+  int               m_arguments;  // Number of arguments of the call
+}
+JitContext;
+
+// Runs the machine code from instruction p_index of the register code.
+// Returns the instruction the register engine must run next
+typedef int (*JitEntry)(JitContext* p_context,int p_index);
+
+// The machine code of one function
+typedef struct _jitcode
+{
+  JitEntry            m_entry;
+  BYTE*               m_memory;   // Executable memory
+  size_t              m_size;
+  std::vector<BYTE*>  m_labels;   // Machine code of each register instruction
+}
+JitCode;
+
+class QLJit
+{
+public:
+  QLJit();
+
+  // Compile register code. Returns nullptr if this platform has no compiler
+  JitCode*    Compile(const RegisterCode* p_code);
+  // Give the executable memory back
+  static void Release(JitCode* p_code);
+
+private:
+  // One template. Returns false if the register engine runs the instruction
+  bool        CompileInstruction(const RegInstruction& p_ins,int p_index);
+  void        CompileOperator   (const RegInstruction& p_ins,int p_index,bool p_branch);
+  void        CompileIncrement  (const RegInstruction& p_ins,int p_index);
+  void        CompileArgument   (const RegInstruction& p_ins,int p_index,bool p_store);
+  void        CompileTruth      (const RegInstruction& p_ins,bool p_jumpOnTrue);
+
+  // Parts of the templates
+  void        LoadSource (int p_reg,int p_source);
+  void        StoreTarget(int p_target);
+  void        SetStack   (int p_depth);
+  void        CheckInteger(int p_reg,int p_index);
+  void        MakeInteger(int p_index);
+  void        MakeBoolean();
+  void        Immediate();
+  void        Exit(int p_index);
+
+  // Instruction encoding
+  void        Byte (int p_byte);
+  void        Int32(int p_value);
+  void        Int64(INT64 p_value);
+  void        Memory(int p_opcode,int p_reg,int p_base,int p_disp,bool p_wide);
+  void        ShortImmediate(int p_group,int p_base,int p_disp,int p_value);
+  void        Jump(int p_condition,int p_index);
+  void        JumpExit(int p_condition,int p_index);
+  int         JumpShort(int p_condition);
+  void        PatchShort(int p_position);
+
+  typedef struct _fixup
+  {
+    int m_position;   // Place of the 32 bits displacement
+    int m_index;      // Instruction jumped to
+  }
+  Fixup;
+
+  std::vector<BYTE>   m_buffer;
+  std::vector<int>    m_offsets;  // Machine code offset of each instruction
+  std::vector<Fixup>  m_jumps;    // Jumps to an instruction
+  std::vector<Fixup>  m_exits;    // Jumps back to the register engine
+};
@@ -18,7 +18,20 @@
 
 // VERSION OF QL LANGUAGE
 // USED IN *.qob FILES
-#define QL_VERSION        200 // 2.00
+#define QL_VERSION        209 // 2.09 Bytecode section of an image counts its code blocks
+// First version with a send cache operand in OP_SEND
+#define QL_VERSION_SENDCACHE 202
+// First version with OP_WIDE and 4 byte branch offsets
+#define QL_VERSION_WIDE      204
+// First version written as a memory mapped image (format 3)
+// Bytecode in an image is never upgraded: it is used in place
+#define QL_VERSION_IMAGE     205
+// First version with compressed (DTYPE_STREAM) sections
+#define QL_VERSION_COMPRESS  206
+// First image with the number of code blocks in the bytecode section
+#define QL_VERSION_CODEBLOCKS 209
+// Oldest *.qob version we can still read
+#define QL_VERSION_MINIMUM 200 // 2.00
 
 #define QUANTUM_PROMPT    _T("Quantum Language (c) 2014-2024 ir. W.E. Huisman")
 #define QUANTUM_VERSION   _T("2.0")
@@ -31,6 +44,19 @@
 #define STACK_MAX         0x7FFF // 32767
 #define STACK_DEFAULT     0x07D0 //  2000
 
+// Range of integers that are shared as immediate values.
+// NIL and these integers never cause a heap allocation
+#define IMMEDIATE_MIN     -128
+#define IMMEDIATE_MAX     1023
+#define IMMEDIATE_COUNT   (IMMEDIATE_MAX - IMMEDIATE_MIN + 1)
+// Wider range of immediates, made a page at a time on first use.
+// Loop counters and sums stay allocation free. Limited, as every page
+// lives as long as the VM (at most 5 MB for the whole range)
+#define IMMEDIATE_WIDE_MIN  -65536
+#define IMMEDIATE_WIDE_MAX  262143
+#define IMMEDIATE_PAGE      1024
+#define IMMEDIATE_PAGES     ((IMMEDIATE_WIDE_MAX - IMMEDIATE_WIDE_MIN + 1) / IMMEDIATE_PAGE)
+
 // Datatypes for QL
 #define DTYPE_ENDMARK     0x0001
 #define DTYPE_NIL         0x0002
@@ -48,6 +74,7 @@
 #define DTYPE_INTERNAL    0x000E
 #define DTYPE_EXTERNAL    0x000F
 #define DTYPE_STREAM      0x0010
+#define DTYPE_MAP         0x0011
 // Added to type on storage of a FLAG_REFERENCE object 
 // in a file stream (e.g. on disk) (String is the name)
 #define DTYPE_REFERENCE   0x0080
@@ -55,17 +82,20 @@
 
 // Minimum and maximum datatype
 #define _DTMIN   DTYPE_ENDMARK
-#define _DTMAX   DTYPE_EXTERNAL
+#define _DTMAX   DTYPE_MAP
 
 // Type flags
 #define FLAG_DEALLOC      0x0001    // Object should be deallocated on free
 #define FLAG_NULL         0x0002    // Object is logical NULL
 #define FLAG_REFERENCE    0x0004    // Object is not garbage collected (REFERENCE!!)
+#define FLAG_IMMEDIATE    0x0008    // Shared immutable NIL/INTEGER value owned by the VM
+#define FLAG_OWNED        0x0010    // String is only referenced by one local variable (OP_TAPPEND)
 
 // GC Generation marks
 #define GC_ALIVE          0x0001
 #define GC_MARKED         0x0002
 #define GC_SWEEP          0x0004
+#define GC_OLD            0x0008    // Survived a collection: lives in the old generation
 
 // Storage class symbol types 
 #define ST_CLASS	    1	  // Class definition       lives in m_classes
@@ -79,8 +109,14 @@
 #define QL_STDOUT     1   // Write to stdout
 #define QL_STDERR     2   // Write to stderr
 
+// Flush policies of the output buffer of stdout (see 'setflush')
+#define QL_FLUSH_ALWAYS 0   // Write every print at once
+#define QL_FLUSH_LINE   1   // Write at the end of each line (default on a console)
+#define QL_FLUSH_FULL   2   // Write when the buffer is full (default on a file or pipe)
+
 // Forward declarations for many objects
 class Array;
+class Map;
 class Class;
 class Object;
 class Function;
@@ -104,6 +140,27 @@ typedef struct _method
 }
 Method;
 
+// Polymorphic inline cache of one OP_SEND instruction
+#define SENDCACHE_WAYS  4
+
+typedef struct _sendentry
+{
+  const void* m_key;      // Class of an object, or datatype of an internal object
+  MemObject*  m_member;   // Resolved member function of the class
+  Method*     m_method;   // Resolved internal method of the datatype
+}
+SendEntry;
+
+typedef struct _sendcache
+{
+  int         m_epoch;    // VM send epoch of the entries
+  int         m_selector; // Interned selector (0 = not yet known)
+  int         m_used;     // Number of entries in use
+  int         m_slot;     // Vtable slot + 1 of OP_VSEND (0 = unknown, -1 = none)
+  SendEntry   m_entries[SENDCACHE_WAYS];
+}
+SendCache;
+
 // Name mapping for global objects in the virtual machine
 typedef std::map<CString, MemObject*>     NameMap;
 typedef std::map<CString, Class*>         ClassMap;
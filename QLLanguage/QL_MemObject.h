@@ -43,6 +43,7 @@ public:
     bcd*          v_floating;       // DTYPE_BCD      value
     WinFile*      v_file;           // DTYPE_FILE     value
     Array*        v_array;          // DTYPE_ARRAY    value
+    Map*          v_map;            // DTYPE_MAP      value
     Object*       v_object;         // DTYPE_OBJECT   value
     Class*        v_class;          // DTYPE_CLASS    value
     Function*     v_script;	        // DTYPE_SCRIPT   Internal compiled script function
@@ -53,17 +54,95 @@ public:
     SQLVariant*   v_variant;        // DTYPE_VARIANT
   }
   m_value;
+};
+
+// Slab allocator page for the MemObjects of one VM.
+// A page is exactly one allocation granule of the OS (64K), 
+// so the page of an object is found by masking its address.
+// Free objects are linked through their 'm_value.v_all' field.
+
+#define MEMPAGE_BYTES     0x10000
+#define MEMPAGE_OBJECTS   ((MEMPAGE_BYTES - 64) * 4 / (4 * sizeof(MemObject) + 1))
+#define MEMPAGE_WORDS     ((MEMPAGE_OBJECTS + 31) / 32)
 
-private:
-  // For use with the GC Garbage Collector
-  MemObject*      m_next;		        // Link to next object
-  MemObject*      m_prev;           // Link to prev object
-  friend          QLVirtualMachine;
+class MemPage
+{
+public:
+  static MemPage* PageOf(const MemObject* p_object);
+  int             IndexOf(const MemObject* p_object);
+  bool            IsInUse(int p_index);
+  bool            IsMarked(int p_index);
+  void            SetInUse(int p_index);
+  void            SetFree(int p_index);
+  void            SetMarked(int p_index);
+  void            ClearMark(int p_index);
+
+  MemPage*        m_next;                     // Next page of the VM
+  int             m_used;                     // Number of objects in use
+  DWORD           m_inuse[MEMPAGE_WORDS];     // Allocation bitmap
+  DWORD           m_marks[MEMPAGE_WORDS];     // Mark bitmap of the GC
+  MemObject       m_objects[MEMPAGE_OBJECTS]; // The objects in this page
 };
 
+static_assert(sizeof(MemPage) <= MEMPAGE_BYTES,"MemPage does not fit in an allocation granule");
+
+inline MemPage*
+MemPage::PageOf(const MemObject* p_object)
+{
+  return reinterpret_cast<MemPage*>((UINT_PTR)p_object & ~((UINT_PTR)MEMPAGE_BYTES - 1));
+}
+
+inline int
+MemPage::IndexOf(const MemObject* p_object)
+{
+  return (int)(p_object - m_objects);
+}
+
+inline bool
+MemPage::IsInUse(int p_index)
+{
+  return (m_inuse[p_index >> 5] & (1UL << (p_index & 31))) != 0;
+}
+
+inline bool
+MemPage::IsMarked(int p_index)
+{
+  return (m_marks[p_index >> 5] & (1UL << (p_index & 31))) != 0;
+}
+
+inline void
+MemPage::SetInUse(int p_index)
+{
+  m_inuse[p_index >> 5] |= (1UL << (p_index & 31));
+}
+
+inline void
+MemPage::SetFree(int p_index)
+{
+  m_inuse[p_index >> 5] &= ~(1UL << (p_index & 31));
+}
+
+inline void
+MemPage::SetMarked(int p_index)
+{
+  m_marks[p_index >> 5] |= (1UL << (p_index & 31));
+}
+
+inline void
+MemPage::ClearMark(int p_index)
+{
+  m_marks[p_index >> 5] &= ~(1UL << (p_index & 31));
+}
+
+// Immediates live outside the pages and are always marked
 inline bool
 MemObject::IsMarked()
 {
-  return (m_generation & GC_MARKED) != 0;
+  if(m_flags & FLAG_IMMEDIATE)
+  {
+    return true;
+  }
+  MemPage* page = MemPage::PageOf(this);
+  return page->IsMarked(page->IndexOf(this));
 }
 
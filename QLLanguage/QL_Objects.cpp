@@ -9,6 +9,8 @@
 #include "QL_Language.h"
 #include "QL_MemObject.h"
 #include "QL_Objects.h"
+#include "QL_Register.h"
+#include "QL_Jit.h"
 #include "QL_vm.h"
 
 #ifdef _DEBUG
@@ -18,7 +20,7 @@ static char THIS_FILE[] = __FILE__;
 #endif
 
 // Finding your datatype name with DTYPE_* macros
-TCHAR* datatype_names[0x11]
+TCHAR* datatype_names[0x12]
 {
    _T("")
   ,_T("ENDMARK")
@@ -37,6 +39,7 @@ TCHAR* datatype_names[0x11]
   ,_T("INTERNAL")
   ,_T("EXTERNAL")
   ,_T("STREAM")
+  ,_T("MAP")
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -47,7 +50,6 @@ TCHAR* datatype_names[0x11]
 
 MemObject::MemObject()
 {
-  m_next = m_prev  = nullptr;
   m_type = m_flags = m_generation = m_storage = 0;
   m_value.v_all    = NULL;
 }
@@ -65,13 +67,11 @@ MemObject::~MemObject()
 MemObject& 
 MemObject::operator=(const MemObject& p_other)
 {
-  // Retain the rootchain
-  m_next       = p_other.m_next;
-  m_prev       = p_other.m_prev;
   // General flags are copied and the fact that's a REFERENCE
-  // is append here, so the objects will not be deleted
+  // is append here, so the objects will not be deleted.
+  // A copy shares the string, so it is never owned by a local
   m_type       = p_other.m_type;
-  m_flags      = p_other.m_flags | FLAG_REFERENCE;
+  m_flags      = (p_other.m_flags & ~FLAG_OWNED) | FLAG_REFERENCE;
   m_generation = p_other.m_generation;
   m_storage    = p_other.m_storage;
 
@@ -102,6 +102,9 @@ MemObject::AllocateType(int p_type)
     case DTYPE_OBJECT:      m_value.v_object = new Object();
                             m_flags |= FLAG_DEALLOC;
                             break;
+    case DTYPE_MAP:         m_value.v_map = new Map();
+                            m_flags |= FLAG_DEALLOC;
+                            break;
     case DTYPE_SCRIPT:      m_value.v_script = new Function();
                             m_flags |= FLAG_DEALLOC;
                             break;
@@ -141,6 +144,7 @@ MemObject::DeAllocate()
       case DTYPE_VARIANT: delete m_value.v_variant;     break;
       case DTYPE_ARRAY:   delete m_value.v_array;       break;
       case DTYPE_OBJECT:  delete m_value.v_object;      break;
+      case DTYPE_MAP:     delete m_value.v_map;         break;
       case DTYPE_CLASS:   break; // Never reached
       case DTYPE_SCRIPT:  delete m_value.v_script;      break;
       case DTYPE_INTERNAL:break; // Never reached
@@ -166,12 +170,20 @@ Array::Array(QLvm* p_vm,int p_size)
 {
   for(int ind = 0; ind < p_size; ++ind)
   {
-    m_members.push_back(p_vm->AllocMemObject(DTYPE_NIL));
+    m_members.push_back(p_vm->GetNil());
   }
 }
 
+Array::Array(QLvm* p_vm,int p_size,int p_type)
+{
+  m_packed = new Packed();
+  m_packed->m_type = p_type;
+  Resize(p_vm,p_size);
+}
+
 Array::~Array()
 {
+  delete m_packed;
 }
 
 MemObject*   
@@ -209,6 +221,49 @@ Array::AddEntryOfType(QLvm* p_vm,int p_type)
   return entry;
 }
 
+void
+Array::RemoveLastEntry()
+{
+  if(!m_members.empty())
+  {
+    m_members.pop_back();
+  }
+}
+
+void
+Array::Append(QLvm* p_vm,MemObject* p_object)
+{
+  if(m_packed)
+  {
+    Resize(p_vm,GetSize() + 1);
+    SetPacked(GetSize() - 1,p_object);
+    return;
+  }
+  p_vm->WriteBarrier(this,p_object);
+  m_members.push_back(p_object);
+}
+
+// New elements are NIL, zero or an empty string
+void
+Array::Resize(QLvm* p_vm,int p_size)
+{
+  if(p_size < 0)
+  {
+    p_size = 0;
+  }
+  if(m_packed == nullptr)
+  {
+    m_members.resize(p_size,p_vm->GetNil());
+    return;
+  }
+  switch(m_packed->m_type)
+  {
+    case DTYPE_INTEGER: m_packed->m_integers.resize(p_size,0);  break;
+    case DTYPE_BCD:     m_packed->m_bcds    .resize(p_size);    break;
+    case DTYPE_STRING:  m_packed->m_strings .resize(p_size);    break;
+  }
+}
+
 int
 Array::FindStringEntry(CString p_name)
 {
@@ -331,9 +386,64 @@ Array::GetEntry(unsigned p_number)
 int
 Array::GetSize()
 {
+  if(m_packed)
+  {
+    switch(m_packed->m_type)
+    {
+      case DTYPE_INTEGER: return (int)m_packed->m_integers.size();
+      case DTYPE_BCD:     return (int)m_packed->m_bcds    .size();
+      case DTYPE_STRING:  return (int)m_packed->m_strings .size();
+    }
+  }
   return (int)m_members.size();
 }
 
+// A packed element is boxed in a new MemObject (integers may be immediates)
+MemObject*
+Array::GetEntry(QLvm* p_vm,unsigned p_number)
+{
+  if(m_packed == nullptr)
+  {
+    return GetEntry(p_number);
+  }
+  MemObject* object = nullptr;
+  switch(m_packed->m_type)
+  {
+    case DTYPE_INTEGER: return p_vm->GetInteger(m_packed->m_integers[p_number]);
+    case DTYPE_BCD:     object = p_vm->AllocMemObject(DTYPE_BCD);
+                        *object->m_value.v_floating = m_packed->m_bcds[p_number];
+                        break;
+    case DTYPE_STRING:  object = p_vm->AllocMemObject(DTYPE_STRING);
+                        *object->m_value.v_string = m_packed->m_strings[p_number];
+                        break;
+  }
+  return object;
+}
+
+int
+Array::GetElementType()
+{
+  return m_packed ? m_packed->m_type : DTYPE_NIL;
+}
+
+int
+Array::GetInteger(unsigned p_number)
+{
+  return m_packed->m_integers[p_number];
+}
+
+bcd&
+Array::GetBcd(unsigned p_number)
+{
+  return m_packed->m_bcds[p_number];
+}
+
+CString&
+Array::GetString(unsigned p_number)
+{
+  return m_packed->m_strings[p_number];
+}
+
 void
 Array::SetEntry(unsigned p_number,MemObject* p_object)
 {
@@ -343,6 +453,72 @@ Array::SetEntry(unsigned p_number,MemObject* p_object)
   }
 }
 
+// Setting an entry through the write barrier of the GC
+void
+Array::SetEntry(QLvm* p_vm,unsigned p_number,MemObject* p_object)
+{
+  if(m_packed)
+  {
+    SetPacked(p_number,p_object);
+    return;
+  }
+  p_vm->WriteBarrier(this,p_object);
+  SetEntry(p_number,p_object);
+}
+
+// Unbox a value into a packed element. Integers and bcd's convert
+void
+Array::SetPacked(unsigned p_number,MemObject* p_object)
+{
+  int type = p_object->m_type;
+  switch(m_packed->m_type)
+  {
+    case DTYPE_INTEGER: if(type == DTYPE_INTEGER)
+                        {
+                          m_packed->m_integers[p_number] = p_object->m_value.v_integer;
+                          return;
+                        }
+                        if(type == DTYPE_BCD)
+                        {
+                          m_packed->m_integers[p_number] = p_object->m_value.v_floating->AsLong();
+                          return;
+                        }
+                        break;
+    case DTYPE_BCD:     if(type == DTYPE_BCD)
+                        {
+                          m_packed->m_bcds[p_number] = *p_object->m_value.v_floating;
+                          return;
+                        }
+                        if(type == DTYPE_INTEGER)
+                        {
+                          m_packed->m_bcds[p_number] = bcd(p_object->m_value.v_integer);
+                          return;
+                        }
+                        break;
+    case DTYPE_STRING:  if(type == DTYPE_STRING)
+                        {
+                          m_packed->m_strings[p_number] = *p_object->m_value.v_string;
+                          return;
+                        }
+                        break;
+  }
+  QLvm::Error(_T("Cannot store %s in an array of %s")
+              ,datatype_names[type]
+              ,datatype_names[m_packed->m_type]);
+}
+
+bool
+Array::GetRemembered()
+{
+  return m_remembered;
+}
+
+void
+Array::SetRemembered(bool p_remembered)
+{
+  m_remembered = p_remembered;
+}
+
 void
 Array::Mark(QLvm* p_vm)
 {
@@ -355,6 +531,258 @@ Array::Mark(QLvm* p_vm)
   }
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+// MAP
+//
+//////////////////////////////////////////////////////////////////////////
+
+Map::Map()
+{
+}
+
+Map::~Map()
+{
+}
+
+MemObject*
+Map::Find(MemObject* p_key)
+{
+  if(m_slots.empty())
+  {
+    return nullptr;
+  }
+  int slot = FindSlot(p_key,Hash(p_key));
+  if(slot < 0)
+  {
+    return nullptr;
+  }
+  return m_values.GetEntry(m_slots[slot] - 1);
+}
+
+void
+Map::Set(QLvm* p_vm,MemObject* p_key,MemObject* p_value)
+{
+  // Keep at least a quarter of the slots empty, so a search always ends.
+  // Grow if removed slots cannot make enough room
+  unsigned needed = (unsigned)GetSize() + 1;
+  if((needed + m_removed) * 4 > m_slots.size() * 3)
+  {
+    unsigned capacity = m_slots.empty() ? 8 : (unsigned)m_slots.size();
+    while(needed * 2 > capacity)
+    {
+      capacity *= 2;
+    }
+    Rehash(capacity);
+  }
+
+  unsigned hash = Hash(p_key);
+  int      slot = FindSlot(p_key,hash);
+  if(slot >= 0)
+  {
+    // Replace the value of an existing key
+    m_values.SetEntry(p_vm,m_slots[slot] - 1,p_value);
+    return;
+  }
+  slot = -slot - 1;
+  if(m_slots[slot] < 0)
+  {
+    --m_removed;
+  }
+  m_slots[slot] = GetSize() + 1;
+  m_hashes.push_back(hash);
+  p_vm->WriteBarrier(&m_keys,p_key);
+  m_keys.AddEntry(p_key);
+  p_vm->WriteBarrier(&m_values,p_value);
+  m_values.AddEntry(p_value);
+}
+
+bool
+Map::Remove(QLvm* p_vm,MemObject* p_key)
+{
+  if(m_slots.empty())
+  {
+    return false;
+  }
+  int slot = FindSlot(p_key,Hash(p_key));
+  if(slot < 0)
+  {
+    return false;
+  }
+  int entry = m_slots[slot] - 1;
+  int last  = GetSize() - 1;
+  m_slots[slot] = -1;
+  ++m_removed;
+
+  // Move the last entry into the hole, so the arrays stay dense
+  if(entry != last)
+  {
+    m_slots[FindEntrySlot(last)] = entry + 1;
+    m_hashes[entry] = m_hashes[last];
+    m_keys  .SetEntry(p_vm,entry,m_keys  .GetEntry(last));
+    m_values.SetEntry(p_vm,entry,m_values.GetEntry(last));
+  }
+  m_hashes.pop_back();
+  m_keys  .RemoveLastEntry();
+  m_values.RemoveLastEntry();
+  return true;
+}
+
+int
+Map::GetSize()
+{
+  return m_keys.GetSize();
+}
+
+MemObject*
+Map::GetKey(int p_index)
+{
+  return m_keys.GetEntry(p_index);
+}
+
+MemObject*
+Map::GetValue(int p_index)
+{
+  return m_values.GetEntry(p_index);
+}
+
+Array&
+Map::GetKeys()
+{
+  return m_keys;
+}
+
+Array&
+Map::GetValues()
+{
+  return m_values;
+}
+
+bool
+Map::IsKeyType(int p_type)
+{
+  return p_type == DTYPE_INTEGER || p_type == DTYPE_STRING ||
+         p_type == DTYPE_BCD     || p_type == DTYPE_VARIANT;
+}
+
+void
+Map::Mark(QLvm* p_vm)
+{
+  m_keys  .Mark(p_vm);
+  m_values.Mark(p_vm);
+}
+
+// Integers are mixed, the others hash their text (FNV-1a)
+unsigned
+Map::Hash(MemObject* p_key)
+{
+  CString text;
+  switch(p_key->m_type)
+  {
+    case DTYPE_INTEGER: { unsigned hash = (unsigned)p_key->m_value.v_integer * 0x9E3779B1;
+                          return hash ^ (hash >> 16);
+                        }
+    case DTYPE_STRING:  text = *p_key->m_value.v_string;
+                        break;
+    case DTYPE_BCD:     text = p_key->m_value.v_floating->AsString();
+                        break;
+    case DTYPE_VARIANT: p_key->m_value.v_variant->GetAsString(text);
+                        break;
+  }
+  unsigned hash = 2166136261 ^ p_key->m_type;
+  for(int ind = 0;ind < text.GetLength(); ++ind)
+  {
+    hash = (hash ^ (unsigned)text.GetAt(ind)) * 16777619;
+  }
+  return hash;
+}
+
+// Keys of different datatypes are never equal
+bool
+Map::Equal(MemObject* p_key,MemObject* p_other)
+{
+  if(p_key->m_type != p_other->m_type)
+  {
+    return false;
+  }
+  switch(p_key->m_type)
+  {
+    case DTYPE_INTEGER: return p_key->m_value.v_integer == p_other->m_value.v_integer;
+    case DTYPE_STRING:  return p_key->m_value.v_string->Compare(*p_other->m_value.v_string) == 0;
+    case DTYPE_BCD:     return *p_key->m_value.v_floating == *p_other->m_value.v_floating;
+    case DTYPE_VARIANT: { CString key;
+                          CString other;
+                          p_key  ->m_value.v_variant->GetAsString(key);
+                          p_other->m_value.v_variant->GetAsString(other);
+                          return key.Compare(other) == 0;
+                        }
+  }
+  return false;
+}
+
+// Slot of a key (linear probing).
+// If not found: -(slot + 1) of the slot where the key can be added
+int
+Map::FindSlot(MemObject* p_key,unsigned p_hash)
+{
+  unsigned mask = (unsigned)m_slots.size() - 1;
+  int      free = -1;
+
+  for(unsigned ind = p_hash & mask;; ind = (ind + 1) & mask)
+  {
+    int entry = m_slots[ind];
+    if(entry == 0)
+    {
+      return -(free >= 0 ? free : (int)ind) - 1;
+    }
+    if(entry < 0)
+    {
+      if(free < 0)
+      {
+        free = (int)ind;
+      }
+      continue;
+    }
+    if(m_hashes[entry - 1] == p_hash && Equal(m_keys.GetEntry(entry - 1),p_key))
+    {
+      return (int)ind;
+    }
+  }
+}
+
+// Slot of an entry that is in the map
+int
+Map::FindEntrySlot(int p_entry)
+{
+  unsigned mask = (unsigned)m_slots.size() - 1;
+  unsigned ind  = m_hashes[p_entry] & mask;
+
+  while(m_slots[ind] != p_entry + 1)
+  {
+    ind = (ind + 1) & mask;
+  }
+  return (int)ind;
+}
+
+// Build a new table without removed slots
+void
+Map::Rehash(unsigned p_capacity)
+{
+  unsigned mask = p_capacity - 1;
+
+  m_slots.assign(p_capacity,0);
+  m_removed = 0;
+  for(int entry = 0;entry < GetSize(); ++entry)
+  {
+    unsigned ind = m_hashes[entry] & mask;
+    while(m_slots[ind] != 0)
+    {
+      ind = (ind + 1) & mask;
+    }
+    m_slots[ind] = entry + 1;
+  }
+}
+
 
 //////////////////////////////////////////////////////////////////////////
 //
@@ -365,12 +793,14 @@ Array::Mark(QLvm* p_vm)
 Class::Class(CString p_name)
       :m_name(p_name)
       ,m_base(nullptr)
+      ,m_vtableEpoch(0)
 {
 }
 
 Class::Class(CString p_name, Class* p_base)
       :m_name(p_name)
       ,m_base(p_base)
+      ,m_vtableEpoch(0)
 {
 
 }
@@ -545,6 +975,61 @@ Class::RecursiveFindDataMember(CString p_name,int& p_entryNum)
   return nullptr;
 }
 
+// Build the vtable: the slots of the base class come first, so a slot
+// is the same for the class and all classes derived from it
+void
+Class::BuildVTable(QLvm* p_vm,int p_epoch)
+{
+  if(m_vtableEpoch == p_epoch)
+  {
+    return;
+  }
+  m_vtable.clear();
+  m_slots.clear();
+  if(m_base)
+  {
+    m_base->BuildVTable(p_vm,p_epoch);
+    m_vtable = m_base->m_vtable;
+    m_slots  = m_base->m_slots;
+  }
+  // Our own member functions override or extend the base
+  for(int ind = 0;ind < m_members.GetSize(); ++ind)
+  {
+    MemObject* member = m_members.GetEntry(ind);
+    if(member->m_type != DTYPE_SCRIPT)
+    {
+      continue;
+    }
+    CString name     = member->m_value.v_script->GetName();
+    int     selector = p_vm->InternSelector(name);
+
+    SlotMap::iterator it = m_slots.find(selector);
+    if(it != m_slots.end())
+    {
+      m_vtable[it->second].m_member = member;
+    }
+    else
+    {
+      VSlot slot = { selector, member };
+      m_slots.insert(std::make_pair(selector,(int)m_vtable.size()));
+      m_vtable.push_back(slot);
+    }
+  }
+  m_vtableEpoch = p_epoch;
+}
+
+// Slot of a selector in the vtable, or -1 if not a member function
+int
+Class::FindSlot(int p_selector)
+{
+  SlotMap::iterator it = m_slots.find(p_selector);
+  if(it != m_slots.end())
+  {
+    return it->second;
+  }
+  return -1;
+}
+
 void
 Class::Mark(QLvm* p_vm)
 {
@@ -575,6 +1060,7 @@ Function::Function()
          ,m_class(nullptr)
          ,m_bytecode(nullptr)
          ,m_bytecode_size(0)
+         ,m_threaded(nullptr)
          ,m_writing(false)
 {
 }
@@ -585,18 +1071,25 @@ Function::Function(CString p_name)
          ,m_class(nullptr)
          ,m_bytecode(nullptr)
          ,m_bytecode_size(0)
+         ,m_threaded(nullptr)
          ,m_writing(false)
 {
 }
 
 Function::~Function()
 {
-  if(m_bytecode)
+  if(m_bytecode && !m_mapped)
   {
     free(m_bytecode);
-    m_bytecode = 0;
-    m_bytecode_size = 0;
   }
+  m_bytecode = 0;
+  m_bytecode_size = 0;
+  if(m_threaded)
+  {
+    delete [] m_threaded;
+    m_threaded = nullptr;
+  }
+  DropRegisterCode();
   if(m_literals)
   {
     delete m_literals;
@@ -618,7 +1111,7 @@ Function::AddLiteral(QLvm* p_vm,CString p_literal)
   {
     m_literals = new Array();
   }
-  m_literals->AddEntry(p_vm,p_literal);
+  p_vm->WriteBarrier(m_literals,m_literals->AddEntry(p_vm,p_literal));
 }
 
 void
@@ -628,15 +1121,48 @@ Function::AddLiteral(QLvm* p_vm, MemObject* p_object)
   {
     m_literals = new Array();
   }
-  m_literals->AddEntry(p_object);
+  p_vm->WriteBarrier(m_literals,m_literals->AddEntry(p_object));
 }
 
 void    
 Function::SetBytecode(BYTE* p_bytecode, unsigned p_size)
 {
+  if(m_threaded)
+  {
+    delete [] m_threaded;
+    m_threaded = nullptr;
+  }
+  DropRegisterCode();
+  m_sendcaches.clear();
+  m_proven.clear();
+  m_maxstack = -1;
   m_bytecode = (BYTE*) malloc(p_size + 1);
   memcpy(m_bytecode,p_bytecode,p_size);
   m_bytecode[m_bytecode_size = p_size] = 0;
+  m_mapped = false;
+}
+
+// Bytecode is used in place from a mapped image, including the
+// closing zero byte. The image lives as long as the virtual machine
+void
+Function::SetMappedBytecode(BYTE* p_bytecode,unsigned p_size)
+{
+  if(m_threaded)
+  {
+    delete [] m_threaded;
+    m_threaded = nullptr;
+  }
+  DropRegisterCode();
+  m_sendcaches.clear();
+  m_proven.clear();
+  m_maxstack = -1;
+  if(m_bytecode && !m_mapped)
+  {
+    free(m_bytecode);
+  }
+  m_bytecode      = p_bytecode;
+  m_bytecode_size = p_size;
+  m_mapped        = true;
 }
 
 void    
@@ -703,6 +1229,57 @@ Function::GetBytecodeSize()
   return m_bytecode_size;
 }
 
+// Threaded code is decoded only once for each function, on its first
+// call. Not at load time: the engine is chosen after loading, and a
+// function that is never called is never decoded
+Instruction*
+Function::GetThreadedCode()
+{
+  if(m_threaded == nullptr && m_bytecode)
+  {
+    m_threaded = DecodeBytecode(m_bytecode,m_bytecode_size);
+  }
+  return m_threaded;
+}
+
+// Register code is translated only once for each function
+RegisterCode*
+Function::GetRegisterCode(QLvm* p_vm)
+{
+  if(m_registers == nullptr && m_bytecode)
+  {
+    QLTranslator translator(p_vm);
+    m_registers = translator.Translate(this);
+  }
+  return m_registers;
+}
+
+// Register code has the literals as constants
+// and its machine code has them compiled in
+void
+Function::DropRegisterCode()
+{
+  if(m_registers)
+  {
+    QLJit::Release(m_registers->m_native);
+    delete m_registers;
+    m_registers = nullptr;
+  }
+}
+
+// Inline cache of the OP_SEND with this site number
+SendCache*
+Function::GetSendCache(int p_site)
+{
+  if(p_site >= (int)m_sendcaches.size())
+  {
+    SendCache empty;
+    memset(&empty,0,sizeof(SendCache));
+    m_sendcaches.resize(p_site + 1,empty);
+  }
+  return &m_sendcaches[p_site];
+}
+
 MemObject*
 Function::GetLiteral(unsigned p_number)
 {
@@ -756,6 +1333,7 @@ Function::SetLiteral(unsigned p_number, MemObject* p_object)
   {
     m_literals->SetEntry(p_number,p_object);
   }
+  DropRegisterCode();
 }
 
 void
@@ -766,6 +1344,27 @@ Function::SetLiterals(Array* p_literals)
     delete m_literals;
   }
   m_literals = p_literals;
+  DropRegisterCode();
+}
+
+// Stack depth and proven call sites of the verifier
+void
+Function::SetVerified(int p_maxstack,std::vector<bool>& p_proven)
+{
+  m_maxstack = p_maxstack;
+  m_proven.swap(p_proven);
+}
+
+bool
+Function::GetVerified()
+{
+  return m_maxstack >= 0;
+}
+
+int
+Function::GetMaxStack()
+{
+  return m_maxstack;
 }
 
 void
@@ -848,12 +1447,18 @@ Object::GetAttribute(int p_index)
   return nullptr;
 }
 
+Array&
+Object::GetAttributes()
+{
+  return m_attributes;
+}
+
 bool
-Object::SetAttribute(int p_index,MemObject* p_attrib)
+Object::SetAttribute(QLvm* p_vm,int p_index,MemObject* p_attrib)
 {
   if(p_index >= 0 && p_index < m_attributes.GetSize())
   {
-    m_attributes.SetEntry(p_index,p_attrib);
+    m_attributes.SetEntry(p_vm,p_index,p_attrib);
     return true;
   }
   return false;
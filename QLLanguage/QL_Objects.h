@@ -7,21 +7,46 @@
 
 #pragma once
 #include "QL_Language.h"
+#include "QL_Threaded.h"
 #include <vector>
 
 class QLVirtualMachine;
+typedef struct _registercode RegisterCode;
 
 typedef std::vector<MemObject*> Members;
 typedef std::vector<int>        ArgTypes;
 
+// One slot in the method table of a class
+typedef struct _vslot
+{
+  int         m_selector; // Interned selector of the slot
+  MemObject*  m_member;   // Member function for this class
+}
+VSlot;
+
+typedef std::vector<VSlot>      VTable;
+typedef std::map<int,int>       SlotMap;  // Selector -> slot in the VTable
+
 // Finding your datatype name with DTYPE_* macros
 extern TCHAR* datatype_names[];
 
+// Elements of a packed array: only the vector of the type is used
+typedef struct _packed
+{
+  int                   m_type;       // DTYPE_INTEGER, DTYPE_BCD or DTYPE_STRING
+  std::vector<int>      m_integers;
+  std::vector<bcd>      m_bcds;
+  std::vector<CString>  m_strings;
+}
+Packed;
+
 class Array
 {
 public:
   Array();
   Array(QLvm* p_vm,int p_size);
+  // Packed array of integers, bcd's or strings without a MemObject per element
+  Array(QLvm* p_vm,int p_size,int p_type);
  ~Array();
 
   MemObject*   FindEntry(CString p_name);
@@ -36,16 +61,76 @@ public:
   MemObject*   AddEntry(QLvm* p_vm,int     p_integer);
   MemObject*   AddEntry(MemObject* p_memob);
   MemObject*   AddEntryOfType(QLvm* p_vm,int p_type);
+  // Remove the last member
+  void         RemoveLastEntry();
+  // Script arrays grow at the end, or change their size
+  void         Append(QLvm* p_vm,MemObject* p_object);
+  void         Resize(QLvm* p_vm,int p_size);
 
   // Getters
   MemObject*   GetEntry(unsigned p_number);
+  MemObject*   GetEntry(QLvm* p_vm,unsigned p_number);
   int          GetSize();
+  bool         GetRemembered();
+  // Packed elements (DTYPE_NIL if not packed)
+  int          GetElementType();
+  int          GetInteger(unsigned p_number);
+  bcd&         GetBcd    (unsigned p_number);
+  CString&     GetString (unsigned p_number);
   // Setters
   void         SetEntry(unsigned p_number,MemObject* p_object);
+  void         SetEntry(QLvm* p_vm,unsigned p_number,MemObject* p_object);
+  void         SetRemembered(bool p_remembered);
   // Garbage collection
   void         Mark(QLvm* p_vm);
 private:
+  void         SetPacked(unsigned p_number,MemObject* p_object);
+
   Members      m_members;
+  Packed*      m_packed     { nullptr };
+  bool         m_remembered { false }; // In the remembered set of the GC
+};
+
+// Hash map of keys (integer, string, bcd or variant) to values.
+// Keys and values are kept in insertion order in two arrays, so the
+// garbage collector and its write barrier treat them as any array.
+// The hash table holds the entry number of each key (open addressing)
+class Map
+{
+public:
+  Map();
+ ~Map();
+
+  // Find the value of a key (nullptr if not found)
+  MemObject*   Find(MemObject* p_key);
+  // Add or replace a key. The key must not be changed afterwards
+  void         Set(QLvm* p_vm,MemObject* p_key,MemObject* p_value);
+  // Remove a key. False if it was not found
+  bool         Remove(QLvm* p_vm,MemObject* p_key);
+
+  // Getters
+  int          GetSize();
+  MemObject*   GetKey  (int p_index);
+  MemObject*   GetValue(int p_index);
+  Array&       GetKeys();
+  Array&       GetValues();
+
+  // Only these datatypes can be a key
+  static bool  IsKeyType(int p_type);
+  // Garbage collection
+  void         Mark(QLvm* p_vm);
+private:
+  static unsigned Hash (MemObject* p_key);
+  static bool     Equal(MemObject* p_key,MemObject* p_other);
+  int          FindSlot(MemObject* p_key,unsigned p_hash);
+  int          FindEntrySlot(int p_entry);
+  void         Rehash(unsigned p_capacity);
+
+  Array                 m_keys;
+  Array                 m_values;
+  std::vector<unsigned> m_hashes;       // Hash of each key
+  std::vector<int>      m_slots;        // Entry + 1 of each slot (0 = empty, -1 = removed)
+  unsigned              m_removed { 0 };// Number of removed slots
 };
 
 class Function
@@ -60,6 +145,7 @@ public:
   void        AddLiteral(QLvm* p_vm,CString p_literal);
   void        AddLiteral(QLvm* p_vm,MemObject* p_object);
   void        SetBytecode(BYTE* p_bytecode,unsigned p_size);
+  void        SetMappedBytecode(BYTE* p_bytecode,unsigned p_size);
   void        SetName(CString p_name);
   void        SetClass(Class* p_class);
   void        SetWriting(bool p_writing);
@@ -72,6 +158,9 @@ public:
   int         GetNumberOfArguments();
   BYTE*       GetBytecode();
   int         GetBytecodeSize();
+  Instruction* GetThreadedCode();
+  RegisterCode* GetRegisterCode(QLvm* p_vm);
+  SendCache*  GetSendCache(int p_site);
   bool        GetWriting();
   MemObject*  GetLiteral      (unsigned p_number);
   CString     GetLiteralString(unsigned p_number);
@@ -83,19 +172,40 @@ public:
   void        SetLiteral(unsigned p_number,MemObject* p_object);
   void        SetLiterals(Array* p_literals);
 
+  // Results of the bytecode verifier
+  void        SetVerified(int p_maxstack,std::vector<bool>& p_proven);
+  bool        GetVerified();
+  int         GetMaxStack();
+  bool        GetProvenCall(int p_offset);
+
   // Garbage collection
   void        Mark(QLvm* p_vm);
 private:
+  void        DropRegisterCode();
+
   Class*      m_class;
   CString     m_name;
   ArgTypes    m_arguments;
   int         m_bytecode_size;
   BYTE*       m_bytecode;
+  bool        m_mapped { false };   // Bytecode lives in a QLImage
+  Instruction* m_threaded;  // Pre-decoded bytecode, made on first use
+  RegisterCode* m_registers { nullptr };  // Register code, translated on first use
+  std::vector<SendCache> m_sendcaches;  // One for each OP_SEND
   Array*      m_literals;
+  int         m_maxstack { -1 };    // Deepest stack of the verifier, -1 if not verified
+  std::vector<bool> m_proven;       // OP_CALL sites with proven arguments
   // Non-recursive writing of the object file
   bool        m_writing;
 };
 
+// OP_CALL at this offset has the arguments the function is tested for
+inline bool
+Function::GetProvenCall(int p_offset)
+{
+  return p_offset < (int)m_proven.size() && m_proven[p_offset];
+}
+
 class Class
 {
 public:
@@ -116,6 +226,11 @@ public:
   MemObject*  RecursiveFindDataMember(CString p_name);
   MemObject*  RecursiveFindDataMember(CString p_name,int& p_entryNum);
 
+  // Flattened method table, built when the classes are finalized
+  void        BuildVTable(QLvm* p_vm,int p_epoch);
+  int         FindSlot(int p_selector);
+  MemObject*  GetVirtual(int p_slot,int p_selector);
+
   // Setters
   void        SetName(CString p_name);
   void        SetBaseClass(Class* p_base);
@@ -133,8 +248,22 @@ private:
   Class*      m_base;         // Pointer to the base class
   Array       m_members;      // Member functions
   Array       m_attributes;   // Attributes of this derived class only
+  VTable      m_vtable;       // Member functions, including the inherited ones
+  SlotMap     m_slots;        // Slot of each selector in the vtable
+  int         m_vtableEpoch;  // Epoch the vtable was built for
 };
 
+// Member function in a vtable slot, if the slot is still for this selector
+inline MemObject*
+Class::GetVirtual(int p_slot,int p_selector)
+{
+  if(p_slot < (int)m_vtable.size() && m_vtable[p_slot].m_selector == p_selector)
+  {
+    return m_vtable[p_slot].m_member;
+  }
+  return nullptr;
+}
+
 class Object
 {
 public:
@@ -147,7 +276,8 @@ public:
   // Operational use of the object
   Class*      GetClass();
   MemObject*  GetAttribute(int p_index);
-  bool        SetAttribute(int p_index,MemObject* p_attrib);
+  Array&      GetAttributes();
+  bool        SetAttribute(QLvm* p_vm,int p_index,MemObject* p_attrib);
   // Garbage collector
   void        Mark(QLvm* p_vm);
 private:
@@ -56,4 +56,38 @@
 #define OP_DELETE  0x2C  // Delete a class object
 #define OP_DESTROY 0x2D  // Destroy deleted object
 #define OP_SWITCH  0x2E  // Switch jump table
-#define OP_LAST    0x2E  // LAST CODE IN ARRAY
+// Superinstructions of the peephole optimizer
+#define OP_TLOADP  0x2F  // load a temporary variable, then push
+#define OP_PTLOAD  0x30  // push, then load a temporary variable
+#define OP_PLIT    0x31  // push, then load a literal
+#define OP_INT     0x32  // load a small integer (signed byte)
+#define OP_PINT    0x33  // push, then load a small integer
+#define OP_TINC    0x34  // increment a temporary variable
+#define OP_TDEC    0x35  // decrement a temporary variable
+#define OP_CBRT    0x36  // compare top two stack entries, branch on true
+#define OP_CBRF    0x37  // compare top two stack entries, branch on false
+// Send to a receiver of a known class, through the method table
+#define OP_VSEND   0x38  // send a message through the vtable of the class
+// Prefix: the next instruction has a word operand instead of a byte
+#define OP_WIDE    0x39  // wide operand for the next instruction
+// Switch tables with a constant time lookup
+#define OP_DSWITCH 0x3A  // switch by index into a dense jump table
+#define OP_HSWITCH 0x3B  // switch by a hash table of the cases
+// In place string append to a local variable
+#define OP_TLOADA  0x3C  // load a temporary variable to append to it
+#define OP_TAPPEND 0x3D  // append top of stack to a temporary variable
+// Operators on the datatypes the compiler inferred for both operands
+#define OP_ADDII   0x3E  // add two integers
+#define OP_SUBII   0x3F  // subtract two integers
+#define OP_MULII   0x40  // multiply two integers
+#define OP_LTII    0x41  // integer less than
+#define OP_LEII    0x42  // integer less than or equal to
+#define OP_EQII    0x43  // integer equal to
+#define OP_NEII    0x44  // integer not equal to
+#define OP_GEII    0x45  // integer greater than or equal to
+#define OP_GTII    0x46  // integer greater than
+#define OP_ADDBB   0x47  // add two bcd's
+#define OP_SUBBB   0x48  // subtract two bcd's
+#define OP_MULBB   0x49  // multiply two bcd's
+#define OP_CONCAT  0x4A  // concatenate two strings
+#define OP_LAST    0x4A  // LAST CODE IN ARRAY
@@ -0,0 +1,379 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language peephole optimizer
+// ir. W.E. Huisman (c) 2018
+//
+// Sequences the compiler emits for (almost) every statement are fused
+// into one superinstruction, so the interpreter does fewer dispatches.
+//
+// TLOAD n; INC; TSTORE n   -> TINC n
+// TLOAD n; DEC; TSTORE n   -> TDEC n
+// TLOAD n; PUSH            -> TLOADP n
+// PUSH; TLOAD n            -> PTLOAD n
+// PUSH; LIT n              -> PLIT n  or PINT v (small integer)
+// LIT n                    -> INT v  (small integer)
+// LT..GT; BRT/BRF nnnn     -> CBRT/CBRF op nnnn
+// LTII..GTII; BRT/BRF nnnn -> CBRT/CBRF op nnnn
+// WIDE op nn (nn < 256)    -> op n
+//
+// Only the first instruction of a sequence may be a branch target.
+// Superinstructions are never larger than the sequence, so the
+// branch offsets can be relocated within the same buffer.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QL_Language.h"
+#include "QL_MemObject.h"
+#include "QL_Objects.h"
+#include "QL_Opcodes.h"
+#include "QL_Threaded.h"
+#include "QL_Peephole.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static char THIS_FILE[] = __FILE__;
+#endif
+
+QLPeephole::QLPeephole(BYTE* p_code,int p_size,Array* p_literals)
+           :m_code(p_code)
+           ,m_size(p_size)
+           ,m_literals(p_literals)
+{
+}
+
+int
+QLPeephole::Optimize()
+{
+  std::vector<BYTE> output(m_size + 1);
+  OffsetMap map(m_size + 1,0);
+  int offset  = 0;
+  int written = 0;
+  int newsize = 0;
+
+  FindTargets(m_code,m_size,m_targets);
+
+  while(offset < m_size)
+  {
+    int consumed = Fuse(offset,&output[newsize],written);
+    for(int ind = 0;ind < consumed; ++ind)
+    {
+      map[offset + ind] = newsize;
+    }
+    offset  += consumed;
+    newsize += written;
+  }
+  // Branches to the end of the function
+  map[m_size] = newsize;
+
+  Relocate(&output[0],newsize,map);
+  memcpy(m_code,&output[0],newsize);
+  return newsize;
+}
+
+// Find all branch targets in a bytecode program
+void
+QLPeephole::FindTargets(const BYTE* p_code,int p_size,TargetMap& p_targets)
+{
+  p_targets.assign(p_size + 1,false);
+
+  for(int offset = 0;offset < p_size; offset += InstructionLength(&p_code[offset]))
+  {
+    const BYTE* pc = &p_code[offset];
+    int target = -1;
+
+    switch(*pc)
+    {
+      case OP_BRT:  // Fall through
+      case OP_BRF:  // Fall through
+      case OP_BR:   target = ReadLong(&pc[1]);
+                    break;
+      case OP_CBRT: // Fall through
+      case OP_CBRF: target = ReadLong(&pc[2]);
+                    break;
+      case OP_SWITCH: // Fall through
+      case OP_DSWITCH:// Fall through
+      case OP_HSWITCH:{ int cases = pc[1] | (pc[2] << 8);
+                        int ind   = SwitchTableOffset(pc);
+                        while(--cases >= 0)
+                        {
+                          // Empty slots of the jump tables have label zero
+                          target = ReadLong(&pc[ind + 2]);
+                          if(target > 0 && target <= p_size)
+                          {
+                            p_targets[target] = true;
+                          }
+                          ind += 6;
+                        }
+                        target = ReadLong(&pc[ind]);
+                      }
+                      break;
+    }
+    if(target >= 0 && target <= p_size)
+    {
+      p_targets[target] = true;
+    }
+  }
+}
+
+// Relocate all branch offsets in a (changed) bytecode program
+// All branch targets must be in the offset map
+void
+QLPeephole::Relocate(BYTE* p_code,int p_size,OffsetMap& p_map)
+{
+  for(int offset = 0;offset < p_size; offset += InstructionLength(&p_code[offset]))
+  {
+    BYTE* pc = &p_code[offset];
+    int   operand = 0;
+
+    switch(*pc)
+    {
+      case OP_BRT:  // Fall through
+      case OP_BRF:  // Fall through
+      case OP_BR:   operand = 1;
+                    break;
+      case OP_CBRT: // Fall through
+      case OP_CBRF: operand = 2;
+                    break;
+      case OP_SWITCH: // Fall through
+      case OP_DSWITCH:// Fall through
+      case OP_HSWITCH:{ int cases = pc[1] | (pc[2] << 8);
+                        int ind   = SwitchTableOffset(pc);
+                        while(--cases >= 0)
+                        {
+                          int label = ReadLong(&pc[ind + 2]);
+                          if(label)
+                          {
+                            WriteLong(&pc[ind + 2],p_map[label]);
+                          }
+                          ind += 6;
+                        }
+                        operand = ind;
+                      }
+                      break;
+    }
+    if(operand)
+    {
+      WriteLong(&pc[operand],p_map[ReadLong(&pc[operand])]);
+    }
+  }
+}
+
+// Length of an instruction in the bytecode of an older object file
+static int
+OldLength(const BYTE* p_pc,int p_version)
+{
+  switch(*p_pc)
+  {
+    case OP_SEND:   return (p_version < QL_VERSION_SENDCACHE) ? 2 : 4;
+    case OP_BRT:    // Fall through
+    case OP_BRF:    // Fall through
+    case OP_BR:     return 3;
+    case OP_CBRT:   // Fall through
+    case OP_CBRF:   return 4;
+    case OP_SWITCH: return 1 + 2 + 4 * (p_pc[1] | (p_pc[2] << 8)) + 2;
+    default:        return InstructionLength(p_pc);
+  }
+}
+
+static void
+PutWord(std::vector<BYTE>& p_output,int p_word)
+{
+  p_output.push_back((BYTE) p_word);
+  p_output.push_back((BYTE)(p_word >> 8));
+}
+
+static void
+PutLong(std::vector<BYTE>& p_output,int p_long)
+{
+  PutWord(p_output,p_long);
+  PutWord(p_output,p_long >> 16);
+}
+
+// Upgrade bytecode from an object file before version 2.04
+// Before 2.04 the branch offsets were words, not longs.
+// Before 2.02 OP_SEND had no word for its send cache.
+int
+QLPeephole::Upgrade(BYTE** p_code,int p_size,int p_version)
+{
+  BYTE*     code   = *p_code;
+  int       length = 0;
+  int       site   = 0;
+  OffsetMap map(p_size + 1,0);
+  std::vector<BYTE> output;
+
+  for(int offset = 0;offset < p_size; offset += length)
+  {
+    const BYTE* pc = &code[offset];
+    length = OldLength(pc,p_version);
+    map[offset] = (int) output.size();
+
+    switch(*pc)
+    {
+      case OP_SEND:   output.insert(output.end(),pc,pc + length);
+                      if(length == 2)
+                      {
+                        PutWord(output,site++);
+                      }
+                      break;
+      case OP_BRT:    // Fall through
+      case OP_BRF:    // Fall through
+      case OP_BR:     output.push_back(pc[0]);
+                      PutLong(output,pc[1] | (pc[2] << 8));
+                      break;
+      case OP_CBRT:   // Fall through
+      case OP_CBRF:   output.push_back(pc[0]);
+                      output.push_back(pc[1]);
+                      PutLong(output,pc[2] | (pc[3] << 8));
+                      break;
+      case OP_SWITCH: { int cases = pc[1] | (pc[2] << 8);
+                        int ind   = 3;
+                        output.insert(output.end(),pc,pc + 3);
+                        while(--cases >= 0)
+                        {
+                          output.insert(output.end(),pc + ind,pc + ind + 2);
+                          PutLong(output,pc[ind + 2] | (pc[ind + 3] << 8));
+                          ind += 4;
+                        }
+                        PutLong(output,pc[ind] | (pc[ind + 1] << 8));
+                      }
+                      break;
+      default:        output.insert(output.end(),pc,pc + length);
+                      break;
+    }
+  }
+  int size = (int) output.size();
+  map[p_size] = size;
+
+  // New bytecode with the extra OP_RETURN and end marker
+  BYTE* result = new BYTE[size + 2];
+  if(size)
+  {
+    memcpy(result,&output[0],size);
+  }
+  Relocate(result,size,map);
+  result[size]     = OP_RETURN;
+  result[size + 1] = 0;
+
+  delete [] code;
+  *p_code = result;
+  return size;
+}
+
+// Fuse the instructions at p_offset. Returns number of bytes consumed
+int
+QLPeephole::Fuse(int p_offset,BYTE* p_output,int& p_written)
+{
+  BYTE* pc     = &m_code[p_offset];
+  int   length = InstructionLength(pc);
+  int   next   = p_offset + length;
+  int   value  = 0;
+
+  switch(*pc)
+  {
+    case OP_TLOAD:  if((Next(next,OP_INC) || Next(next,OP_DEC)) && Next(next + 1,OP_TSTORE) && m_code[next + 2] == pc[1])
+                    {
+                      p_output[0] = m_code[next] == OP_INC ? OP_TINC : OP_TDEC;
+                      p_output[1] = pc[1];
+                      p_written   = 2;
+                      return 5;
+                    }
+                    if(Next(next,OP_PUSH))
+                    {
+                      p_output[0] = OP_TLOADP;
+                      p_output[1] = pc[1];
+                      p_written   = 2;
+                      return 3;
+                    }
+                    break;
+    case OP_PUSH:   if(Next(next,OP_TLOAD))
+                    {
+                      p_output[0] = OP_PTLOAD;
+                      p_output[1] = m_code[next + 1];
+                      p_written   = 2;
+                      return 3;
+                    }
+                    if(Next(next,OP_LIT))
+                    {
+                      if(SmallInteger(m_code[next + 1],value))
+                      {
+                        p_output[0] = OP_PINT;
+                        p_output[1] = (BYTE) value;
+                      }
+                      else
+                      {
+                        p_output[0] = OP_PLIT;
+                        p_output[1] = m_code[next + 1];
+                      }
+                      p_written = 2;
+                      return 3;
+                    }
+                    break;
+    case OP_LIT:    if(SmallInteger(pc[1],value))
+                    {
+                      p_output[0] = OP_INT;
+                      p_output[1] = (BYTE) value;
+                      p_written   = 2;
+                      return 2;
+                    }
+                    break;
+    case OP_LT:     // Fall through
+    case OP_LE:     // Fall through
+    case OP_EQ:     // Fall through
+    case OP_NE:     // Fall through
+    case OP_GE:     // Fall through
+    case OP_GT:     // Fall through
+    case OP_LTII:   // Fall through
+    case OP_LEII:   // Fall through
+    case OP_EQII:   // Fall through
+    case OP_NEII:   // Fall through
+    case OP_GEII:   // Fall through
+    case OP_GTII:   if(Next(next,OP_BRT) || Next(next,OP_BRF))
+                    {
+                      p_output[0] = m_code[next] == OP_BRT ? OP_CBRT : OP_CBRF;
+                      p_output[1] = pc[0];
+                      memcpy(&p_output[2],&m_code[next + 1],4);
+                      p_written   = 6;
+                      return 6;
+                    }
+                    break;
+    case OP_WIDE:   if(pc[3] == 0)
+                    {
+                      // Operand fits in a byte after all
+                      p_output[0] = pc[1];
+                      p_output[1] = pc[2];
+                      p_written   = 2;
+                      return 4;
+                    }
+                    break;
+  }
+  // Copy the instruction unchanged
+  memcpy(p_output,pc,length);
+  p_written = length;
+  return length;
+}
+
+// Next instruction can be fused: not a branch target
+bool
+QLPeephole::Next(int p_offset,BYTE p_opcode)
+{
+  return p_offset < m_size && !m_targets[p_offset] && m_code[p_offset] == p_opcode;
+}
+
+// Literal is an integer fitting in a signed byte
+bool
+QLPeephole::SmallInteger(int p_literal,int& p_value)
+{
+  if(m_literals == nullptr || p_literal >= m_literals->GetSize())
+  {
+    return false;
+  }
+  MemObject* literal = m_literals->GetEntry(p_literal);
+  if(literal->m_type == DTYPE_INTEGER && literal->m_value.v_integer >= -128 && literal->m_value.v_integer <= 127)
+  {
+    p_value = literal->m_value.v_integer;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,46 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language peephole optimizer
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "QL_Language.h"
+#include <vector>
+
+// Old bytecode offset -> new bytecode offset
+typedef std::vector<int>  OffsetMap;
+// Bytecode offsets that are the target of a branch
+typedef std::vector<bool> TargetMap;
+
+class QLPeephole
+{
+public:
+  QLPeephole(BYTE* p_code,int p_size,Array* p_literals);
+
+  // Fuse common instruction sequences into superinstructions
+  // Returns the new size of the bytecode, which never grows
+  int         Optimize();
+
+  // Find all branch targets in a bytecode program
+  static void FindTargets(const BYTE* p_code,int p_size,TargetMap& p_targets);
+  // Relocate all branch offsets in a (changed) bytecode program
+  static void Relocate(BYTE* p_code,int p_size,OffsetMap& p_map);
+  // Upgrade bytecode of an older object file to the current version
+  // Returns the new size of the (re-allocated) bytecode
+  static int  Upgrade(BYTE** p_code,int p_size,int p_version);
+
+private:
+  // Fuse the instructions at p_offset. Returns number of bytes consumed
+  int         Fuse(int p_offset,BYTE* p_output,int& p_written);
+  // Next instruction can be fused: not a branch target
+  bool        Next(int p_offset,BYTE p_opcode);
+  // Literal is an integer fitting in a signed byte
+  bool        SmallInteger(int p_literal,int& p_value);
+
+  BYTE*       m_code;
+  int         m_size;
+  Array*      m_literals;
+  TargetMap   m_targets;
+};
@@ -0,0 +1,510 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language register code
+// ir. W.E. Huisman (c) 2018
+//
+// Translates the stack bytecode of a function into register code.
+// The translator runs the bytecode on a symbolic stack: loading a local
+// variable or a constant only notes where the value of the stack entry
+// is. The operators read their operands from those places and write
+// their result straight into the register of the result, or into the
+// local variable it is stored in. So "x = a + b" is one RG_OPER instead
+// of TLOADP, TLOAD, ADDII and TSTORE.
+//
+// Every other instruction runs on the stack as it does in the threaded
+// engine. Before it, all entries are written to their own register, and
+// so they are at the start of each block: at a branch target, a switch
+// label and after a call. The stack pointer always covers the registers
+// that hold an object, so the garbage collector finds all values.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QL_Language.h"
+#include "QL_MemObject.h"
+#include "QL_Objects.h"
+#include "QL_Opcodes.h"
+#include "QL_Threaded.h"
+#include "QL_Verifier.h"
+#include "QL_Register.h"
+#include "QL_vm.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static char THIS_FILE[] = __FILE__;
+#endif
+
+QLTranslator::QLTranslator(QLVirtualMachine* p_vm)
+             :m_vm(p_vm)
+             ,m_function(nullptr)
+             ,m_result(nullptr)
+             ,m_size(0)
+             ,m_offset(0)
+             ,m_locals(0)
+             ,m_fresh(-1)
+             ,m_freshValid(false)
+{
+}
+
+RegisterCode*
+QLTranslator::Translate(Function* p_function)
+{
+  const BYTE* code = p_function->GetBytecode();
+  m_function = p_function;
+  m_size     = p_function->GetBytecodeSize();
+  m_result   = new RegisterCode();
+
+  // The stack depth of each instruction is proven by the verifier
+  QLVerifier verifier(m_vm);
+  verifier.Depths(p_function,m_depths);
+
+  Instruction* decoded = DecodeBytecode(code,m_size);
+  m_locals = (m_size > 0 && decoded[0].m_opcode == OP_TSPACE) ? decoded[0].m_operand : 0;
+  FindLabels(code,decoded,m_size);
+  m_result->m_entry.assign(m_size + 1,-1);
+
+  bool open = false;  // The previous instruction falls through
+  int  next = 0;
+  for(m_offset = 0;m_offset < m_size; m_offset = next)
+  {
+    next = m_offset + InstructionLength(&code[m_offset]);
+    if(m_depths[m_offset] < 0)
+    {
+      // No path reaches this instruction
+      open = false;
+      continue;
+    }
+    if(m_labels[m_offset] || !open)
+    {
+      // A block starts with all entries in their own register
+      if(open)
+      {
+        Flush();
+      }
+      Reset(m_depths[m_offset]);
+      m_result->m_entry[m_offset] = (int)m_result->m_code.size();
+    }
+    open = TranslateInstruction(decoded[m_offset],next);
+  }
+  // The end marker stops with a bad opcode, as in the other engines
+  m_offset = m_size;
+  m_result->m_entry[m_size] = (int)m_result->m_code.size();
+  Emit(0);
+
+  // Branches go to the register code of their target
+  for(auto& ins : m_result->m_code)
+  {
+    switch(ins.m_opcode)
+    {
+      case OP_BR:   // Fall through
+      case OP_BRT:  // Fall through
+      case OP_BRF:  // Fall through
+      case RG_CBRT: // Fall through
+      case RG_CBRF: ins.m_operand = m_result->m_entry[ins.m_operand];
+                    break;
+    }
+  }
+  delete [] decoded;
+  return m_result;
+}
+
+void
+QLTranslator::FindLabels(const BYTE* p_code,const Instruction* p_decoded,int p_size)
+{
+  m_labels.assign(p_size + 1,false);
+
+  for(int offset = 0;offset < p_size; offset += InstructionLength(&p_code[offset]))
+  {
+    if(m_depths[offset] < 0)
+    {
+      continue;
+    }
+    const BYTE* pc = &p_code[offset];
+    switch(p_decoded[offset].m_opcode)
+    {
+      case OP_BR:       // Fall through
+      case OP_BRT:      // Fall through
+      case OP_BRF:      // Fall through
+      case OP_CBRT:     // Fall through
+      case OP_CBRF:     m_labels[p_decoded[offset].m_operand] = true;
+                        break;
+      case OP_CALL:     // Fall through
+      case OP_SEND:     // Fall through
+      case OP_VSEND:    // Fall through
+      case OP_DESTROY:  // Return point of the call
+                        m_labels[offset + InstructionLength(pc)] = true;
+                        break;
+      case OP_SWITCH:   // Fall through
+      case OP_DSWITCH:  // Fall through
+      case OP_HSWITCH:  { int slots = pc[1] | (pc[2] << 8);
+                          int ind   = SwitchTableOffset(pc);
+                          for(int slot = 0;slot < slots; ++slot,ind += 6)
+                          {
+                            // Jump tables have label zero for an empty slot
+                            int label = ReadLong(&pc[ind + 2]);
+                            if(*pc == OP_SWITCH || label)
+                            {
+                              m_labels[label] = true;
+                            }
+                          }
+                          // The default label
+                          m_labels[ReadLong(&pc[ind])] = true;
+                        }
+                        break;
+    }
+  }
+}
+
+bool
+QLTranslator::TranslateInstruction(const Instruction& p_ins,int p_next)
+{
+  switch(p_ins.m_opcode)
+  {
+    case OP_PUSH:     Push(Constant(m_vm->GetInteger(0)));
+                      break;
+    case OP_INT:      Top().m_source = Constant(m_vm->GetInteger(p_ins.m_operand));
+                      break;
+    case OP_PINT:     Push(Constant(m_vm->GetInteger(p_ins.m_operand)));
+                      break;
+    case OP_LIT:      TranslateLiteral(p_ins.m_operand);
+                      break;
+    case OP_PLIT:     Push(Constant(m_vm->GetInteger(0)));
+                      TranslateLiteral(p_ins.m_operand);
+                      break;
+    case OP_TLOAD:    Top().m_source = p_ins.m_operand + 1;
+                      break;
+    case OP_TLOADP:   Top().m_source = p_ins.m_operand + 1;
+                      Push(Constant(m_vm->GetInteger(0)));
+                      break;
+    case OP_PTLOAD:   Push(p_ins.m_operand + 1);
+                      break;
+    case OP_TSTORE:   TranslateStore(p_ins.m_operand + 1);
+                      break;
+    case OP_TINC:     TranslateIncrement(RG_INC,p_ins.m_operand + 1);
+                      break;
+    case OP_TDEC:     TranslateIncrement(RG_DEC,p_ins.m_operand + 1);
+                      break;
+    case OP_LOAD:     TranslateResult(RG_LOAD,p_ins.m_operand);
+                      break;
+    case OP_ALOAD:    TranslateResult(RG_ALOAD,p_ins.m_operand);
+                      break;
+    case OP_STORE:    { RegInstruction& ins = Emit(RG_STORE);
+                        ins.m_left    = Top().m_source;
+                        ins.m_operand = p_ins.m_operand;
+                      }
+                      break;
+    case OP_ADD:      // Fall through
+    case OP_SUB:      // Fall through
+    case OP_MUL:      // Fall through
+    case OP_DIV:      // Fall through
+    case OP_REM:      // Fall through
+    case OP_LT:       // Fall through
+    case OP_LE:       // Fall through
+    case OP_EQ:       // Fall through
+    case OP_NE:       // Fall through
+    case OP_GE:       // Fall through
+    case OP_GT:       // Fall through
+    case OP_ADDII:    // Fall through
+    case OP_SUBII:    // Fall through
+    case OP_MULII:    // Fall through
+    case OP_LTII:     // Fall through
+    case OP_LEII:     // Fall through
+    case OP_EQII:     // Fall through
+    case OP_NEII:     // Fall through
+    case OP_GEII:     // Fall through
+    case OP_GTII:     // Fall through
+    case OP_ADDBB:    // Fall through
+    case OP_SUBBB:    // Fall through
+    case OP_MULBB:    // Fall through
+    case OP_CONCAT:   TranslateOperator(RG_OPER,p_ins.m_opcode,-1);
+                      break;
+    case OP_CBRT:     TranslateOperator(RG_CBRT,p_ins.m_extra,p_ins.m_operand);
+                      break;
+    case OP_CBRF:     TranslateOperator(RG_CBRF,p_ins.m_extra,p_ins.m_operand);
+                      break;
+    default:          return TranslateStack(p_ins,p_next);
+  }
+  return true;
+}
+
+// Integers and by-reference literals are constants.
+// A string is copied each time, as OP_LIT does.
+void
+QLTranslator::TranslateLiteral(int p_literal)
+{
+  MemObject* literal = m_function->GetLiteral(p_literal);
+  if(literal->m_type == DTYPE_STRING)
+  {
+    TranslateResult(RG_LITERAL,p_literal);
+    return;
+  }
+  if(literal->m_type == DTYPE_INTEGER &&
+     literal->m_value.v_integer >= IMMEDIATE_MIN &&
+     literal->m_value.v_integer <= IMMEDIATE_MAX)
+  {
+    literal = m_vm->GetInteger(literal->m_value.v_integer);
+  }
+  Top().m_source = Constant(literal);
+}
+
+// Store the TOS in a local variable
+void
+QLTranslator::TranslateStore(int p_register)
+{
+  if(Top().m_source == p_register)
+  {
+    // "TLOAD x, TSTORE x" or a second store
+    return;
+  }
+  Release(p_register);
+
+  // The instruction that computed the TOS writes the local instead
+  int last = (int)m_result->m_code.size() - 1;
+  if(m_fresh >= 0 && m_fresh == last && Top().m_source == Depth())
+  {
+    RegInstruction& ins = m_result->m_code[last];
+    ins.m_target = p_register;
+    Top() = Operand { p_register,m_freshValid };
+    ins.m_depth = ValidDepth();
+    m_fresh = -1;
+    return;
+  }
+  RegInstruction& ins = Emit(RG_MOVE);
+  ins.m_target = p_register;
+  ins.m_left   = Top().m_source;
+  if(Top().m_source != Depth())
+  {
+    Top().m_source = p_register;
+  }
+}
+
+// Increment a local variable. It becomes the TOS
+void
+QLTranslator::TranslateIncrement(BYTE p_opcode,int p_register)
+{
+  int depth = Depth();
+  Release(p_register);
+  MakeValid(depth);
+  Top().m_source = p_register;
+
+  RegInstruction& ins = Emit(p_opcode);
+  ins.m_target = p_register;
+  ins.m_stage  = depth;
+}
+
+// Operator on the top two entries, or a compare and branch
+void
+QLTranslator::TranslateOperator(BYTE p_opcode,BYTE p_operator,int p_branch)
+{
+  int depth = Depth();
+  if(p_branch >= 0)
+  {
+    // A block ends with all entries in their own register
+    for(int index = m_locals;index < depth - 1; ++index)
+    {
+      Materialize(index);
+    }
+  }
+  else
+  {
+    MakeValid(depth - 1);
+  }
+  Operand left  = m_stack[depth - 1];
+  Operand right = m_stack[depth];
+  m_stack.pop_back();
+  Top() = Operand { depth - 1,true };
+
+  RegInstruction& ins = Emit(p_opcode);
+  ins.m_extra  = p_operator;
+  ins.m_target = depth - 1;
+  ins.m_left   = left.m_source;
+  ins.m_right  = right.m_source;
+  ins.m_stage  = depth;
+  if(p_branch >= 0)
+  {
+    ins.m_operand = p_branch;
+  }
+  else
+  {
+    m_fresh      = (int)m_result->m_code.size() - 1;
+    m_freshValid = left.m_valid;
+  }
+}
+
+// Instruction that writes a new value in the TOS
+void
+QLTranslator::TranslateResult(BYTE p_opcode,int p_operand)
+{
+  int  depth = Depth();
+  MakeValid(depth);
+  bool valid = Top().m_valid;
+  Top() = Operand { depth,true };
+
+  RegInstruction& ins = Emit(p_opcode);
+  ins.m_target  = depth;
+  ins.m_operand = p_operand;
+  m_fresh      = (int)m_result->m_code.size() - 1;
+  m_freshValid = valid;
+}
+
+// Run the instruction on the stack, with all entries in their own register
+bool
+QLTranslator::TranslateStack(const Instruction& p_ins,int p_next)
+{
+  // These do not read the TOS, but it must hold an object
+  bool overwrite = p_ins.m_opcode == OP_NIL   ||
+                   p_ins.m_opcode == OP_MLOAD ||
+                   p_ins.m_opcode == OP_TLOADA;
+  Flush(overwrite);
+
+  RegInstruction& ins = Emit(p_ins.m_opcode);
+  ins.m_extra   = p_ins.m_extra;
+  ins.m_operand = p_ins.m_operand;
+
+  switch(p_ins.m_opcode)
+  {
+    case OP_RETURN:   // Fall through
+    case OP_BR:       // Fall through
+    case OP_SWITCH:   // Fall through
+    case OP_DSWITCH:  // Fall through
+    case OP_HSWITCH:  return false;
+  }
+  if(p_next < m_size && m_depths[p_next] >= 0)
+  {
+    Reset(m_depths[p_next]);
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// THE SYMBOLIC STACK
+//
+//////////////////////////////////////////////////////////////////////////
+
+void
+QLTranslator::Reset(int p_depth)
+{
+  m_stack.resize(p_depth + 1);
+  for(int index = 0;index <= p_depth; ++index)
+  {
+    m_stack[index] = Operand { index,true };
+  }
+  m_fresh = -1;
+}
+
+// A pushed entry has no object in its register yet
+void
+QLTranslator::Push(int p_source)
+{
+  m_stack.push_back(Operand { p_source,false });
+}
+
+Operand&
+QLTranslator::Top()
+{
+  return m_stack.back();
+}
+
+int
+QLTranslator::Depth()
+{
+  return (int)m_stack.size() - 1;
+}
+
+// Registers up to this depth hold an object, the stack pointer covers them
+int
+QLTranslator::ValidDepth()
+{
+  int depth = 0;
+  while(depth < Depth() && m_stack[depth + 1].m_valid)
+  {
+    ++depth;
+  }
+  return depth;
+}
+
+int
+QLTranslator::Constant(MemObject* p_object)
+{
+  std::vector<MemObject*>& constants = m_result->m_constants;
+  for(size_t ind = 0;ind < constants.size(); ++ind)
+  {
+    if(constants[ind] == p_object)
+    {
+      return -(int)ind;
+    }
+  }
+  constants.push_back(p_object);
+  return -(int)(constants.size() - 1);
+}
+
+void
+QLTranslator::Materialize(int p_index)
+{
+  MakeValid(p_index);
+  if(m_stack[p_index].m_source != p_index)
+  {
+    int source = m_stack[p_index].m_source;
+    m_stack[p_index] = Operand { p_index,true };
+
+    RegInstruction& ins = Emit(RG_MOVE);
+    ins.m_target = p_index;
+    ins.m_left   = source;
+  }
+}
+
+// Only pushed entries can be without an object, so those are
+// always at the top: the registers with an object have no gaps
+void
+QLTranslator::MakeValid(int p_index)
+{
+  for(int index = m_locals;index < p_index; ++index)
+  {
+    if(!m_stack[index].m_valid)
+    {
+      Materialize(index);
+    }
+  }
+}
+
+void
+QLTranslator::Flush(bool p_keepTop /*= false*/)
+{
+  int depth = Depth();
+  for(int index = m_locals;index < depth; ++index)
+  {
+    Materialize(index);
+  }
+  if(depth >= m_locals && (!p_keepTop || !Top().m_valid))
+  {
+    Materialize(depth);
+  }
+}
+
+void
+QLTranslator::Release(int p_register)
+{
+  for(int index = m_locals;index < Depth(); ++index)
+  {
+    if(index != p_register && m_stack[index].m_source == p_register)
+    {
+      Materialize(index);
+    }
+  }
+}
+
+// The stack depth after an instruction is that of the symbolic stack
+// at the moment it is emitted, so emit after changing the stack
+RegInstruction&
+QLTranslator::Emit(BYTE p_opcode)
+{
+  RegInstruction ins;
+  memset(&ins,0,sizeof(RegInstruction));
+  ins.m_opcode = p_opcode;
+  ins.m_offset = m_offset;
+  ins.m_depth  = ValidDepth();
+  m_result->m_code.push_back(ins);
+  return m_result->m_code.back();
+}
@@ -0,0 +1,122 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language register code
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "QL_Language.h"
+#include "QL_Opcodes.h"
+#include "QL_Threaded.h"
+#include <vector>
+
+class QLVirtualMachine;
+class Function;
+typedef struct _jitcode JitCode;
+
+// Register code is translated from the stack bytecode of a function,
+// the first time the register engine calls it. The object file keeps
+// the stack bytecode. A register is a slot of the stack frame:
+// register r is frame_pointer[-r]. The local variables are registers
+// 1 to n and the stack of the bytecode lies on top of them, so the
+// bytecode stack entry at depth d is register d.
+// Sources of zero and below are constants of the function.
+
+// Register opcodes, numbered after the bytecode opcodes.
+// All other opcodes are run on the stack as in the threaded engine.
+#define RG_MOVE     (OP_LAST + 1)  // target = left
+#define RG_LITERAL  (OP_LAST + 2)  // target = copy of string literal <operand>
+#define RG_LOAD     (OP_LAST + 3)  // target = global <operand>
+#define RG_STORE    (OP_LAST + 4)  // global <operand> = left
+#define RG_ALOAD    (OP_LAST + 5)  // target = argument <operand>
+#define RG_OPER     (OP_LAST + 6)  // target = left <extra> right
+#define RG_CBRT     (OP_LAST + 7)  // target = left <extra> right, branch on true
+#define RG_CBRF     (OP_LAST + 8)  // target = left <extra> right, branch on false
+#define RG_INC      (OP_LAST + 9)  // ++target
+#define RG_DEC      (OP_LAST + 10) // --target
+
+// One instruction of the register code
+typedef struct _reginstruction
+{
+  BYTE  m_opcode;   // Register opcode, or the bytecode opcode run on the stack
+  BYTE  m_extra;    // Operator of RG_OPER, RG_CBRT and RG_CBRF, compare of OP_CBRT/OP_CBRF
+  int   m_depth;    // Register opcodes: stack depth after the instruction
+  int   m_stage;    // Stack depth to put the operands of an operator on
+  int   m_target;   // Register written
+  int   m_left;     // Source of the left (or only) operand
+  int   m_right;    // Source of the right operand
+  int   m_operand;  // Decoded operand. For branches the index of the target instruction
+  int   m_offset;   // Offset of the bytecode instruction it was translated from
+}
+RegInstruction;
+
+// The register code of one function
+typedef struct _registercode
+{
+  std::vector<RegInstruction> m_code;
+  std::vector<int>            m_entry;      // Instruction of a bytecode offset that can be jumped to
+  std::vector<MemObject*>     m_constants;  // Source -n is constant n
+  int                         m_hotness { 0 };      // Entries and loops counted for the compiler
+  JitCode*                    m_native  { nullptr };// Machine code of a hot function
+}
+RegisterCode;
+
+// What the translator knows of one entry of the bytecode stack
+typedef struct _operand
+{
+  int   m_source;   // Register or constant holding the value
+  bool  m_valid;    // The register of the entry holds an object (maybe an older one)
+}
+Operand;
+
+class QLTranslator
+{
+public:
+  QLTranslator(QLVirtualMachine* p_vm);
+
+  // Translate the stack bytecode of a script function (delete when done)
+  RegisterCode* Translate(Function* p_function);
+
+private:
+  // Branch targets, switch labels and return points of calls
+  void        FindLabels(const BYTE* p_code,const Instruction* p_decoded,int p_size);
+  // One bytecode instruction. Returns false if it does not fall through
+  bool        TranslateInstruction(const Instruction& p_ins,int p_next);
+  void        TranslateLiteral (int p_literal);
+  void        TranslateStore   (int p_register);
+  void        TranslateIncrement(BYTE p_opcode,int p_register);
+  void        TranslateOperator(BYTE p_opcode,BYTE p_operator,int p_branch);
+  void        TranslateResult  (BYTE p_opcode,int p_operand);
+  bool        TranslateStack   (const Instruction& p_ins,int p_next);
+
+  // The symbolic stack
+  void        Reset(int p_depth);
+  void        Push(int p_source);
+  Operand&    Top();
+  int         Depth();
+  int         ValidDepth();
+  int         Constant(MemObject* p_object);
+  // Write the value of an entry to its own register
+  void        Materialize(int p_index);
+  // All entries below an index hold an object
+  void        MakeValid(int p_index);
+  // All entries in their own register. The TOS only if it holds no object
+  void        Flush(bool p_keepTop = false);
+  // Entries below the TOS that still read a local variable about to change
+  void        Release(int p_register);
+
+  RegInstruction& Emit(BYTE p_opcode);
+
+  QLVirtualMachine*     m_vm;
+  Function*             m_function;
+  RegisterCode*         m_result;
+  int                   m_size;       // Size of the bytecode
+  int                   m_offset;     // Bytecode instruction being translated
+  int                   m_locals;     // Operand of TSPACE: the stack never drops below it
+  int                   m_fresh;      // Instruction that just wrote the top of the stack, or -1
+  bool                  m_freshValid; // The top of the stack held an object before it
+  std::vector<Operand>  m_stack;      // Stack from the frame upwards, last is the TOS
+  std::vector<int>      m_depths;     // Stack depth on entry of each instruction (verifier)
+  std::vector<bool>     m_labels;     // Offsets reached by a jump or a return
+};
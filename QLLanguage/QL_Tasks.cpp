@@ -0,0 +1,356 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language tasks for parallel_for, spawn and join
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QL_Language.h"
+#include "QL_MemObject.h"
+#include "QL_Objects.h"
+#include "QL_vm.h"
+#include "QL_Interpreter.h"
+#include "QL_Exception.h"
+#include "QL_Tasks.h"
+#include <process.h>
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static char THIS_FILE[] = __FILE__;
+#endif
+
+// Index of the worker of the pool, -1 for all other threads
+__declspec(thread) static int t_worker = -1;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// TASK
+//
+//////////////////////////////////////////////////////////////////////////
+
+QLTask::QLTask(QLImage* p_image,CString p_function)
+       :m_image(p_image)
+       ,m_function(p_function)
+{
+  m_image->AddRef();
+  m_done = CreateEvent(NULL,TRUE,FALSE,NULL);
+}
+
+QLTask::~QLTask()
+{
+  CloseHandle(m_done);
+  m_image->Release();
+}
+
+void
+QLTask::SetEngine(QLInterpreter* p_inter)
+{
+  m_threaded  = p_inter->GetThreaded();
+  m_registers = p_inter->GetRegisters();
+  m_jit       = p_inter->GetJit();
+}
+
+std::vector<TaskValue>&
+QLTask::AddCall()
+{
+  m_arguments.emplace_back();
+  return m_arguments.back();
+}
+
+// A new VM with the code of the image runs the init code once,
+// and then all calls. The output is kept for the caller
+void
+QLTask::Run()
+{
+  QLVirtualMachine vm;
+  vm.SetOutputCapture(&m_output);
+
+  try
+  {
+    if(vm.LoadContext(m_image))
+    {
+      QLInterpreter inter(&vm,false);
+      inter.SetThreaded(m_threaded);
+      inter.SetRegisters(m_registers);
+      inter.SetJit(m_jit);
+      inter.Initialize();
+
+      Function* function = vm.FindScript(m_function);
+      if(function == nullptr)
+      {
+        vm.Error(_T("Task of a non-existing function: %s"),m_function.GetString());
+      }
+      for(auto& arguments : m_arguments)
+      {
+        for(auto& argument : arguments)
+        {
+          MemObject** slot = inter.PushArgument();
+          *slot = MakeValue(&vm,argument);
+          FillValue(&vm,argument,*slot);
+        }
+        MemObject* result = inter.Call(function,(int) arguments.size());
+        m_results.emplace_back();
+        CopyValue(result,m_results.back());
+      }
+    }
+    else
+    {
+      m_error = _T("Cannot load the code of a task");
+    }
+    vm.FlushOutput();
+  }
+  catch(int& error)
+  {
+    vm.FlushOutput();
+    m_error.Format(_T("Task stopped with: %d"),error);
+  }
+  catch(QLException& exp)
+  {
+    vm.FlushOutput();
+    m_error = exp.GetErrorMessage();
+  }
+  SetEvent(m_done);
+}
+
+// A worker of the pool runs other tasks while it waits, so a task
+// that joins the tasks it started never blocks a worker
+void
+QLTask::Wait()
+{
+  QLTaskPool* pool = QLTaskPool::GetPool();
+  while(WaitForSingleObject(m_done,0) == WAIT_TIMEOUT)
+  {
+    if(!pool->Help())
+    {
+      WaitForSingleObject(m_done,pool->IsWorker() ? 1 : INFINITE);
+    }
+  }
+}
+
+// Reading a value does not allocate: the object can be anywhere
+/*static*/ void
+QLTask::CopyValue(MemObject* p_object,TaskValue& p_value,int p_depth /*=0*/)
+{
+  p_value.m_type = p_object->m_type;
+  switch(p_object->m_type)
+  {
+    case DTYPE_NIL:     break;
+    case DTYPE_INTEGER: p_value.m_integer = p_object->m_value.v_integer;
+                        break;
+    case DTYPE_STRING:  p_value.m_string  = *p_object->m_value.v_string;
+                        break;
+    case DTYPE_BCD:     p_value.m_bcd     = *p_object->m_value.v_floating;
+                        break;
+    case DTYPE_ARRAY:   if(p_depth >= TASK_MAX_DEPTH)
+                        {
+                          QLvm::Error(_T("Arrays nested too deep to copy for a task"));
+                        }
+                        else
+                        {
+                          Array* array = p_object->m_value.v_array;
+                          int    size  = array->GetSize();
+                          p_value.m_packed = array->GetElementType();
+                          p_value.m_elements.resize(size);
+                          for(int ind = 0;ind < size; ++ind)
+                          {
+                            TaskValue& element = p_value.m_elements[ind];
+                            element.m_type = p_value.m_packed;
+                            switch(p_value.m_packed)
+                            {
+                              case DTYPE_INTEGER: element.m_integer = array->GetInteger(ind);
+                                                  break;
+                              case DTYPE_BCD:     element.m_bcd     = array->GetBcd(ind);
+                                                  break;
+                              case DTYPE_STRING:  element.m_string  = array->GetString(ind);
+                                                  break;
+                              default:            CopyValue(array->GetEntry(ind),element,p_depth + 1);
+                                                  break;
+                            }
+                          }
+                        }
+                        break;
+    default:            QLvm::Error(_T("A task cannot take or return a value of type: %s"),datatype_names[p_object->m_type]);
+                        break;
+  }
+}
+
+// An array is made empty (all NIL) or packed with zero's
+/*static*/ MemObject*
+QLTask::MakeValue(QLvm* p_vm,TaskValue& p_value)
+{
+  MemObject* object = nullptr;
+  switch(p_value.m_type)
+  {
+    case DTYPE_INTEGER: return p_vm->GetInteger(p_value.m_integer);
+    case DTYPE_STRING:  object = p_vm->AllocMemObject(DTYPE_STRING);
+                        *object->m_value.v_string = p_value.m_string;
+                        break;
+    case DTYPE_BCD:     object = p_vm->AllocMemObject(DTYPE_BCD);
+                        *object->m_value.v_floating = p_value.m_bcd;
+                        break;
+    case DTYPE_ARRAY:   { int    size  = (int) p_value.m_elements.size();
+                          Array* array = p_value.m_packed == DTYPE_NIL ? new Array(p_vm,size)
+                                                                       : new Array(p_vm,size,p_value.m_packed);
+                          object = p_vm->AllocMemObject(DTYPE_NIL);
+                          object->m_type = DTYPE_ARRAY;
+                          object->m_value.v_array = array;
+                          object->m_flags |= FLAG_DEALLOC;
+                        }
+                        break;
+    default:            return p_vm->GetNil();
+  }
+  return object;
+}
+
+// Each element is stored in the array at once, before the next one is made
+/*static*/ void
+QLTask::FillValue(QLvm* p_vm,TaskValue& p_value,MemObject* p_object)
+{
+  if(p_value.m_type != DTYPE_ARRAY)
+  {
+    return;
+  }
+  Array* array = p_object->m_value.v_array;
+  for(int ind = 0;ind < (int) p_value.m_elements.size(); ++ind)
+  {
+    TaskValue& element = p_value.m_elements[ind];
+    MemObject* object  = MakeValue(p_vm,element);
+    array->SetEntry(p_vm,ind,object);
+    FillValue(p_vm,element,object);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// THE POOL OF WORKER THREADS
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Never destroyed: the workers wait for work until the process ends
+/*static*/ QLTaskPool*
+QLTaskPool::GetPool()
+{
+  static QLTaskPool* pool = new QLTaskPool();
+  return pool;
+}
+
+QLTaskPool::QLTaskPool()
+           :m_next(0)
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  int workers = info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+
+  m_work = CreateSemaphore(NULL,0,LONG_MAX,NULL);
+  for(int ind = 0;ind < workers; ++ind)
+  {
+    TaskQueue* queue = new TaskQueue();
+    InitializeCriticalSection(&queue->m_lock);
+    m_queues.push_back(queue);
+  }
+  for(int ind = 0;ind < workers; ++ind)
+  {
+    HANDLE thread = (HANDLE)_beginthreadex(NULL,0,Worker,(void*)(INT_PTR) ind,0,NULL);
+    if(thread)
+    {
+      CloseHandle(thread);
+    }
+  }
+}
+
+// A worker runs the tasks of its own queue, and steals all other
+// tasks it can find, before it waits again
+/*static*/ unsigned __stdcall
+QLTaskPool::Worker(void* p_index)
+{
+  t_worker = (int)(INT_PTR) p_index;
+  // Waits for the constructor of the pool to finish
+  QLTaskPool* pool = GetPool();
+
+  while(WaitForSingleObject(pool->m_work,INFINITE) == WAIT_OBJECT_0)
+  {
+    QLTask* task = nullptr;
+    while((task = pool->FindTask(t_worker)) != nullptr)
+    {
+      task->Run();
+    }
+  }
+  return 0;
+}
+
+// A worker queues its own tasks, so they stay on the same core.
+// Tasks from outside the pool are spread over all queues
+void
+QLTaskPool::Submit(QLTask* p_task)
+{
+  int index = t_worker;
+  if(index < 0)
+  {
+    index = (int)((unsigned) InterlockedIncrement(&m_next) % m_queues.size());
+  }
+  TaskQueue* queue = m_queues[index];
+
+  EnterCriticalSection(&queue->m_lock);
+  queue->m_tasks.push_back(p_task);
+  LeaveCriticalSection(&queue->m_lock);
+
+  ReleaseSemaphore(m_work,1,NULL);
+}
+
+bool
+QLTaskPool::Help()
+{
+  if(t_worker < 0)
+  {
+    return false;
+  }
+  QLTask* task = FindTask(t_worker);
+  if(task == nullptr)
+  {
+    return false;
+  }
+  task->Run();
+  return true;
+}
+
+bool
+QLTaskPool::IsWorker()
+{
+  return t_worker >= 0;
+}
+
+// The newest task of our own queue, or else the oldest task of another queue
+QLTask*
+QLTaskPool::FindTask(int p_worker)
+{
+  int workers = (int) m_queues.size();
+  for(int ind = 0;ind < workers; ++ind)
+  {
+    TaskQueue* queue = m_queues[(p_worker + ind) % workers];
+    QLTask*    task  = nullptr;
+
+    EnterCriticalSection(&queue->m_lock);
+    if(!queue->m_tasks.empty())
+    {
+      if(ind == 0)
+      {
+        task = queue->m_tasks.back();
+        queue->m_tasks.pop_back();
+      }
+      else
+      {
+        task = queue->m_tasks.front();
+        queue->m_tasks.pop_front();
+      }
+    }
+    LeaveCriticalSection(&queue->m_lock);
+
+    if(task)
+    {
+      return task;
+    }
+  }
+  return nullptr;
+}
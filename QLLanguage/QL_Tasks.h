@@ -0,0 +1,143 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language tasks for parallel_for, spawn and join
+// ir. W.E. Huisman (c) 2018
+//
+// A task calls a script function in an execution context of its own:
+// a new VM loaded from the code image of the VM that started it.
+// Arguments and results are copied between the heaps of the two VMs.
+// Tasks run on one pool of worker threads for the whole process.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "QL_Language.h"
+#include "QL_Objects.h"
+#include "QL_Image.h"
+#include <vector>
+#include <deque>
+
+class QLInterpreter;
+
+// Arrays nested deeper than this cannot go to or come from a task
+#define TASK_MAX_DEPTH  64
+// parallel_for makes this many tasks for each worker of the pool
+#define TASK_CHUNKS     4
+
+// A value that belongs to no heap: integers, strings, bcd's and arrays.
+// An array is copied with all its elements
+typedef struct _taskvalue
+{
+  int                     m_type { DTYPE_NIL };
+  int                     m_integer { 0 };
+  bcd                     m_bcd;
+  CString                 m_string;
+  int                     m_packed { DTYPE_NIL }; // Element type of a packed array
+  std::vector<_taskvalue> m_elements;
+}
+TaskValue;
+
+class QLTask
+{
+public:
+  QLTask(QLImage* p_image,CString p_function);
+ ~QLTask();
+
+  // Run with the same engine as the interpreter that starts the task
+  void        SetEngine(QLInterpreter* p_inter);
+  // Arguments of one more call. All calls of a task share its context
+  std::vector<TaskValue>& AddCall();
+  // Run all calls (on a worker thread of the pool)
+  void        Run();
+  // Wait until the task has run
+  void        Wait();
+
+  // Results of a finished task
+  int         GetCalls();
+  TaskValue&  GetResult(int p_call);
+  CString&    GetOutput();
+  CString&    GetError();
+
+  // Copy a value out of a heap. Throws on other datatypes
+  static void       CopyValue(MemObject* p_object,TaskValue& p_value,int p_depth = 0);
+  // Make a value in a heap: first the object, then FillValue with its elements
+  // The object must be on the stack or in an array in between
+  static MemObject* MakeValue(QLvm* p_vm,TaskValue& p_value);
+  static void       FillValue(QLvm* p_vm,TaskValue& p_value,MemObject* p_object);
+
+private:
+  QLImage*    m_image;
+  CString     m_function;
+  bool        m_threaded  { false };
+  bool        m_registers { false };
+  bool        m_jit       { false };
+  std::vector<std::vector<TaskValue>> m_arguments;
+  std::vector<TaskValue>              m_results;
+  CString     m_output;     // Written by the caller at the join
+  CString     m_error;
+  HANDLE      m_done;
+};
+
+// Work-stealing pool: one worker thread per core, each with a queue.
+// A worker runs its own newest task first and steals the oldest task
+// of another worker when its own queue is empty. A worker that waits
+// for a task (a task that joins another task) runs tasks while it waits.
+class QLTaskPool
+{
+public:
+  // The pool is started on first use and lives until the process ends
+  static QLTaskPool* GetPool();
+
+  void        Submit(QLTask* p_task);
+  // A worker that waits runs one task of the queues. False if it found none
+  bool        Help();
+  bool        IsWorker();
+  int         GetWorkers();
+
+private:
+  QLTaskPool();
+
+  typedef struct _taskqueue
+  {
+    CRITICAL_SECTION    m_lock;
+    std::deque<QLTask*> m_tasks;
+  }
+  TaskQueue;
+
+  static unsigned __stdcall Worker(void* p_index);
+  QLTask*     FindTask(int p_worker);
+
+  std::vector<TaskQueue*> m_queues;
+  HANDLE      m_work;       // Semaphore: one count for every submitted task
+  long        m_next;       // Queue for a task submitted from outside the pool
+};
+
+inline int
+QLTask::GetCalls()
+{
+  return (int) m_results.size();
+}
+
+inline TaskValue&
+QLTask::GetResult(int p_call)
+{
+  return m_results[p_call];
+}
+
+inline CString&
+QLTask::GetOutput()
+{
+  return m_output;
+}
+
+inline CString&
+QLTask::GetError()
+{
+  return m_error;
+}
+
+inline int
+QLTaskPool::GetWorkers()
+{
+  return (int) m_queues.size();
+}
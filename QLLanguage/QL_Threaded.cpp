@@ -0,0 +1,125 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language pre-decoded (threaded) bytecode
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QL_Language.h"
+#include "QL_Opcodes.h"
+#include "QL_Threaded.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static char THIS_FILE[] = __FILE__;
+#endif
+
+// Length of the bytecode instruction at p_pc in bytes
+int
+InstructionLength(const BYTE* p_pc)
+{
+  switch(*p_pc)
+  {
+    case OP_BRT:    // Fall through
+    case OP_BRF:    // Fall through
+    case OP_BR:     return 5;
+    case OP_LIT:    // Fall through
+    case OP_CALL:   // Fall through
+    case OP_LOAD:   // Fall through
+    case OP_STORE:  // Fall through
+    case OP_MLOAD:  // Fall through
+    case OP_MSTORE: // Fall through
+    case OP_ALOAD:  // Fall through
+    case OP_ASTORE: // Fall through
+    case OP_TLOAD:  // Fall through
+    case OP_TSTORE: // Fall through
+    case OP_TSPACE: // Fall through
+    case OP_TLOADP: // Fall through
+    case OP_PTLOAD: // Fall through
+    case OP_PLIT:   // Fall through
+    case OP_INT:    // Fall through
+    case OP_PINT:   // Fall through
+    case OP_TINC:   // Fall through
+    case OP_TDEC:   // Fall through
+    case OP_TLOADA: // Fall through
+    case OP_TAPPEND:return 2;
+    case OP_SEND:   // Fall through
+    case OP_VSEND:  // Fall through
+    case OP_WIDE:   return 4;
+    case OP_CBRT:   // Fall through
+    case OP_CBRF:   return 6;
+    case OP_SWITCH: // Fall through
+    case OP_DSWITCH:// Fall through
+    case OP_HSWITCH:// Header, case literal/label pairs, default label
+                    return SwitchTableOffset(p_pc) + 6 * (p_pc[1] | (p_pc[2] << 8)) + 4;
+    default:        return 1;
+  }
+}
+
+// Offset of the first case of a switch instruction
+// OP_SWITCH  <nn>              Number of cases
+// OP_DSWITCH <nn> <nnnn>       Number of slots, lowest case value
+// OP_HSWITCH <nn> <n>          Number of slots, type of the cases
+int
+SwitchTableOffset(const BYTE* p_pc)
+{
+  switch(*p_pc)
+  {
+    case OP_DSWITCH: return 7;
+    case OP_HSWITCH: return 4;
+    default:         return 3;
+  }
+}
+
+// Decode a bytecode program into threaded code
+Instruction*
+DecodeBytecode(const BYTE* p_code,int p_size)
+{
+  Instruction* code = new Instruction[p_size + 1];
+  memset(code,0,(p_size + 1) * sizeof(Instruction));
+
+  int offset = 0;
+  while(offset < p_size)
+  {
+    const BYTE*  pc  = &p_code[offset];
+    Instruction& ins = code[offset];
+    int       length = InstructionLength(pc);
+
+    ins.m_opcode = *pc;
+    ins.m_length = (WORD) length;
+    switch(ins.m_opcode)
+    {
+      case OP_INT:    // Fall through
+      case OP_PINT:   ins.m_operand = (signed char) pc[1];
+                      break;
+      case OP_SEND:   // Fall through
+      case OP_VSEND:  ins.m_extra   = pc[1];
+                      ins.m_operand = pc[2] | (pc[3] << 8);
+                      break;
+      case OP_CBRT:   // Fall through
+      case OP_CBRF:   ins.m_extra   = pc[1];
+                      ins.m_operand = ReadLong(&pc[2]);
+                      break;
+      case OP_BRT:    // Fall through
+      case OP_BRF:    // Fall through
+      case OP_BR:     ins.m_operand = ReadLong(&pc[1]);
+                      break;
+      case OP_WIDE:   // The instruction itself, with the word operand
+                      ins.m_opcode  = pc[1];
+                      ins.m_operand = pc[2] | (pc[3] << 8);
+                      break;
+      default:        switch(length)
+                      {
+                        case 2:  ins.m_operand = pc[1];
+                                 break;
+                        case 3:  ins.m_operand = pc[1] | (pc[2] << 8);
+                                 break;
+                      }
+                      break;
+    }
+    offset += length;
+  }
+  return code;
+}
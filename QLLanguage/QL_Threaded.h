@@ -0,0 +1,65 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language pre-decoded (threaded) bytecode
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// One pre-decoded instruction.
+// The threaded code has one entry for every byte of the bytecode, so
+// bytecode offsets (stack frames, branches) can be used unchanged.
+// Only entries on an instruction boundary are filled, all other
+// entries have opcode zero (bad opcode)
+typedef struct _instruction
+{
+  BYTE  m_opcode;   // Opcode from QL_Opcodes.h (never OP_WIDE)
+  BYTE  m_extra;    // Compare operator of OP_CBRT and OP_CBRF
+  WORD  m_length;   // Length of the instruction in bytes (not for switches)
+  int   m_operand;  // Decoded byte, word or long operand (branch offset)
+}
+Instruction;
+
+// Length of the bytecode instruction at p_pc in bytes
+int           InstructionLength(const BYTE* p_pc);
+// Offset of the first case of a switch instruction
+int           SwitchTableOffset(const BYTE* p_pc);
+// Decode a bytecode program into threaded code (delete [] when done)
+Instruction*  DecodeBytecode(const BYTE* p_code,int p_size);
+
+// Branch offsets are 4 bytes long, least significant byte first
+inline int
+ReadLong(const BYTE* p_pc)
+{
+  return p_pc[0] | (p_pc[1] << 8) | (p_pc[2] << 16) | (p_pc[3] << 24);
+}
+
+inline void
+WriteLong(BYTE* p_pc,int p_value)
+{
+  p_pc[0] = (BYTE) p_value;
+  p_pc[1] = (BYTE)(p_value >> 8);
+  p_pc[2] = (BYTE)(p_value >> 16);
+  p_pc[3] = (BYTE)(p_value >> 24);
+}
+
+// Hash of an integer case of OP_HSWITCH
+inline unsigned
+SwitchHash(int p_value)
+{
+  unsigned hash = (unsigned) p_value * 2654435761U;
+  return hash ^ (hash >> 16);
+}
+
+// Hash of a string case of OP_HSWITCH (FNV-1a)
+inline unsigned
+SwitchHash(const CString& p_value)
+{
+  unsigned hash = 2166136261U;
+  for(int ind = 0;ind < p_value.GetLength(); ++ind)
+  {
+    hash = (hash ^ (_TUCHAR) p_value.GetAt(ind)) * 16777619U;
+  }
+  return hash;
+}
@@ -0,0 +1,629 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language bytecode verifier
+// ir. W.E. Huisman (c) 2018
+//
+// Runs after a compile and after loading an object file, so the
+// interpreter can trust the bytecode and test less while running.
+// The verifier follows every path through a function and proves:
+//
+// - every byte belongs to an instruction with a valid opcode
+// - branches and switch labels end on an instruction boundary
+// - literal, temporary, global, member and argument operands are in range
+// - the stack has the same depth wherever two paths join, and never
+//   drops below the temporaries of the function
+// - the deepest stack of the function, so the interpreter checks the
+//   stack only once when the function is called
+// - OP_CALL sites of a known script function with the right number
+//   and datatypes of the arguments, so the interpreter skips that test
+//
+// Sends are resolved at runtime by the class of the receiver, so their
+// arguments are still tested on each call.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QL_Language.h"
+#include "QL_MemObject.h"
+#include "QL_Objects.h"
+#include "QL_Opcodes.h"
+#include "QL_Threaded.h"
+#include "QL_Exception.h"
+#include "QL_vm.h"
+#include "QL_Verifier.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static char THIS_FILE[] = __FILE__;
+#endif
+
+QLVerifier::QLVerifier(QLVirtualMachine* p_vm)
+           :m_vm(p_vm)
+           ,m_function(nullptr)
+           ,m_code(nullptr)
+           ,m_size(0)
+           ,m_floor(0)
+           ,m_temporaries(0)
+           ,m_literals(0)
+           ,m_maxstack(0)
+           ,m_record(false)
+{
+}
+
+void
+QLVerifier::Verify(Function* p_function)
+{
+  m_function = p_function;
+  m_code     = p_function->GetBytecode();
+  m_size     = p_function->GetBytecodeSize();
+  m_literals = p_function->GetLiteralsSize();
+  m_proven.clear();
+
+  // Declared, but never defined
+  if(m_code == nullptr || m_size == 0)
+  {
+    p_function->SetVerified(0,m_proven);
+    return;
+  }
+  Run();
+  p_function->SetVerified(m_maxstack,m_proven);
+}
+
+int
+QLVerifier::VerifyInitCode(const BYTE* p_code,int p_size)
+{
+  m_function = nullptr;
+  m_code     = p_code;
+  m_size     = p_size;
+  m_literals = m_vm->GetLiteralsSize();
+
+  Run();
+  return m_maxstack;
+}
+
+void
+QLVerifier::Depths(Function* p_function,std::vector<int>& p_depths)
+{
+  m_function = p_function;
+  m_code     = p_function->GetBytecode();
+  m_size     = p_function->GetBytecodeSize();
+  m_literals = p_function->GetLiteralsSize();
+
+  p_depths.assign(m_size + 1,-1);
+  if(m_code == nullptr || m_size == 0)
+  {
+    return;
+  }
+  Run();
+  for(int offset = 0;offset < m_size; ++offset)
+  {
+    if(m_reached[offset])
+    {
+      p_depths[offset] = (int)m_states[offset].size() - 1;
+    }
+  }
+}
+
+void
+QLVerifier::Run()
+{
+  m_boundary.assign(m_size + 1,false);
+  m_reached .assign(m_size + 1,false);
+  m_states  .assign(m_size + 1,StackState());
+  m_proven  .assign(m_size,false);
+  m_work.clear();
+  m_floor       = 0;
+  m_temporaries = 0;
+  m_maxstack    = 0;
+  m_record      = false;
+
+  // Every byte of the bytecode belongs to exactly one instruction
+  int length = 0;
+  for(int offset = 0;offset < m_size; offset += length)
+  {
+    const BYTE* pc = &m_code[offset];
+    if(*pc == 0 || *pc > OP_LAST)
+    {
+      Fail(offset,_T("Bad opcode: %02X"),*pc);
+    }
+    if((*pc == OP_SWITCH || *pc == OP_DSWITCH || *pc == OP_HSWITCH) && offset + SwitchTableOffset(pc) > m_size)
+    {
+      Fail(offset,_T("Switch table runs past the end of the bytecode"));
+    }
+    length = InstructionLength(pc);
+    if(offset + length > m_size)
+    {
+      Fail(offset,_T("Instruction runs past the end of the bytecode"));
+    }
+    m_boundary[offset] = true;
+  }
+  // The end marker after the bytecode
+  m_boundary[m_size] = true;
+
+  // A function starts by reserving its temporaries
+  // The last one is the TOS of the function itself
+  if(m_function)
+  {
+    if(m_code[0] == OP_TSPACE)
+    {
+      m_temporaries = m_code[1];
+    }
+    else if(m_code[0] == OP_WIDE && m_code[1] == OP_TSPACE)
+    {
+      m_temporaries = m_code[2] | (m_code[3] << 8);
+    }
+    if(m_temporaries < 1)
+    {
+      Fail(0,_T("Function does not start with TSPACE"));
+    }
+    m_floor = m_temporaries;
+  }
+
+  // On entry the TOS is the last entry of the stack frame
+  StackState entry(1,StackSlot { 0,nullptr });
+  Flow(0,0,entry);
+  while(!m_work.empty())
+  {
+    int offset = m_work.back();
+    m_work.pop_back();
+    StackState state = m_states[offset];
+    Execute(offset,state);
+  }
+
+  // All states are proven: record the stack depth and the call sites
+  m_record = true;
+  for(int offset = 0;offset < m_size; ++offset)
+  {
+    if(m_reached[offset])
+    {
+      StackState state = m_states[offset];
+      Execute(offset,state);
+    }
+  }
+}
+
+void
+QLVerifier::Execute(int p_offset,StackState& p_state)
+{
+  const BYTE* pc      = &m_code[p_offset];
+  int         opcode  = pc[0];
+  int         operand = pc[1];
+  int         next    = p_offset + InstructionLength(pc);
+  int         type    = 0;
+
+  if(opcode == OP_WIDE)
+  {
+    opcode  = pc[1];
+    operand = pc[2] | (pc[3] << 8);
+    switch(opcode)
+    {
+      case OP_LIT:    // Fall through
+      case OP_LOAD:   // Fall through
+      case OP_STORE:  // Fall through
+      case OP_MLOAD:  // Fall through
+      case OP_MSTORE: // Fall through
+      case OP_ALOAD:  // Fall through
+      case OP_ASTORE: // Fall through
+      case OP_TLOAD:  // Fall through
+      case OP_TSTORE: // Fall through
+      case OP_TLOADA: // Fall through
+      case OP_TAPPEND:// Fall through
+      case OP_TSPACE: break;
+      default:        Fail(p_offset,_T("Bad wide opcode: %02X"),opcode);
+                      break;
+    }
+  }
+
+  switch(opcode)
+  {
+    case OP_RETURN:   // End of this path
+                      next = -1;
+                      break;
+    case OP_BR:       Flow(p_offset,ReadLong(&pc[1]),p_state);
+                      next = -1;
+                      break;
+    case OP_BRT:      // Fall through
+    case OP_BRF:      Flow(p_offset,ReadLong(&pc[1]),p_state);
+                      break;
+    case OP_CBRT:     // Fall through
+    case OP_CBRF:     if((pc[1] < OP_LT || pc[1] > OP_GT) && (pc[1] < OP_LTII || pc[1] > OP_GTII))
+                      {
+                        Fail(p_offset,_T("Bad compare operator: %02X"),pc[1]);
+                      }
+                      Pop(p_offset,p_state,1);
+                      p_state.back() = StackSlot { 0,nullptr };
+                      Flow(p_offset,ReadLong(&pc[2]),p_state);
+                      break;
+    case OP_SWITCH:   // Fall through
+    case OP_DSWITCH:  // Fall through
+    case OP_HSWITCH:  CheckSwitch(p_offset,pc,p_state);
+                      next = -1;
+                      break;
+    case OP_NIL:      p_state.back() = StackSlot { DTYPE_NIL,nullptr };
+                      break;
+    case OP_PUSH:     Push(p_state,DTYPE_INTEGER);
+                      break;
+    case OP_NOT:      // Fall through
+    case OP_NEG:      // Fall through
+    case OP_BNOT:     // Fall through
+    case OP_DELETE:   p_state.back() = StackSlot { DTYPE_INTEGER,nullptr };
+                      break;
+    case OP_INC:      // Fall through
+    case OP_DEC:      p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_NEW:      p_state.back() = StackSlot { DTYPE_OBJECT,nullptr };
+                      break;
+    case OP_BAND:     // Fall through
+    case OP_BOR:      // Fall through
+    case OP_XOR:      // Fall through
+    case OP_SHR:      Pop(p_offset,p_state,1);
+                      p_state.back() = StackSlot { DTYPE_INTEGER,nullptr };
+                      break;
+    case OP_ADD:      // Fall through
+    case OP_SUB:      // Fall through
+    case OP_MUL:      // Fall through
+    case OP_DIV:      // Fall through
+    case OP_REM:      // Fall through
+    case OP_SHL:      // Fall through
+    case OP_LT:       // Fall through
+    case OP_LE:       // Fall through
+    case OP_EQ:       // Fall through
+    case OP_NE:       // Fall through
+    case OP_GE:       // Fall through
+    case OP_GT:       Pop(p_offset,p_state,1);
+                      p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_ADDII:    // Fall through
+    case OP_SUBII:    // Fall through
+    case OP_MULII:    // Fall through
+    case OP_LTII:     // Fall through
+    case OP_LEII:     // Fall through
+    case OP_EQII:     // Fall through
+    case OP_NEII:     // Fall through
+    case OP_GEII:     // Fall through
+    case OP_GTII:     // Fall through
+    case OP_ADDBB:    // Fall through
+    case OP_SUBBB:    // Fall through
+    case OP_MULBB:    // Fall through
+    case OP_CONCAT:   type = (opcode == OP_CONCAT) ? DTYPE_STRING
+                           : (opcode >= OP_ADDBB)  ? DTYPE_BCD : DTYPE_INTEGER;
+                      // Only with both operands of the type, the result is of the type
+                      if(p_state.size() < 2 ||
+                         p_state[p_state.size() - 1].m_type != type ||
+                         p_state[p_state.size() - 2].m_type != type)
+                      {
+                        type = 0;
+                      }
+                      Pop(p_offset,p_state,1);
+                      p_state.back() = StackSlot { type,nullptr };
+                      break;
+    case OP_LIT:      CheckLiteral(p_offset,operand);
+                      p_state.back() = LiteralSlot(operand);
+                      break;
+    case OP_PLIT:     CheckLiteral(p_offset,operand);
+                      Push(p_state,0);
+                      p_state.back() = LiteralSlot(operand);
+                      break;
+    case OP_INT:      p_state.back() = StackSlot { DTYPE_INTEGER,nullptr };
+                      break;
+    case OP_PINT:     Push(p_state,DTYPE_INTEGER);
+                      break;
+    case OP_LOAD:     // Fall through
+    case OP_STORE:    if(operand >= m_vm->GetGlobalsSize())
+                      {
+                        Fail(p_offset,_T("Global out of range: %d"),operand);
+                      }
+                      if(opcode == OP_LOAD)
+                      {
+                        p_state.back() = StackSlot { 0,nullptr };
+                      }
+                      break;
+    case OP_MLOAD:    // Fall through
+    case OP_MSTORE:   if(m_function == nullptr || m_function->GetClass() == nullptr)
+                      {
+                        Fail(p_offset,_T("Member outside of a member function"));
+                      }
+                      if(operand >= (int)m_function->GetClass()->GetSize())
+                      {
+                        Fail(p_offset,_T("Member out of range: %d"),operand);
+                      }
+                      if(opcode == OP_MLOAD)
+                      {
+                        p_state.back() = StackSlot { 0,nullptr };
+                      }
+                      break;
+    case OP_ALOAD:    // Fall through
+    case OP_ASTORE:   // Members have the 'this' pointer as an extra argument
+                      if(m_function == nullptr || operand > m_function->GetNumberOfArguments())
+                      {
+                        Fail(p_offset,_T("Argument out of range: %d"),operand);
+                      }
+                      if(opcode == OP_ALOAD)
+                      {
+                        p_state.back() = StackSlot { 0,nullptr };
+                      }
+                      break;
+    case OP_TSPACE:   if(m_function == nullptr || p_offset != 0)
+                      {
+                        Fail(p_offset,_T("TSPACE not at the start of a function"));
+                      }
+                      while((int)p_state.size() <= m_temporaries)
+                      {
+                        Push(p_state,DTYPE_NIL);
+                      }
+                      break;
+    case OP_TLOAD:    // Fall through
+    case OP_TLOADA:   CheckTemporary(p_offset,operand);
+                      p_state.back() = p_state[operand + 1];
+                      break;
+    case OP_TLOADP:   CheckTemporary(p_offset,operand);
+                      p_state.back() = p_state[operand + 1];
+                      Push(p_state,DTYPE_INTEGER);
+                      break;
+    case OP_PTLOAD:   CheckTemporary(p_offset,operand);
+                      Push(p_state,0);
+                      p_state.back() = p_state[operand + 1];
+                      break;
+    case OP_TSTORE:   CheckTemporary(p_offset,operand);
+                      p_state[operand + 1] = p_state.back();
+                      break;
+    case OP_TINC:     // Fall through
+    case OP_TDEC:     CheckTemporary(p_offset,operand);
+                      p_state[operand + 1] = p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_TAPPEND:  CheckTemporary(p_offset,operand);
+                      Pop(p_offset,p_state,1);
+                      p_state[operand + 1] = p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_VLOAD:    Pop(p_offset,p_state,1);
+                      p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_VSTORE:   Pop(p_offset,p_state,2);
+                      p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_CALL:     if(m_record && ProvenCall(p_state,operand))
+                      {
+                        m_proven[p_offset] = true;
+                      }
+                      Pop(p_offset,p_state,operand);
+                      p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_SEND:     // Fall through
+    case OP_VSEND:    // At least the selector, that becomes the 'this' pointer
+                      if(operand < 1)
+                      {
+                        Fail(p_offset,_T("Send without a selector"));
+                      }
+                      Pop(p_offset,p_state,operand);
+                      p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    case OP_DUP2:     if((int)p_state.size() - 2 < m_floor)
+                      {
+                        Fail(p_offset,_T("Stack underflow"));
+                      }
+                      p_state.push_back(p_state[p_state.size() - 2]);
+                      p_state.push_back(p_state[p_state.size() - 2]);
+                      break;
+    case OP_DESTROY:  // The object is pushed once more for the 'destroy' method
+                      Push(p_state,DTYPE_OBJECT);
+                      if(m_record)
+                      {
+                        m_maxstack = max(m_maxstack,(int)p_state.size() - 1);
+                      }
+                      Pop(p_offset,p_state,1);
+                      p_state.back() = StackSlot { 0,nullptr };
+                      break;
+    default:          Fail(p_offset,_T("Bad opcode: %02X"),opcode);
+                      break;
+  }
+  if(m_record)
+  {
+    m_maxstack = max(m_maxstack,(int)p_state.size() - 1);
+  }
+  if(next >= 0)
+  {
+    Flow(p_offset,next,p_state);
+  }
+}
+
+// Merge a state into the one known for the target
+// Datatypes and functions that differ between the paths are not known
+void
+QLVerifier::Flow(int p_offset,int p_target,const StackState& p_state)
+{
+  if(p_target < 0 || p_target > m_size || !m_boundary[p_target])
+  {
+    Fail(p_offset,_T("Branch to a bad offset: %d"),p_target);
+  }
+  // The end marker stops the interpreter with a bad opcode
+  if(p_target == m_size || m_record)
+  {
+    return;
+  }
+  StackState& known = m_states[p_target];
+  if(!m_reached[p_target])
+  {
+    m_reached[p_target] = true;
+    known = p_state;
+    m_work.push_back(p_target);
+    return;
+  }
+  if(known.size() != p_state.size())
+  {
+    Fail(p_target,_T("Stack depth differs between paths: %d and %d"),(int)known.size() - 1,(int)p_state.size() - 1);
+  }
+  bool changed = false;
+  for(size_t ind = 0;ind < known.size(); ++ind)
+  {
+    if(known[ind].m_type && known[ind].m_type != p_state[ind].m_type)
+    {
+      known[ind].m_type = 0;
+      changed = true;
+    }
+    if(known[ind].m_function && known[ind].m_function != p_state[ind].m_function)
+    {
+      known[ind].m_function = nullptr;
+      changed = true;
+    }
+  }
+  if(changed)
+  {
+    m_work.push_back(p_target);
+  }
+}
+
+void
+QLVerifier::Pop(int p_offset,StackState& p_state,int p_count)
+{
+  if((int)p_state.size() - 1 - p_count < m_floor)
+  {
+    Fail(p_offset,_T("Stack underflow"));
+  }
+  StackSlot tos = p_state.back();
+  p_state.resize(p_state.size() - p_count);
+  p_state.back() = tos;
+}
+
+void
+QLVerifier::Push(StackState& p_state,int p_type)
+{
+  p_state.push_back(StackSlot { p_type,nullptr });
+}
+
+void
+QLVerifier::CheckLiteral(int p_offset,int p_literal)
+{
+  if(p_literal >= m_literals)
+  {
+    Fail(p_offset,_T("Literal out of range: %d"),p_literal);
+  }
+}
+
+// The last temporary is the TOS of the function itself
+void
+QLVerifier::CheckTemporary(int p_offset,int p_temporary)
+{
+  if(m_function == nullptr || p_temporary >= m_temporaries)
+  {
+    Fail(p_offset,_T("Temporary out of range: %d"),p_temporary);
+  }
+}
+
+// All labels of a switch, and the literals of its cases
+// Jump tables have label zero for an empty slot
+void
+QLVerifier::CheckSwitch(int p_offset,const BYTE* p_pc,const StackState& p_state)
+{
+  if(m_function == nullptr)
+  {
+    Fail(p_offset,_T("Switch outside of a function"));
+  }
+  int slots = p_pc[1] | (p_pc[2] << 8);
+  int ind   = SwitchTableOffset(p_pc);
+  int empty = 0;
+
+  // Probing of the hash table ends on an empty slot
+  if(*p_pc == OP_HSWITCH && (slots == 0 || (slots & (slots - 1))))
+  {
+    Fail(p_offset,_T("Hash table size is not a power of two: %d"),slots);
+  }
+  for(int slot = 0;slot < slots; ++slot,ind += 6)
+  {
+    int literal = p_pc[ind] | (p_pc[ind + 1] << 8);
+    int label   = ReadLong(&p_pc[ind + 2]);
+    if(*p_pc != OP_SWITCH && label == 0)
+    {
+      ++empty;
+      continue;
+    }
+    if(*p_pc != OP_DSWITCH)
+    {
+      CheckLiteral(p_offset,literal);
+    }
+    if(*p_pc == OP_HSWITCH)
+    {
+      int type = (p_pc[3] == DTYPE_INTEGER) ? DTYPE_INTEGER : DTYPE_STRING;
+      if(m_function->GetLiteral(literal)->m_type != type)
+      {
+        Fail(p_offset,_T("Case of a hash table is not of its type"));
+      }
+    }
+    Flow(p_offset,label,p_state);
+  }
+  if(*p_pc == OP_HSWITCH && empty == 0)
+  {
+    Fail(p_offset,_T("Hash table without an empty slot"));
+  }
+  // The default label
+  Flow(p_offset,ReadLong(&p_pc[ind]),p_state);
+}
+
+// The function of the call gets exactly the arguments it is tested for
+bool
+QLVerifier::ProvenCall(const StackState& p_state,int p_arguments)
+{
+  int top = (int)p_state.size() - 1;
+  if(top - p_arguments < m_floor)
+  {
+    return false;
+  }
+  Function* function = p_state[top - p_arguments].m_function;
+  if(function == nullptr || function->GetNumberOfArguments() != p_arguments)
+  {
+    return false;
+  }
+  for(int ind = 0;ind < p_arguments; ++ind)
+  {
+    if(p_state[top - ind].m_type != function->GetArgument(ind))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Literals of a function are constants or symbols, that only change
+// by a compile or a load. After that all bytecode is verified again.
+// Calling a string or a script is calling the script function
+StackSlot
+QLVerifier::LiteralSlot(int p_literal)
+{
+  StackSlot  slot    { 0,nullptr };
+  MemObject* literal = m_function ? m_function->GetLiteral(p_literal)
+                                  : m_vm->GetLiteral(p_literal);
+  if(literal == nullptr)
+  {
+    return slot;
+  }
+  switch(literal->m_type)
+  {
+    case DTYPE_INTEGER: // Fall through
+    case DTYPE_BCD:     slot.m_type     = literal->m_type;
+                        break;
+    case DTYPE_STRING:  slot.m_type     = DTYPE_STRING;
+                        slot.m_function = m_vm->FindScript(*literal->m_value.v_string);
+                        break;
+    case DTYPE_SCRIPT:  slot.m_type     = DTYPE_SCRIPT;
+                        slot.m_function = literal->m_value.v_script;
+                        break;
+  }
+  return slot;
+}
+
+void
+QLVerifier::Fail(int p_offset,LPCTSTR p_format,...)
+{
+  CString text;
+  va_list argList;
+  va_start(argList,p_format);
+  text.FormatV(p_format,argList);
+  va_end(argList);
+
+  CString message;
+  message.Format(_T("Bytecode of %s not verified at offset %d: %s")
+                ,m_function ? m_function->GetFullName().GetString() : _T("the init code")
+                ,p_offset
+                ,text.GetString());
+  throw QLException(message,EXCEPTION_BY_ERROR);
+}
@@ -0,0 +1,76 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// QL Language bytecode verifier
+// ir. W.E. Huisman (c) 2018
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "QL_Language.h"
+#include <vector>
+
+class QLVirtualMachine;
+class Function;
+
+// What the verifier knows of one slot on the stack
+typedef struct _stackslot
+{
+  int       m_type;     // Datatype of the value, zero if not known
+  Function* m_function; // Script function this value calls, if known
+}
+StackSlot;
+
+// The stack of a function from its frame upwards, last is the TOS
+typedef std::vector<StackSlot>  StackState;
+
+class QLVerifier
+{
+public:
+  QLVerifier(QLVirtualMachine* p_vm);
+
+  // Verify the bytecode of a script function and store the results in it
+  // A QLException is thrown if the bytecode cannot be proven correct
+  void        Verify(Function* p_function);
+  // Verify the init code. Returns the maximum depth of its stack
+  int         VerifyInitCode(const BYTE* p_code,int p_size);
+  // Stack depth on entry of each instruction of a verified function
+  // Offsets that no path reaches get a depth of -1
+  void        Depths(Function* p_function,std::vector<int>& p_depths);
+
+private:
+  // Find the instruction boundaries and prove every state
+  void        Run();
+  // One instruction: checks operands and brings the state to the next one
+  // In the last pass the stack depth and the call sites are recorded
+  void        Execute(int p_offset,StackState& p_state);
+  // The state flows to a branch target or the next instruction
+  void        Flow(int p_offset,int p_target,const StackState& p_state);
+  // Pop operands of an instruction, keeping the TOS
+  void        Pop(int p_offset,StackState& p_state,int p_count);
+  void        Push(StackState& p_state,int p_type);
+  // Operand checks
+  void        CheckLiteral  (int p_offset,int p_literal);
+  void        CheckTemporary(int p_offset,int p_temporary);
+  void        CheckSwitch   (int p_offset,const BYTE* p_pc,const StackState& p_state);
+  // Call site with a known function, right number and types of arguments
+  bool        ProvenCall(const StackState& p_state,int p_arguments);
+  // Value of a literal: its datatype and the function it calls
+  StackSlot   LiteralSlot(int p_literal);
+  // Stop verifying with an exception
+  void        Fail(int p_offset,LPCTSTR p_format,...);
+
+  QLVirtualMachine*       m_vm;
+  Function*               m_function;   // Function verified, or nullptr for init code
+  const BYTE*             m_code;
+  int                     m_size;
+  int                     m_floor;      // Lowest TOS of the function (after TSPACE)
+  int                     m_temporaries;// Operand of TSPACE
+  int                     m_literals;   // Number of literals
+  int                     m_maxstack;   // Deepest stack found
+  bool                    m_record;     // Last pass over the proven states
+  std::vector<bool>       m_boundary;   // Offsets where an instruction starts
+  std::vector<bool>       m_reached;    // Offsets reached by the control flow
+  std::vector<StackState> m_states;     // Stack on entry of each reached instruction
+  std::vector<int>        m_work;       // Offsets with a changed state
+  std::vector<bool>       m_proven;     // OP_CALL sites with proven arguments
+};
@@ -16,9 +16,15 @@
 #include "QL_Compiler.h"
 #include "QL_Debugger.h"
 #include "QL_Opcodes.h"
+#include "QL_Verifier.h"
+#include "QL_Tasks.h"
 #include "bcd.h"
+#include <Crypto.h>
+#include <CRC32.h>
 #include <stdarg.h>
+#include <intrin.h>
 #include <io.h>
+#include <algorithm>
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -36,31 +42,65 @@ CString db_password;
 
 QLVirtualMachine::QLVirtualMachine()
 {
-  m_root_object   = nullptr;
-  m_last_object   = nullptr;
+  m_pages         = nullptr;
+  m_freelist      = nullptr;
+  m_numpages      = 0;
+  m_minor         = false;
+  m_promoted      = 0;
+  m_oldLive       = 0;
+  m_marking       = false;
+  m_markTicks     = 0;
+  m_markBudget    = MARK_BUDGET_DEFAULT;
   m_interpreter   = nullptr;
   m_globals       = nullptr;
   m_literals      = nullptr;
   m_initcode      = nullptr;
+  m_initthreaded  = nullptr;
+  m_initMaxStack  = -1;
+  m_codeImage     = nullptr;
+  m_lastTask      = 0;
+  m_capture       = nullptr;
   m_transaction   = nullptr;
   m_threshold     = THRESHOLD_DEFAULT;
   m_dumpchain     = false;
+  m_silent        = false;
   m_allocs        = 0;
   m_position      = 0;
   m_initcode_size = 0;
-
+  m_sendEpoch     = 1;
+  m_fileVersion   = QL_VERSION;
+  m_compressFrom  = -1;
+  m_compress      = false;
+  m_inposition    = 0;
+  m_outputSize    = OUTPUT_BUFFER_DEFAULT;
+  // Interactive: see each line at once. Redirected: write in large blocks
+  m_outputFlush   = _isatty(_fileno(stdout)) ? QL_FLUSH_LINE : QL_FLUSH_FULL;
+  m_output.reserve(m_outputSize + 1);
+
+  memset(&m_gcstats,0,sizeof(GCStats));
+  QueryPerformanceFrequency(&m_frequency);
+
+  InitImmediates();
   InitializeCriticalSection(&m_lock);
 }
 
 QLVirtualMachine::~QLVirtualMachine()
 {
+  CleanUpTasks();
+  FlushOutput();
   DestroyObjectChain();
   CleanUpClasses();
   CleanUpGlobals();
   CleanUpLiterals();
   CleanUpMethods();
   CleanUpInitcode();
+  CleanUpImages();
 
+  delete [] m_immediates;
+  for(auto& page : m_immediatePages)
+  {
+    delete [] page;
+  }
   DeleteCriticalSection(&m_lock);
 }
 
@@ -70,14 +110,11 @@ QLVirtualMachine::CheckInit()
   // Initialize the SQLComponents to the English language
   InitSQLComponents();
 
-  // See if the gc object chain has been initialized
-  if(m_root_object == nullptr)
+  // See if the gc object pages have been initialized
+  if(m_pages == nullptr)
   {
-    // Very special call to AllocMemObject. VM not initialized yet
-    m_root_object = AllocMemObject(DTYPE_ENDMARK, false);
-    m_last_object = AllocMemObject(DTYPE_ENDMARK,false);
-    m_root_object->m_next = m_last_object;
-    m_last_object->m_prev = m_root_object;
+    // Our first page of MemObjects
+    AllocMemPage();
 
     init_functions(this);
 
@@ -86,13 +123,49 @@ QLVirtualMachine::CheckInit()
   }
 }
 
+// Create the shared NIL and small integer values.
+// They live outside the GC chain and are permanently marked,
+// so pushing them on the stack never allocates
+void
+QLVirtualMachine::InitImmediates()
+{
+  m_immediates = new MemObject[IMMEDIATE_COUNT + 1];
+  for(int ind = 0;ind <= IMMEDIATE_COUNT; ++ind)
+  {
+    MemObject* object = &m_immediates[ind];
+    object->m_type       = ind ? DTYPE_INTEGER : DTYPE_NIL;
+    object->m_generation = GC_ALIVE | GC_MARKED | GC_OLD;
+    object->m_flags      = FLAG_IMMEDIATE | FLAG_REFERENCE;
+    object->m_value.v_integer = ind ? IMMEDIATE_MIN + ind - 1 : 0;
+  }
+  memset(m_immediatePages,0,sizeof(m_immediatePages));
+}
+
+// One page of the wider range of immediates, made on first use
+MemObject*
+QLVirtualMachine::AllocImmediatePage(int p_page)
+{
+  MemObject* page  = new MemObject[IMMEDIATE_PAGE];
+  int        first = IMMEDIATE_WIDE_MIN + p_page * IMMEDIATE_PAGE;
+  for(int ind = 0;ind < IMMEDIATE_PAGE; ++ind)
+  {
+    MemObject* object = &page[ind];
+    object->m_type       = DTYPE_INTEGER;
+    object->m_generation = GC_ALIVE | GC_MARKED | GC_OLD;
+    object->m_flags      = FLAG_IMMEDIATE | FLAG_REFERENCE;
+    object->m_value.v_integer = first + ind;
+  }
+  m_immediatePages[p_page] = page;
+  return page;
+}
+
 // Setting the alloc threshold for the GC
 void        
 QLVirtualMachine::SetGCThreshold(int p_threshold)
 {
-  if(p_threshold < THRESHOLD_RELAXED)
+  if(p_threshold < THRESHOLD_AGGRESIVE)
   {
-    p_threshold = THRESHOLD_RELAXED;
+    p_threshold = THRESHOLD_AGGRESIVE;
   }
   if(p_threshold > THRESHOLD_RELAXED)
   {
@@ -101,6 +174,16 @@ QLVirtualMachine::SetGCThreshold(int p_threshold)
   m_threshold = p_threshold;
 }
 
+void
+QLVirtualMachine::SetGCBudget(int p_microseconds)
+{
+  if(p_microseconds < 1)
+  {
+    p_microseconds = 1;
+  }
+  m_markBudget = p_microseconds;
+}
+
 /*static*/ void
 QLVirtualMachine::Error(LPCTSTR p_format,...)
 {
@@ -125,6 +208,7 @@ QLVirtualMachine::Info(LPCTSTR p_format,...)
   va_start(argList, p_format);
   text.FormatV(p_format, argList);
   va_end(argList);
+  FlushOutput();
   _ftprintf(stdout,_T("[%s]\n"),text.GetString());
 }
 
@@ -134,27 +218,29 @@ QLVirtualMachine::Info(LPCTSTR p_format,...)
 //
 //////////////////////////////////////////////////////////////////////////
 
-static XString g_input_buffer;
-static int     g_input_position;
+// Per thread, as VMs can compile at the same time
+// A thread variable has no constructor: the buffer lives in CompileFile
+__declspec(thread) static XString* g_input_buffer   = nullptr;
+__declspec(thread) static int      g_input_position = 0;
 
-static void readfile_reset()
+static void readfile_reset(XString* p_buffer)
 {
   g_input_position = 0;
-  g_input_buffer.Empty();
+  g_input_buffer   = p_buffer;
 }
 
 static int readfile(void* p_buff)
 {
   WinFile* file = reinterpret_cast<WinFile*>(p_buff);
-  if(g_input_position >= g_input_buffer.GetLength())
+  if(g_input_position >= g_input_buffer->GetLength())
   {
-    if(!file->Read(g_input_buffer))
+    if(!file->Read(*g_input_buffer))
     {
       return EOF;
     }
     g_input_position = 0;
   }
-  return g_input_buffer.GetAt(g_input_position++);
+  return g_input_buffer->GetAt(g_input_position++);
 }
 
 // Compile a QL source code file into this VM
@@ -183,13 +269,23 @@ QLVirtualMachine::CompileFile(LPCTSTR p_filename,bool p_trace)
     filename += _T(".ql");
   }
 
-  readfile_reset();
+  // Our code changes: contexts cannot share an image of it any more
+  SetCodeImage(nullptr);
+
+  XString buffer;
+  readfile_reset(&buffer);
   WinFile file(filename);
   if(file.Open(winfile_read))
   {
     result = comp.CompileDefinitions((int(*)(void*))readfile,(void*)&file);
     file.Close();
   }
+  // New classes and methods: all send sites must resolve again
+  FinalizeClasses();
+  if(result)
+  {
+    result = VerifyCode();
+  }
 
   // Remove the debugger again
   if(dbg)
@@ -197,10 +293,143 @@ QLVirtualMachine::CompileFile(LPCTSTR p_filename,bool p_trace)
     delete dbg;
     dbg = nullptr;
   }
-  readfile_reset();
+  readfile_reset(nullptr);
   return result;
 }
 
+// Compile a source file, or load the object file that was written to
+// the cache the last time this source was compiled. The cache is only
+// used for the first file of a VM, as the object file holds the whole VM
+bool
+QLVirtualMachine::CompileCached(LPCTSTR p_filename,bool p_trace)
+{
+  CheckInit();
+
+  CString filename(p_filename);
+  if(filename.Right(3).CompareNoCase(_T(".ql")))
+  {
+    filename += _T(".ql");
+  }
+  CString directory = GetCacheDirectory();
+  CString hash      = HashSourceFile(filename);
+  if(directory.IsEmpty() || hash.IsEmpty() || !m_scripts.empty() || !m_classes.empty())
+  {
+    return CompileFile(p_filename,p_trace);
+  }
+
+  // Cache hit: the source has not changed since the last compile.
+  // A damaged entry, or one of another QL version, is removed and the
+  // source is compiled again: the cache must never fail a run
+  CString cached = directory + hash + _T(".qob");
+  if(_taccess(cached,04) == 0)
+  {
+    QLImage* image = QLImage::Acquire(cached);
+    if(image)
+    {
+      bool good   = ProbeCached(image);
+      bool loaded = good && LoadFile(const_cast<TCHAR*>(cached.GetString()),false);
+      image->Release();
+      if(good)
+      {
+        return loaded;
+      }
+    }
+    DeleteFile(cached);
+  }
+  if(CompileFile(p_filename,p_trace) == false)
+  {
+    return false;
+  }
+
+  // Cache miss: write under a private name first, as many scripts can
+  // be started at the same time. All of them write the same code, so
+  // the last one to finish replaces the entry (or a damaged one)
+  CString temporary;
+  temporary.Format(_T("%s%s_%u.qob"),directory.GetString(),hash.GetString(),GetCurrentProcessId());
+  if(WriteFile(const_cast<TCHAR*>(temporary.GetString()),false))
+  {
+    if(!MoveFileEx(temporary,cached,MOVEFILE_REPLACE_EXISTING))
+    {
+      DeleteFile(temporary);
+    }
+  }
+  return true;
+}
+
+// Read and verify a cached image in a VM of its own, so a bad image
+// never leaves half a program in ours. The image is only checked
+/*static*/ bool
+QLVirtualMachine::ProbeCached(QLImage* p_image)
+{
+  QLVirtualMachine probe;
+  probe.m_silent = true;
+  return probe.LoadContext(p_image);
+}
+
+// The cache directory, made if it does not exist yet
+// Default is QL_CACHE or %LOCALAPPDATA%\QL\Cache
+CString
+QLVirtualMachine::GetCacheDirectory()
+{
+  if(m_cacheDirectory.IsEmpty())
+  {
+    CString appdata;
+    if(appdata.GetEnvironmentVariable(_T("QL_CACHE")))
+    {
+      m_cacheDirectory = appdata;
+    }
+    else if(appdata.GetEnvironmentVariable(_T("LOCALAPPDATA")))
+    {
+      CreateDirectory(appdata + _T("\\QL"),NULL);
+      m_cacheDirectory = appdata + _T("\\QL\\Cache");
+    }
+    else
+    {
+      return CString();
+    }
+  }
+  if(m_cacheDirectory.Right(1) != _T("\\"))
+  {
+    m_cacheDirectory += _T("\\");
+  }
+  CreateDirectory(m_cacheDirectory,NULL);
+  return m_cacheDirectory;
+}
+
+// SHA-256 of the source, the QL version and the character size.
+// A CRC32 if the crypto provider is not available
+CString
+QLVirtualMachine::HashSourceFile(CString p_filename)
+{
+  std::vector<BYTE> source;
+  FILE* file = nullptr;
+  _tfopen_s(&file,p_filename,_T("rb"));
+  if(file == nullptr)
+  {
+    return CString();
+  }
+  BYTE buffer[4096];
+  size_t size = 0;
+  while((size = fread(buffer,1,sizeof(buffer),file)) > 0)
+  {
+    source.insert(source.end(),buffer,buffer + size);
+  }
+  fclose(file);
+
+  DWORD version[2] = { QL_VERSION,sizeof(TCHAR) };
+  source.insert(source.end(),(BYTE*)version,(BYTE*)version + sizeof(version));
+
+  Crypto crypto(CALG_SHA_256);
+  crypto.SetDigestBase64(false);
+  CString hash = crypto.Digest(source.data(),source.size());
+  hash.Trim();
+  if(hash.IsEmpty())
+  {
+    hash.Format(_T("crc%08X_%u"),ComputeCRC32(0,source.data(),(UINT)source.size()),(unsigned)source.size());
+  }
+  return hash;
+}
+
 bool
 QLVirtualMachine::IsObjectFile(const TCHAR* p_filename)
 {
@@ -219,6 +448,12 @@ QLVirtualMachine::IsObjectFile(const TCHAR* p_filename)
   _tfopen_s(&fp,filename,_T("r"));
   if(fp != nullptr)
   {
+    // Version 3 images start with their own marker
+    if(QLImage::IsImage(fp))
+    {
+      fclose(fp);
+      return true;
+    }
     try
     {
       if(ReadHeader(fp,false))
@@ -294,10 +529,18 @@ QLVirtualMachine::CompileBuffer(LPCTSTR p_buffer,bool p_trace)
     dbg = new QLDebugger(this);
     comp.SetDebugger(dbg,1);
   }
+  // Our code changes: contexts cannot share an image of it any more
+  SetCodeImage(nullptr);
   // Reset our buffer
   compile_buffer = nullptr;
   // Compile the buffered string
   result = comp.CompileDefinitions(readbuffer,(void*)p_buffer);
+  // New classes and methods: all send sites must resolve again
+  FinalizeClasses();
+  if(result)
+  {
+    result = VerifyCode();
+  }
 
   // Remove the debugger again
   if(dbg)
@@ -320,24 +563,16 @@ QLVirtualMachine::AllocMemObject(int p_type,bool p_running /*=true*/)
   // Call the garbage collector every now and then!
   if((m_allocs % m_threshold) == 0)
   {
-    GC();
+    CollectGarbage();
   }
 
-  // Create a new MemObject
-  MemObject* object = new MemObject;
-
-  // Place object in the GC chain
-  if(m_last_object)
-  {
-    object->m_prev = m_last_object->m_prev;
-    m_last_object->m_prev = object;
-    object->m_next = m_last_object;
-    object->m_prev->m_next = object;
-  }
-  else if(p_running)
+  if(m_pages == nullptr && p_running)
   {
     Error(_T("INTERNAL: AllocMemObject called before VM is initialized!"));
   }
+  // Take a new MemObject from the free list
+  MemObject* object = NewMemObject();
+
   // Record the flags
   object->m_generation = GC_ALIVE;
   object->m_flags     |= FLAG_NULL;
@@ -358,23 +593,25 @@ QLVirtualMachine::AllocMemObject(int p_type,bool p_running /*=true*/)
 MemObject*  
 QLVirtualMachine::AllocMemObject(const MemObject* p_other)
 {
-  // Call the garbage collector every now and then!
-  if ((m_allocs % 1000) == 0)
+  // Integers and NIL are immutable: share the immediate value if we can
+  if(p_other->m_type == DTYPE_NIL)
   {
-    GC();
+    return GetNil();
+  }
+  if(p_other->m_type == DTYPE_INTEGER)
+  {
+    return GetInteger(p_other->m_value.v_integer);
   }
 
-  // Create a new MemObject
-  MemObject* object = new MemObject();
-
-  // Place object in the GC chain
-  if(m_last_object)
+  // Call the garbage collector every now and then!
+  if((m_allocs % m_threshold) == 0)
   {
-    object->m_prev = m_last_object->m_prev;
-    m_last_object->m_prev = object;
-    object->m_next = m_last_object;
-    object->m_prev->m_next = object;
+    CollectGarbage();
   }
+
+  // Take a new MemObject from the free list
+  MemObject* object = NewMemObject();
+
   // Record the flags
   object->m_generation = GC_ALIVE;
   object->m_flags |= FLAG_NULL;
@@ -401,6 +638,7 @@ QLVirtualMachine::AllocMemObject(const MemObject* p_other)
                           object->m_flags |= FLAG_REFERENCE;
                           break;
     case DTYPE_ARRAY:     // Cannot copy this object
+    case DTYPE_MAP:       // Cannot copy this object
     case DTYPE_OBJECT:    // Must be copy object
     case DTYPE_CLASS:     // error
     case DTYPE_SCRIPT:    
@@ -426,22 +664,86 @@ QLVirtualMachine::FreeMemObject(MemObject* p_object,bool p_running /*=true*/)
   // Delete the type data
   MemObjectSetType(p_object,DTYPE_NIL);
 
-  if(p_running)
-  {
-    // If the object is not one of the end-markers in the chain
-    // readjust the prev/next chain of the other objects
-    // so this object becomes free
-    if(p_object->m_next && p_object->m_prev)
-    {
-      p_object->m_prev->m_next = p_object->m_next;
-      p_object->m_next->m_prev = p_object->m_prev;
-    }
-  }
 // #ifdef _DEBUG
 //   TRACE("Freeing an alloc: %d\n",--m_allocs);
 // #endif
-  // Now delete the MemObject
-  delete p_object;
+  // Now give the MemObject back to its page
+  if(p_running)
+  {
+    ReleaseMemObject(p_object);
+  }
+}
+
+// Pop a MemObject from the free list
+MemObject*
+QLVirtualMachine::NewMemObject()
+{
+  if(m_freelist == nullptr)
+  {
+    AllocMemPage();
+  }
+  MemObject* object = m_freelist;
+  m_freelist = reinterpret_cast<MemObject*>(object->m_value.v_all);
+  object->m_value.v_all = NULL;
+
+  MemPage* page = MemPage::PageOf(object);
+  page->SetInUse(page->IndexOf(object));
+  ++page->m_used;
+
+  // All new objects are born in the nursery
+  m_nursery.push_back(object);
+  return object;
+}
+
+// Push a MemObject on the free list
+void
+QLVirtualMachine::ReleaseMemObject(MemObject* p_object)
+{
+  MemPage* page  = MemPage::PageOf(p_object);
+  int      index = page->IndexOf(p_object);
+  page->SetFree(index);
+  page->ClearMark(index);
+  --page->m_used;
+
+  p_object->m_type       = 0;
+  p_object->m_flags      = 0;
+  p_object->m_generation = 0;
+  p_object->m_storage    = 0;
+  p_object->m_value.v_all = (UINT_PTR) m_freelist;
+  m_freelist = p_object;
+}
+
+// Get a new page of MemObjects from the OS.
+// VirtualAlloc returns zeroed memory on the allocation granularity,
+// so all MemObjects in the page are empty and the page is aligned
+void
+QLVirtualMachine::AllocMemPage()
+{
+  void* memory = VirtualAlloc(nullptr,MEMPAGE_BYTES,MEM_RESERVE | MEM_COMMIT,PAGE_READWRITE);
+  if(memory == nullptr)
+  {
+    Error(_T("Out of memory: cannot allocate a new page of objects"));
+  }
+  MemPage* page = reinterpret_cast<MemPage*>(memory);
+  page->m_next  = m_pages;
+  m_pages = page;
+  ++m_numpages;
+
+  // Thread all objects on the free list in ascending order
+  for(int ind = (int)MEMPAGE_OBJECTS - 1;ind >= 0; --ind)
+  {
+    page->m_objects[ind].m_value.v_all = (UINT_PTR) m_freelist;
+    m_freelist = &page->m_objects[ind];
+  }
+}
+
+// Return a page to the OS
+// The objects of the page may not be on the free list!
+void
+QLVirtualMachine::FreeMemPage(MemPage* p_page)
+{
+  VirtualFree(p_page,0,MEM_RELEASE);
+  --m_numpages;
 }
 
 // Can be called with DTYPE_NIL to deallocate storage and set to NIL
@@ -609,12 +911,14 @@ QLVirtualMachine::DestroyObject(MemObject* p_object)
 {
   if(p_object->m_type == DTYPE_OBJECT)
   {
+    // The attributes may not stay in the remembered set of the GC
+    ForgetArray(&p_object->m_value.v_object->GetAttributes());
     FreeMemObject(p_object);
 
     // Call the garbage collector every now and then!
     if((m_allocs++ % m_threshold) == 0)
     {
-      GC();
+      CollectGarbage();
     }
     return 1;
   }
@@ -734,10 +1038,166 @@ QLVirtualMachine::AddMethod(CString p_name, int p_type)
     found->m_internal   = nullptr;
     // Remember new method
     m_methods.insert(std::make_pair(p_name,found));
+    InvalidateSendCaches();
   }
   return found;
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+// SEND RESOLUTION FOR THE INLINE CACHES
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Give each selector name a number, starting at 1
+int
+QLVirtualMachine::InternSelector(CString& p_selector)
+{
+  SelectorMap::iterator it = m_selectors.find(p_selector);
+  if(it != m_selectors.end())
+  {
+    return it->second;
+  }
+  int selector = (int)m_selectors.size() + 1;
+  m_selectors.insert(std::make_pair(p_selector,selector));
+  return selector;
+}
+
+// Find the member function of a class that answers to a selector
+// Returns a DTYPE_SCRIPT or DTYPE_INTERNAL member, or nullptr
+MemObject*
+QLVirtualMachine::FindSendMember(Class* p_class,int p_selector,CString& p_name)
+{
+  SendKey key(p_class,p_selector);
+  SendMemberMap::iterator it = m_sendMembers.find(key);
+  if(it != m_sendMembers.end())
+  {
+    return it->second;
+  }
+  MemObject* member = p_class->RecursiveFindFuncMember(p_name);
+  if(member && member->m_type == DTYPE_STRING)
+  {
+    // Declared in the class, but defined later on
+    member = p_class->FindFuncMember(p_name);
+  }
+  if(member == nullptr)
+  {
+    return nullptr;
+  }
+  if(member->m_type == DTYPE_SCRIPT || member->m_type == DTYPE_INTERNAL)
+  {
+    m_sendMembers.insert(std::make_pair(key,member));
+  }
+  return member;
+}
+
+// Find the method of an internal datatype that answers to a selector
+Method*
+QLVirtualMachine::FindSendMethod(int p_type,int p_selector,CString& p_name)
+{
+  SendKey key((const void*)(INT_PTR)p_type,p_selector);
+  SendMethodMap::iterator it = m_sendMethods.find(key);
+  if(it != m_sendMethods.end())
+  {
+    return it->second;
+  }
+  Method* method = FindMethod(p_name,p_type);
+  if(method)
+  {
+    m_sendMethods.insert(std::make_pair(key,method));
+  }
+  return method;
+}
+
+// Build the vtables of all classes for a new send epoch
+void
+QLVirtualMachine::FinalizeClasses()
+{
+  InvalidateSendCaches();
+  for(auto& cl : m_classes)
+  {
+    cl.second->BuildVTable(this,m_sendEpoch);
+  }
+}
+
+// Verify the bytecode of all functions and the init code
+// Call sites are proven with the functions they call, so after a
+// compile or a load all bytecode is verified again
+bool
+QLVirtualMachine::VerifyCode()
+{
+  QLVerifier verifier(this);
+  try
+  {
+    for(auto& script : m_scripts)
+    {
+      if(script.second->m_type == DTYPE_SCRIPT && script.second->m_value.v_script)
+      {
+        verifier.Verify(script.second->m_value.v_script);
+      }
+    }
+    for(auto& cl : m_classes)
+    {
+      Array& members = cl.second->GetMembers();
+      for(int ind = 0;ind < members.GetSize(); ++ind)
+      {
+        MemObject* member = members.GetEntry(ind);
+        if(member->m_type == DTYPE_SCRIPT && member->m_value.v_script)
+        {
+          verifier.Verify(member->m_value.v_script);
+        }
+      }
+    }
+    m_initMaxStack = m_initcode ? verifier.VerifyInitCode(m_initcode,m_initcode_size + 1) : -1;
+  }
+  catch(QLException& exception)
+  {
+    if(!m_silent)
+    {
+      _ftprintf(stderr,_T("%s\n"),exception.GetMessage().GetString());
+    }
+    return false;
+  }
+  return true;
+}
+
+// Deepest stack of a function or of the init code (nullptr)
+// Bytecode that was not verified yet, is verified now
+int
+QLVirtualMachine::Verify(Function* p_function)
+{
+  QLVerifier verifier(this);
+  try
+  {
+    if(p_function)
+    {
+      if(!p_function->GetVerified())
+      {
+        verifier.Verify(p_function);
+      }
+      return p_function->GetMaxStack();
+    }
+    if(m_initMaxStack < 0 && m_initcode)
+    {
+      m_initMaxStack = verifier.VerifyInitCode(m_initcode,m_initcode_size + 1);
+    }
+  }
+  catch(QLException& exception)
+  {
+    Error(_T("%s\n"),exception.GetMessage().GetString());
+  }
+  return max(m_initMaxStack,0);
+}
+
+// All inline caches with an older epoch are stale
+void
+QLVirtualMachine::InvalidateSendCaches()
+{
+  ++m_sendEpoch;
+  m_sendMembers.clear();
+  m_sendMethods.clear();
+}
+
 void
 QLVirtualMachine::AddBytecode(BYTE* p_bytecode,unsigned p_size)
 {
@@ -751,13 +1211,32 @@ QLVirtualMachine::AddBytecode(BYTE* p_bytecode,unsigned p_size)
   {
     BYTE* code = new BYTE[m_initcode_size + p_size + 1];
     memcpy(code,m_initcode,m_initcode_size);
-    memcpy(&m_initcode[m_initcode_size],p_bytecode,p_size);
+    memcpy(&code[m_initcode_size],p_bytecode,p_size);
     m_initcode_size += p_size;
     delete [] m_initcode;
     m_initcode = code;
   }
   // Mark as the end of the init group
   m_initcode[m_initcode_size] = (BYTE) OP_RETURN;
+  m_initMaxStack = -1;
+
+  // Threaded code must be decoded again
+  if(m_initthreaded)
+  {
+    delete [] m_initthreaded;
+    m_initthreaded = nullptr;
+  }
+}
+
+// Pre-decoded init code, including the closing OP_RETURN
+Instruction*
+QLVirtualMachine::GetThreadedCode()
+{
+  if(m_initthreaded == nullptr && m_initcode)
+  {
+    m_initthreaded = DecodeBytecode(m_initcode,m_initcode_size + 1);
+  }
+  return m_initthreaded;
 }
 
 
@@ -768,10 +1247,13 @@ QLVirtualMachine::AddBytecode(BYTE* p_bytecode,unsigned p_size)
 //////////////////////////////////////////////////////////////////////////
 
 // print1 - print one value 
+// Integers and strings go to the output buffer without a CString in between
 int
 QLVirtualMachine::Print(WinFile* p_fp,int p_quoteFlag,MemObject* p_value)
 {
-  int len = 0;
+  int     len  = 0;
+  LPCTSTR text = nullptr;
+  TCHAR   number[16];
   CString value;
 
   if(p_fp == nullptr)
@@ -786,12 +1268,18 @@ QLVirtualMachine::Print(WinFile* p_fp,int p_quoteFlag,MemObject* p_value)
                         break;
     case DTYPE_ENDMARK: value = _T("<ENDMARK>");
                         break;
-    case DTYPE_INTEGER: value.Format(_T("%ld"),p_value->m_value.v_integer);
+    case DTYPE_INTEGER: _itot_s(p_value->m_value.v_integer,number,16,10);
+                        text = number;
+                        len  = (int)_tcslen(number);
                         break;
-    case DTYPE_STRING:  value = *p_value->m_value.v_string;
-                        if (p_quoteFlag)
+    case DTYPE_STRING:  if (p_quoteFlag)
+                        {
+                          value = _T("\"") + *p_value->m_value.v_string + _T("\"");
+                        }
+                        else
                         {
-                          value = _T("\"") + value + _T("\"");
+                          text = p_value->m_value.v_string->GetString();
+                          len  = p_value->m_value.v_string->GetLength();
                         }
                         break;
     case DTYPE_BCD:     value = p_value->m_value.v_floating->AsString();
@@ -806,6 +1294,7 @@ QLVirtualMachine::Print(WinFile* p_fp,int p_quoteFlag,MemObject* p_value)
                         break;
     case DTYPE_ARRAY:   value.Format(_T("<Array: %p>"),p_value->m_value.v_array);
                         break;
+    case DTYPE_MAP:     return PrintMap(p_fp,p_value->m_value.v_map);
     case DTYPE_OBJECT:  value.Format(_T("<Object: %p Class: %s>")
                                      ,p_value->m_value.v_object
                                      ,p_value->m_value.v_object->GetClass()->GetName().GetString());
@@ -821,22 +1310,178 @@ QLVirtualMachine::Print(WinFile* p_fp,int p_quoteFlag,MemObject* p_value)
     default:            Error(_T("Undefined type: %d"), p_value->m_type);
                         break;
   }
+  if(text == nullptr)
+  {
+    text = value.GetString();
+    len  = value.GetLength();
+  }
+  if(p_value && p_value->m_type == DTYPE_STRING && !p_quoteFlag &&
+     (INT_PTR)p_fp != QL_STDOUT && (INT_PTR)p_fp != QL_STDERR)
+  {
+    // Files have their own page buffer
+    return p_fp->Write(*p_value->m_value.v_string);
+  }
+  return PrintText(p_fp,text,len);
+} 
+
+// Print a map as: {key: value, ...}
+// A map in a map is not printed again, as it can contain itself
+int
+QLVirtualMachine::PrintMap(WinFile* p_fp,Map* p_map)
+{
+  int len = PrintText(p_fp,_T("{"),1);
+  for(int ind = 0;ind < p_map->GetSize(); ++ind)
+  {
+    if(ind > 0)
+    {
+      len += PrintText(p_fp,_T(", "),2);
+    }
+    len += Print(p_fp,TRUE,p_map->GetKey(ind));
+    len += PrintText(p_fp,_T(": "),2);
+
+    MemObject* value = p_map->GetValue(ind);
+    if(value->m_type == DTYPE_MAP)
+    {
+      len += PrintText(p_fp,_T("{...}"),5);
+    }
+    else
+    {
+      len += Print(p_fp,TRUE,value);
+    }
+  }
+  len += PrintText(p_fp,_T("}"),1);
+  return len;
+}
+
+// Write text to stdout, stderr or a file
+int
+QLVirtualMachine::PrintText(WinFile* p_fp,LPCTSTR p_text,int p_length)
+{
   if((INT_PTR)p_fp == QL_STDOUT)
   {
-    osputs_stdout(value);
-    len = value.GetLength();
+    Output(p_text,p_length);
   }
   else if((INT_PTR)p_fp == QL_STDERR)
   {
-    osputs_stderr(value);
-    len = value.GetLength();
+    // Keep the order of stdout and stderr on the console
+    FlushOutput();
+    osputs_stderr(CString(p_text,p_length));
   }
   else
   {
-    len = p_fp->Write(value);
+    p_length = p_fp->Write(CString(p_text,p_length));
   }
-  return len;
-} 
+  return p_length;
+}
+
+// Append to the output buffer of stdout
+void
+QLVirtualMachine::Output(LPCTSTR p_text,int p_length)
+{
+  if(m_output.size() + p_length > (size_t)m_outputSize)
+  {
+    FlushOutput();
+    if(p_length > m_outputSize)
+    {
+      // Larger than the buffer: write it at once
+      m_output.assign(p_text,p_text + p_length);
+      FlushOutput();
+      return;
+    }
+  }
+  m_output.insert(m_output.end(),p_text,p_text + p_length);
+
+  if(m_outputFlush == QL_FLUSH_ALWAYS ||
+    (m_outputFlush == QL_FLUSH_LINE && std::find(p_text,p_text + p_length,_T('\n')) != p_text + p_length))
+  {
+    FlushOutput();
+  }
+}
+
+// Write the output buffer of stdout through the output driver
+void
+QLVirtualMachine::FlushOutput()
+{
+  if(m_output.empty())
+  {
+    return;
+  }
+  m_output.push_back(0);
+
+  // The driver writes strings, so a NUL in the output ends a part
+  const TCHAR* text = &m_output[0];
+  const TCHAR* end  = text + m_output.size() - 1;
+  while(text < end)
+  {
+    if(m_capture)
+    {
+      *m_capture += text;
+    }
+    else
+    {
+      osputs_stdout(text);
+    }
+    text += _tcslen(text) + 1;
+  }
+  m_output.clear();
+}
+
+// Flush policy of stdout (QL_FLUSH_*). Returns the previous policy
+int
+QLVirtualMachine::SetOutputFlush(int p_policy)
+{
+  int previous = m_outputFlush;
+  if(p_policy >= QL_FLUSH_ALWAYS && p_policy <= QL_FLUSH_FULL)
+  {
+    m_outputFlush = p_policy;
+    if(p_policy != QL_FLUSH_FULL)
+    {
+      FlushOutput();
+    }
+  }
+  return previous;
+}
+
+// Size of the output buffer of stdout in characters
+void
+QLVirtualMachine::SetOutputSize(int p_size)
+{
+  FlushOutput();
+  m_outputSize = p_size > 0 ? p_size : 1;
+  m_output.shrink_to_fit();
+  m_output.reserve(m_outputSize + 1);
+}
+
+// A spawned task, until it is joined
+int
+QLVirtualMachine::AddTask(QLTask* p_task)
+{
+  m_tasks[++m_lastTask] = p_task;
+  return m_lastTask;
+}
+
+// Nullptr if there is no such task (or it is already joined)
+QLTask*
+QLVirtualMachine::TakeTask(int p_handle)
+{
+  auto it = m_tasks.find(p_handle);
+  if(it == m_tasks.end())
+  {
+    return nullptr;
+  }
+  QLTask* task = it->second;
+  m_tasks.erase(it);
+  return task;
+}
+
+// A context that runs in a thread of its own keeps its output apart.
+// Nullptr writes to stdout again
+void
+QLVirtualMachine::SetOutputCapture(CString* p_capture)
+{
+  FlushOutput();
+  m_capture = p_capture;
+}
 
 //////////////////////////////////////////////////////////////////////////
 // 
@@ -868,10 +1513,192 @@ QLVirtualMachine::GetSQLTransaction()
 //
 //////////////////////////////////////////////////////////////////////////
 
+// Called by the allocator: collect the nursery, and do a full
+// collection if the old generation has grown as large again
+// as it was after the last full collection.
+void
+QLVirtualMachine::CollectGarbage()
+{
+  if(m_marking)
+  {
+    // Allocating faster than the interpreter slices
+    MarkSlice();
+  }
+  else if(m_promoted > max(m_oldLive,MAJOR_GC_MINIMUM))
+  {
+    StartMarking();
+  }
+  else
+  {
+    MinorGC();
+  }
+}
+
+// Full (major) collection of both generations in one pause.
+// Finishes an incremental marking if one is in progress
 void
 QLVirtualMachine::GC()
 {
+  LARGE_INTEGER start;
+  StartPause(start);
+
   // STEP A: Mark all reachable memory objects
+  m_minor = false;
+  MarkRoots();
+  DrainMarkStack();
+
+  // STEP B: Delete unmarked memory objects
+  SweepMajor();
+  StopPause(start);
+}
+
+// Nursery (minor) collection.
+// Only young objects are marked: old objects are not traced,
+// as the remembered set holds all old arrays with young objects
+void
+QLVirtualMachine::MinorGC()
+{
+  LARGE_INTEGER start;
+  StartPause(start);
+
+  // STEP A: Mark young objects from the roots and the remembered set
+  m_minor = true;
+  MarkRoots();
+  MarkRemembered();
+  DrainMarkStack();
+  ClearRemembered();
+
+  // STEP B: Free or promote the nursery
+  SweepNursery();
+  m_minor = false;
+
+  ++m_gcstats.m_minor;
+  StopPause(start);
+}
+
+// Begin an incremental major collection: only the roots are
+// marked now, the rest is done in slices between the instructions.
+// Objects allocated while marking are not marked: they are either
+// found by the final root scan or stored by the write barrier
+void
+QLVirtualMachine::StartMarking()
+{
+  LARGE_INTEGER start;
+  StartPause(start);
+
+  m_minor     = false;
+  m_marking   = true;
+  m_markTicks = 0;
+  MarkRoots();
+
+  StopPause(start);
+}
+
+// One slice of incremental marking within the time budget
+void
+QLVirtualMachine::MarkSlice()
+{
+  LARGE_INTEGER start;
+  LARGE_INTEGER now;
+  LONGLONG budget = m_frequency.QuadPart * m_markBudget / 1000000;
+  StartPause(start);
+
+  while(!m_markstack.empty())
+  {
+    for(int ind = 0;ind < MARK_CHUNK && !m_markstack.empty(); ++ind)
+    {
+      MemObject* object = m_markstack.back();
+      m_markstack.pop_back();
+      ScanObject(object);
+    }
+    QueryPerformanceCounter(&now);
+    if(now.QuadPart - start.QuadPart >= budget)
+    {
+      break;
+    }
+  }
+  ++m_gcstats.m_slices;
+
+  // Marking done: rescan the roots (the stack and globals
+  // have changed since) and sweep in this last slice
+  if(m_markstack.empty())
+  {
+    MarkRoots();
+    DrainMarkStack();
+    SweepMajor();
+  }
+  StopPause(start);
+}
+
+// Scan all marked objects, without recursion on the C++ stack
+void
+QLVirtualMachine::DrainMarkStack()
+{
+  while(!m_markstack.empty())
+  {
+    MemObject* object = m_markstack.back();
+    m_markstack.pop_back();
+    ScanObject(object);
+  }
+}
+
+// Mark the contents of a marked object.
+// The object can have been freed by DestroyObject in the mean time
+void
+QLVirtualMachine::ScanObject(MemObject* p_object)
+{
+  switch(p_object->m_type)
+  {
+    case DTYPE_ARRAY:   p_object->m_value.v_array->Mark(this);
+                        break;
+    case DTYPE_MAP:     p_object->m_value.v_map->Mark(this);
+                        break;
+    case DTYPE_OBJECT:  p_object->m_value.v_object->Mark(this);
+                        break;
+    case DTYPE_SCRIPT:  p_object->m_value.v_script->Mark(this);
+                        break;
+  }
+}
+
+// Sweep after a major marking.
+// All survivors now belong to the old generation
+void
+QLVirtualMachine::SweepMajor()
+{
+  m_marking = false;
+  ClearRemembered();
+  RemoveUnmarked();
+  m_nursery.clear();
+  m_promoted = 0;
+  ++m_gcstats.m_major;
+}
+
+void
+QLVirtualMachine::StartPause(LARGE_INTEGER& p_start)
+{
+  QueryPerformanceCounter(&p_start);
+}
+
+// Record the pause time of the scripts
+void
+QLVirtualMachine::StopPause(LARGE_INTEGER& p_start)
+{
+  LARGE_INTEGER stop;
+  QueryPerformanceCounter(&stop);
+
+  double pause = (double)(stop.QuadPart - p_start.QuadPart) * 1000000.0 / (double)m_frequency.QuadPart;
+  m_gcstats.m_lastPause   = pause;
+  m_gcstats.m_totalPause += pause;
+  if(pause > m_gcstats.m_maxPause)
+  {
+    m_gcstats.m_maxPause = pause;
+  }
+}
+
+// The VM tables and the interpreter stack
+void
+QLVirtualMachine::MarkRoots()
+{
   MarkClasses();
   MarkMap(m_symbols);
   MarkMap(m_scripts);
@@ -879,13 +1706,79 @@ QLVirtualMachine::GC()
   {
     m_globals->Mark(this);
   }
+  if(m_literals)
+  {
+    m_literals->Mark(this);
+  }
   if(m_interpreter)
   {
     m_interpreter->Mark();
   }
+}
 
-  // STEP B: Delete unmarked memory objects
-  RemoveUnmarked();
+void
+QLVirtualMachine::MarkRemembered()
+{
+  for(auto& array : m_remembered)
+  {
+    array->Mark(this);
+  }
+}
+
+void
+QLVirtualMachine::ClearRemembered()
+{
+  for(auto& array : m_remembered)
+  {
+    array->SetRemembered(false);
+  }
+  m_remembered.clear();
+}
+
+// Array is destroyed outside the GC
+void
+QLVirtualMachine::ForgetArray(Array* p_array)
+{
+  if(p_array->GetRemembered())
+  {
+    for(auto it = m_remembered.begin();it != m_remembered.end(); ++it)
+    {
+      if(*it == p_array)
+      {
+        m_remembered.erase(it);
+        break;
+      }
+    }
+    p_array->SetRemembered(false);
+  }
+}
+
+void
+QLVirtualMachine::SweepNursery()
+{
+  for(auto& object : m_nursery)
+  {
+    MemPage* page  = MemPage::PageOf(object);
+    int      index = page->IndexOf(object);
+
+    // Already freed or promoted (a re-used object is recorded twice)
+    if(!page->IsInUse(index) || (object->m_generation & GC_OLD))
+    {
+      continue;
+    }
+    if(page->IsMarked(index) || (object->m_flags & FLAG_REFERENCE))
+    {
+      // Survivor: promote to the old generation
+      object->m_generation |= GC_OLD;
+      page->ClearMark(index);
+      ++m_promoted;
+    }
+    else
+    {
+      FreeMemObject(object);
+    }
+  }
+  m_nursery.clear();
 }
 
 void
@@ -913,83 +1806,136 @@ QLVirtualMachine::MarkMap(NameMap& p_map)
 void
 QLVirtualMachine::MarkObject(MemObject* p_object)
 {
-  // Mark the object
-  p_object->m_generation |= GC_MARKED;
+  // Immediates are always marked
+  if(p_object->m_flags & FLAG_IMMEDIATE)
+  {
+    return;
+  }
+  // A minor GC does not trace into the old generation
+  if(m_minor && (p_object->m_generation & GC_OLD))
+  {
+    return;
+  }
+  // Mark the object in the bitmap of its page
+  MemPage* page  = MemPage::PageOf(p_object);
+  int      index = page->IndexOf(p_object);
+  if(page->IsMarked(index))
+  {
+    return;
+  }
+  page->SetMarked(index);
 
+  // Contents are scanned later from the mark stack
   switch(p_object->m_type)
   {
-    case DTYPE_ARRAY:   p_object->m_value.v_array->Mark(this);
-                        break;
-    case DTYPE_OBJECT:  p_object->m_value.v_object->Mark(this);
-                        break;
-    case DTYPE_SCRIPT:  p_object->m_value.v_script->Mark(this);
+    case DTYPE_ARRAY:   // Fall through
+    case DTYPE_MAP:     // Fall through
+    case DTYPE_OBJECT:  // Fall through
+    case DTYPE_SCRIPT:  m_markstack.push_back(p_object);
                         break;
   }
 }
 
+// Sweep all pages: objects in use but not marked are garbage.
+// The free list is rebuilt from scratch, so that pages that 
+// became completely empty can be returned to the OS.
 void
 QLVirtualMachine::RemoveUnmarked()
 {
-  // See if the chain is filled?
-  if(m_root_object == nullptr || m_root_object->m_next == nullptr)
-  {
-    // No, nothing to do
-    return;
-  }
-  // Start at the root object
-  MemObject* object = m_root_object->m_next;
+  MemPage** previous = &m_pages;
+  bool      spare    = false;
+
+  m_freelist = nullptr;
+  m_oldLive  = 0;
 
-  // Walk until the end marker
-  do 
+  while(*previous)
   {
-    if((object->m_generation & GC_MARKED) == 0)
+    MemPage* page = *previous;
+
+    for(int word = 0;word < MEMPAGE_WORDS; ++word)
     {
-      // Object not marked
-      if(!(object->m_flags & FLAG_REFERENCE))
+      DWORD garbage = page->m_inuse[word] & ~page->m_marks[word];
+      unsigned long bit = 0;
+
+      while(_BitScanForward(&bit,garbage))
       {
-        MemObject* next = object->m_next;
-        FreeMemObject(object);
-        object = next;
+        garbage &= garbage - 1;
+        MemObject* object = &page->m_objects[word * 32 + bit];
+
+        // Stack reference objects are not garbage
+        if(object->m_flags & FLAG_REFERENCE)
+        {
+          object->m_generation |= GC_OLD;
+        }
+        else
+        {
+          MemObjectSetType(object,DTYPE_NIL);
+          object->m_type       = 0;
+          object->m_generation = 0;
+          object->m_storage    = 0;
+          page->SetFree(word * 32 + bit);
+          --page->m_used;
+        }
       }
-      else
+      // Survivors are swiped and promoted, reset for the next GC
+      DWORD living = page->m_inuse[word] & page->m_marks[word];
+      while(_BitScanForward(&bit,living))
       {
-        // Object is a stack reference object, skip it
-        object = object->m_next;
+        living &= living - 1;
+        page->m_objects[word * 32 + bit].m_generation |= GC_OLD;
       }
+      page->m_marks[word] = 0;
     }
-    else
+    m_oldLive += page->m_used;
+
+    // Keep one empty page for the next allocations
+    if(page->m_used == 0 && spare)
+    {
+      *previous = page->m_next;
+      FreeMemPage(page);
+      continue;
+    }
+    if(page->m_used == 0)
     {
-      // Object swiped, Next object
-      object->m_generation = GC_ALIVE;
-      object = object->m_next;
+      spare = true;
     }
-  } 
-  while (object && object->m_type != DTYPE_ENDMARK);
+
+    // Thread the free objects of this page in ascending order
+    for(int ind = (int)MEMPAGE_OBJECTS - 1;ind >= 0; --ind)
+    {
+      if(!page->IsInUse(ind))
+      {
+        page->m_objects[ind].m_value.v_all = (UINT_PTR) m_freelist;
+        m_freelist = &page->m_objects[ind];
+      }
+    }
+    previous = &page->m_next;
+  }
 }
 
 // Only to be called at destruction time
 void
 QLVirtualMachine::DestroyObjectChain()
 {
-  MemObject* object = m_root_object;
-  while(object)
+  while(m_pages)
   {
-    MemObject* next = object->m_next;
-
-    if(m_dumpchain)
+    MemPage* page = m_pages;
+    for(int ind = 0;ind < (int)MEMPAGE_OBJECTS; ++ind)
     {
-      DumpObject(object);
-    }
-    FreeMemObject(object,false);
-
-    if(object == m_last_object)
-    {
-      // Stop at the last object
-      break;
+      if(page->IsInUse(ind))
+      {
+        MemObject* object = &page->m_objects[ind];
+        if(m_dumpchain)
+        {
+          DumpObject(object);
+        }
+        FreeMemObject(object,false);
+      }
     }
-    // Next object
-    object = next;
+    m_pages = page->m_next;
+    FreeMemPage(page);
   }
+  m_freelist = nullptr;
 }
 
 void
@@ -1048,4 +1994,53 @@ QLVirtualMachine::CleanUpInitcode()
     delete [] m_initcode;
     m_initcode = nullptr;
   }
-}
\ No newline at end of file
+  if(m_initthreaded)
+  {
+    delete [] m_initthreaded;
+    m_initthreaded = nullptr;
+  }
+  m_initMaxStack = -1;
+}
+
+// Unmapped last: functions may still point to their bytecode
+// Other VMs can still run the same images
+void
+QLVirtualMachine::CleanUpImages()
+{
+  SetCodeImage(nullptr);
+  for(auto& image : m_images)
+  {
+    image->Release();
+  }
+  m_images.clear();
+}
+
+// Tasks that were never joined must end before we do
+// Their output is lost
+void
+QLVirtualMachine::CleanUpTasks()
+{
+  for(auto& task : m_tasks)
+  {
+    task.second->Wait();
+    delete task.second;
+  }
+  m_tasks.clear();
+}
+
+// The image other contexts load to run our code
+void
+QLVirtualMachine::SetCodeImage(QLImage* p_image)
+{
+  EnterCriticalSection(&m_lock);
+  if(p_image)
+  {
+    p_image->AddRef();
+  }
+  if(m_codeImage)
+  {
+    m_codeImage->Release();
+  }
+  m_codeImage = p_image;
+  LeaveCriticalSection(&m_lock);
+}
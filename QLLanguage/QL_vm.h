@@ -8,19 +8,60 @@
 #pragma once
 #include "QL_Language.h"
 #include "QL_Objects.h"
+#include "QL_Image.h"
+#include <unordered_map>
 
 // Values for the GC alloc counter
 #define THRESHOLD_DEFAULT      1000
 #define THRESHOLD_AGGRESIVE     100
 #define THRESHOLD_RELAXED  10000000
+// Minimum number of promoted objects before a major GC
+#define MAJOR_GC_MINIMUM      10000
+// Incremental marking: instructions between two slices,
+// objects marked between two clock readings,
+// and the default time budget of a slice in microseconds
+#define MARK_INTERVAL           256
+#define MARK_CHUNK               64
+#define MARK_BUDGET_DEFAULT     200
+// Characters in the output buffer of stdout
+#define OUTPUT_BUFFER_DEFAULT  8192
 
 // Forward declarations
 class QLCompiler;
 class QLInterpreter;
+class QLTask;
 class WinFile;
+class MemPage;
 
 using SQLComponents::SQLTransaction;
 
+// Pause-time statistics of the garbage collector in microseconds
+typedef struct _gcstats
+{
+  int    m_minor;       // Number of nursery collections
+  int    m_major;       // Number of full collections
+  int    m_slices;      // Number of incremental marking slices
+  double m_lastPause;   // Last pause of the scripts
+  double m_maxPause;    // Longest pause of the scripts
+  double m_totalPause;  // Total of all pauses
+}
+GCStats;
+
+// Resolved sends: (class or datatype, interned selector)
+typedef std::pair<const void*,int> SendKey;
+
+struct SendKeyHash
+{
+  size_t operator()(const SendKey& p_key) const
+  {
+    return std::hash<const void*>()(p_key.first) ^ ((size_t)p_key.second * 0x9E3779B9);
+  }
+};
+
+typedef std::map<CString,int>                              SelectorMap;
+typedef std::unordered_map<SendKey,MemObject*,SendKeyHash> SendMemberMap;
+typedef std::unordered_map<SendKey,Method*,   SendKeyHash> SendMethodMap;
+
 class QLVirtualMachine
 {
 public:
@@ -32,21 +73,39 @@ public:
   // Compile a QL source code file into this VM
   bool        CompileFile(LPCTSTR p_filename,bool p_trace);
   bool        CompileBuffer(LPCTSTR p_buffer,bool p_trace);
+  // Compile through the cache of object files, keyed on the source hash
+  bool        CompileCached(LPCTSTR p_filename,bool p_trace);
+  void        SetCacheDirectory(CString p_directory);
 
   // SetInterpreter
   void        SetInterpreter(QLInterpreter* p_inter);
   // Setting the alloc threshold for the GC
   void        SetGCThreshold(int p_threshold);
+  // Setting the time budget of an incremental marking slice
+  void        SetGCBudget(int p_microseconds);
+  // Pause-time statistics of the GC
+  const GCStats& GetGCStats();
   // Setting the dumping of the object chain
   void        SetDumping(bool p_dump);
-  // Garbage Collection
+  // Garbage Collection (full) and nursery collection
   void        GC();
+  void        MinorGC();
+  // Incremental marking between bytecode instructions
+  void        GCStep();
   // Error handling for all objects
   static void Error(LPCTSTR p_format, ...);
   // Printing of information
   void        Info(LPCTSTR p_format, ...);
   // Print - print one value 
   int         Print(WinFile* p_fp,int p_quoteFlag,MemObject* p_value);
+  int         PrintMap(WinFile* p_fp,Map* p_map);
+  int         PrintText(WinFile* p_fp,LPCTSTR p_text,int p_length);
+  // Buffered output to stdout of print, fprint, putc, puts and '<<'
+  void        Output(LPCTSTR p_text,int p_length);
+  void        FlushOutput();
+  int         SetOutputFlush(int p_policy);
+  void        SetOutputSize(int p_size);
+  int         GetOutputSize();
 
   // Getters
   NameMap&    GetSymbols();
@@ -58,6 +117,11 @@ public:
   void        FreeMemObject(MemObject* p_object,bool p_running = true);
   void        MemObjectSetType(MemObject* p_object, int p_type);
   void        MarkObject(MemObject* p_object);
+  void        WriteBarrier(Array* p_array,MemObject* p_value);
+  // Immediate values (shared and immutable, never collected)
+  MemObject*  GetNil();
+  MemObject*  GetInteger(int p_value);
+  MemObject* const* GetImmediatePages();
 
   // CLASSES SYMBOLS GLOBALS AND SCRIPTS
   Class*      FindClass  (CString& p_name);
@@ -67,6 +131,18 @@ public:
   Function*   FindScript (CString p_name);
   Method*     AddMethod  (CString p_name,int p_type);
   Method*     FindMethod (CString p_name,int p_type);
+  // Send resolution for the inline caches of OP_SEND
+  int         InternSelector(CString& p_selector);
+  MemObject*  FindSendMember(Class* p_class,int p_selector,CString& p_name);
+  Method*     FindSendMethod(int p_type,int p_selector,CString& p_name);
+  int         GetSendEpoch();
+  void        InvalidateSendCaches();
+  // Build the vtables of all classes after a compile or a load
+  void        FinalizeClasses();
+  // Verify all bytecode after a compile or a load
+  bool        VerifyCode();
+  // Deepest stack of a function or of the init code (nullptr)
+  int         Verify(Function* p_function);
 
   // Add an entry to a dictionary 
   MemObject*  AddEntry(NameMap& dict,CString p_key,int p_storage);
@@ -83,15 +159,31 @@ public:
   MemObject*  GetGlobal(unsigned p_index);
   void        SetGlobal(unsigned p_index,MemObject* p_object);
   MemObject*  GetLiteral(unsigned p_index);
+  int         GetGlobalsSize();
+  int         GetLiteralsSize();
   BYTE*       GetBytecode();
+  Instruction* GetThreadedCode();
   int         FindGlobal(CString p_name);
   CString     FindSymbolName(MemObject* p_object);
   bool        HasInitCode();
 
   // FILE STREAMING OPERATIONS
-  bool        WriteFile(TCHAR* p_filename,bool p_trace);
+  bool        WriteFile(TCHAR* p_filename,bool p_trace,bool p_image = true);
+  // Compress the literals and bytecode of a streamed object file
+  void        SetCompression(bool p_compress);
   bool        LoadFile (TCHAR* p_filename,bool p_trace);
 
+  // EXECUTION CONTEXTS
+  // The code of this VM as an immutable image. Release() it when done
+  QLImage*    GetCodeImage();
+  // Load a shared image into this (empty) VM to run it in a thread of its own
+  bool        LoadContext(QLImage* p_image,bool p_trace = false);
+  // Collect the output of stdout in a string instead of writing it
+  void        SetOutputCapture(CString* p_capture);
+  // Tasks started by spawn, by handle. Take the task to join it
+  int         AddTask (QLTask* p_task);
+  QLTask*     TakeTask(int p_handle);
+
   // Test for types of files
   bool        IsObjectFile(const TCHAR* p_filename);
   bool        IsSourceFile(const TCHAR* p_filename);
@@ -102,6 +194,19 @@ public:
 
 private:
   // Garbage collector sub-functions
+  void        CollectGarbage();
+  void        StartMarking();
+  void        MarkSlice();
+  void        DrainMarkStack();
+  void        ScanObject(MemObject* p_object);
+  void        SweepMajor();
+  void        StartPause(LARGE_INTEGER& p_start);
+  void        StopPause(LARGE_INTEGER& p_start);
+  void        MarkRoots();
+  void        MarkRemembered();
+  void        ClearRemembered();
+  void        ForgetArray(Array* p_array);
+  void        SweepNursery();
   void        MarkClasses();
   void        MarkMap(NameMap& p_map);
   void        RemoveUnmarked();
@@ -111,7 +216,21 @@ private:
   void        CleanUpLiterals();
   void        CleanUpMethods();
   void        CleanUpInitcode();
+  void        CleanUpImages();
+  void        SetCodeImage(QLImage* p_image);
+  void        CleanUpTasks();
   void        DumpObject(MemObject* p_object);
+  void        InitImmediates();
+  MemObject*  AllocImmediatePage(int p_page);
+  // Compile cache
+  CString     GetCacheDirectory();
+  CString     HashSourceFile(CString p_filename);
+  static bool ProbeCached(QLImage* p_image);
+  // Slab allocator of the MemObjects
+  MemObject*  NewMemObject();
+  void        ReleaseMemObject(MemObject* p_object);
+  void        AllocMemPage();
+  void        FreeMemPage(MemPage* p_page);
 
   void        TracingText(bool p_trace,const TCHAR* p_text,...);
 
@@ -119,13 +238,15 @@ private:
   bool        WriteToFile   (FILE* p_fp, bool p_trace);
   int         Putc  (int cc, FILE* p_fp, bool p_trace);
   void        WriteHeader   (FILE* p_fp, bool p_trace);
-  void        WriteStream   (FILE* p_fp, bool p_trace, TCHAR* p_message);
+  void        WriteStream   (FILE* p_fp, bool p_trace, TCHAR* p_message,bool p_compress = false);
+  void        FlushStream   (FILE* p_fp, bool p_trace);
   void        WriteInteger  (FILE* p_fp, bool p_trace, int n);
   void        WriteString   (FILE* p_fp, bool p_trace, CString*   p_string,   TCHAR* p_extra = nullptr);
   void        WriteFloat    (FILE* p_fp, bool p_trace, bcd*       p_float);
   void        WriteFileName (FILE* p_fp, bool p_trace, MemObject* p_object);
   void        WriteArray    (FILE* p_fp, bool p_trace, Array*     p_array,    TCHAR* p_extra = nullptr,bool p_doScripts = false);
   void        WriteObject   (FILE* p_fp, bool p_trace, Object*    p_object);
+  void        WriteMap      (FILE* p_fp, bool p_trace, Map*       p_map);
   void        WriteClass    (FILE* p_fp, bool p_trace, Class*     p_class);
   void        WriteBytecode (FILE* p_fp, bool p_trace, BYTE*      p_bytecode, int p_length);
   void        WriteScript   (FILE* p_fp, bool p_trace, Function*  p_script);
@@ -136,10 +257,14 @@ private:
   void        WriteMemObject(FILE* p_fp, bool p_trace, MemObject* p_object,bool p_ref = false);
   void        WriteClasses  (FILE* p_fp, bool p_trace, ClassMap&  p_map);
   void        WriteNameMap  (FILE* p_fp, bool p_trace, NameMap&   p_map,const TCHAR* p_name,bool p_doScripts);
+  // Writing the heap as a memory mapped image (version 3)
+  bool        WriteImage    (FILE* p_fp, bool p_trace);
+  void        FillImage     (QLImageWriter& p_writer);
 
   // Reading into the heap from a file
   bool        ReadFromFile    (FILE* p_fp, bool p_trace);
   int         Getc            (FILE* p_fp, bool p_trace);
+  void        ReadCompressed  (FILE* p_fp, bool p_trace);
   bool        ReadHeader      (FILE* p_fp, bool p_trace);
   void        ReadStream      (FILE* p_fp, bool p_trce,  TCHAR* p_errorMessage);
   bool        ReadInteger     (FILE* p_fp, bool p_trace, long* n);
@@ -152,6 +277,7 @@ private:
   Array*      ReadArray       (FILE* p_fp, bool p_trace, Array* p_array = nullptr,TCHAR* p_name = nullptr);
   Array*      MustReadArray   (FILE* p_fp, bool p_trace, Array* p_array = nullptr,TCHAR* p_name = nullptr);
   Object*     ReadObject      (FILE* p_fp, bool p_trace);
+  Map*        ReadMap         (FILE* p_fp, bool p_trace);
   Class*      ReadClass       (FILE* p_fp, bool p_trace);
   void        ReadBytecode    (FILE* p_fp, bool p_trace, BYTE** p_bytecode,int* p_size);
   Function*   ReadScript      (FILE* p_fp, bool p_trace);
@@ -161,9 +287,17 @@ private:
   MemObject*  ReadMemObject   (FILE* p_fp, bool p_trace);
   void        ReadClasses     (FILE* p_fp, bool p_trace, ClassMap& p_map);
   void        ReadNameMap     (FILE* p_fp, bool p_trace, NameMap&  p_map,TCHAR* p_name);
+  // Reading from a memory mapped image (version 3)
+  bool        LoadImage       (CString p_filename,bool p_trace);
+  bool        ReadShared      (QLImage* p_image,bool p_trace);
+  bool        ReadImage       (QLImage* p_image,bool p_trace);
+  MemObject*  ReadImageValue  (QobValue& p_value,QobTables& p_tables);
+  void        ReadImageElements(QobTables& p_tables,Array* p_array,DWORD p_first,DWORD p_count);
+  void        ReadImageMap     (QobTables& p_tables,Map*   p_map,  DWORD p_first,DWORD p_count);
 
   // Thunking to be done after a file load
   void        Thunking();
+  void        ThunkObject(MemObject* p_object);
 
   // Globals
   ClassMap    m_classes;   // All defined script classes
@@ -174,10 +308,53 @@ private:
   MethodMap   m_methods;   // All internal defined methods for internal datatypes
   BYTE*       m_initcode;  // Code to run before the entrypoint
   int         m_initcode_size;
+  Instruction* m_initthreaded; // Pre-decoded init code
+  int         m_initMaxStack;  // Deepest stack of the init code, -1 if not verified
+  std::vector<QLImage*> m_images; // Mapped object files, used in place
+  QLImage*    m_codeImage;     // All our code, shared with other contexts
+  std::map<int,QLTask*> m_tasks; // Spawned tasks that are not joined yet
+  int         m_lastTask;      // Handle of the last spawned task
+  // Interned selectors and resolved sends
+  SelectorMap   m_selectors;
+  SendMemberMap m_sendMembers;
+  SendMethodMap m_sendMethods;
+  int           m_sendEpoch; // Bumped when classes or methods change
+  int           m_fileVersion; // Version of the object file being read
+  CString       m_cacheDirectory;
+  bool          m_silent;           // No messages on a failed read of an image
+  // Object file streams: buffered writing and compressed sections
+  std::vector<TCHAR> m_outbuffer;   // Section being written, not yet obfuscated
+  int           m_compressFrom;     // Start of the compressed part or -1
+  bool          m_compress;         // Compress literals and bytecode
+  std::vector<TCHAR> m_inbuffer;    // Inflated section being read
+  size_t        m_inposition;
+  // Output buffer of stdout
+  std::vector<TCHAR> m_output;
+  int           m_outputSize;       // Flushed before it grows beyond this
+  int           m_outputFlush;      // QL_FLUSH_* policy
+  CString*      m_capture;          // Flushed here instead of to stdout
 
-  // The object chain for gc
-  MemObject*  m_root_object;
-  MemObject*  m_last_object;
+  // Immediates: NIL followed by IMMEDIATE_MIN..IMMEDIATE_MAX
+  MemObject*  m_immediates;
+  // Pages of the wider range, nullptr until first used
+  MemObject*  m_immediatePages[IMMEDIATE_PAGES];
+  // The pages with all objects for the gc
+  MemPage*    m_pages;
+  MemObject*  m_freelist;
+  int         m_numpages;
+  // Generational GC: young objects and arrays with young objects
+  std::vector<MemObject*> m_nursery;
+  std::vector<Array*>     m_remembered;
+  bool        m_minor;     // Doing a nursery collection
+  int         m_promoted;  // Objects promoted since the last major GC
+  int         m_oldLive;   // Objects alive after the last major GC
+  // Marked objects that must still be scanned for their contents
+  std::vector<MemObject*> m_markstack;
+  bool        m_marking;   // Incremental marking in progress
+  int         m_markTicks; // Instructions since the last slice
+  int         m_markBudget;// Time budget of a slice (microseconds)
+  LARGE_INTEGER m_frequency;
+  GCStats     m_gcstats;
   // Number of memory allocations for GC
   int         m_allocs;
   // After this number of allocations, a GC is forced
@@ -192,9 +369,16 @@ private:
   // The one-and-only SQL Transaction
   SQLTransaction* m_transaction;
 
+  // Guards the code image, as contexts can be made on any thread
   CRITICAL_SECTION m_lock;
 };
 
+inline int
+QLVirtualMachine::GetOutputSize()
+{
+  return m_outputSize;
+}
+
 inline NameMap&
 QLVirtualMachine::GetSymbols()
 {
@@ -219,6 +403,92 @@ QLVirtualMachine::SetDumping(bool p_dump)
   m_dumpchain = p_dump;
 }
 
+inline void
+QLVirtualMachine::SetCompression(bool p_compress)
+{
+  m_compress = p_compress;
+}
+
+inline void
+QLVirtualMachine::SetCacheDirectory(CString p_directory)
+{
+  m_cacheDirectory = p_directory;
+}
+
+inline const GCStats&
+QLVirtualMachine::GetGCStats()
+{
+  return m_gcstats;
+}
+
+inline int
+QLVirtualMachine::GetSendEpoch()
+{
+  return m_sendEpoch;
+}
+
+// Called by the interpreter between two instructions
+inline void
+QLVirtualMachine::GCStep()
+{
+  if(m_marking && (++m_markTicks % MARK_INTERVAL) == 0)
+  {
+    MarkSlice();
+  }
+}
+
+// Write barrier of the GC.
+// An array that gets a young object is scanned by the next minor GC.
+// While marking incrementally, the new value is marked (Dijkstra style)
+inline void
+QLVirtualMachine::WriteBarrier(Array* p_array,MemObject* p_value)
+{
+  // During incremental marking the array may already be scanned
+  if(m_marking)
+  {
+    MarkObject(p_value);
+  }
+  if((p_value->m_generation & GC_OLD) == 0 && !p_array->GetRemembered())
+  {
+    p_array->SetRemembered(true);
+    m_remembered.push_back(p_array);
+  }
+}
+
+inline MemObject*
+QLVirtualMachine::GetNil()
+{
+  return &m_immediates[0];
+}
+
+inline MemObject* const*
+QLVirtualMachine::GetImmediatePages()
+{
+  return m_immediatePages;
+}
+
+inline MemObject*
+QLVirtualMachine::GetInteger(int p_value)
+{
+  if(p_value >= IMMEDIATE_MIN && p_value <= IMMEDIATE_MAX)
+  {
+    return &m_immediates[p_value - IMMEDIATE_MIN + 1];
+  }
+  if(p_value >= IMMEDIATE_WIDE_MIN && p_value <= IMMEDIATE_WIDE_MAX)
+  {
+    int        offset = p_value - IMMEDIATE_WIDE_MIN;
+    MemObject* page   = m_immediatePages[offset / IMMEDIATE_PAGE];
+    if(page == nullptr)
+    {
+      page = AllocImmediatePage(offset / IMMEDIATE_PAGE);
+    }
+    return &page[offset % IMMEDIATE_PAGE];
+  }
+  MemObject* object = AllocMemObject(DTYPE_INTEGER);
+  object->m_value.v_integer = p_value;
+  return object;
+}
+
 inline BYTE*
 QLVirtualMachine::GetBytecode()
 {
@@ -230,3 +500,15 @@ QLVirtualMachine::HasInitCode()
 {
   return m_initcode != nullptr;
 }
+
+inline int
+QLVirtualMachine::GetGlobalsSize()
+{
+  return m_globals ? m_globals->GetSize() : 0;
+}
+
+inline int
+QLVirtualMachine::GetLiteralsSize()
+{
+  return m_literals ? m_literals->GetSize() : 0;
+}
@@ -16,7 +16,9 @@
 #include "QL_Interpreter.h"
 #include "QL_Functions.h"
 #include "QL_Opcodes.h"
+#include "QL_Peephole.h"
 #include "bcd.h"
+#include <ZIP/gzip.h>
 #include <stdarg.h>
 
 #ifdef _DEBUG
@@ -45,19 +47,79 @@ QLVirtualMachine::LoadFile(TCHAR* p_filename,bool p_trace)
   _tfopen_s(&file,filename,_T("rb"));
   if(file)
   {
-    if(ReadFromFile(file,p_trace))
+    if(QLImage::IsImage(file))
     {
-      result = true;
+      // Version 3: map the image and use it in place
+      fclose(file);
+      file = NULL;
+      result = LoadImage(filename,p_trace);
     }
     else
+    {
+      result = ReadFromFile(file,p_trace);
+      fclose(file);
+    }
+    if(result)
+    {
+      // New classes and methods: all send sites must resolve again
+      FinalizeClasses();
+      // A damaged object file is refused before it runs
+      result = VerifyCode();
+    }
+    if(!result)
     {
       _tprintf(_T("Object file NOT correctly loaded: %s\n"),filename.GetString());
     }
-    fclose(file);
   }
   return result;
 }
 
+// An image file is mapped only once in the process,
+// all VMs that load it share the same mapping
+bool
+QLVirtualMachine::LoadImage(CString p_filename,bool p_trace)
+{
+  QLImage* image = QLImage::Acquire(p_filename);
+  if(image == nullptr)
+  {
+    _ftprintf(stderr,_T("Cannot map QL image: %s\n"),p_filename.GetString());
+    return false;
+  }
+  bool result = ReadShared(image,p_trace);
+  image->Release();
+  return result;
+}
+
+// Load the code image of another VM, so this VM becomes an execution
+// context of the same program: it gets its own heap, classes, functions
+// and globals, but runs the bytecode of the shared image in place
+bool
+QLVirtualMachine::LoadContext(QLImage* p_image,bool p_trace)
+{
+  if(ReadShared(p_image,p_trace) == false)
+  {
+    return false;
+  }
+  // New classes and methods: all send sites must resolve again
+  FinalizeClasses();
+  return VerifyCode();
+}
+
+// The image stays mapped as long as the VM lives, even if reading
+// it failed: functions may already run from the mapped bytecode
+bool
+QLVirtualMachine::ReadShared(QLImage* p_image,bool p_trace)
+{
+  p_image->AddRef();
+  m_images.push_back(p_image);
+
+  // Our only code is this image: contexts can share it as is
+  bool only = m_scripts.empty() && m_classes.empty() && m_initcode == nullptr;
+  SetCodeImage(only ? p_image : nullptr);
+
+  return ReadImage(p_image,p_trace);
+}
+
 bool
 QLVirtualMachine::ReadFromFile(FILE* p_fp,bool p_trace)
 {
@@ -68,6 +130,10 @@ QLVirtualMachine::ReadFromFile(FILE* p_fp,bool p_trace)
   // Clean up our stack/heap as much as possible
   // In case we do a second case read
   GC();
+  m_inbuffer.clear();
+  m_inposition = 0;
+  // Our code changes: contexts cannot share an image of it any more
+  SetCodeImage(nullptr);
 
   try
   {
@@ -126,8 +192,16 @@ QLVirtualMachine::ReadFromFile(FILE* p_fp,bool p_trace)
 int
 QLVirtualMachine::Getc(FILE* p_fp,bool p_trace)
 {
-  // Getting the character
-  int cc = ::_gettc(p_fp);
+  // Getting the character from a compressed section or the file
+  int cc = 0;
+  if(m_inposition < m_inbuffer.size())
+  {
+    cc = (_TUCHAR) m_inbuffer[m_inposition++];
+  }
+  else
+  {
+    cc = ::_gettc(p_fp);
+  }
   // Decoding the character
   cc ^= 0xFF;
 
@@ -164,11 +238,13 @@ QLVirtualMachine::ReadHeader(FILE* p_fp, bool p_trace)
   // Read version number
   MustReadInteger(p_fp,p_trace,&version,error);
   TracingText(p_trace,_T("QL Object file version: %2.2f"), (float)(version / 100));
-  if (version != QL_VERSION)
+  // Older bytecode has a subset of our opcodes
+  if (version < QL_VERSION_MINIMUM || version > QL_VERSION)
   {
     error = _T("QL Object file WRONG VERSION!");
     throw QLException(error);
   }
+  m_fileVersion = version;
   return true;
 }
 
@@ -180,6 +256,47 @@ QLVirtualMachine::ReadStream(FILE* p_fp,bool p_trace,TCHAR* p_message)
     throw QLException(p_message);
   }
   TracingText(p_trace,p_message);
+
+  // A compressed section follows the stream header
+  if(m_fileVersion >= QL_VERSION_COMPRESS)
+  {
+    if(m_inposition < m_inbuffer.size())
+    {
+      throw QLException(_T("Compressed section not completely read!"));
+    }
+    int cc = ::_gettc(p_fp);
+    if((cc ^ 0xFF) == DTYPE_STREAM)
+    {
+      ReadCompressed(p_fp,p_trace);
+    }
+    else if(cc != _TEOF)
+    {
+      ::_ungettc(cc,p_fp);
+    }
+  }
+}
+
+// Inflate a section: the next Getc calls read from the buffer
+void
+QLVirtualMachine::ReadCompressed(FILE* p_fp,bool p_trace)
+{
+  long size = 0;
+  if(!ReadInteger(p_fp,p_trace,&size) || size <= 0)
+  {
+    throw QLException(_T("Misread compressed section size!"));
+  }
+  std::vector<uint8_t> deflated(size);
+  std::vector<uint8_t> inflated;
+  if(fread(deflated.data(),1,size,p_fp) != (size_t)size ||
+     !gzip_decompress_memory(deflated.data(),size,inflated))
+  {
+    throw QLException(_T("Compressed section not read!"));
+  }
+  m_inbuffer.resize(inflated.size() / sizeof(TCHAR));
+  memcpy(m_inbuffer.data(),inflated.data(),m_inbuffer.size() * sizeof(TCHAR));
+  m_inposition = 0;
+
+  TracingText(p_trace,_T("COMPRESSED %d -> %d bytes"),(int)size,(int)inflated.size());
 }
 
 bool
@@ -361,13 +478,39 @@ QLVirtualMachine::ReadObject(FILE* p_fp, bool p_trace)
   // Read all attributes of the object
   for (int ind = 0; ind < attributes; ++ind)
   {
-    object->SetAttribute(ind,ReadMemObject(p_fp,p_trace));
+    object->SetAttribute(this,ind,ReadMemObject(p_fp,p_trace));
   }
   TracingText(p_trace,_T("END OBJECT"));
 
   return object;
 }
 
+Map*
+QLVirtualMachine::ReadMap(FILE* p_fp,bool p_trace)
+{
+  // Read number of entries
+  long mapSize = 0;
+  MustReadInteger(p_fp,p_trace,&mapSize,_T("Missing map size"));
+  TracingText(p_trace,_T("Mapsize: %d"),mapSize);
+
+  // Read all key/value pairs
+  Map* map = new Map();
+  for(int ind = 0;ind < mapSize; ++ind)
+  {
+    MemObject* key   = ReadMemObject(p_fp,p_trace);
+    MemObject* value = ReadMemObject(p_fp,p_trace);
+    if(!Map::IsKeyType(key->m_type))
+    {
+      delete map;
+      throw QLException(_T("Misread map key!"));
+    }
+    map->Set(this,key,value);
+  }
+  TracingText(p_trace,_T("END MAP"));
+
+  return map;
+}
+
 Class*
 QLVirtualMachine::ReadClass(FILE* p_fp,bool p_trace)
 {
@@ -447,6 +590,12 @@ QLVirtualMachine::ReadBytecode(FILE* p_fp, bool p_trace, BYTE** p_bytecode,int*
   // End marker
   *pointer = 0;
 
+  // Older object files have smaller branches and sends in the bytecode
+  if(m_fileVersion < QL_VERSION_WIDE)
+  {
+    length = QLPeephole::Upgrade(&bytecode,length,m_fileVersion);
+  }
+
   // Transfer the result
   *p_bytecode = bytecode;
   *p_size     = length;
@@ -590,6 +739,10 @@ QLVirtualMachine::ReadMemObject(FILE* p_fp,bool p_trace)
                           object->m_value.v_object = ReadObject(p_fp,p_trace);
                           object->m_flags |= FLAG_DEALLOC;
                           break;
+    case DTYPE_MAP:       TracingText(p_trace,_T("MAP"));
+                          object->m_value.v_map = ReadMap(p_fp,p_trace);
+                          object->m_flags |= FLAG_DEALLOC;
+                          break;
     case DTYPE_CLASS:     // never reached
                           break;
     case DTYPE_SCRIPT:    TracingText(p_trace,_T("SCRIPT"));
@@ -661,62 +814,431 @@ QLVirtualMachine::ReadNameMap(FILE* p_fp, bool p_trace, NameMap&  p_map,TCHAR* p
 
 //////////////////////////////////////////////////////////////////////////
 //
-// THUNKING TO BE DONE AFTER A LOAD FROM FILE
+// READING A MEMORY MAPPED IMAGE (VERSION 3)
 //
 //////////////////////////////////////////////////////////////////////////
 
-void
-QLVirtualMachine::Thunking()
+// All references in an image are indices: check them before use
+static void
+CheckImageRange(DWORD p_first,DWORD p_count,DWORD p_size,const TCHAR* p_what)
 {
-  MemObject* object = m_root_object->m_next;
+  if(p_first > p_size || p_count > p_size - p_first)
+  {
+    throw QLException(CString(_T("QL Image is corrupt, index out of range: ")) + p_what,0);
+  }
+}
 
-  while(object && object->m_next->m_type != DTYPE_ENDMARK)
+static CString&
+ImageString(QobTables& p_tables,DWORD p_index)
+{
+  CheckImageRange(p_index,1,(DWORD)p_tables.m_strings.size(),_T("string"));
+  return p_tables.m_strings[p_index];
+}
+
+// Only the values, classes and functions are made on the heap.
+// The bytecode of the functions is not copied, but runs from the image
+bool
+QLVirtualMachine::ReadImage(QLImage* p_image,bool p_trace)
+{
+  // In case it is the first thing we do, check that we have
+  // the root chain and the functions initialized
+  CheckInit();
+
+  // Clean up our stack/heap as much as possible
+  GC();
+
+  QobHeader*  header    = p_image->GetHeader();
+  QobSection* sections  = header->m_sections;
+  int         threshold = m_threshold;
+  QobTables   tables;
+
+  try
   {
-    if(object->m_type & DTYPE_REFERENCE)
+    tracing(_T("\nQL Image mapped from file.\n\n"));
+
+    // Bytecode in an image is used as is and cannot be upgraded
+    if(header->m_version < QL_VERSION_IMAGE || header->m_version > QL_VERSION)
+    {
+      throw QLException(_T("QL Image WRONG VERSION!"));
+    }
+    if(header->m_charsize != sizeof(TCHAR))
+    {
+      throw QLException(_T("QL Image written with another character size!"));
+    }
+    m_fileVersion = header->m_version;
+
+    // The fixed size tables must fit in their sections
+    const size_t entries[QOB_SECTIONS] = { sizeof(DWORD),1,sizeof(QobValue),sizeof(DWORD)
+                                          ,sizeof(QobClass),sizeof(QobFunction),sizeof(QobSymbol) };
+    for(int ind = 0;ind < QOB_SECTIONS; ++ind)
+    {
+      if(ind != QOB_BYTECODE && sections[ind].m_count > sections[ind].m_size / entries[ind])
+      {
+        throw QLException(_T("QL Image is corrupt, section too small!"));
+      }
+    }
+    // A block of bytecode for every function and one for the init code
+    if(header->m_version >= QL_VERSION_CODEBLOCKS &&
+       sections[QOB_BYTECODE].m_count != sections[QOB_FUNCTIONS].m_count + 1)
+    {
+      throw QLException(_T("QL Image is corrupt, wrong number of bytecode blocks!"));
+    }
+    BYTE*        bytecode  = p_image->GetSection(QOB_BYTECODE);
+    DWORD        codesize  = sections[QOB_BYTECODE].m_size;
+    QobValue*    values    = reinterpret_cast<QobValue*>   (p_image->GetSection(QOB_VALUES));
+    QobClass*    classes   = reinterpret_cast<QobClass*>   (p_image->GetSection(QOB_CLASSES));
+    QobFunction* functions = reinterpret_cast<QobFunction*>(p_image->GetSection(QOB_FUNCTIONS));
+    QobSymbol*   symbols   = reinterpret_cast<QobSymbol*>  (p_image->GetSection(QOB_SYMBOLS));
+    tables.m_elements      = reinterpret_cast<DWORD*>      (p_image->GetSection(QOB_ELEMENTS));
+    tables.m_elementsCount = sections[QOB_ELEMENTS].m_count;
+
+    // STRINGS: every string is made once, all values share it
+    BYTE*  strings = p_image->GetSection(QOB_STRINGS);
+    DWORD* offsets = reinterpret_cast<DWORD*>(strings);
+    DWORD  size    = sections[QOB_STRINGS].m_size;
+    tables.m_strings.reserve(sections[QOB_STRINGS].m_count);
+    for(DWORD ind = 0;ind < sections[QOB_STRINGS].m_count; ++ind)
     {
-      // Getting the actual name
-      CString name = *object->m_value.v_string;
+      CheckImageRange(offsets[ind],sizeof(DWORD),size,_T("string"));
+      DWORD length = *reinterpret_cast<DWORD*>(strings + offsets[ind]);
+      CheckImageRange(0,length,(DWORD)((size - offsets[ind] - sizeof(DWORD)) / sizeof(TCHAR)),_T("string"));
+      tables.m_strings.push_back(CString(reinterpret_cast<TCHAR*>(strings + offsets[ind] + sizeof(DWORD)),(int)length));
+    }
 
-      // Remember and clearing the read-in string
-      CString* str = object->m_value.v_string;
-      object->m_value.v_all = 0;
+    // CLASSES: a class can already be known from an earlier file
+    std::vector<bool> newClass;
+    for(DWORD ind = 0;ind < sections[QOB_CLASSES].m_count; ++ind)
+    {
+      CString name = ImageString(tables,classes[ind].m_name);
+      Class*  theClass = FindClass(name);
+      if(theClass == nullptr)
+      {
+        theClass = new Class(name);
+        AddClass(theClass);
+      }
+      newClass.push_back(theClass->GetMembers().GetSize() == 0 && theClass->GetAttributes().GetSize() == 0);
+      tables.m_classes.push_back(theClass);
+    }
+    for(DWORD ind = 0;ind < sections[QOB_CLASSES].m_count; ++ind)
+    {
+      DWORD base = classes[ind].m_base;
+      if(base != QOB_NONE && tables.m_classes[ind]->GetBaseClass() == nullptr)
+      {
+        CheckImageRange(base,1,(DWORD)tables.m_classes.size(),_T("base class"));
+        tables.m_classes[ind]->SetBaseClass(tables.m_classes[base]);
+      }
+    }
+
+    // FUNCTIONS: the bytecode stays in the image
+    for(DWORD ind = 0;ind < sections[QOB_FUNCTIONS].m_count; ++ind)
+    {
+      QobFunction& entry = functions[ind];
+      Function* function = new Function(ImageString(tables,entry.m_name));
+      tables.m_functions.push_back(function);
 
-      // Find the reference
-      switch(object->m_type & DTYPE_MASK)
+      if(entry.m_class != QOB_NONE)
       {
-        case DTYPE_OBJECT:  object->m_value.v_object = new Object(FindClass(name));
-                            break;
-        case DTYPE_CLASS:   object->m_value.v_class  = FindClass(name);
-                            break;
-        case DTYPE_SCRIPT:  object->m_value.v_script = FindScript(name);
-                            break;
-        default:            Error(_T("Unknown reference data type!"));
-                            break;
+        CheckImageRange(entry.m_class,1,(DWORD)tables.m_classes.size(),_T("function class"));
+        function->SetClass(tables.m_classes[entry.m_class]);
       }
+      CheckImageRange(entry.m_arguments,entry.m_argumentsCount,tables.m_elementsCount,_T("arguments"));
+      for(DWORD arg = 0;arg < entry.m_argumentsCount; ++arg)
+      {
+        function->AddArgument((int)tables.m_elements[entry.m_arguments + arg]);
+      }
+      // Including the closing zero byte
+      CheckImageRange(entry.m_code,entry.m_size,codesize ? codesize - 1 : 0,_T("bytecode"));
+      function->SetMappedBytecode(bytecode + entry.m_code,entry.m_size);
+    }
 
-      // See if thunking successfull
-      if(object->m_value.v_all)
+    // VALUES: no garbage collection while they are not yet rooted
+    m_threshold = INT_MAX;
+    tables.m_objects.reserve(sections[QOB_VALUES].m_count);
+    for(DWORD ind = 0;ind < sections[QOB_VALUES].m_count; ++ind)
+    {
+      tables.m_objects.push_back(ReadImageValue(values[ind],tables));
+    }
+    // All values exist: now arrays and objects can be filled
+    for(DWORD ind = 0;ind < sections[QOB_VALUES].m_count; ++ind)
+    {
+      QobValue&  value  = values[ind];
+      MemObject* object = tables.m_objects[ind];
+      if(value.m_type == DTYPE_ARRAY)
+      {
+        ReadImageElements(tables,object->m_value.v_array,value.m_first,value.m_count);
+      }
+      else if(value.m_type == DTYPE_OBJECT)
       {
-        // Clear the reference marker
-        object->m_type &= ~DTYPE_REFERENCE;
-
-        // Tell the object it carries a reference
-        // and should not deallocate the object
-        if(object->m_type == DTYPE_CLASS || object->m_type == DTYPE_SCRIPT)
-        {
-          object->m_flags |= FLAG_REFERENCE;
-        }
-
-        // Delete the saved string
-        delete str;
+        ReadImageElements(tables,&object->m_value.v_object->GetAttributes(),value.m_first,value.m_count);
       }
-      else
+      else if(value.m_type == DTYPE_MAP)
       {
-        // Not thunked yet, save for a next try in a next loading operation
-        object->m_value.v_string = str;
+        ReadImageMap(tables,object->m_value.v_map,value.m_first,value.m_count);
       }
-    } 
-    // Next object
-    object = object->m_next;
+    }
+    for(DWORD ind = 0;ind < sections[QOB_FUNCTIONS].m_count; ++ind)
+    {
+      QobFunction& entry = functions[ind];
+      if(entry.m_literals != QOB_NONE)
+      {
+        Array* literals = new Array();
+        ReadImageElements(tables,literals,entry.m_literals,entry.m_literalsCount);
+        tables.m_functions[ind]->SetLiterals(literals);
+      }
+    }
+    for(DWORD ind = 0;ind < sections[QOB_CLASSES].m_count; ++ind)
+    {
+      if(newClass[ind])
+      {
+        QobClass& entry = classes[ind];
+        ReadImageElements(tables,&tables.m_classes[ind]->GetMembers(),   entry.m_members,   entry.m_membersCount);
+        ReadImageElements(tables,&tables.m_classes[ind]->GetAttributes(),entry.m_attributes,entry.m_attributesCount);
+      }
+    }
+
+    // SYMBOLS and SCRIPTS: only added if not found in the map already
+    for(DWORD ind = 0;ind < sections[QOB_SYMBOLS].m_count; ++ind)
+    {
+      CString name  = ImageString(tables,symbols[ind].m_name);
+      DWORD   value = symbols[ind].m_value;
+      CheckImageRange(value,1,(DWORD)tables.m_objects.size(),_T("symbol"));
+
+      NameMap& map = ind < header->m_symbols ? m_symbols : m_scripts;
+      if(map.find(name) == map.end())
+      {
+        map.insert(std::make_pair(name,tables.m_objects[value]));
+      }
+    }
+
+    // GLOBALS and GLOBAL LITERALS
+    ReadImageElements(tables,m_globals, header->m_globals, header->m_globalsCount);
+    ReadImageElements(tables,m_literals,header->m_literals,header->m_literalsCount);
+
+    // Init code of several files is concatenated, so it is copied
+    if(header->m_initcodeSize)
+    {
+      CheckImageRange(header->m_initcode,header->m_initcodeSize,codesize,_T("init code"));
+      AddBytecode(bytecode + header->m_initcode,header->m_initcodeSize);
+    }
+    m_threshold = threshold;
+
+    // References that were not resolved when the image was written
+    for(auto& object : tables.m_objects)
+    {
+      ThunkObject(object);
+    }
+
+    tracingx(_T("Strings: %u Values: %u Classes: %u Functions: %u Symbols: %u\n")
+            ,sections[QOB_STRINGS].m_count
+            ,sections[QOB_VALUES].m_count
+            ,sections[QOB_CLASSES].m_count
+            ,sections[QOB_FUNCTIONS].m_count
+            ,sections[QOB_SYMBOLS].m_count);
+    tracing(_T("\nQL Image read-in OK!\n"));
+  }
+  catch(QLException& exception)
+  {
+    m_threshold = threshold;
+    if(!m_silent)
+    {
+      _ftprintf(stderr,_T("%s\n"),exception.GetMessage().GetString());
+    }
+    return false;
+  }
+  return true;
+}
+
+// Make the MemObject of a value. Arrays and objects are filled
+// later on, as their elements can come later in the image
+MemObject*
+QLVirtualMachine::ReadImageValue(QobValue& p_value,QobTables& p_tables)
+{
+  // Shared values of this VM
+  if(p_value.m_flags & QOB_IMMEDIATE)
+  {
+    return p_value.m_type == DTYPE_NIL ? GetNil() : GetInteger((int)p_value.m_value);
+  }
+
+  MemObject* object = AllocMemObject(DTYPE_NIL);
+  object->m_type    = p_value.m_type;
+  object->m_storage = p_value.m_storage;
+
+  if(object->m_type & DTYPE_REFERENCE)
+  {
+    // Thunked by name after the read
+    object->m_value.v_string = new CString(ImageString(p_tables,p_value.m_value));
+    return object;
+  }
+
+  MemObject* symbol = nullptr;
+  CString    name;
+  switch(object->m_type)
+  {
+    case DTYPE_NIL:       break;
+    case DTYPE_INTEGER:   object->m_value.v_integer = (int)p_value.m_value;
+                          break;
+    case DTYPE_STRING:    object->m_value.v_string = new CString(ImageString(p_tables,p_value.m_value));
+                          object->m_flags |= FLAG_DEALLOC;
+                          break;
+    case DTYPE_BCD:       { SQL_NUMERIC_STRUCT numeric;
+                            CheckImageRange(p_value.m_first,QOB_BCD_ELEMENTS,p_tables.m_elementsCount,_T("bcd"));
+                            memcpy(&numeric,&p_tables.m_elements[p_value.m_first],sizeof(SQL_NUMERIC_STRUCT));
+                            object->m_value.v_floating = new bcd(&numeric);
+                            object->m_flags |= FLAG_DEALLOC;
+                          }
+                          break;
+    case DTYPE_FILE:      name   = ImageString(p_tables,p_value.m_value);
+                          symbol = FindSymbol(name);
+                          if(symbol == nullptr || symbol->m_type != DTYPE_FILE)
+                          {
+                            throw QLException(CString(_T("File pointer not found: ")) + name,DTYPE_FILE);
+                          }
+                          object->m_value.v_file = symbol->m_value.v_file;
+                          break;
+    case DTYPE_INTERNAL:  name   = ImageString(p_tables,p_value.m_value);
+                          symbol = FindSymbol(name);
+                          if(symbol == nullptr || symbol->m_type != DTYPE_INTERNAL)
+                          {
+                            throw QLException(_T("Unknown internal function found!"));
+                          }
+                          object->m_value.v_internal = symbol->m_value.v_internal;
+                          break;
+    case DTYPE_EXTERNAL:  object->m_value.v_sysname = new CString(ImageString(p_tables,p_value.m_value));
+                          object->m_flags |= FLAG_DEALLOC;
+                          break;
+    case DTYPE_ARRAY:     object->m_value.v_array = new Array();
+                          object->m_flags |= FLAG_DEALLOC;
+                          break;
+    case DTYPE_MAP:       object->m_value.v_map = new Map();
+                          object->m_flags |= FLAG_DEALLOC;
+                          break;
+    case DTYPE_OBJECT:    CheckImageRange(p_value.m_value,1,(DWORD)p_tables.m_classes.size(),_T("object class"));
+                          object->m_value.v_object = new Object(p_tables.m_classes[p_value.m_value]);
+                          object->m_flags |= FLAG_DEALLOC;
+                          break;
+    case DTYPE_CLASS:     // Classes are owned by the VM
+                          CheckImageRange(p_value.m_value,1,(DWORD)p_tables.m_classes.size(),_T("class"));
+                          object->m_value.v_class = p_tables.m_classes[p_value.m_value];
+                          object->m_flags |= FLAG_REFERENCE;
+                          break;
+    case DTYPE_SCRIPT:    // Only one value owns the function
+                          CheckImageRange(p_value.m_value,1,(DWORD)p_tables.m_functions.size(),_T("function"));
+                          object->m_value.v_script = p_tables.m_functions[p_value.m_value];
+                          object->m_flags |= (p_value.m_flags & QOB_REFERENCE) ? FLAG_REFERENCE : FLAG_DEALLOC;
+                          break;
+    default:              throw QLException(_T("Unknown type in QL Image!"));
+  }
+  return object;
+}
+
+// Add the values of consecutive elements to an array
+void
+QLVirtualMachine::ReadImageElements(QobTables& p_tables,Array* p_array,DWORD p_first,DWORD p_count)
+{
+  if(p_count == 0)
+  {
+    return;
+  }
+  CheckImageRange(p_first,p_count,p_tables.m_elementsCount,_T("elements"));
+  for(DWORD ind = 0;ind < p_count; ++ind)
+  {
+    DWORD value = p_tables.m_elements[p_first + ind];
+    CheckImageRange(value,1,(DWORD)p_tables.m_objects.size(),_T("element"));
+    p_array->AddEntry(p_tables.m_objects[value]);
+  }
+}
+
+// Add the key/value pairs of consecutive elements to a map
+void
+QLVirtualMachine::ReadImageMap(QobTables& p_tables,Map* p_map,DWORD p_first,DWORD p_count)
+{
+  if(p_count == 0)
+  {
+    return;
+  }
+  CheckImageRange(p_first,p_count,p_tables.m_elementsCount,_T("elements"));
+  for(DWORD ind = 0;ind + 1 < p_count; ind += 2)
+  {
+    DWORD key   = p_tables.m_elements[p_first + ind];
+    DWORD value = p_tables.m_elements[p_first + ind + 1];
+    CheckImageRange(key,  1,(DWORD)p_tables.m_objects.size(),_T("element"));
+    CheckImageRange(value,1,(DWORD)p_tables.m_objects.size(),_T("element"));
+    if(!Map::IsKeyType(p_tables.m_objects[key]->m_type))
+    {
+      throw QLException(_T("Map key of a wrong datatype in QL Image!"));
+    }
+    p_map->Set(this,p_tables.m_objects[key],p_tables.m_objects[value]);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// THUNKING TO BE DONE AFTER A LOAD FROM FILE
+//
+//////////////////////////////////////////////////////////////////////////
+
+void
+QLVirtualMachine::Thunking()
+{
+  for(MemPage* page = m_pages; page; page = page->m_next)
+  {
+    for(int ind = 0;ind < (int)MEMPAGE_OBJECTS; ++ind)
+    {
+      if(page->IsInUse(ind))
+      {
+        ThunkObject(&page->m_objects[ind]);
+      }
+    }
+  }
+}
+
+// Resolve the name of a reference object after loading
+void
+QLVirtualMachine::ThunkObject(MemObject* p_object)
+{
+  if((p_object->m_type & DTYPE_REFERENCE) == 0)
+  {
+    return;
+  }
+  // Getting the actual name
+  CString name = *p_object->m_value.v_string;
+
+  // Remember and clearing the read-in string
+  CString* str = p_object->m_value.v_string;
+  p_object->m_value.v_all = 0;
+
+  // Find the reference
+  switch(p_object->m_type & DTYPE_MASK)
+  {
+    case DTYPE_OBJECT:  p_object->m_value.v_object = new Object(FindClass(name));
+                        break;
+    case DTYPE_CLASS:   p_object->m_value.v_class  = FindClass(name);
+                        break;
+    case DTYPE_SCRIPT:  p_object->m_value.v_script = FindScript(name);
+                        break;
+    default:            Error(_T("Unknown reference data type!"));
+                        break;
+  }
+
+  // See if thunking successfull
+  if(p_object->m_value.v_all)
+  {
+    // Clear the reference marker
+    p_object->m_type &= ~DTYPE_REFERENCE;
+
+    // Tell the object it carries a reference
+    // and should not deallocate the object
+    if(p_object->m_type == DTYPE_CLASS || p_object->m_type == DTYPE_SCRIPT)
+    {
+      p_object->m_flags |= FLAG_REFERENCE;
+    }
+
+    // Delete the saved string
+    delete str;
+  }
+  else
+  {
+    // Not thunked yet, save for a next try in a next loading operation
+    p_object->m_value.v_string = str;
   }
 }
\ No newline at end of file
@@ -17,6 +17,7 @@
 #include "QL_Functions.h"
 #include "QL_Objects.h"
 #include "bcd.h"
+#include <ZIP/gzip.h>
 #include <stdarg.h>
 
 #ifdef _DEBUG
@@ -31,8 +32,9 @@ static char  THIS_FILE[] = __FILE__;
 //
 //////////////////////////////////////////////////////////////////////////
 
+// Writes a memory mapped image (version 3) or a stream (version 2)
 bool 
-QLVirtualMachine::WriteFile(TCHAR* p_filename,bool p_trace)
+QLVirtualMachine::WriteFile(TCHAR* p_filename,bool p_trace,bool p_image /*=true*/)
 {
   FILE* file = NULL;
 
@@ -51,7 +53,8 @@ QLVirtualMachine::WriteFile(TCHAR* p_filename,bool p_trace)
   if(file)
   {
     tracingx(_T("\nQL Program writing to file: %s\n\n"),filename.GetString());
-    if(WriteToFile(file,p_trace) == false)
+    bool written = p_image ? WriteImage(file,p_trace) : WriteToFile(file,p_trace);
+    if(written == false)
     {
       _tprintf(_T("Object file NOT written correctly to: %s\n"),filename.GetString());
     }
@@ -80,35 +83,174 @@ QLVirtualMachine::WriteToFile(FILE* p_fp,bool p_trace)
     WriteStream(p_fp,p_trace,_T("GLOBALS stream header!"));
     WriteArray (p_fp,p_trace,m_globals);
 
-    WriteStream(p_fp,p_trace,_T("GLOBAL LITERALS stream header!"));
+    WriteStream(p_fp,p_trace,_T("GLOBAL LITERALS stream header!"),true);
     WriteArray (p_fp,p_trace,m_literals);
 
-    WriteStream  (p_fp,p_trace,_T("INIT BYTECODE stream header!"));
+    WriteStream  (p_fp,p_trace,_T("INIT BYTECODE stream header!"),true);
     WriteBytecode(p_fp,p_trace,m_initcode,m_initcode_size);
 
-    WriteStream(p_fp,p_trace,_T("FUNCTIONS stream header!"));
+    WriteStream(p_fp,p_trace,_T("FUNCTIONS stream header!"),true);
     WriteNameMap(p_fp,p_trace,m_scripts,_T("FUNCTIONS"),true);
 
     WriteStream(p_fp,p_trace,_T("END-OF-STREAM"));
+    FlushStream(p_fp,p_trace);
     tracing(_T("\nQL Object written OK!\n"));
   }
   catch(QLException& exception)
   {
+    m_outbuffer.clear();
     _ftprintf(stderr,_T("%s\n"),exception.GetMessage().GetString());
     return false;
   }
   return true;
 }
 
+// Write the heap as an image that can be mapped and used in place.
+// See QL_Image.h for the sections of the image
+bool
+QLVirtualMachine::WriteImage(FILE* p_fp,bool p_trace)
+{
+  try
+  {
+    tracing(_T("SECTION    TRACING\n"));
+    tracing(_T("---------- ------------------------------------\n"));
+
+    QLImageWriter writer(this);
+    FillImage(writer);
+    writer.Write(p_fp,p_trace);
+
+    tracing(_T("\nQL Image written OK!\n"));
+  }
+  catch(QLException& exception)
+  {
+    _ftprintf(stderr,_T("%s\n"),exception.GetMessage().GetString());
+    return false;
+  }
+  return true;
+}
+
+// Everything of the VM goes in the image
+void
+QLVirtualMachine::FillImage(QLImageWriter& p_writer)
+{
+  // All classes, also the ones no object refers to
+  for(auto& cl : m_classes)
+  {
+    p_writer.AddClass(cl.second);
+  }
+  p_writer.AddSymbols (m_symbols,m_scripts);
+  p_writer.SetGlobals (m_globals,m_literals);
+  p_writer.SetInitCode(m_initcode,m_initcode_size);
+}
+
+// The image of our code that execution contexts load with LoadContext().
+// If we are loaded from one image file, that mapping is shared as is.
+// Otherwise the image is made in memory, once until our code changes.
+// The globals in the image are the globals as they were when it was made.
+QLImage*
+QLVirtualMachine::GetCodeImage()
+{
+  QLImage* image = nullptr;
+
+  EnterCriticalSection(&m_lock);
+  try
+  {
+    if(m_codeImage == nullptr && m_pages)
+    {
+      QLImageWriter writer(this);
+      FillImage(writer);
+
+      std::vector<BYTE> sections;
+      writer.Write(sections,false);
+      m_codeImage = QLImage::Create(sections);
+    }
+    if(m_codeImage)
+    {
+      m_codeImage->AddRef();
+      image = m_codeImage;
+    }
+  }
+  catch(QLException& exception)
+  {
+    _ftprintf(stderr,_T("%s\n"),exception.GetMessage().GetString());
+  }
+  LeaveCriticalSection(&m_lock);
+  return image;
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 // WRITING THE HEAP TO AN OBJECT FILE
 //
 //////////////////////////////////////////////////////////////////////////
 
-// PUT 1 CHAR on the file stream
+// Obfuscate a block of the stream, a machine word at the time
+static void
+ObfuscateBlock(TCHAR* p_block,size_t p_length)
+{
+  // 0xFF in the low byte of every TCHAR in a word
+  UINT64 mask = 0;
+  for(size_t ind = 0;ind < sizeof(UINT64) / sizeof(TCHAR); ++ind)
+  {
+    mask |= (UINT64)0xFF << (ind * 8 * sizeof(TCHAR));
+  }
+  size_t bytes = p_length * sizeof(TCHAR);
+  BYTE*  block = reinterpret_cast<BYTE*>(p_block);
+  size_t ind   = 0;
+  for(;ind + sizeof(UINT64) <= bytes; ind += sizeof(UINT64))
+  {
+    UINT64 word;
+    memcpy(&word,block + ind,sizeof(UINT64));
+    word ^= mask;
+    memcpy(block + ind,&word,sizeof(UINT64));
+  }
+  for(size_t tc = ind / sizeof(TCHAR);tc < p_length; ++tc)
+  {
+    p_block[tc] ^= 0xFF;
+  }
+}
+
+// Write the buffered section with one write to the file.
+// A compressed section is written as DTYPE_STREAM, its size in bytes
+// and the deflated (already obfuscated) stream data
+void
+QLVirtualMachine::FlushStream(FILE* p_fp,bool p_trace)
+{
+  if(m_outbuffer.empty())
+  {
+    return;
+  }
+  ObfuscateBlock(m_outbuffer.data(),m_outbuffer.size());
+
+  std::vector<uint8_t> deflated;
+  size_t from = m_compressFrom >= 0 ? (size_t)m_compressFrom : m_outbuffer.size();
+  if(from < m_outbuffer.size())
+  {
+    size_t size = (m_outbuffer.size() - from) * sizeof(TCHAR);
+    if(!gzip_compress_memory(&m_outbuffer[from],size,deflated))
+    {
+      throw QLException(_T("Object file section not compressed!"));
+    }
+    m_outbuffer.resize(from);
+    m_outbuffer.push_back((TCHAR)(DTYPE_STREAM ^ 0xFF));
+    for(int shift = 24;shift >= 0; shift -= 8)
+    {
+      m_outbuffer.push_back((TCHAR)((((int)deflated.size() >> shift) & 0xFF) ^ 0xFF));
+    }
+    TracingText(p_trace,_T("COMPRESSED %d -> %d bytes"),(int)size,(int)deflated.size());
+  }
+  if(fwrite(m_outbuffer.data(),sizeof(TCHAR),m_outbuffer.size(),p_fp) != m_outbuffer.size() ||
+     (!deflated.empty() && fwrite(deflated.data(),1,deflated.size(),p_fp) != deflated.size()))
+  {
+    throw QLException(_T("Object file not written!"));
+  }
+  m_outbuffer.clear();
+  m_compressFrom = -1;
+}
+
+// PUT 1 CHAR on the section buffer
 int
-QLVirtualMachine::Putc(int cc,FILE* p_fp,bool p_trace)
+QLVirtualMachine::Putc(int cc,FILE* /*p_fp*/,bool p_trace)
 {
   if(p_trace)
   {
@@ -122,8 +264,9 @@ QLVirtualMachine::Putc(int cc,FILE* p_fp,bool p_trace)
     _ftprintf(stderr,_T("%2.2X "),cc & 0xFF);
     m_position += 3;
   }
-  // Put one byte on the file stream
-  return _puttc(cc ^ 0xFF,p_fp);
+  // Put one byte in the buffer, obfuscated when flushed
+  m_outbuffer.push_back((TCHAR) cc);
+  return cc;
 }
 
 // ADD tracing text to the output
@@ -176,14 +319,18 @@ QLVirtualMachine::WriteHeader(FILE* p_fp,bool p_trace)
   TracingText(p_trace,_T("QL Version: %2.2f"),(float)(QL_VERSION / 100));
 }
 
+// Start a new section: the previous one is written to the file first
 void
-QLVirtualMachine::WriteStream(FILE* p_fp,bool p_trace,TCHAR* p_message)
+QLVirtualMachine::WriteStream(FILE* p_fp,bool p_trace,TCHAR* p_message,bool p_compress /*=false*/)
 {
-  if(Putc(DTYPE_FILE,p_fp,p_trace) == _TEOF)
+  FlushStream(p_fp,p_trace);
+  Putc(DTYPE_FILE,p_fp,p_trace);
+  TracingText(p_trace,p_message);
+
+  if(m_compress && p_compress)
   {
-    throw QLException(p_message);
+    m_compressFrom = (int)m_outbuffer.size();
   }
-  TracingText(p_trace,p_message);
 }
 
 void
@@ -297,11 +444,17 @@ QLVirtualMachine::WriteArray(FILE* p_fp,bool p_trace,Array* p_array,TCHAR* p_ext
   WriteInteger(p_fp,p_trace,p_array->GetSize());
   TracingText(p_trace,_T("Arraysize: %d"),p_array->GetSize());
 
-  // Stream all members to file
+  // Stream all members to file. Packed elements as their values
   for(int ind = 0;ind < p_array->GetSize(); ++ind)
   {
     TRACE(_T("Writing array: %d\n"),ind + 1);
-    WriteMemObject(p_fp,p_trace,p_array->GetEntry(ind),p_doScripts);
+    switch(p_array->GetElementType())
+    {
+      case DTYPE_INTEGER: WriteInteger  (p_fp,p_trace, p_array->GetInteger(ind));            break;
+      case DTYPE_BCD:     WriteFloat    (p_fp,p_trace,&p_array->GetBcd(ind));                break;
+      case DTYPE_STRING:  WriteString   (p_fp,p_trace,&p_array->GetString(ind));             break;
+      default:            WriteMemObject(p_fp,p_trace, p_array->GetEntry(ind),p_doScripts);  break;
+    }
   }
   // End array marker
   CString end(_T("END "));
@@ -334,6 +487,23 @@ QLVirtualMachine::WriteObject(FILE* p_fp,bool p_trace,Object* p_object)
   TracingText(p_trace,_T("END OBJECT"));
 }
 
+// Write a map as its number of entries and all key/value pairs
+void
+QLVirtualMachine::WriteMap(FILE* p_fp,bool p_trace,Map* p_map)
+{
+  Putc(DTYPE_MAP,p_fp,p_trace);
+  TracingText(p_trace,_T("MAP"));
+  WriteInteger(p_fp,p_trace,p_map->GetSize());
+  TracingText(p_trace,_T("Mapsize: %d"),p_map->GetSize());
+
+  for(int ind = 0;ind < p_map->GetSize(); ++ind)
+  {
+    WriteMemObject(p_fp,p_trace,p_map->GetKey(ind));
+    WriteMemObject(p_fp,p_trace,p_map->GetValue(ind));
+  }
+  TracingText(p_trace,_T("END MAP"));
+}
+
 void
 QLVirtualMachine::WriteClass(FILE* p_fp,bool p_trace,Class* p_class)
 {
@@ -469,6 +639,7 @@ QLVirtualMachine::WriteReference(FILE* p_fp,bool p_trace,MemObject* p_object)
     case DTYPE_INTERNAL:   WriteInternal(p_fp,p_trace,p_object);                     return;
     case DTYPE_EXTERNAL:   WriteExternal(p_fp,p_trace,p_object->m_value.v_sysname);  return;
     case DTYPE_ARRAY:      Error(_T("Cannot write reference for an array"));             return;
+    case DTYPE_MAP:        Error(_T("Cannot write reference for a map"));                return;
     case DTYPE_OBJECT:     name = p_object->m_value.v_object->GetClass()->GetName();
                            break;
     case DTYPE_CLASS:      name = p_object->m_value.v_class->GetName();
@@ -510,6 +681,7 @@ QLVirtualMachine::WriteMemObject(FILE* p_fp,bool p_trace,MemObject* p_object,boo
     case DTYPE_BCD:        WriteFloat   (p_fp,p_trace,p_object->m_value.v_floating);   break;
     case DTYPE_FILE:       WriteFileName(p_fp,p_trace,p_object);                       break;
     case DTYPE_ARRAY:      WriteArray   (p_fp,p_trace,p_object->m_value.v_array);      break;
+    case DTYPE_MAP:        WriteMap     (p_fp,p_trace,p_object->m_value.v_map);        break;
     case DTYPE_OBJECT:     WriteObject  (p_fp,p_trace,p_object->m_value.v_object);     break;
     case DTYPE_CLASS:      WriteClass   (p_fp,p_trace,p_object->m_value.v_class);      break;
     case DTYPE_SCRIPT:     if(p_scripts)
@@ -0,0 +1,37 @@
+@echo off
+@echo Benchmark of the instruction dispatch of all engines
+@echo bench_dispatch.ql runs a loop of cheap instructions 2000000 times.
+@echo The bytecode and threaded engines run exactly the same instructions,
+@echo so their ratio is the ratio of dispatch speed. The register engine
+@echo runs fewer instructions for the same loop. With -j hot functions of
+@echo the register engine run as machine code. Speed is relative to the
+@echo switch loop of the bytecode engine.
+@echo .
+
+set QL=..\bin\ql.exe
+set ITERATIONS=2000000
+set BASE=
+
+%QL% -c bench_dispatch.ql bench_dispatch.qob > nul
+call :engine bytecode
+call :engine threaded -f
+call :engine register -r
+call :engine compiled -j
+del bench_dispatch.qob
+goto :eof
+
+rem Run the loop with one engine: the time of -m goes to stderr
+:engine
+set ELAPSED=
+for /f "tokens=5" %%t in ('%QL% -m %2 bench_dispatch.qob 2^>^&1 ^>nul ^| findstr /b Execution') do set ELAPSED=%%t
+if not defined ELAPSED (
+  @echo %1: failed
+  goto :eof
+)
+for /f "tokens=1 delims=." %%m in ("%ELAPSED%") do set /a MS=%%m
+if %MS% LSS 1 set MS=1
+if not defined BASE set BASE=%MS%
+set /a RATE=%ITERATIONS% / %MS%
+set /a SPEED=%BASE% * 100 / %MS%
+@echo %1: %ELAPSED% ms  %RATE%k iterations/s  %SPEED%%% of the switch loop
+goto :eof
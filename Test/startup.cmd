@@ -0,0 +1,16 @@
+@echo off
+@echo Benchmark of the startup time with both object file formats
+@echo Version 2 files are streamed byte by byte, version 3 images
+@echo are mapped and used in place. Compare the load times.
+@echo .
+
+set QL=..\bin\ql.exe
+
+for %%f in (*.ql) do (
+  %QL% -c -s %%f %%~nf_v2.qob > nul
+  %QL% -c    %%f %%~nf_v3.qob > nul
+  @echo %%~nf
+  %QL% -m %%~nf_v2.qob > nul
+  %QL% -m %%~nf_v3.qob > nul
+)
+del *_v2.qob *_v3.qob
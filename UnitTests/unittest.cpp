@@ -2,6 +2,7 @@
 #include "RunRedirect.h"
 #include "CppUnitTest.h"
 #include <direct.h>
+#include <vector>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -26,11 +27,79 @@ namespace UnitTests
       DoTheTest(_T("test_basic"));
     }
 
+    // The compile cache of "ql file.ql": a miss writes the entry, a hit
+    // loads it as is. A damaged entry, or one of another QL version, may
+    // never fail a run: it is compiled again and replaced
+    TEST_METHOD(test_cache)
+    {
+      Logger::WriteMessage(_T("Running: test_cache"));
+      _tchdir(m_basedir);
+
+      CString cacheDir   = m_basedir + _T("cache\\");
+      CString sourceFile = m_basedir + _T("test_cache.ql");
+      CString qlRuntime  = m_exedir  + _T("ql.exe");
+      CString correct    = ReadOutputFile(m_basedir + _T("test_cache.ok"));
+      correct.TrimRight(_T("\r\n"));
+      correct.Replace(_T("\r"),_T(""));
+
+      // A cache of our own, empty at the start
+      CreateDirectory(cacheDir,NULL);
+      CString entry;
+      while(!(entry = FindCacheEntry(cacheDir)).IsEmpty())
+      {
+        DeleteFile(entry);
+      }
+      SetEnvironmentVariable(_T("QL_CACHE"),cacheDir);
+
+      // Miss: compiled and written to the cache
+      CString result;
+      CallProgram_For_String(qlRuntime,sourceFile,result);
+      AssertOutput(correct,result);
+      entry = FindCacheEntry(cacheDir);
+      Assert::IsFalse(entry.IsEmpty());
+      std::vector<BYTE> image = ReadBinaryFile(entry);
+      Assert::IsTrue(image.size() > 72);
+
+      // Hit: loaded from the cache, which is not written again
+      FILETIME written = GetWriteTime(entry);
+      CallProgram_For_String(qlRuntime,sourceFile,result);
+      AssertOutput(correct,result);
+      FILETIME loaded = GetWriteTime(entry);
+      Assert::AreEqual(0L,CompareFileTime(&written,&loaded));
+
+      // Damaged entries: not an image at all, another QL version, and
+      // bytecode the verifier refuses after the classes have been read
+      std::vector<BYTE> garbage(16,'x');
+      std::vector<BYTE> version(image);
+      std::vector<BYTE> bytecode(image);
+      *reinterpret_cast<DWORD*>(&version[8]) = 1;
+      DWORD offset = *reinterpret_cast<DWORD*>(&bytecode[60]);  // QOB_BYTECODE section
+      DWORD size   = *reinterpret_cast<DWORD*>(&bytecode[68]);
+      Assert::IsTrue(size > 0 && offset + size <= bytecode.size());
+      memset(&bytecode[offset],0xFF,size);
+
+      std::vector<BYTE>* damaged[] = { &garbage,&version,&bytecode };
+      for(auto& damage : damaged)
+      {
+        WriteBinaryFile(entry,*damage);
+        CallProgram_For_String(qlRuntime,sourceFile,result);
+        AssertOutput(correct,result);
+        // Replaced by a good entry
+        Assert::IsTrue(ReadBinaryFile(entry) == image);
+      }
+      SetEnvironmentVariable(_T("QL_CACHE"),NULL);
+    }
+
     TEST_METHOD(test_call)
     {
       DoTheTest(_T("test_call"));
     }
 
+    TEST_METHOD(test_constant_fold)
+    {
+      DoTheTest(_T("test_constant_fold"));
+    }
+
     TEST_METHOD(test_constructor_2)
     {
       DoTheTest(_T("test_constructor_2"));
@@ -56,16 +125,41 @@ namespace UnitTests
       DoTheTest(_T("test_for_loop"));
     }
 
+    TEST_METHOD(test_frames)
+    {
+      DoTheTest(_T("test_frames"));
+    }
+
+    TEST_METHOD(test_gc_list)
+    {
+      DoTheTest(_T("test_gc_list"));
+    }
+
     TEST_METHOD(test_globals)
     {
       DoTheTest(_T("test_globals"));
     }
 
+    TEST_METHOD(test_immediates)
+    {
+      DoTheTest(_T("test_immediates"));
+    }
+
+    TEST_METHOD(test_jit)
+    {
+      DoTheTest(_T("test_jit"));
+    }
+
     TEST_METHOD(test_locals)
     {
       DoTheTest(_T("test_locals"));
     }
 
+    TEST_METHOD(test_map)
+    {
+      DoTheTest(_T("test_map"));
+    }
+
     TEST_METHOD(test_object)
     {
       DoTheTest(_T("test_object"));
@@ -76,6 +170,16 @@ namespace UnitTests
       DoTheTest(_T("test_objects"));
     }
 
+    TEST_METHOD(test_packed)
+    {
+      DoTheTest(_T("test_packed"));
+    }
+
+    TEST_METHOD(test_print)
+    {
+      DoTheTest(_T("test_print"));
+    }
+
     TEST_METHOD(test_recurse)
     {
       DoTheTest(_T("test_recurse"));
@@ -86,6 +190,16 @@ namespace UnitTests
       DoTheTest(_T("test_reference"));
     }
 
+    TEST_METHOD(test_registers)
+    {
+      DoTheTest(_T("test_registers"));
+    }
+
+    TEST_METHOD(test_sendcache)
+    {
+      DoTheTest(_T("test_sendcache"));
+    }
+
     TEST_METHOD(test_sizeof)
     {
       DoTheTest(_T("test_sizeof"));
@@ -96,6 +210,11 @@ namespace UnitTests
       DoTheTest(_T("test_square"));
     }
 
+    TEST_METHOD(test_string_append)
+    {
+      DoTheTest(_T("test_string_append"));
+    }
+
     TEST_METHOD(test_string_find)
     {
       DoTheTest(_T("test_string_find"));
@@ -131,6 +250,38 @@ namespace UnitTests
       DoTheTest(_T("test_switch"));
     }
 
+    TEST_METHOD(test_switchtable)
+    {
+      DoTheTest(_T("test_switchtable"));
+    }
+
+    TEST_METHOD(test_tasks)
+    {
+      DoTheTest(_T("test_tasks"));
+    }
+
+    TEST_METHOD(test_typed)
+    {
+      DoTheTest(_T("test_typed"));
+    }
+
+    TEST_METHOD(test_verify)
+    {
+      DoTheTest(_T("test_verify"));
+      // Damaged bytecode in an object file is refused before it runs
+      VerifyRefused(_T("test_verify"),_T("depth"));
+    }
+
+    TEST_METHOD(test_vtable)
+    {
+      DoTheTest(_T("test_vtable"));
+    }
+
+    TEST_METHOD(test_wide)
+    {
+      DoTheTest(_T("test_wide"));
+    }
+
     TEST_METHOD(test_database)
     {
       DoTheTest(_T("test_database"));
@@ -149,30 +300,117 @@ namespace UnitTests
 
       _tchdir(m_basedir);
 
+      CString sourceFile = m_basedir + p_filename + _T(".ql");
+      CString objectFile = m_basedir + p_filename + _T(".qob");
+      CString outputFile = m_basedir + p_filename + _T(".ok");
+
+      CString correct = ReadOutputFile(outputFile);
+      correct.TrimRight(_T("\r\n"));
+      correct.Replace(_T("\r"),_T(""));
+
+      // Every way to compile and run the program must deliver exactly the
+      // same as the output file. Compiled again when the options change
+      const TCHAR* variants[][2] =
+      {
+        { _T("-c "),       _T("")      }  // Image on the bytecode engine
+       ,{ _T("-c "),       _T("-f ")   }  // Threaded code engine
+       ,{ _T("-c "),       _T("-r ")   }  // Register code engine
+       ,{ _T("-c "),       _T("-j ")   }  // Hot functions compiled to machine code
+       ,{ _T("-c "),       _T("-w 0 ") }  // One context per core, all sharing the image
+       ,{ _T("-c -s "),    _T("")      }  // Streamed (version 2) object file
+       ,{ _T("-c -s "),    _T("-w 0 ") }  // Contexts share an image made in memory
+       ,{ _T("-c -s -z "), _T("")      }  // Compressed literals and bytecode
+       ,{ _T("-c -s -z "), _T("-w 0 ") }
+      };
+      CString compiled;
+      for(auto& variant : variants)
+      {
+        if(compiled != variant[0])
+        {
+          // Compile the test: result MUST be zero (0)
+          CString result;
+          compiled = variant[0];
+          int res = CallProgram_For_String(m_exedir + _T("ql.exe"),compiled + sourceFile,result);
+          Assert::AreEqual(res,0);
+        }
+        CheckRun(variant[1],objectFile,correct);
+      }
+    }
+
+    // Run an object file with options: the output must be the correct one
+    void CheckRun(CString p_options,CString p_objectFile,CString& p_correct)
+    {
+      Logger::WriteMessage(_T("Options: ") + p_options);
       CString result;
-      CString compileOption = _T("-c ");
+      CallProgram_For_String(m_exedir + _T("ql.exe"),p_options + p_objectFile,result);
+      AssertOutput(p_correct,result);
+    }
 
+    // Patch the bytecode of a function in the image of a test, and see
+    // that the verifier refuses it: a branch into the middle of an
+    // instruction, and two paths that join with a different stack depth
+    void VerifyRefused(CString p_filename,CString p_function)
+    {
+      CString result;
       CString sourceFile = m_basedir + p_filename + _T(".ql");
       CString objectFile = m_basedir + p_filename + _T(".qob");
-      CString outputFile = m_basedir + p_filename + _T(".ok");
+      CString badFile    = m_basedir + p_filename + _T("_bad.qob");
       CString qlRuntime  = m_exedir  + _T("ql.exe");
 
-      // Compile the test: result MUST be zero (0)
-      int res = CallProgram_For_String(qlRuntime,compileOption + sourceFile,result);
+      int res = CallProgram_For_String(qlRuntime,_T("-c ") + sourceFile,result);
       Assert::AreEqual(res,0);
+      std::vector<BYTE> image = ReadBinaryFile(objectFile);
+      Assert::IsTrue(image.size() > 132);
+      Assert::IsTrue(*reinterpret_cast<DWORD*>(&image[12]) == sizeof(TCHAR));
 
-      // Run the program, resulting in output
-      res = CallProgram_For_String(qlRuntime,objectFile,result);
-
-      CString correct = ReadOutputFile(outputFile);
+      // Header: 12 DWORDs, then offset, count and size of each section
+      auto section = [&](int p_section,int p_field) -> DWORD
+      {
+        return *reinterpret_cast<DWORD*>(&image[48 + 12 * p_section + 4 * p_field]);
+      };
+      DWORD* offsets   = reinterpret_cast<DWORD*>(&image[section(0,0)]);   // QOB_STRINGS
+      DWORD* functions = reinterpret_cast<DWORD*>(&image[section(5,0)]);   // QOB_FUNCTIONS
+      DWORD  code      = 0;
+      DWORD  size      = 0;
+      for(DWORD ind = 0;ind < section(5,1); ++ind)
+      {
+        DWORD* entry  = &functions[ind * 8];  // name,class,code,size,...
+        BYTE*  string = &image[section(0,0) + offsets[entry[0]]];
+        CString name(reinterpret_cast<TCHAR*>(string + sizeof(DWORD)),*reinterpret_cast<DWORD*>(string));
+        if(name == p_function && entry[1] == 0xFFFFFFFF)
+        {
+          code = section(1,0) + entry[2];   // QOB_BYTECODE
+          size = entry[3];
+        }
+      }
+      const BYTE brf = 0x02,br = 0x03,push = 0x05,ret = 0x1C,tspace = 0x28,wide = 0x39;
 
-      correct.TrimRight(_T("\r\n"));
-      result.TrimRight(_T("\r\n"));
-      result.Replace(_T("\r"),_T(""));
-      correct.Replace(_T("\r"),_T(""));
+      // Keep the TSPACE the function starts with, or the verifier stops there
+      DWORD start = (image[code] == tspace) ? 2 : 4;
+      Assert::IsTrue(image[code] == tspace || (image[code] == wide && image[code + 1] == tspace));
+      Assert::IsTrue(size >= start + 7);
 
-      // Program must deliver exactly the same as the output file
-      Assert::AreEqual(correct.GetString(),result.GetString());
+      // Branch targets are offsets from the start of the function
+      const BYTE badJump[] = { br,(BYTE)(start + 1),0,0,0 };             // BR into its own operand
+      const BYTE unequal[] = { brf,(BYTE)(start + 6),0,0,0,push,ret };   // BRF past a PUSH to the RET
+      struct { std::vector<BYTE> m_patch; CString m_error; } patches[] =
+      {
+        { std::vector<BYTE>(badJump,badJump + sizeof(badJump)),_T("Branch to a bad offset")             }
+       ,{ std::vector<BYTE>(unequal,unequal + sizeof(unequal)),_T("Stack depth differs between paths") }
+      };
+      for(auto& patch : patches)
+      {
+        std::vector<BYTE> bad(image);
+        memset(&bad[code + start],ret,size - start);
+        memcpy(&bad[code + start],patch.m_patch.data(),patch.m_patch.size());
+        WriteBinaryFile(badFile,bad);
+
+        CallProgram_For_String(qlRuntime,badFile,result);
+        Assert::IsTrue(result.Find(_T("Bytecode of ") + p_function + _T(" not verified")) >= 0);
+        Assert::IsTrue(result.Find(patch.m_error) >= 0);
+        Assert::IsTrue(result.Find(_T("Object file NOT correctly loaded")) >= 0);
+      }
+      DeleteFile(badFile);
     }
 
     CString ReadOutputFile(CString p_filename)
@@ -207,6 +445,58 @@ namespace UnitTests
       return output;
     }
 
+    void AssertOutput(CString p_correct,CString p_result)
+    {
+      p_result.TrimRight(_T("\r\n"));
+      p_result.Replace(_T("\r"),_T(""));
+      Assert::AreEqual(p_correct.GetString(),p_result.GetString());
+    }
+
+    // The only object file in a directory of the compile cache
+    CString FindCacheEntry(CString p_directory)
+    {
+      WIN32_FIND_DATA data;
+      HANDLE find = FindFirstFile(p_directory + _T("*.qob"),&data);
+      if(find == INVALID_HANDLE_VALUE)
+      {
+        return CString();
+      }
+      FindClose(find);
+      return p_directory + data.cFileName;
+    }
+
+    FILETIME GetWriteTime(CString p_filename)
+    {
+      WIN32_FILE_ATTRIBUTE_DATA data;
+      memset(&data,0,sizeof(data));
+      GetFileAttributesEx(p_filename,GetFileExInfoStandard,&data);
+      return data.ftLastWriteTime;
+    }
+
+    std::vector<BYTE> ReadBinaryFile(CString p_filename)
+    {
+      std::vector<BYTE> contents;
+      CFile file;
+      if(file.Open(p_filename,CFile::modeRead | CFile::typeBinary | CFile::shareDenyNone))
+      {
+        contents.resize((size_t)file.GetLength());
+        if(!contents.empty())
+        {
+          file.Read(contents.data(),(UINT)contents.size());
+        }
+        file.Close();
+      }
+      return contents;
+    }
+
+    void WriteBinaryFile(CString p_filename,const std::vector<BYTE>& p_contents)
+    {
+      CFile file;
+      Assert::IsTrue(file.Open(p_filename,CFile::modeCreate | CFile::modeWrite | CFile::typeBinary) != FALSE);
+      file.Write(p_contents.data(),(UINT)p_contents.size());
+      file.Close();
+    }
+
     void PrintFileError(CFileException& exp,CString& p_filename)
     {
       TCHAR buffer[1024];